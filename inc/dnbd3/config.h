@@ -32,8 +32,11 @@
 // Protocol version should be increased whenever new features/messages are added,
 // so either the client or server can run in compatibility mode, or they can
 // cancel the connection right away if the protocol has changed too much
-#define PROTOCOL_VERSION 3
+#define PROTOCOL_VERSION 6
 // 2017-10-16: Update to v3: Change header to support request hop-counting
+// 2026-10-18: Update to v4: Add CMD_GET_HEAT
+// 2026-10-18: Update to v5: Add CMD_CANCEL
+// 2026-10-18: Update to v6: Add CMD_GET_LOAD
 
 #define NUMBER_SERVERS 8 // Number of alt servers per image/device
 
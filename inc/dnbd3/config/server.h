@@ -7,6 +7,27 @@
 #define SERVER_MAX_CLIENTS 4000
 #define SERVER_MAX_IMAGES  5000
 #define SERVER_MAX_ALTS    50
+#define SERVER_TOPOLOGY_MAX_ZONES 64 // Max number of zones in topology file
+#define SERVER_TOPOLOGY_MAX_NETS 1024 // Max number of networks in topology file
+#define SERVER_TOPOLOGY_MAX_COST 999 // Max cost between two zones; zones without a configured cost are one more than that
+#define SERVER_CLIENT_STREAMS 4 // Number of concurrent sequential streams tracked per client for prefetching
+#define SERVER_MAX_RELAYED 250 // Stop reading requests from a client while it has this many requests waiting for the uplink
+#define SERVER_STREAM_SLACK (128 * 1024) // Max distance of a request to a stream's position to still count as sequential
+#define SERVER_PREFETCH_MIN_DEPTH (64 * 1024) // Initial prefetch depth for a client's streams, and lower bound when shrinking
+#define SERVER_BOOT_PROFILE_CHUNK (256 * 1024) // Granularity of boot profiles, see bootProfileTime
+#define SERVER_BOOT_PROFILE_MAX 8192 // Maximum number of chunks in a boot profile, and in a single client's trace
+#define SERVER_BOOT_PROFILE_MIN_TRACE 16 // Discard client traces shorter than this many chunks
+#define SERVER_BOOT_PROFILE_INTERVAL 30 // Merge finished client traces into boot profiles and save them every this many seconds
+#define SERVER_BOOT_PROFILE_PENDING 256 // Maximum number of finished client traces waiting to be merged
+#define SERVER_HEAT_MAX (1 << 24) // Halve all access counters of an image's heat map once one of them reaches this value
+#define SERVER_WARMUP_MAX_JOBS 64 // Maximum number of warm-up jobs, see warmup config file
+#define SERVER_WARMUP_KEEP 3600 // Seconds a finished warm-up job is kept in the status list
+#define SERVER_WARMUP_RETRY 60 // Seconds to wait before trying again to get the image of a warm-up job
+#define SERVER_MULTICAST_MAX_BYTES (512ull * 1024 * 1024) // Max amount of data of an image in the multicast carousel
+#define SERVER_MULTICAST_PICK_INTERVAL 10 // Seconds between checks which image should be streamed to the multicast group
+#define SERVER_MULTICAST_TTL 1 // TTL of multicast packets; 1 = don't leave the local network
+#define SERVER_HANDOFF_TIMEOUT 30 // Seconds to wait for all clients to be handed over to new process before giving up on the rest
+#define SERVER_HANDOFF_RELAY_WAIT 5 // Seconds a client waits for pending uplink replies before being handed over; dropped otherwise
 // +++++ Uplink handling (proxy mode)
 #define SERVER_GLOBAL_DUP_TIME 6 // How many seconds to wait before changing global fail counter again
 #define SERVER_BAD_UPLINK_MIN 10 // Thresold for fails at which we start ignoring the server occasionally
@@ -15,6 +36,25 @@
 #define SERVER_BAD_UPLINK_IGNORE 180 // How many seconds is a server ignored
 #define UPLINK_MAX_QUEUE  500 // Maximum number of queued requests per uplink
 #define UPLINK_MAX_CLIENTS_PER_REQUEST 32 // Maximum number of clients that can attach to one uplink request
+#define SERVER_BGR_MAX_UPLINKS 100 // Maximum number of uplinks tracked by the background replication scheduler
+#define UPLINK_MAX_CONNECTIONS 8 // Maximum number of parallel connections per uplink (see uplinkConnections)
+#define UPLINK_STRIPE_STALL_TIME 15 // Seconds an additional connection may have pending requests without receiving anything
+#define UPLINK_STRIPE_SLOW_FACTOR 8 // Additional connection is considered slow if the fastest one is this many times faster
+#define UPLINK_LIVE_SAMPLES 32 // Max number of request latencies per connection between updates of the server's RTT
+#define UPLINK_LIVE_MIN_SAMPLES 4 // Minimum number of request latencies needed to update the server's RTT
+#define SERVER_MAX_SIBLINGS 8 // Maximum number of sibling proxies, see alt-servers config
+#define UPLINK_CONNECT_RETRY 10 // Seconds to wait before opening an additional or hedge connection again after it failed
+#define UPLINK_SIBLING_RETRY 30 // Seconds to wait before connecting to a sibling again after it failed
+#define UPLINK_STANDBY_IDLE_TIME 60 // Drop standby connection if uplink didn't serve clients for this many seconds
+#define UPLINK_HEDGE_SAMPLES 64 // Number of recent client request latencies used to determine the hedging threshold
+#define UPLINK_HEDGE_MIN_DELAY 20 // Minimum time in ms before a client request is hedged
+#define UPLINK_HEDGE_DEFAULT_DELAY 500 // Time in ms before a client request is hedged, until enough samples are available
+#define UPLINK_HEDGE_LOSERS 64 // Number of recently answered hedged requests to recognize late duplicate replies of
+#define UPLINK_OVERFETCH_SLOTS 64 // Number of recent request extensions tracked to see whether clients actually read them
+#define UPLINK_CANCEL_BATCH 32 // Max number of requests withdrawn from upstream at once when clients cancel or disconnect
+#define UPLINK_REQUEST_SIZE_MAX (1024 * 1024) // Upper bound for the size client requests get extended to automatically
+#define UPLINK_PROFILE_WINDOW 16 // Max number of prefetch requests in flight while replaying a boot profile
+#define UPLINK_WARMUP_WINDOW 32 // Max number of prefetch requests in flight per uplink while running warm-up jobs
 #define SERVER_UPLINK_QUEUELEN_THRES  900 // Threshold where we start dropping incoming clients
 #define SERVER_MAX_PENDING_ALT_CHECKS 500 // Length of queue for pending alt checks requested by uplinks
 
@@ -41,8 +81,15 @@
 #define SERVER_RTT_INTERVAL_MAX 45 // Maximum interval between probes
 #define SERVER_RTT_MAX_UNREACH 10 // If no server was reachable this many times, stop RTT measurements for a while
 #define SERVER_RTT_INTERVAL_FAILED 180 // Interval to use if no uplink server is reachable for above many times
+#define SERVER_RTT_MAX_AGE 30 // Don't actively probe servers whose RTT was updated within this many seconds, by any uplink
+#define SERVER_LOAD_INTERVAL 10 // (Seconds) How often to ask alt servers how busy they are
+#define SERVER_LOAD_RETRY 600 // (Seconds) Wait this long before asking a server again that didn't answer a load query
+#define SERVER_LOAD_MAX_AGE 60 // (Seconds) Ignore load reports older than this when ordering alt servers for clients
+#define SERVER_LOAD_MAX_IMAGES 64 // Max number of images to ask an alt server about per load query
+#define SERVER_LOAD_WEIGHT 2 // Max penalty per load metric when ordering alt servers for clients; closeness gives one point per matching address nibble
 
 #define SERVER_REMOTE_IMAGE_CHECK_CACHETIME 120 // 2 minutes
+#define SERVER_REMOTE_LOOKUP_MAX 10000 // Max number of remembered image lookups on upstream servers, see above
 
 // Which is the minimum protocol version the server expects from the client
 #define MIN_SUPPORTED_CLIENT 2
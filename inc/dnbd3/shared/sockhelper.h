@@ -105,6 +105,20 @@ void sock_set_block(int sock);
  */
 bool sock_append(poll_list_t *list, const int sock, bool wantRead, bool wantWrite);
 
+/**
+ * Copy the fds of all sockets in the poll list to given array.
+ *
+ * @return number of fds written to the array, at most max
+ */
+int sock_getFds(poll_list_t *list, int *fds, const int max);
+
+/**
+ * Remove given socket from the poll list without closing it.
+ *
+ * @return true if the socket was in the list
+ */
+bool sock_remove(poll_list_t *list, const int sock);
+
 /**
  * Send the whole buffer, calling write() multiple times if neccessary.
  * Give up after calling write() maxtries times.
@@ -152,6 +152,9 @@ typedef struct __attribute__((packed))
 #define CMD_LATEST_RID          6
 #define CMD_SET_CLIENT_MODE     7
 #define CMD_GET_CRC32           8
+#define CMD_GET_HEAT            9
+#define CMD_CANCEL              10
+#define CMD_GET_LOAD            11
 
 #define DNBD3_REQUEST_SIZE     24
 typedef struct __attribute__((packed))
@@ -0,0 +1,135 @@
+#include "admission.h"
+#include "helper.h"
+#include "net.h"
+#include "server.h"
+#include "reference.h"
+#include <dnbd3/shared/timing.h>
+
+#include <jansson.h>
+
+/*
+ * Admission control. Decide whether a new client should be served, based
+ * on the measured state of the server: number of connected clients,
+ * outgoing bandwidth, how long writes to the local cache take, and for
+ * incomplete images, how long client requests queue up at the uplink.
+ * Clients that are turned away get a list of alt servers to try instead,
+ * see net.c. The measurements are cheap to read, so the check doesn't
+ * slow down the handshake.
+ */
+
+static atomic_uint diskLatency = 0;       // Smoothed latency of writes to cache in µs
+static atomic_uint diskSamples = 0;       // Number of writes since last timer run
+static atomic_uint_fast64_t bandwidth = 0; // Bytes per second sent to clients, measured by timer
+static atomic_int clientCount = 0;        // Number of clients, updated by timer
+static atomic_uint_fast64_t busy = 0;     // Number of handshakes while we were too busy
+
+static void* admissionTimer(void *data);
+
+void admission_init()
+{
+	server_addJob( &admissionTimer, NULL, 1, 1 );
+}
+
+/**
+ * Record how long a write to an image's cache file took.
+ */
+void admission_recordDiskLatency(uint64_t us)
+{
+	const uint32_t latency = (uint32_t)MIN( us, UINT32_MAX );
+	const uint32_t smoothed = diskLatency;
+	diskLatency = smoothed == 0 ? latency : (uint32_t)( ( (uint64_t)smoothed * 7 + latency ) / 8 );
+	diskSamples++;
+}
+
+/**
+ * Check the limits that don't depend on the requested image.
+ */
+static const char* checkServer(bool isServer)
+{
+	if ( _admissionClients > 0 && !isServer && clientCount >= _admissionClients )
+		return "too many clients";
+	if ( _admissionBandwidth != 0 && bandwidth >= _admissionBandwidth )
+		return "bandwidth exhausted";
+	if ( _admissionDiskLatency > 0 && diskLatency / 1000 >= (uint32_t)_admissionDiskLatency )
+		return "disk too slow";
+	return NULL;
+}
+
+/**
+ * Check whether a new client for given image should be admitted.
+ * @return NULL if so, otherwise the reason for turning the client away
+ */
+const char* admission_check(dnbd3_client_t *client, dnbd3_image_t *image)
+{
+	const char *reason = checkServer( client->isServer );
+	if ( reason == NULL && image->ref_cacheMap != NULL ) {
+		// Incomplete image, depends on uplink and being able to cache data
+		if ( image->problem.write ) {
+			reason = "cannot write to cache";
+		} else if ( image->problem.queue ) {
+			reason = "uplink queue full";
+		} else {
+			dnbd3_uplink_t *uplink = ref_get_uplink( &image->uplinkref );
+			if ( uplink != NULL ) {
+				// If there is no uplink yet, it will be started on demand
+				const uint32_t current = uplink->demandLatency, base = uplink->baseLatency;
+				if ( image->problem.uplink ) {
+					reason = "uplink unavailable";
+				} else if ( _admissionQueueDelay > 0 && current > base
+						&& ( current - base ) / 1000 >= (uint32_t)_admissionQueueDelay ) {
+					reason = "uplink overloaded";
+				}
+				ref_put( &uplink->reference );
+			}
+		}
+	}
+	if ( reason != NULL ) {
+		busy++;
+	}
+	return reason;
+}
+
+/**
+ * Get the current load of this server, as reported to other servers
+ * asking via CMD_GET_LOAD. busy is true if new clients would currently
+ * be turned away, regardless of image.
+ */
+void admission_getLoad(uint64_t *clients, uint64_t *bytesPerSecond, uint32_t *diskUs, bool *busy)
+{
+	*clients = (uint64_t)MAX( 0, clientCount );
+	*bytesPerSecond = bandwidth;
+	*diskUs = diskLatency;
+	*busy = checkServer( false ) != NULL;
+}
+
+json_t* admission_toJson()
+{
+	return json_pack( "{sisIsisI}",
+			"diskLatency", (int)diskLatency,
+			"bandwidth", (json_int_t)bandwidth,
+			"clients", (int)clientCount,
+			"busy", (json_int_t)busy );
+}
+
+static void* admissionTimer(void *data UNUSED)
+{
+	static ticks last;
+	static uint64_t lastBytes = 0;
+	int clients;
+	uint64_t bytes;
+	declare_now;
+	net_getStats( &clients, NULL, &bytes );
+	clientCount = clients;
+	if ( lastBytes != 0 ) {
+		const uint64_t ms = MAX( 1, timing_diffMs( &last, &now ) );
+		bandwidth = bytes > lastBytes ? ( bytes - lastBytes ) * 1000 / ms : 0;
+	}
+	last = now;
+	lastBytes = bytes;
+	// Let latency fade out if nothing has been written recently, so we don't
+	// keep turning clients away because of a hiccup long ago
+	if ( atomic_exchange( &diskSamples, 0 ) == 0 ) {
+		diskLatency = diskLatency / 2;
+	}
+	return NULL;
+}
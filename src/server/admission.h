@@ -0,0 +1,18 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include "globals.h"
+
+struct json_t;
+
+void admission_init();
+
+void admission_recordDiskLatency(uint64_t us);
+
+const char* admission_check(dnbd3_client_t *client, dnbd3_image_t *image);
+
+void admission_getLoad(uint64_t *clients, uint64_t *bytesPerSecond, uint32_t *diskUs, bool *busy);
+
+struct json_t* admission_toJson();
+
+#endif /* ADMISSION_H_ */
@@ -5,6 +5,8 @@
 #include "helper.h"
 #include "image.h"
 #include "fileutil.h"
+#include "server.h"
+#include "topology.h"
 #include <dnbd3/shared/protocol.h>
 #include <dnbd3/shared/timing.h>
 #include <dnbd3/config/server.h>
@@ -13,6 +15,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <jansson.h>
+#include <poll.h>
 
 #define LOG(lvl, msg, ...) logadd(lvl, msg " (%s:%d)", __VA_ARGS__, PIMG(image))
 #define LOG_GOTO(jumplabel, lvl, ...) do { LOG(lvl, __VA_ARGS__); goto jumplabel; } while (0);
@@ -22,17 +25,30 @@ static dnbd3_alt_server_t altServers[SERVER_MAX_ALTS];
 static atomic_int numAltServers = 0;
 static pthread_mutex_t altServersLock;
 
+// Address of this server in its sibling group, type == 0 if sibling mode is disabled
+static dnbd3_host_t siblingSelf;
+
+// Topology tables, built once at startup, see buildZoneTables
+static int localZone = -1;
+static int16_t altZone[SERVER_MAX_ALTS];
+static uint16_t zoneCost[SERVER_TOPOLOGY_MAX_ZONES][SERVER_MAX_ALTS]; // Cost from zone to alt server
+static uint8_t zoneOrder[SERVER_TOPOLOGY_MAX_ZONES][SERVER_MAX_ALTS]; // Alt servers sorted by cost from zone
+static bool hasTopology = false;
+
 static void *altservers_runCheck(void *data);
 static int altservers_getListForUplink(dnbd3_uplink_t *uplink, const char *image, int *servers, int size, int current);
 static void altservers_findUplinkInternal(dnbd3_uplink_t *uplink);
-static uint32_t altservers_updateRtt(dnbd3_uplink_t *uplink, int index, uint32_t rtt);
-static void altservers_imageFailed(dnbd3_uplink_t *uplink, int server);
+static void altservers_setStandby(dnbd3_uplink_t *uplink, dnbd3_server_connection_t *con);
+static uint32_t altservers_updateRtt(int index, uint32_t rtt);
+static void* altservers_gossip(void *data);
+static void buildZoneTables();
 
 void altservers_init()
 {
 	srand( (unsigned int)time( NULL ) );
 	// Init lock
 	mutex_init( &altServersLock, LOCK_ALT_SERVER_LIST );
+	server_addJob( &altservers_gossip, NULL, 5, SERVER_LOAD_INTERVAL );
 }
 
 static void addAltFromLegacy(int argc, char **argv, void *data)
@@ -78,9 +94,15 @@ static int addAltFromIni(void *countptr, const char* section, const char* key, c
 		if ( strncmp( value, "client", 6 ) == 0 ) {
 			altServers[index].isClientOnly = true;
 			altServers[index].isPrivate = false;
+			altServers[index].isSibling = false;
 		} else if ( strcmp( value, "replication" ) == 0 ) {
 			altServers[index].isClientOnly = false;
 			altServers[index].isPrivate = true;
+			altServers[index].isSibling = false;
+		} else if ( strcmp( value, "sibling" ) == 0 ) {
+			altServers[index].isClientOnly = false;
+			altServers[index].isPrivate = true;
+			altServers[index].isSibling = true;
 		} else {
 			logadd( LOG_WARNING, "Invalid value in alt-servers section %s for key %s: '%s'", section, key, value );
 		}
@@ -109,15 +131,58 @@ int altservers_load()
 		return 0;
 	}
 	ini_parse( name, &addAltFromIni, &count );
+	siblingSelf.type = 0;
+	if ( _siblingName != NULL && _siblingName[0] != '\0' ) {
+		char *tmp = strdup( _siblingName );
+		if ( !parse_address( tmp, &siblingSelf ) ) {
+			logadd( LOG_WARNING, "Invalid siblingName '%s', sibling mode disabled", _siblingName );
+			siblingSelf.type = 0;
+		}
+		free( tmp );
+	}
 	if ( numAltServers == 0 ) {
 		logadd( LOG_INFO, "Could not parse %s as .ini file, trying to load as legacy format.", name );
 		file_loadLineBased( name, 1, 2, &addAltFromLegacy, (void*)&count );
 	}
 	free( name );
+	if ( topology_load() ) {
+		buildZoneTables();
+	}
 	logadd( LOG_DEBUG1, "Added %d alt servers\n", count );
 	return count;
 }
 
+/**
+ * Precompute the zone of every alt server, and for every zone the cost to
+ * each alt server and the alt servers sorted by that cost, so ordering
+ * servers by topology is just a table lookup later on.
+ */
+static void buildZoneTables()
+{
+	const int num = numAltServers;
+	for ( int i = 0; i < num; ++i ) {
+		altZone[i] = (int16_t)topology_getZone( &altServers[i].host );
+	}
+	for ( int z = 0; z < SERVER_TOPOLOGY_MAX_ZONES && topology_zoneName( z ) != NULL; ++z ) {
+		uint16_t * const cost = zoneCost[z];
+		uint8_t * const order = zoneOrder[z];
+		for ( int i = 0; i < num; ++i ) {
+			cost[i] = (uint16_t)topology_getCost( z, altZone[i] );
+			// Insertion sort, keeping order of alt-servers file for equal cost
+			int j = i;
+			for ( ; j > 0 && cost[order[j - 1]] > cost[i]; --j ) {
+				order[j] = order[j - 1];
+			}
+			order[j] = (uint8_t)i;
+		}
+	}
+	localZone = topology_localZone();
+	if ( localZone == -1 && siblingSelf.type != 0 ) {
+		localZone = topology_getZone( &siblingSelf );
+	}
+	hasTopology = true;
+}
+
 bool altservers_add(dnbd3_host_t *host, const char *comment, const int isPrivate, const int isClientOnly, int *index)
 {
 	int i, freeSlot = -1;
@@ -146,7 +211,9 @@ bool altservers_add(dnbd3_host_t *host, const char *comment, const int isPrivate
 	altServers[freeSlot].host = *host;
 	altServers[freeSlot].isPrivate = isPrivate;
 	altServers[freeSlot].isClientOnly = isClientOnly;
+	altServers[freeSlot].isSibling = false;
 	altServers[freeSlot].nameSpaces = NULL;
+	memset( &altServers[freeSlot].load, 0, sizeof(altServers[freeSlot].load) );
 	if ( comment != NULL ) snprintf( altServers[freeSlot].comment, COMMENT_LENGTH, "%s", comment );
 	mutex_unlock( &altServersLock );
 	*index = freeSlot;
@@ -190,9 +257,56 @@ static bool isImageAllowed(dnbd3_alt_server_t *alt, const char *image)
 	return false;
 }
 
+static bool hasRecentLoad(dnbd3_alt_server_t *alt, ticks *now)
+{
+	return alt->load.valid && timing_diff( &alt->load.updated, now ) < SERVER_LOAD_MAX_AGE;
+}
+
+/**
+ * Penalty for handing out the given server to a client of the given image,
+ * based on what it told us about its load, see altservers_gossip.
+ * Clients and bandwidth are rated relative to the busiest candidate, so they
+ * only count if at least two candidates reported; servers that didn't report
+ * get a medium penalty for those then. Must hold altServersLock.
+ */
+static int loadPenalty(int server, dnbd3_image_t *image, uint64_t maxClients, uint64_t maxBandwidth, ticks *now)
+{
+	dnbd3_alt_server_t * const alt = &altServers[server];
+	int penalty = 0;
+	if ( !hasRecentLoad( alt, now ) ) {
+		if ( maxClients != 0 ) penalty += SERVER_LOAD_WEIGHT / 2;
+		if ( maxBandwidth != 0 ) penalty += SERVER_LOAD_WEIGHT / 2;
+		return penalty;
+	}
+	if ( alt->load.busy ) {
+		penalty += 2 * SERVER_LOAD_WEIGHT;
+	}
+	if ( maxClients != 0 ) {
+		penalty += (int)( alt->load.clients * SERVER_LOAD_WEIGHT / maxClients );
+	}
+	if ( maxBandwidth != 0 ) {
+		penalty += (int)( alt->load.bandwidth * SERVER_LOAD_WEIGHT / maxBandwidth );
+	}
+	if ( _admissionDiskLatency > 0 ) {
+		// Scale by our own limit, assuming the fleet is configured alike
+		penalty += (int)MIN( SERVER_LOAD_WEIGHT,
+				(uint64_t)alt->load.diskLatency * SERVER_LOAD_WEIGHT / ( (uint64_t)_admissionDiskLatency * 1000 ) );
+	}
+	const uint8_t complete = image->peerComplete[server];
+	if ( complete == 255 ) {
+		penalty += SERVER_LOAD_WEIGHT; // Would have to fetch everything first
+	} else if ( complete != 0 ) {
+		penalty += ( 101 - complete ) * SERVER_LOAD_WEIGHT / 100;
+	}
+	return penalty;
+}
+
 /**
  * Get <size> known (working) alt servers, ordered by network closeness
- * (by finding the smallest possible subnet)
+ * (by finding the smallest possible subnet), minus a penalty for servers
+ * that told us they are busy, see loadPenalty.
+ * If there is a topology file and the client is in a known zone, the cost
+ * from that zone to each server is the primary sort key instead.
  * Private servers are excluded, so this is what you want to call to
  * get a list of servers you can tell a client about
  */
@@ -203,7 +317,11 @@ int altservers_getListForClient(dnbd3_client_t *client, dnbd3_server_entry_t *ou
 		return 0;
 	int i, j;
 	int count = 0;
-	uint16_t scores[SERVER_MAX_ALTS] = { 0 };
+	int reports = 0;
+	uint64_t maxClients = 0, maxBandwidth = 0;
+	int scores[SERVER_MAX_ALTS] = { 0 };
+	const int clientZone = hasTopology ? topology_getZone( host ) : -1;
+	declare_now;
 	if ( size > numAltServers ) size = numAltServers;
 	mutex_lock( &altServersLock );
 	for ( i = 0; i < numAltServers; ++i ) {
@@ -211,7 +329,24 @@ int altservers_getListForClient(dnbd3_client_t *client, dnbd3_server_entry_t *ou
 			continue; // Slot is empty or uplink is for replication only
 		if ( !isImageAllowed( &altServers[i], client->image->name ) )
 			continue;
-		scores[i] = (uint16_t)( 10 + altservers_netCloseness( host, &altServers[i].host ) );
+		scores[i] = 20 + altservers_netCloseness( host, &altServers[i].host );
+		if ( hasRecentLoad( &altServers[i], &now ) ) {
+			reports++;
+			maxClients = MAX( maxClients, altServers[i].load.clients );
+			maxBandwidth = MAX( maxBandwidth, altServers[i].load.bandwidth );
+		}
+	}
+	if ( reports < 2 ) {
+		maxClients = maxBandwidth = 0;
+	}
+	for ( i = 0; i < numAltServers; ++i ) {
+		if ( scores[i] == 0 )
+			continue;
+		scores[i] = MAX( 1, scores[i] - loadPenalty( i, client->image, maxClients, maxBandwidth, &now ) );
+		if ( clientZone != -1 ) {
+			// Above score is at most 20 + 32, so this takes precedence
+			scores[i] += ( SERVER_TOPOLOGY_MAX_COST + 1 - zoneCost[clientZone][i] ) * 64;
+		}
 	}
 	while ( count < size ) {
 		i = -1;
@@ -242,7 +377,7 @@ static bool isUsableForUplink( dnbd3_uplink_t *uplink, int server, ticks *now )
 {
 	dnbd3_alt_local_t *local = ( uplink == NULL ? NULL : &uplink->altData[server] );
 	dnbd3_alt_server_t *global = &altServers[server];
-	if ( global->isClientOnly || ( !global->isPrivate && _proxyPrivateOnly ) )
+	if ( global->isClientOnly || global->isSibling || ( !global->isPrivate && _proxyPrivateOnly ) )
 		return false;
 	// Blocked locally (image not found on server...)
 	if ( local != NULL && local->blocked ) {
@@ -282,7 +417,7 @@ bool altservers_imageHasAltServers(const char *image)
 	bool ret = false;
 	mutex_lock( &altServersLock );
 	for ( int i = 0; i < numAltServers; ++i ) {
-		if ( altServers[i].isClientOnly || ( !altServers[i].isPrivate && _proxyPrivateOnly ) )
+		if ( altServers[i].isClientOnly || altServers[i].isSibling || ( !altServers[i].isPrivate && _proxyPrivateOnly ) )
 			continue;
 		if ( !isImageAllowed( &altServers[i], image ) )
 			continue;
@@ -293,6 +428,36 @@ bool altservers_imageHasAltServers(const char *image)
 	return ret;
 }
 
+/**
+ * Fill order with all alt servers, sorted by cost from our own zone, and
+ * shuffled within each group of equal cost. Without topology, that is
+ * just a random order. Must hold altServersLock.
+ * @return number of entries in order
+ */
+static int candidateOrder(int *order)
+{
+	const int num = numAltServers;
+	const bool useZone = localZone != -1;
+	for ( int i = 0; i < num; ++i ) {
+		order[i] = useZone ? zoneOrder[localZone][i] : i;
+	}
+	for ( int start = 0; start < num; ) {
+		int end = num;
+		if ( useZone ) {
+			const uint16_t cost = zoneCost[localZone][order[start]];
+			for ( end = start + 1; end < num && zoneCost[localZone][order[end]] == cost; ++end ) { }
+		}
+		for ( int i = end - 1; i > start; --i ) {
+			const int j = start + rand() % ( i - start + 1 );
+			const int tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+		start = end;
+	}
+	return num;
+}
+
 /**
  * Get <size> alt servers. If there are more alt servers than
  * requested, random servers will be picked.
@@ -310,24 +475,26 @@ static int altservers_getListForUplink(dnbd3_uplink_t *uplink, const char *image
 	// If we don't have enough servers to randomize, take a shortcut
 	if ( numAltServers <= size ) {
 		for ( int i = 0; i < numAltServers; ++i ) {
-			if ( current == -1 || i == current || isUsableForUplink( uplink, i, &now ) ) {
+			if ( ( current == -1 && !altServers[i].isSibling ) || i == current || isUsableForUplink( uplink, i, &now ) ) {
 				if ( isImageAllowed( &altServers[i], image ) ) {
 					servers[count++] = i;
 				}
 			}
 		}
 	} else {
-		// Plenty of alt servers; randomize
+		// Plenty of alt servers; randomize, but cheapest first if we know our zone
+		int order[SERVER_MAX_ALTS];
 		uint8_t state[SERVER_MAX_ALTS] = { 0 };
+		const int num = candidateOrder( order );
 		if ( current != -1 ) { // Make sure we also test the current server
 			servers[count++] = current;
 			state[current] = 2;
 		}
-		for ( int tr = size * 10; tr > 0 && count < size; --tr ) {
-			int idx = rand() % numAltServers;
+		for ( int i = 0; i < num && count < size; ++i ) {
+			const int idx = order[i];
 			if ( state[idx] != 0 )
 				continue;
-			if ( !isImageAllowed( &altServers[idx], image ) ) {
+			if ( !isImageAllowed( &altServers[idx], image ) || altServers[idx].isSibling ) {
 				state[idx] = 2; // Mark as used without adding, so it will be ignored in panic loop
 			} else if ( isUsableForUplink( uplink, idx, &now ) ) {
 				servers[count++] = idx;
@@ -337,8 +504,8 @@ static int altservers_getListForUplink(dnbd3_uplink_t *uplink, const char *image
 			}
 		}
 		// If panic mode, consider others too
-		for ( int tr = size * 10; current == -1 && tr > 0 && count < size; --tr ) {
-			int idx = rand() % numAltServers;
+		for ( int i = 0; current == -1 && i < num && count < size; ++i ) {
+			const int idx = order[i];
 			if ( state[idx] == 2 )
 				continue;
 			servers[count++] = idx;
@@ -349,9 +516,77 @@ static int altservers_getListForUplink(dnbd3_uplink_t *uplink, const char *image
 	return count;
 }
 
+static uint64_t hrwScore(uint64_t key, const dnbd3_host_t *host)
+{
+	uint64_t h = ( key ^ host->type ) * 0x100000001b3ull;
+	const size_t len = host->type == HOST_IP4 ? 4 : sizeof(host->addr);
+	for ( size_t i = 0; i < len; ++i ) {
+		h = ( h ^ host->addr[i] ) * 0x100000001b3ull;
+	}
+	h = ( h ^ host->port ) * 0x100000001b3ull;
+	// Finalizer from splitmix64, so similar inputs yield very different scores
+	h = ( h ^ ( h >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+	h = ( h ^ ( h >> 27 ) ) * 0x94d049bb133111ebull;
+	return h ^ ( h >> 31 );
+}
+
+/**
+ * Get list of all configured sibling proxies, by index, in a stable order.
+ * Returns 0 if sibling mode is disabled.
+ */
+int altservers_getSiblings(int *servers, int size)
+{
+	int count = 0;
+	if ( siblingSelf.type == 0 )
+		return 0;
+	mutex_lock( &altServersLock );
+	for ( int i = 0; i < numAltServers && count < size; ++i ) {
+		if ( altServers[i].isSibling && altServers[i].host.type != 0 ) {
+			servers[count++] = i;
+		}
+	}
+	mutex_unlock( &altServersLock );
+	return count;
+}
+
+/**
+ * Determine which member of our sibling group owns the given hash block
+ * of the given image, using rendezvous hashing. This only depends on the
+ * configured group, not on which siblings are currently reachable, so all
+ * members come to the same conclusion.
+ * @return index of owning sibling, or -1 if we own it ourselves or
+ *         sibling mode is disabled
+ */
+int altservers_getOwner(const char *image, uint16_t rid, uint64_t hashBlock)
+{
+	if ( siblingSelf.type == 0 )
+		return -1;
+	uint64_t key = 0xcbf29ce484222325ull; // FNV-1a
+	for ( const char *c = image; *c != '\0'; ++c ) {
+		key = ( key ^ (uint8_t)*c ) * 0x100000001b3ull;
+	}
+	key = ( key ^ rid ) * 0x100000001b3ull;
+	key = ( key ^ hashBlock ) * 0x100000001b3ull;
+	int owner = -1;
+	uint64_t best = hrwScore( key, &siblingSelf );
+	mutex_lock( &altServersLock );
+	for ( int i = 0; i < numAltServers; ++i ) {
+		if ( !altServers[i].isSibling || altServers[i].host.type == 0 )
+			continue;
+		const uint64_t score = hrwScore( key, &altServers[i].host );
+		if ( score > best ) {
+			best = score;
+			owner = i;
+		}
+	}
+	mutex_unlock( &altServersLock );
+	return owner;
+}
+
 json_t* altservers_toJson()
 {
 	json_t *list = json_array();
+	declare_now;
 
 	mutex_lock( &altServersLock );
 	char host[100];
@@ -365,14 +600,26 @@ json_t* altservers_toJson()
 			json_array_append_new( rtts, json_integer( src[i].rtt[ (j + src[i].rttIndex + 1) % SERVER_RTT_PROBES ] ) );
 		}
 		sock_printHost( &src[i].host, host, sizeof(host) );
-		json_t *server = json_pack( "{ss,ss,so,sb,sb,si}",
+		json_t *server = json_pack( "{ss,ss,so,sb,sb,si,sI}",
 			"comment", src[i].comment,
 			"host", host,
 			"rtt", rtts,
 			"isPrivate", (int)src[i].isPrivate,
 			"isClientOnly", (int)src[i].isClientOnly,
-			"numFails", src[i].fails
+			"numFails", src[i].fails,
+			"throughput", (json_int_t)src[i].throughput
 		);
+		if ( hasTopology && altZone[i] != -1 ) {
+			json_object_set_new( server, "zone", json_string( topology_zoneName( altZone[i] ) ) );
+		}
+		if ( src[i].load.valid ) {
+			json_object_set_new( server, "load", json_pack( "{sI,sI,si,sb,si}",
+				"clients", (json_int_t)src[i].load.clients,
+				"bandwidth", (json_int_t)src[i].load.bandwidth,
+				"diskLatency", (int)src[i].load.diskLatency,
+				"busy", (int)src[i].load.busy,
+				"age", (int)timing_diff( &src[i].load.updated, &now ) ) );
+		}
 		json_array_append_new( list, server );
 	}
 	return list;
@@ -380,26 +627,27 @@ json_t* altservers_toJson()
 
 /**
  * Update rtt history of given server - returns the new average for that server.
+ * The history is shared by all uplinks.
  */
-static uint32_t altservers_updateRtt(dnbd3_uplink_t *uplink, int index, uint32_t rtt)
+static uint32_t altservers_updateRtt(int index, uint32_t rtt)
 {
 	uint32_t avg = 0, j;
-	dnbd3_alt_local_t *local = &uplink->altData[index];
+	dnbd3_alt_server_t *server = &altServers[index];
 	mutex_lock( &altServersLock );
-	if ( likely( local->initDone ) ) {
-		local->rtt[++local->rttIndex % SERVER_RTT_PROBES] = rtt;
+	if ( likely( server->rttInit ) ) {
+		server->rtt[++server->rttIndex % SERVER_RTT_PROBES] = rtt;
 		for ( j = 0; j < SERVER_RTT_PROBES; ++j ) {
-			avg += local->rtt[j];
+			avg += server->rtt[j];
 		}
 		avg /= SERVER_RTT_PROBES;
 	} else { // First rtt measurement -- copy to every slot
 		for ( j = 0; j < SERVER_RTT_PROBES; ++j ) {
-			local->rtt[j] = rtt;
+			server->rtt[j] = rtt;
 		}
 		avg = rtt;
-		local->initDone = true;
+		server->rttInit = true;
 	}
-	altServers[index].rtt[++altServers[index].rttIndex % SERVER_RTT_PROBES] = avg;
+	timing_get( &server->lastRtt );
 	mutex_unlock( &altServersLock );
 	return avg;
 }
@@ -447,7 +695,7 @@ void altservers_serverFailed(int server)
  * subsequently selecting the given image failed. Handle this within
  * the uplink and don't increase the global fail counter.
  */
-static void altservers_imageFailed(dnbd3_uplink_t *uplink, int server)
+void altservers_imageFailed(dnbd3_uplink_t *uplink, int server)
 {
 	mutex_lock( &altServersLock );
 	if ( uplink->altData[server].fails++ >= SERVER_BAD_UPLINK_MAX ) {
@@ -489,19 +737,269 @@ int altservers_hostToIndex(dnbd3_host_t *host)
 	return -1;
 }
 
+/**
+ * Check whether given address belongs to one of our alt servers.
+ * The port is ignored, as this is meant for incoming connections.
+ */
+bool altservers_isKnownHost(const dnbd3_host_t *host)
+{
+	bool found = false;
+	mutex_lock( &altServersLock );
+	for ( int i = 0; i < numAltServers && !found; ++i ) {
+		found = isSameAddress( host, &altServers[i].host );
+	}
+	mutex_unlock( &altServersLock );
+	return found;
+}
+
 const dnbd3_host_t* altservers_indexToHost(int server)
 {
 	return &altServers[server].host;
 }
 
+/**
+ * Get average RTT in µs of given server, as measured by all uplinks.
+ * Returns 0 if the server was never measured.
+ */
+uint32_t altservers_getRtt(int server)
+{
+	uint32_t avg = 0;
+	mutex_lock( &altServersLock );
+	if ( altServers[server].rttInit ) {
+		for ( int j = 0; j < SERVER_RTT_PROBES; ++j ) {
+			avg += altServers[server].rtt[j] / SERVER_RTT_PROBES;
+		}
+	}
+	mutex_unlock( &altServersLock );
+	return avg;
+}
+
+/**
+ * Feed RTT derived from live uplink traffic into the server's RTT
+ * history. As long as these keep coming in, the server won't be
+ * actively probed by any alt check.
+ */
+void altservers_recordLiveRtt(int server, uint32_t rtt)
+{
+	altservers_updateRtt( server, rtt );
+}
+
+/**
+ * Report throughput of a busy uplink connection to given server.
+ */
+void altservers_recordThroughput(int server, uint32_t throughput)
+{
+	mutex_lock( &altServersLock );
+	const uint32_t old = altServers[server].throughput;
+	altServers[server].throughput = old == 0 ? throughput : (uint32_t)( ( (uint64_t)old * 7 + throughput ) / 8 );
+	mutex_unlock( &altServersLock );
+}
+
+/**
+ * Get smoothed throughput of given server in bytes/s, 0 if unknown.
+ */
+uint32_t altservers_getThroughput(int server)
+{
+	mutex_lock( &altServersLock );
+	const uint32_t throughput = altServers[server].throughput;
+	mutex_unlock( &altServersLock );
+	return throughput;
+}
+
+/**
+ * Check whether the given server's RTT was updated recently enough,
+ * by any uplink, so it doesn't need to be probed.
+ */
+static bool hasRecentRtt(int server, ticks *now)
+{
+	mutex_lock( &altServersLock );
+	bool ret = altServers[server].rttInit
+			&& timing_diff( &altServers[server].lastRtt, now ) < SERVER_RTT_MAX_AGE;
+	mutex_unlock( &altServersLock );
+	return ret;
+}
+
+/**
+ * Get list of usable servers that can act as additional sources
+ * for the given uplink, ordered by their RTT, best first. The
+ * uplink's current server is not included.
+ * Servers the uplink never measured go last.
+ */
+int altservers_getSwarmList(dnbd3_uplink_t *uplink, int *servers, int size)
+{
+	int cand[SERVER_MAX_ALTS];
+	uint32_t rtt[SERVER_MAX_ALTS];
+	int num = altservers_getListForUplink( uplink, uplink->image->name, cand, SERVER_MAX_ALTS, uplink->current.index );
+	int count = 0;
+	for ( int i = 0; i < num; ++i ) {
+		const int idx = cand[i];
+		if ( idx == uplink->current.index )
+			continue;
+		uint32_t r = altservers_getRtt( idx );
+		if ( r == 0 ) {
+			r = UINT32_MAX;
+		}
+		// Insertion sort, list is tiny
+		int j = count++;
+		while ( j > 0 && rtt[j - 1] > r ) {
+			cand[j] = cand[j - 1];
+			rtt[j] = rtt[j - 1];
+			j--;
+		}
+		rtt[j] = r;
+		cand[j] = idx;
+	}
+	if ( count > size ) {
+		count = size;
+	}
+	memcpy( servers, cand, count * sizeof(*servers) );
+	return count;
+}
+
 // XXX Sync call above must block until async worker has finished XXX
+/**
+ * Replace standby connection of uplink by given connection. If the
+ * uplink wasn't serving any clients recently, or standby connections
+ * are disabled, just close the given connection instead.
+ */
+static void altservers_setStandby(dnbd3_uplink_t *uplink, dnbd3_server_connection_t *con)
+{
+	if ( con->fd != -1 && ( !_uplinkStandby || uplink->idleTime >= UPLINK_STANDBY_IDLE_TIME ) ) {
+		close( con->fd );
+		con->fd = -1;
+	}
+	mutex_lock( &uplink->rttLock );
+	const int old = uplink->standby.fd;
+	uplink->standby = *con;
+	mutex_unlock( &uplink->rttLock );
+	if ( old != -1 ) {
+		close( old );
+	}
+}
+
+#define PROBE_CONNECTING 0
+#define PROBE_SELECTING 1
+#define PROBE_FETCHING 2
+#define PROBE_DONE 3
+#define PROBE_FAILED 4
+#define PROBE_CONNECT_TIMEOUT 750 // ms
+
+typedef struct {
+	int server;        // Index into altServers
+	int fd;
+	int state;         // PROBE_*
+	int version;       // Protocol version of server, once known
+	bool isCurrent;    // Server is the uplink's current server
+	bool recent;       // Server has recent RTT samples, only do handshake
+	uint32_t rtt;      // Averaged RTT, once done
+	ticks start;       // When the block request was sent
+} rtt_probe_t;
+
+/**
+ * Advance given probe by one step, after poll() signaled an event for
+ * its socket. Reads are blocking with a timeout, but the data we need
+ * should be there already at that point, so we don't block long.
+ */
+static void probeStep(dnbd3_uplink_t *uplink, dnbd3_image_t *image, rtt_probe_t *p, short revents,
+		uint64_t offset, uint32_t length)
+{
+	const int server = p->server;
+	const int sock = p->fd;
+	if ( p->state == PROBE_CONNECTING ) {
+		struct sockaddr_storage tmp;
+		socklen_t len = sizeof(tmp);
+		if ( ( revents & POLLOUT ) == 0 || getpeername( sock, (struct sockaddr*)&tmp, &len ) == -1 )
+			goto server_failed;
+		sock_set_block( sock );
+		sock_setTimeout( sock, _uplinkTimeout );
+		// Select image ++++++++++++++++++++++++++++++
+		if ( !dnbd3_select_image( sock, image->name, image->rid, SI_SERVER_FLAGS ) ) {
+			goto image_failed;
+		}
+		p->state = PROBE_SELECTING;
+		return;
+	}
+	if ( p->state == PROBE_SELECTING ) {
+		// See if selecting the image succeeded ++++++++++++++++++++++++++++++
+		uint16_t protocolVersion = 0;
+		uint16_t rid;
+		uint64_t imageSize;
+		char *name;
+		serialized_buffer_t serialized;
+		if ( !dnbd3_select_image_reply( &serialized, sock, &protocolVersion, &name, &rid, &imageSize ) ) {
+			goto image_failed;
+		}
+		if ( protocolVersion < MIN_SUPPORTED_SERVER ) { // Server version unsupported; global fail
+			goto server_failed;
+		}
+		if ( name == NULL || strcmp( name, image->name ) != 0 ) {
+			ERROR_GOTO( image_failed, "[RTT] Server offers image '%s' instead of '%s'", name, image->name );
+		}
+		if ( rid != image->rid ) {
+			ERROR_GOTO( image_failed, "[RTT] Server provides rid %d instead of %d", (int)rid, (int)image->rid );
+		}
+		if ( imageSize != image->virtualFilesize ) {
+			ERROR_GOTO( image_failed, "[RTT] Remote size: %" PRIu64 ", expected: %" PRIu64, imageSize, image->virtualFilesize );
+		}
+		p->version = protocolVersion;
+		if ( p->recent ) {
+			// Handshake is all we need
+			p->rtt = altservers_getRtt( server );
+			p->state = PROBE_DONE;
+			return;
+		}
+		// Only time the block request itself, so the result is comparable to live samples
+		timing_get( &p->start );
+		// Request block (NOT random! First or from queue) ++++++++++++
+		if ( !dnbd3_get_block( sock, offset, length, 0, COND_HOPCOUNT( protocolVersion, 1 ) ) ) {
+			LOG_GOTO( image_failed, LOG_DEBUG1, "[RTT%d] Could not request block", server );
+		}
+		p->state = PROBE_FETCHING;
+		return;
+	}
+	// PROBE_FETCHING - See if requesting the block succeeded ++++++++++++++++++++++
+	dnbd3_reply_t reply;
+	if ( !dnbd3_get_reply( sock, &reply ) ) {
+		LOG_GOTO( image_failed, LOG_DEBUG1, "[RTT%d] Received corrupted reply header after CMD_GET_BLOCK", server );
+	}
+	// check reply header
+	if ( reply.cmd != CMD_GET_BLOCK || reply.size != length ) {
+		// Sanity check failed; count this as global error (malicious/broken server)
+		ERROR_GOTO( server_failed, "[RTT] Reply to first block request is %" PRIu32 " bytes", reply.size );
+	}
+	// flush payload to include this into measurement
+	char buffer[DNBD3_BLOCK_SIZE];
+	uint32_t todo = length;
+	ssize_t ret;
+	while ( todo != 0 && ( ret = recv( sock, buffer, MIN( DNBD3_BLOCK_SIZE, todo ), MSG_WAITALL ) ) > 0 ) {
+		todo -= (uint32_t)ret;
+	}
+	if ( todo != 0 ) {
+		ERROR_GOTO( image_failed, "[RTT%d] Could not read first block payload", server );
+	}
+	// Measurement done - everything fine so far
+	declare_now;
+	const uint32_t rtt = (uint32_t)MIN( timing_diffUs( &p->start, &now ), UINT32_MAX ); // µs
+	p->rtt = altservers_updateRtt( server, rtt );
+	p->state = PROBE_DONE;
+	return;
+	// Jump here if anything went wrong
+image_failed:
+	altservers_imageFailed( uplink, server );
+	goto failed;
+server_failed:
+	altservers_serverFailed( server );
+failed:
+	close( sock );
+	p->state = PROBE_FAILED;
+}
+
 static void altservers_findUplinkInternal(dnbd3_uplink_t *uplink)
 {
 	const int ALTS = 4;
 	int itAlt, numAlts, current;
 	bool panic;
 	int servers[ALTS + 1];
-	struct timespec start, end;
 
 	if ( _shutdown )
 		return;
@@ -532,8 +1030,8 @@ static void altservers_findUplinkInternal(dnbd3_uplink_t *uplink)
 	logadd( LOG_DEBUG2, "Running alt check for %s:%d", PIMG(image) );
 	assert( uplink->rttTestResult == RTT_INPROGRESS );
 	// Test them all
-	dnbd3_server_connection_t best = { .fd = -1 };
-	unsigned long bestRtt = RTT_UNREACHABLE;
+	dnbd3_server_connection_t best = { .fd = -1 }, second = { .fd = -1 };
+	unsigned long bestRtt = RTT_UNREACHABLE, secondRtt = RTT_UNREACHABLE;
 	unsigned long currentRtt = RTT_UNREACHABLE;
 	uint64_t offset = 0;
 	uint32_t length = DNBD3_BLOCK_SIZE;
@@ -547,104 +1045,134 @@ static void altservers_findUplinkInternal(dnbd3_uplink_t *uplink)
 		length = (uint32_t)( uplink->queue->to - offset );
 	}
 	mutex_unlock( &uplink->queueLock );
+	// Start connecting to all servers at once
+	rtt_probe_t probes[ALTS + 1];
+	int numProbes = 0;
+	ticks begin;
+	timing_get( &begin );
 	for (itAlt = 0; itAlt < numAlts; ++itAlt) {
-		int server = servers[itAlt];
-		// Connect
-		clock_gettime( BEST_CLOCK_SOURCE, &start );
-		int sock = sock_connect( &altServers[server].host, 750, _uplinkTimeout );
+		const int server = servers[itAlt];
+		mutex_lock( &uplink->rttLock );
+		const bool isCurrent = ( uplink->current.index == server );
+		mutex_unlock( &uplink->rttLock );
+		// If we or any other uplink have recent data, use that instead of probing
+		const bool recent = hasRecentRtt( server, &begin );
+		if ( recent && !panic && isCurrent ) {
+			const uint32_t avg = altservers_getRtt( server );
+			currentRtt = uplink->cycleDetected ? (avg * 2) + 50000 : avg;
+			continue; // No need to connect at all
+		}
+		const int sock = sock_connect( &altServers[server].host, -1, -1 ); // Non-blocking
 		if ( sock == -1 ) { // Connection failed means global error
 			altservers_serverFailed( server );
 			continue;
 		}
-		// Select image ++++++++++++++++++++++++++++++
-		if ( !dnbd3_select_image( sock, image->name, image->rid, SI_SERVER_FLAGS ) ) {
-			goto image_failed;
-		}
-		// See if selecting the image succeeded ++++++++++++++++++++++++++++++
-		uint16_t protocolVersion = 0;
-		uint16_t rid;
-		uint64_t imageSize;
-		char *name;
-		serialized_buffer_t serialized;
-		if ( !dnbd3_select_image_reply( &serialized, sock, &protocolVersion, &name, &rid, &imageSize ) ) {
-			goto image_failed;
-		}
-		if ( protocolVersion < MIN_SUPPORTED_SERVER ) { // Server version unsupported; global fail
-			goto server_failed;
-		}
-		if ( name == NULL || strcmp( name, image->name ) != 0 ) {
-			ERROR_GOTO( image_failed, "[RTT] Server offers image '%s' instead of '%s'", name, image->name );
-		}
-		if ( rid != image->rid ) {
-			ERROR_GOTO( image_failed, "[RTT] Server provides rid %d instead of %d", (int)rid, (int)image->rid );
-		}
-		if ( imageSize != image->virtualFilesize ) {
-			ERROR_GOTO( image_failed, "[RTT] Remote size: %" PRIu64 ", expected: %" PRIu64, imageSize, image->virtualFilesize );
-		}
-		// Request block (NOT random! First or from queue) ++++++++++++
-		if ( !dnbd3_get_block( sock, offset, length, 0, COND_HOPCOUNT( protocolVersion, 1 ) ) ) {
-			LOG_GOTO( image_failed, LOG_DEBUG1, "[RTT%d] Could not request block", server );
+		probes[numProbes++] = (rtt_probe_t){ .server = server, .fd = sock, .state = PROBE_CONNECTING,
+			.isCurrent = isCurrent, .recent = recent };
+	}
+	// Now drive all of them concurrently until they're done, or we ran out of time.
+	// As soon as the first one finished, the others get as much time again; anything
+	// slower than that is unlikely to be chosen anyways.
+	uint64_t deadline = PROBE_CONNECT_TIMEOUT + (uint64_t)_uplinkTimeout;
+	bool hardDeadline = true;
+	for ( ;; ) {
+		struct pollfd pfd[ALTS + 1];
+		int active = 0;
+		for ( int i = 0; i < numProbes; ++i ) {
+			pfd[i].fd = -1;
+			pfd[i].revents = 0;
+			if ( probes[i].state >= PROBE_DONE )
+				continue;
+			pfd[i].fd = probes[i].fd;
+			pfd[i].events = probes[i].state == PROBE_CONNECTING ? POLLOUT : POLLIN;
+			active++;
 		}
-		// See if requesting the block succeeded ++++++++++++++++++++++
-		dnbd3_reply_t reply;
-		if ( !dnbd3_get_reply( sock, &reply ) ) {
-			LOG_GOTO( image_failed, LOG_DEBUG1, "[RTT%d] Received corrupted reply header after CMD_GET_BLOCK", server );
+		if ( active == 0 || _shutdown )
+			break;
+		declare_now;
+		uint64_t elapsed = timing_diffMs( &begin, &now );
+		if ( elapsed >= deadline )
+			break;
+		int wait = (int)( deadline - elapsed );
+		for ( int i = 0; i < numProbes; ++i ) {
+			if ( probes[i].state == PROBE_CONNECTING ) {
+				if ( elapsed >= PROBE_CONNECT_TIMEOUT ) { // Connect timeout means global error
+					altservers_serverFailed( probes[i].server );
+					close( probes[i].fd );
+					probes[i].state = PROBE_FAILED;
+					pfd[i].fd = -1;
+				} else if ( wait > (int)( PROBE_CONNECT_TIMEOUT - elapsed ) ) {
+					wait = (int)( PROBE_CONNECT_TIMEOUT - elapsed );
+				}
+			}
 		}
-		// check reply header
-		if ( reply.cmd != CMD_GET_BLOCK || reply.size != length ) {
-			// Sanity check failed; count this as global error (malicious/broken server)
-			ERROR_GOTO( server_failed, "[RTT] Reply to first block request is %" PRIu32 " bytes", reply.size );
+		const int ret = poll( pfd, numProbes, wait );
+		if ( ret == -1 && errno != EINTR ) {
+			logadd( LOG_WARNING, "poll() failed during alt check (errno=%d)", errno );
+			break;
 		}
-		// flush payload to include this into measurement
-		char buffer[DNBD3_BLOCK_SIZE];
-		uint32_t todo = length;
-		ssize_t ret;
-		while ( todo != 0 && ( ret = recv( sock, buffer, MIN( DNBD3_BLOCK_SIZE, todo ), MSG_WAITALL ) ) > 0 ) {
-			todo -= (uint32_t)ret;
+		for ( int i = 0; i < numProbes && ret > 0; ++i ) {
+			if ( pfd[i].fd == -1 || pfd[i].revents == 0 )
+				continue;
+			probeStep( uplink, image, &probes[i], pfd[i].revents, offset, length );
+			if ( probes[i].state == PROBE_DONE && hardDeadline ) {
+				timing_get( &now );
+				elapsed = timing_diffMs( &begin, &now );
+				deadline = MIN( deadline, elapsed * 2 + 50 );
+				hardDeadline = false;
+			}
 		}
-		if ( todo != 0 ) {
-			ERROR_GOTO( image_failed, "[RTT%d] Could not read first block payload", server );
+	}
+	// Evaluate
+	for ( int i = 0; i < numProbes; ++i ) {
+		rtt_probe_t * const p = &probes[i];
+		if ( p->state != PROBE_DONE ) {
+			if ( p->state != PROBE_FAILED ) {
+				// Timed out. Only count as failure if we waited the full time, not if we just
+				// stopped waiting because others were a lot faster
+				if ( hardDeadline ) {
+					if ( p->state == PROBE_CONNECTING ) {
+						altservers_serverFailed( p->server );
+					} else {
+						altservers_imageFailed( uplink, p->server );
+					}
+				}
+				close( p->fd );
+			}
+			continue;
 		}
-		clock_gettime( BEST_CLOCK_SOURCE, &end );
-		// Measurement done - everything fine so far
-		mutex_lock( &uplink->rttLock );
-		const bool isCurrent = ( uplink->current.index == server );
-		mutex_unlock( &uplink->rttLock );
-		uint32_t rtt = (uint32_t)((end.tv_sec - start.tv_sec) * 1000000
-				+ (end.tv_nsec - start.tv_nsec) / 1000); // µs
-		uint32_t avg = altservers_updateRtt( uplink, server, rtt );
+		uint32_t avg = p->rtt;
 		// If a cycle was detected, or we lost connection to the current (last) server, penaltize it one time
-		if ( ( uplink->cycleDetected || panic ) && isCurrent ) {
+		if ( ( uplink->cycleDetected || panic ) && p->isCurrent ) {
 			avg = (avg * 2) + 50000;
 		}
-		if ( !panic && isCurrent ) {
+		if ( !panic && p->isCurrent ) {
 			// Was measuring current server
 			currentRtt = avg;
-			close( sock );
+			close( p->fd );
 		} else if ( avg < bestRtt ) {
-			// Was another server, update "best"
-			if ( best.fd != -1 ) {
-				close( best.fd );
+			// Was another server, update "best", previous best becomes runner-up
+			if ( second.fd != -1 ) {
+				close( second.fd );
 			}
-			best.fd = sock;
+			second = best;
+			secondRtt = bestRtt;
+			best.fd = p->fd;
 			bestRtt = avg;
-			best.index = server;
-			best.version = protocolVersion;
+			best.index = p->server;
+			best.version = p->version;
+		} else if ( avg < secondRtt ) {
+			if ( second.fd != -1 ) {
+				close( second.fd );
+			}
+			second.fd = p->fd;
+			secondRtt = avg;
+			second.index = p->server;
+			second.version = p->version;
 		} else {
 			// Was too slow, ignore
-			close( sock );
+			close( p->fd );
 		}
-		// We're done, call continue
-		continue;
-		// Jump here if anything went wrong
-		// This will cleanup and continue
-image_failed:
-		altservers_imageFailed( uplink, server );
-		goto failed;
-server_failed:
-		altservers_serverFailed( server );
-failed:
-		close( sock );
 	}
 	// Done testing all servers. See if we should switch
 	if ( best.fd != -1 && (panic || (bestRtt < 10000000 && RTT_THRESHOLD_FACTOR(currentRtt) > bestRtt)) ) {
@@ -658,15 +1186,20 @@ failed:
 		uplink->better = best;
 		uplink->rttTestResult = RTT_DOCHANGE;
 		mutex_unlock( &uplink->rttLock );
+		altservers_setStandby( uplink, &second );
 		signal_call( uplink->signal );
 	} else if ( best.fd == -1 && currentRtt == RTT_UNREACHABLE ) {
 		// No server was reachable, including current
+		if ( second.fd != -1 ) {
+			close( second.fd );
+		}
 		uplink->rttTestResult = RTT_NOT_REACHABLE;
 	} else {
-		// nope
-		if ( best.fd != -1 ) {
-			close( best.fd );
+		// nope, but keep best one around for quick failover
+		if ( second.fd != -1 ) {
+			close( second.fd );
 		}
+		altservers_setStandby( uplink, &best );
 		uplink->cycleDetected = false; // It's a lie, but prevents rtt measurement triggering again right away
 		mutex_lock( &uplink->rttLock );
 		uplink->rttTestResult = RTT_DONTCHANGE;
@@ -675,3 +1208,114 @@ failed:
 	image_release( image );
 }
 
+
+/**
+ * Ask given server how busy it is, and how complete its copies of the given
+ * images are. See sendLoad in net.c for the other side.
+ * @return false if the server couldn't be asked or didn't answer properly
+ */
+static bool queryLoad(int server, const dnbd3_host_t *host, dnbd3_image_t **images, int numImages)
+{
+	serialized_buffer_t payload;
+	dnbd3_reply_t reply;
+	uint8_t complete[SERVER_LOAD_MAX_IMAGES];
+	bool ok = false;
+	// Only ask about as many images as fit in one request
+	int count = 0;
+	size_t bytes = 2 * sizeof(uint16_t);
+	while ( count < numImages && count < SERVER_LOAD_MAX_IMAGES ) {
+		bytes += strlen( images[count]->name ) + 1 + sizeof(uint16_t);
+		if ( bytes > MAX_PAYLOAD )
+			break;
+		count++;
+	}
+	serializer_reset_write( &payload );
+	serializer_put_uint16( &payload, PROTOCOL_VERSION );
+	serializer_put_uint16( &payload, (uint16_t)count );
+	for ( int i = 0; i < count; ++i ) {
+		serializer_put_string( &payload, images[i]->name );
+		serializer_put_uint16( &payload, images[i]->rid );
+	}
+	const uint32_t len = serializer_get_written_length( &payload );
+	dnbd3_request_t request = {
+		.magic = dnbd3_packet_magic,
+		.cmd = CMD_GET_LOAD,
+		.size = len,
+	};
+	fixup_request( request );
+	const int sock = sock_connect( host, 500, _uplinkTimeout );
+	if ( sock == -1 )
+		return false;
+	if ( sock_sendAll( sock, &request, sizeof(request), 2 ) != (ssize_t)sizeof(request)
+			|| sock_sendAll( sock, &payload, len, 2 ) != (ssize_t)len )
+		goto exit;
+	if ( !dnbd3_get_reply( sock, &reply ) || reply.cmd != CMD_GET_LOAD
+			|| reply.size == 0 || reply.size > MAX_PAYLOAD )
+		goto exit;
+	if ( sock_recv( sock, payload.buffer, reply.size ) != (ssize_t)reply.size )
+		goto exit;
+	serializer_reset_read( &payload, reply.size );
+	serializer_get_uint16( &payload ); // Protocol version, nothing depends on it yet
+	const uint64_t clients = serializer_get_uint64( &payload );
+	const uint64_t bandwidth = serializer_get_uint64( &payload );
+	const uint64_t diskLatency = serializer_get_uint64( &payload );
+	const bool busy = serializer_get_uint8( &payload ) != 0;
+	if ( serializer_get_uint16( &payload ) != count )
+		goto exit;
+	for ( int i = 0; i < count; ++i ) {
+		complete[i] = serializer_get_uint8( &payload );
+	}
+	declare_now;
+	mutex_lock( &altServersLock );
+	if ( isSameAddressPort( &altServers[server].host, host ) ) {
+		altServers[server].load.clients = clients;
+		altServers[server].load.bandwidth = bandwidth;
+		altServers[server].load.diskLatency = (uint32_t)MIN( diskLatency, UINT32_MAX );
+		altServers[server].load.busy = busy;
+		altServers[server].load.updated = now;
+		altServers[server].load.valid = true;
+	}
+	mutex_unlock( &altServersLock );
+	for ( int i = 0; i < count; ++i ) {
+		images[i]->peerComplete[server] = complete[i] > 100 ? 255 : (uint8_t)( complete[i] + 1 );
+	}
+	ok = true;
+exit:
+	close( sock );
+	return ok;
+}
+
+/**
+ * Periodically ask all alt servers we might tell clients about how busy they
+ * are, so altservers_getListForClient can prefer idle ones. Servers that don't
+ * answer, i.e. because they are too old to understand CMD_GET_LOAD, are left
+ * alone for a while.
+ */
+static void* altservers_gossip(void *data UNUSED)
+{
+	static atomic_bool running = false;
+	dnbd3_image_t *images[SERVER_LOAD_MAX_IMAGES];
+	if ( atomic_exchange( &running, true ) )
+		return NULL;
+	const int numImages = image_getInUse( images, SERVER_LOAD_MAX_IMAGES );
+	for ( int i = 0; i < numAltServers && !_shutdown; ++i ) {
+		dnbd3_host_t host;
+		declare_now;
+		mutex_lock( &altServersLock );
+		const bool skip = altServers[i].host.type == 0 || altServers[i].isPrivate
+				|| !timing_reached( &altServers[i].load.retry, &now );
+		host = altServers[i].host;
+		mutex_unlock( &altServersLock );
+		if ( skip || queryLoad( i, &host, images, numImages ) )
+			continue;
+		logadd( LOG_DEBUG1, "Could not get load of alt server %d, not asking again for a while", i );
+		mutex_lock( &altServersLock );
+		timing_set( &altServers[i].load.retry, &now, SERVER_LOAD_RETRY );
+		mutex_unlock( &altServersLock );
+	}
+	for ( int i = 0; i < numImages; ++i ) {
+		image_release( images[i] );
+	}
+	running = false;
+	return NULL;
+}
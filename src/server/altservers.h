@@ -29,8 +29,26 @@ void altservers_serverFailed(int server);
 
 int altservers_hostToIndex(dnbd3_host_t *host);
 
+bool altservers_isKnownHost(const dnbd3_host_t *host);
+
 const dnbd3_host_t* altservers_indexToHost(int server);
 
+int altservers_getSwarmList(dnbd3_uplink_t *uplink, int *servers, int size);
+
+uint32_t altservers_getRtt(int server);
+
+void altservers_recordLiveRtt(int server, uint32_t rtt);
+
+void altservers_recordThroughput(int server, uint32_t throughput);
+
+uint32_t altservers_getThroughput(int server);
+
+void altservers_imageFailed(dnbd3_uplink_t *uplink, int server);
+
+int altservers_getSiblings(int *servers, int size);
+
+int altservers_getOwner(const char *image, uint16_t rid, uint64_t hashBlock);
+
 struct json_t* altservers_toJson();
 
 #endif /* UPLINK_CONNECTOR_H_ */
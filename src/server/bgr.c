@@ -0,0 +1,245 @@
+#include "bgr.h"
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include <dnbd3/shared/timing.h>
+
+#include <assert.h>
+#include <time.h>
+#include <jansson.h>
+
+/*
+ * Central scheduler for background replication. Every uplink doing
+ * BGR asks for permission before firing replication requests. The
+ * global bandwidth budget (bgrBandwidth) is split among all uplinks
+ * that recently asked, weighted by their priority (bgrPriority). Each
+ * uplink has its own token bucket refilled at its share of the budget,
+ * so bandwidth not used by idle uplinks automatically goes to the
+ * remaining ones. Optionally, only the bgrMaxUplinks uplinks with the
+ * highest priority get to replicate at all, and replication can be
+ * limited to a time window (bgrTimeWindow).
+ */
+
+#define BGR_ACTIVE_TIMEOUT 10 // Seconds after last request until an uplink is considered inactive
+
+typedef struct
+{
+	int imageId;         // Image the uplink belongs to, 0 = unused slot
+	uint32_t weight;     // Priority as of last request
+	int64_t tokens;      // Bytes this uplink may currently request
+	uint64_t rate;       // Current share of global budget in bytes/s
+	uint64_t granted;    // Total bytes granted
+	ticks lastRefill;    // When tokens were last refilled
+	ticks lastSeen;      // When uplink last asked for slots
+	bool blocked;        // Denied last time because of time window or bgrMaxUplinks
+} bgr_entry_t;
+
+static pthread_mutex_t bgrLock;
+static bgr_entry_t entries[SERVER_BGR_MAX_UPLINKS];
+
+void bgr_init()
+{
+	mutex_init( &bgrLock, LOCK_BGR );
+}
+
+/**
+ * Check whether given time of day is within configured time window.
+ */
+static bool inTimeWindow()
+{
+	const int start = _bgrTimeStart, end = _bgrTimeEnd;
+	if ( start == end )
+		return true;
+	struct tm tm;
+	time_t t = time( NULL );
+	if ( localtime_r( &t, &tm ) == NULL )
+		return true;
+	const int minute = tm.tm_hour * 60 + tm.tm_min;
+	if ( start < end )
+		return minute >= start && minute < end;
+	return minute >= start || minute < end; // Wraps around midnight
+}
+
+/**
+ * Determine priority of given uplink. Higher is more important.
+ * Locks on: image.lock
+ */
+static uint32_t getWeight(dnbd3_uplink_t *uplink)
+{
+	dnbd3_image_t *image = uplink->image;
+	switch ( _bgrPriority ) {
+	case BGR_PRIO_USERS:
+		return 1 + (uint32_t)MAX( 0, image->users );
+	case BGR_PRIO_REMAINING: {
+		mutex_lock( &image->lock );
+		const int complete = image_getCompletenessEstimate( image );
+		mutex_unlock( &image->lock );
+		return 1 + (uint32_t)complete;
+	}
+	default:
+		return 1;
+	}
+}
+
+/**
+ * Find entry for image, or create if not existing.
+ * Inactive entries get cleared on the fly.
+ * HOLD BGR LOCK WHILE CALLING
+ */
+static bgr_entry_t* getEntry(int imageId, ticks *now)
+{
+	bgr_entry_t *unused = NULL, *found = NULL;
+	for ( int i = 0; i < SERVER_BGR_MAX_UPLINKS; ++i ) {
+		bgr_entry_t *e = &entries[i];
+		if ( e->imageId != 0 && timing_diff( &e->lastSeen, now ) > BGR_ACTIVE_TIMEOUT ) {
+			e->imageId = 0;
+		}
+		if ( e->imageId == imageId ) {
+			found = e;
+		} else if ( e->imageId == 0 && unused == NULL ) {
+			unused = e;
+		}
+	}
+	if ( found != NULL || unused == NULL )
+		return found;
+	memset( unused, 0, sizeof(*unused) );
+	unused->imageId = imageId;
+	unused->lastRefill = *now;
+	return unused;
+}
+
+/**
+ * Check whether given entry is among the top maxUplinks entries
+ * by weight. Ties are broken by image id.
+ * HOLD BGR LOCK WHILE CALLING
+ */
+static bool isTopRanked(const bgr_entry_t *entry, int maxUplinks)
+{
+	if ( maxUplinks == 0 )
+		return true;
+	int rank = 0;
+	for ( int i = 0; i < SERVER_BGR_MAX_UPLINKS; ++i ) {
+		const bgr_entry_t *e = &entries[i];
+		if ( e->imageId == 0 || e == entry )
+			continue;
+		if ( e->weight > entry->weight || ( e->weight == entry->weight && e->imageId < entry->imageId ) ) {
+			if ( ++rank >= maxUplinks )
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Ask for permission to send replication requests.
+ * Only call from uplink thread, with no locks held.
+ * @param wanted number of replication requests the uplink would like to send
+ * @param requestSize expected size of each request
+ * @return number of requests the uplink may send, between 0 and wanted
+ */
+int bgr_requestSlots(dnbd3_uplink_t *uplink, int wanted, uint32_t requestSize)
+{
+	if ( wanted <= 0 )
+		return 0;
+	const uint64_t budget = _bgrBandwidth;
+	const int maxUplinks = _bgrMaxUplinks;
+	const bool window = inTimeWindow();
+	if ( budget == 0 && maxUplinks == 0 && window )
+		return wanted; // No restrictions, fast path
+	const uint32_t weight = getWeight( uplink );
+	int retval = 0;
+	declare_now;
+	mutex_lock( &bgrLock );
+	bgr_entry_t *entry = getEntry( uplink->image->id, &now );
+	if ( entry == NULL ) {
+		// Table full, so many uplinks replicating - be conservative
+		logadd( LOG_DEBUG1, "BGR scheduler table full, deferring replication of %s:%d", PIMG(uplink->image) );
+		goto out;
+	}
+	entry->weight = weight;
+	entry->lastSeen = now;
+	entry->blocked = !window || !isTopRanked( entry, maxUplinks );
+	if ( entry->blocked ) {
+		entry->tokens = 0;
+		entry->lastRefill = now;
+		goto out;
+	}
+	if ( budget == 0 ) {
+		entry->rate = 0;
+		retval = wanted;
+	} else {
+		// Sum up weight of all uplinks allowed to replicate
+		uint64_t totalWeight = 0;
+		for ( int i = 0; i < SERVER_BGR_MAX_UPLINKS; ++i ) {
+			if ( entries[i].imageId != 0 && isTopRanked( &entries[i], maxUplinks ) ) {
+				totalWeight += entries[i].weight;
+			}
+		}
+		// Refill bucket according to our current share of the budget
+		entry->rate = budget * weight / MAX( totalWeight, 1 );
+		const uint64_t ms = timing_diffMs( &entry->lastRefill, &now );
+		entry->lastRefill = now;
+		entry->tokens += (int64_t)( entry->rate * ms / 1000 );
+		// Allow bursts of one second, but always enough for at least one request
+		const int64_t cap = (int64_t)MAX( entry->rate, requestSize );
+		if ( entry->tokens > cap ) {
+			entry->tokens = cap;
+		}
+		if ( entry->tokens > 0 ) {
+			retval = (int)MIN( (int64_t)wanted, entry->tokens / requestSize );
+		}
+	}
+	entry->tokens -= (int64_t)retval * requestSize;
+	entry->granted += (uint64_t)retval * requestSize;
+out:
+	mutex_unlock( &bgrLock );
+	return retval;
+}
+
+/**
+ * Give back slots that were granted, but not used, because
+ * the uplink couldn't find enough missing blocks.
+ */
+void bgr_returnSlots(dnbd3_uplink_t *uplink, int unused, uint32_t requestSize)
+{
+	if ( unused <= 0 || _bgrBandwidth == 0 )
+		return;
+	mutex_lock( &bgrLock );
+	for ( int i = 0; i < SERVER_BGR_MAX_UPLINKS; ++i ) {
+		if ( entries[i].imageId == uplink->image->id ) {
+			entries[i].tokens += (int64_t)unused * requestSize;
+			entries[i].granted -= MIN( entries[i].granted, (uint64_t)unused * requestSize );
+			break;
+		}
+	}
+	mutex_unlock( &bgrLock );
+}
+
+/**
+ * Get state of scheduler as json object, containing all uplinks
+ * that recently asked for replication slots.
+ */
+json_t* bgr_toJson()
+{
+	json_t *list = json_array();
+	declare_now;
+	mutex_lock( &bgrLock );
+	for ( int i = 0; i < SERVER_BGR_MAX_UPLINKS; ++i ) {
+		const bgr_entry_t *e = &entries[i];
+		if ( e->imageId == 0 || timing_diff( &e->lastSeen, &now ) > BGR_ACTIVE_TIMEOUT )
+			continue;
+		json_array_append_new( list, json_pack( "{si,si,sI,sI,sb}",
+				"id", e->imageId,
+				"weight", (int)e->weight,
+				"rate", (json_int_t)e->rate,
+				"granted", (json_int_t)e->granted,
+				"blocked", (int)e->blocked ) );
+	}
+	mutex_unlock( &bgrLock );
+	return json_pack( "{sIsbsisio}",
+			"bandwidth", (json_int_t)_bgrBandwidth,
+			"inWindow", (int)inTimeWindow(),
+			"maxUplinks", (int)_bgrMaxUplinks,
+			"priority", (int)_bgrPriority,
+			"uplinks", list );
+}
@@ -0,0 +1,16 @@
+#ifndef _BGR_H_
+#define _BGR_H_
+
+#include "globals.h"
+
+struct json_t;
+
+void bgr_init();
+
+int bgr_requestSlots(dnbd3_uplink_t *uplink, int wanted, uint32_t requestSize);
+
+void bgr_returnSlots(dnbd3_uplink_t *uplink, int unused, uint32_t requestSize);
+
+struct json_t* bgr_toJson();
+
+#endif /* BGR_H_ */
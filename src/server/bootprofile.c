@@ -0,0 +1,422 @@
+#include "bootprofile.h"
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include "uplink.h"
+#include "reference.h"
+#include "server.h"
+#include "threadpool.h"
+#include <dnbd3/shared/timing.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+/*
+ * Boot profiles. Clients netbooting the same image read mostly the
+ * same chunks in mostly the same order during their first minutes.
+ * For bootProfileTime seconds after selecting an image, each client's
+ * reads are recorded as an ordered list of chunks. Finished traces are
+ * collected and periodically merged into the image's profile by a timer
+ * job, so the client's thread never waits for that: Every chunk gets the
+ * average of its relative position in all traces it appeared in. The
+ * profile is stored next to the image as <image>.boot.
+ * Once a client selects the image, the profile is replayed: the uplink
+ * of an incomplete image fetches missing chunks in profile order, and
+ * locally available chunks are read into the page cache ahead of time.
+ */
+
+#define PROFILE_MAGIC "DNBDBP01"
+
+typedef struct
+{
+	uint32_t chunk;
+	uint32_t index;      // Position in trace; upper bit set once merged
+} traced_t;
+
+typedef struct _pending_trace
+{
+	struct _pending_trace *next;
+	dnbd3_image_t *image; // Holds a reference
+	uint32_t *trace;
+	int len;
+} pending_trace_t;
+
+static pthread_mutex_t pendingLock;
+static pending_trace_t *pendingTraces = NULL; // Protected by pendingLock
+static int numPending = 0; // Protected by pendingLock
+static atomic_bool processing = false;
+
+static void profileFree(ref *ref);
+static void* processTraces(void *data);
+static void mergeTrace(dnbd3_image_t *image, const uint32_t *trace, int len);
+static void saveProfile(dnbd3_image_t *image);
+static void* replayLocal(void *data);
+
+void bootprofile_init()
+{
+	mutex_init( &pendingLock, LOCK_BOOT_PROFILE );
+	server_addJob( &processTraces, NULL, SERVER_BOOT_PROFILE_INTERVAL, SERVER_BOOT_PROFILE_INTERVAL );
+}
+
+/**
+ * Merge and save all traces that are still pending.
+ * Call on shutdown, once all clients are gone.
+ */
+void bootprofile_shutdown()
+{
+	processTraces( NULL );
+}
+
+/**
+ * Load boot profile of given image from disk, if it exists.
+ * Only call while the image is not in use yet.
+ */
+void bootprofile_load(dnbd3_image_t *image)
+{
+	char *fn;
+	if ( asprintf( &fn, "%s.boot", image->path ) == -1 )
+		return;
+	int fd = open( fn, O_RDONLY );
+	free( fn );
+	if ( fd == -1 )
+		return;
+	char magic[8];
+	uint32_t header[2];
+	dnbd3_boot_profile_t *profile = NULL;
+	if ( read( fd, magic, sizeof(magic) ) != sizeof(magic) || memcmp( magic, PROFILE_MAGIC, sizeof(magic) ) != 0
+			|| read( fd, header, sizeof(header) ) != sizeof(header) || header[1] > SERVER_BOOT_PROFILE_MAX ) {
+		logadd( LOG_WARNING, "Ignoring invalid boot profile for %s:%d", PIMG(image) );
+		goto out;
+	}
+	const ssize_t size = (ssize_t)( header[1] * sizeof(dnbd3_profile_entry_t) );
+	profile = malloc( sizeof(*profile) + (size_t)size );
+	if ( read( fd, profile->entries, (size_t)size ) != size ) {
+		logadd( LOG_WARNING, "Boot profile for %s:%d is truncated", PIMG(image) );
+		free( profile );
+		goto out;
+	}
+	ref_init( &profile->reference, profileFree, 0 );
+	profile->traces = header[0];
+	profile->count = (int)header[1];
+	mutex_lock( &image->lock );
+	ref_setref( &image->ref_bootProfile, &profile->reference );
+	mutex_unlock( &image->lock );
+	logadd( LOG_DEBUG1, "Loaded boot profile for %s:%d (%d chunks, %"PRIu32" traces)",
+			PIMG(image), profile->count, profile->traces );
+out:
+	close( fd );
+}
+
+/**
+ * Client selected an image. Start recording its trace, and replay the
+ * image's profile if this didn't happen recently.
+ * Called from the client's thread.
+ */
+void bootprofile_clientStart(dnbd3_client_t *client)
+{
+	const int secs = _bootProfileTime;
+	if ( secs <= 0 )
+		return;
+	dnbd3_image_t *image = client->image;
+	declare_now;
+	if ( !client->isServer ) {
+		const uint64_t chunks = ( image->virtualFilesize + SERVER_BOOT_PROFILE_CHUNK - 1 ) / SERVER_BOOT_PROFILE_CHUNK;
+		client->traceSeen = calloc( 1, ( chunks + 7 ) / 8 );
+		client->trace = malloc( SERVER_BOOT_PROFILE_MAX * sizeof(*client->trace) );
+		client->traceLen = 0;
+		timing_set( &client->traceEnd, &now, secs );
+	}
+	dnbd3_boot_profile_t *profile = ref_get_bootprofile( image );
+	if ( profile == NULL )
+		return;
+	ref_put( &profile->reference );
+	mutex_lock( &image->lock );
+	const bool replay = timing_reached( &image->nextProfileReplay, &now );
+	if ( replay ) {
+		timing_set( &image->nextProfileReplay, &now, secs );
+	}
+	mutex_unlock( &image->lock );
+	if ( !replay )
+		return;
+	logadd( LOG_DEBUG1, "Replaying boot profile of %s:%d", PIMG(image) );
+	if ( image->ref_cacheMap != NULL ) {
+		uplink_startProfile( image );
+	}
+	dnbd3_image_t *locked = image_lock( image );
+	if ( locked != NULL && !threadpool_run( &replayLocal, locked, "PROFILE" ) ) {
+		image_release( locked );
+	}
+}
+
+/**
+ * Add range read by client to its trace, if still recording.
+ * Called from the client's thread.
+ */
+void bootprofile_record(dnbd3_client_t *client, uint64_t offset, uint32_t length)
+{
+	if ( client->trace == NULL || length == 0 )
+		return;
+	declare_now;
+	if ( timing_reached( &client->traceEnd, &now ) ) {
+		bootprofile_clientEnd( client );
+		return;
+	}
+	const uint32_t last = (uint32_t)( ( offset + length - 1 ) / SERVER_BOOT_PROFILE_CHUNK );
+	for ( uint32_t chunk = (uint32_t)( offset / SERVER_BOOT_PROFILE_CHUNK ); chunk <= last; ++chunk ) {
+		const uint8_t bit = (uint8_t)( 1 << ( chunk & 7 ) );
+		if ( client->traceSeen[chunk / 8] & bit )
+			continue;
+		client->traceSeen[chunk / 8] |= bit;
+		if ( client->traceLen < SERVER_BOOT_PROFILE_MAX ) {
+			client->trace[client->traceLen++] = chunk;
+		}
+	}
+}
+
+/**
+ * Stop recording and queue trace for merging into the image's profile,
+ * if long enough. See processTraces().
+ * Called from the client's thread, when done recording or on disconnect.
+ */
+void bootprofile_clientEnd(dnbd3_client_t *client)
+{
+	if ( client->trace == NULL )
+		return;
+	dnbd3_image_t *image = NULL;
+	if ( client->traceLen >= SERVER_BOOT_PROFILE_MIN_TRACE ) {
+		image = image_lock( client->image );
+	}
+	if ( image != NULL ) {
+		pending_trace_t *entry = malloc( sizeof(*entry) );
+		entry->image = image;
+		entry->trace = realloc( client->trace, (size_t)client->traceLen * sizeof(*client->trace) );
+		entry->len = client->traceLen;
+		client->trace = NULL;
+		mutex_lock( &pendingLock );
+		if ( numPending < SERVER_BOOT_PROFILE_PENDING ) {
+			entry->next = pendingTraces;
+			pendingTraces = entry;
+			numPending++;
+			entry = NULL;
+		}
+		mutex_unlock( &pendingLock );
+		if ( entry != NULL ) {
+			logadd( LOG_DEBUG1, "Too many pending boot traces, dropping trace for %s:%d", PIMG(image) );
+			image_release( image );
+			free( entry->trace );
+			free( entry );
+		}
+	}
+	free( client->trace );
+	free( client->traceSeen );
+	client->trace = NULL;
+	client->traceSeen = NULL;
+}
+
+static void profileFree(ref *ref)
+{
+	free( container_of( ref, dnbd3_boot_profile_t, reference ) );
+}
+
+/**
+ * Timer job: Merge all finished traces into their image's profile,
+ * then save each affected profile once.
+ */
+static void* processTraces(void *data UNUSED)
+{
+	if ( atomic_exchange( &processing, true ) )
+		return NULL; // Previous run still busy
+	mutex_lock( &pendingLock );
+	pending_trace_t *list = pendingTraces;
+	pendingTraces = NULL;
+	numPending = 0;
+	mutex_unlock( &pendingLock );
+	for ( pending_trace_t *it = list; it != NULL; it = it->next ) {
+		mergeTrace( it->image, it->trace, it->len );
+	}
+	while ( list != NULL ) {
+		pending_trace_t *entry = list;
+		list = list->next;
+		bool saved = false;
+		for ( pending_trace_t *it = list; it != NULL && !saved; it = it->next ) {
+			saved = it->image == entry->image; // Will be saved when we get to that entry
+		}
+		if ( !saved ) {
+			saveProfile( entry->image );
+		}
+		image_release( entry->image );
+		free( entry->trace );
+		free( entry );
+	}
+	processing = false;
+	return NULL;
+}
+
+static int cmpTraced(const void *a, const void *b)
+{
+	const uint32_t x = ((const traced_t*)a)->chunk, y = ((const traced_t*)b)->chunk;
+	return x < y ? -1 : x > y;
+}
+
+static int cmpPos(const void *a, const void *b)
+{
+	const dnbd3_profile_entry_t *x = a, *y = b;
+	if ( x->pos != y->pos )
+		return x->pos < y->pos ? -1 : 1;
+	return x->chunk < y->chunk ? -1 : x->chunk > y->chunk;
+}
+
+static int cmpHits(const void *a, const void *b)
+{
+	const uint16_t x = ((const dnbd3_profile_entry_t*)a)->hits, y = ((const dnbd3_profile_entry_t*)b)->hits;
+	return x > y ? -1 : x < y;
+}
+
+static inline uint16_t tracePos(uint32_t index, int len)
+{
+	return (uint16_t)( (uint64_t)index * UINT16_MAX / (uint64_t)( len - 1 ) );
+}
+
+/**
+ * Merge trace into image's profile, replacing the profile.
+ * Locks on: image.lock
+ */
+static void mergeTrace(dnbd3_image_t *image, const uint32_t *trace, int len)
+{
+	traced_t *sorted = malloc( (size_t)len * sizeof(*sorted) );
+	for ( int i = 0; i < len; ++i ) {
+		sorted[i].chunk = trace[i];
+		sorted[i].index = (uint32_t)i;
+	}
+	qsort( sorted, (size_t)len, sizeof(*sorted), &cmpTraced );
+	mutex_lock( &image->lock );
+	dnbd3_boot_profile_t *old = ref_get_bootprofile( image );
+	const int oldCount = old == NULL ? 0 : old->count;
+	dnbd3_boot_profile_t *profile = malloc( sizeof(*profile) + (size_t)( oldCount + len ) * sizeof(dnbd3_profile_entry_t) );
+	ref_init( &profile->reference, profileFree, 0 );
+	profile->traces = old == NULL ? 1 : MIN( old->traces + 1, UINT16_MAX );
+	int count = 0;
+	// Update chunks already in profile
+	for ( int i = 0; i < oldCount; ++i ) {
+		dnbd3_profile_entry_t *e = &profile->entries[count++];
+		*e = old->entries[i];
+		const traced_t key = { .chunk = e->chunk };
+		traced_t *t = bsearch( &key, sorted, (size_t)len, sizeof(*sorted), &cmpTraced );
+		if ( t == NULL )
+			continue;
+		const uint16_t pos = tracePos( t->index, len );
+		e->pos = (uint16_t)( ( (uint32_t)e->pos * e->hits + pos ) / ( e->hits + 1u ) );
+		if ( e->hits < UINT16_MAX ) {
+			e->hits++;
+		}
+		t->index |= 0x80000000u;
+	}
+	// Add new ones
+	for ( int i = 0; i < len; ++i ) {
+		if ( sorted[i].index & 0x80000000u )
+			continue;
+		profile->entries[count++] = (dnbd3_profile_entry_t){
+			.chunk = sorted[i].chunk,
+			.pos = tracePos( sorted[i].index, len ),
+			.hits = 1,
+		};
+	}
+	if ( profile->traces >= 10 ) {
+		// Drop chunks that only few clients read
+		int keep = 0;
+		for ( int i = 0; i < count; ++i ) {
+			if ( (uint32_t)profile->entries[i].hits * 10 >= profile->traces ) {
+				profile->entries[keep++] = profile->entries[i];
+			}
+		}
+		count = keep;
+	}
+	if ( count > SERVER_BOOT_PROFILE_MAX ) {
+		qsort( profile->entries, (size_t)count, sizeof(profile->entries[0]), &cmpHits );
+		count = SERVER_BOOT_PROFILE_MAX;
+	}
+	qsort( profile->entries, (size_t)count, sizeof(profile->entries[0]), &cmpPos );
+	profile->count = count;
+	ref_setref( &image->ref_bootProfile, &profile->reference );
+	mutex_unlock( &image->lock );
+	if ( old != NULL ) {
+		ref_put( &old->reference );
+	}
+	free( sorted );
+}
+
+/**
+ * Write current boot profile of image to disk.
+ * Only called from processTraces(), so there's only one writer.
+ */
+static void saveProfile(dnbd3_image_t *image)
+{
+	char *fn, *tmp;
+	if ( asprintf( &fn, "%s.boot", image->path ) == -1 )
+		return;
+	if ( asprintf( &tmp, "%s.boot.tmp", image->path ) == -1 ) {
+		free( fn );
+		return;
+	}
+	dnbd3_boot_profile_t *profile = ref_get_bootprofile( image );
+	if ( profile == NULL )
+		goto out;
+	int fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd == -1 ) {
+		logadd( LOG_WARNING, "Cannot open %s for writing (errno=%d)", tmp, errno );
+		ref_put( &profile->reference );
+		goto out;
+	}
+	const uint32_t header[2] = { profile->traces, (uint32_t)profile->count };
+	const ssize_t size = (ssize_t)( profile->count * sizeof(dnbd3_profile_entry_t) );
+	const bool ok = write( fd, PROFILE_MAGIC, 8 ) == 8
+			&& write( fd, header, sizeof(header) ) == sizeof(header)
+			&& write( fd, profile->entries, (size_t)size ) == size;
+	ref_put( &profile->reference );
+	close( fd );
+	if ( !ok || rename( tmp, fn ) == -1 ) {
+		logadd( LOG_WARNING, "Could not write boot profile %s (errno=%d)", fn, errno );
+		unlink( tmp );
+	}
+out:
+	free( tmp );
+	free( fn );
+}
+
+/**
+ * Thread pool job: Read chunks of profile that are available locally
+ * into the page cache, in profile order.
+ * Called with a reference to the image, which is released here.
+ */
+static void* replayLocal(void *data)
+{
+	dnbd3_image_t *image = (dnbd3_image_t*)data;
+	dnbd3_boot_profile_t *profile = ref_get_bootprofile( image );
+	dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+	if ( profile != NULL && image_ensureOpen( image ) ) {
+		int done = 0;
+		for ( int i = 0; i < profile->count && !_shutdown; ++i ) {
+			const uint64_t start = (uint64_t)profile->entries[i].chunk * SERVER_BOOT_PROFILE_CHUNK;
+			if ( start >= image->realFilesize )
+				continue;
+			const uint64_t end = MIN( start + SERVER_BOOT_PROFILE_CHUNK, image->virtualFilesize );
+			if ( cache != NULL && !image_isRangeCachedUnsafe( cache, start, end ) )
+				continue; // Uplink takes care of this one
+			if ( posix_fadvise( image->readFd, (off_t)start, (off_t)( MIN( end, image->realFilesize ) - start ),
+					POSIX_FADV_WILLNEED ) == 0 ) {
+				done++;
+			}
+		}
+		logadd( LOG_DEBUG2, "Primed page cache with %d chunks of %s:%d", done, PIMG(image) );
+	}
+	if ( cache != NULL ) {
+		ref_put( &cache->reference );
+	}
+	if ( profile != NULL ) {
+		ref_put( &profile->reference );
+	}
+	image_release( image );
+	return NULL;
+}
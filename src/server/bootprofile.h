@@ -0,0 +1,18 @@
+#ifndef _BOOTPROFILE_H_
+#define _BOOTPROFILE_H_
+
+#include "globals.h"
+
+void bootprofile_init();
+
+void bootprofile_shutdown();
+
+void bootprofile_load(dnbd3_image_t *image);
+
+void bootprofile_clientStart(dnbd3_client_t *client);
+
+void bootprofile_record(dnbd3_client_t *client, uint64_t offset, uint32_t length);
+
+void bootprofile_clientEnd(dnbd3_client_t *client);
+
+#endif /* BOOTPROFILE_H_ */
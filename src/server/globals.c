@@ -14,17 +14,31 @@ atomic_bool _shutdown = false;
 // [dnbd3]
 atomic_int _listenPort = PORT;
 char *_basePath = NULL;
+char *_siblingName = NULL;
+char *_multicastGroup = NULL;
+char *_multicastUpstream = NULL;
+char *_handoffSocket = NULL;
 atomic_int _serverPenalty = 0;
 atomic_int _clientPenalty = 0;
 atomic_bool _isProxy = false;
 atomic_int _backgroundReplication = BGR_FULL;
 atomic_int _bgrMinClients = 0;
-atomic_int _bgrWindowSize = 1;
+atomic_int _bgrWindowSize = 8;
+atomic_int _bgrTargetDelay = 25;
+atomic_int _bgrTimeStart = 0;
+atomic_int _bgrTimeEnd = 0;
+atomic_int _bgrPriority = BGR_PRIO_USERS;
+atomic_int _bgrMaxUplinks = 0;
 atomic_bool _lookupMissingForProxy = true;
 atomic_bool _sparseFiles = false;
 atomic_bool _ignoreAllocErrors = false;
 atomic_bool _removeMissingImages = true;
 atomic_uint _uplinkTimeout = SOCKET_TIMEOUT_UPLINK;
+atomic_int _uplinkConnections = 1;
+atomic_bool _uplinkSwarm = false;
+atomic_bool _uplinkHedging = false;
+atomic_bool _uplinkStandby = true;
+atomic_int _bootProfileTime = 0;
 atomic_uint _clientTimeout = SOCKET_TIMEOUT_CLIENT;
 atomic_bool _closeUnusedFd = false;
 atomic_bool _vmdkLegacyMode = false;
@@ -39,6 +53,13 @@ atomic_uint _maxPayload = 9000000; // 9MB
 atomic_uint_fast64_t _maxReplicationSize = (uint64_t)100000000000LL;
 atomic_uint _maxPrefetch = 262144; // 256KB
 atomic_uint _minRequestSize = 0;
+atomic_uint_fast64_t _bgrBandwidth = 0;
+atomic_int _admissionClients = 0;
+atomic_uint_fast64_t _admissionBandwidth = 0;
+atomic_int _admissionDiskLatency = 500;
+atomic_int _admissionQueueDelay = 1000;
+atomic_int _multicastMinClients = 20;
+atomic_uint_fast64_t _multicastBandwidth = 20000000;
 
 /**
  * True when loading config the first time. Consecutive loads will
@@ -58,6 +79,8 @@ static void sanitizeFixedConfig();
 
 static void handleMaskString( const char *value, void(*func)(logmask_t) );
 
+static void handleTimeWindow( const char *value );
+
 static const char* units = "KMGTPEZY";
 
 static bool parse64(const char *in, atomic_int_fast64_t *out, const char *optname);
@@ -69,6 +92,10 @@ static int ini_handler(void *custom UNUSED, const char* section, const char* key
 {
 	if ( initialLoad ) {
 		if ( _basePath == NULL ) SAVE_TO_VAR_STR( dnbd3, basePath );
+		SAVE_TO_VAR_STR( dnbd3, siblingName );
+		SAVE_TO_VAR_STR( dnbd3, multicastGroup );
+		SAVE_TO_VAR_STR( dnbd3, multicastUpstream );
+		SAVE_TO_VAR_STR( dnbd3, handoffSocket );
 		SAVE_TO_VAR_BOOL( dnbd3, vmdkLegacyMode );
 		SAVE_TO_VAR_INT( dnbd3, listenPort );
 		SAVE_TO_VAR_INT( limits, maxClients );
@@ -78,6 +105,8 @@ static int ini_handler(void *custom UNUSED, const char* section, const char* key
 	SAVE_TO_VAR_BOOL( dnbd3, proxyPrivateOnly );
 	SAVE_TO_VAR_INT( dnbd3, bgrMinClients );
 	SAVE_TO_VAR_INT( dnbd3, bgrWindowSize );
+	SAVE_TO_VAR_INT( dnbd3, bgrTargetDelay );
+	SAVE_TO_VAR_INT( dnbd3, bgrMaxUplinks );
 	SAVE_TO_VAR_BOOL( dnbd3, lookupMissingForProxy );
 	SAVE_TO_VAR_BOOL( dnbd3, sparseFiles );
 	SAVE_TO_VAR_BOOL( dnbd3, ignoreAllocErrors );
@@ -86,22 +115,46 @@ static int ini_handler(void *custom UNUSED, const char* section, const char* key
 	SAVE_TO_VAR_INT( dnbd3, serverPenalty );
 	SAVE_TO_VAR_INT( dnbd3, clientPenalty );
 	SAVE_TO_VAR_UINT( dnbd3, uplinkTimeout );
+	SAVE_TO_VAR_INT( dnbd3, uplinkConnections );
+	SAVE_TO_VAR_BOOL( dnbd3, uplinkSwarm );
+	SAVE_TO_VAR_BOOL( dnbd3, uplinkHedging );
+	SAVE_TO_VAR_BOOL( dnbd3, uplinkStandby );
+	SAVE_TO_VAR_INT( dnbd3, bootProfileTime );
+	SAVE_TO_VAR_INT( dnbd3, multicastMinClients );
 	SAVE_TO_VAR_UINT( dnbd3, clientTimeout );
 	SAVE_TO_VAR_UINT( limits, maxPayload );
 	SAVE_TO_VAR_UINT64( limits, maxReplicationSize );
 	SAVE_TO_VAR_UINT( limits, maxPrefetch );
 	SAVE_TO_VAR_UINT( limits, minRequestSize );
+	SAVE_TO_VAR_UINT64( limits, bgrBandwidth );
+	SAVE_TO_VAR_INT( limits, admissionClients );
+	SAVE_TO_VAR_UINT64( limits, admissionBandwidth );
+	SAVE_TO_VAR_INT( limits, admissionDiskLatency );
+	SAVE_TO_VAR_INT( limits, admissionQueueDelay );
+	SAVE_TO_VAR_UINT64( limits, multicastBandwidth );
 	SAVE_TO_VAR_BOOL( dnbd3, pretendClient );
 	SAVE_TO_VAR_INT( dnbd3, autoFreeDiskSpaceDelay );
 	if ( strcmp( section, "dnbd3" ) == 0 && strcmp( key, "backgroundReplication" ) == 0 ) {
 		if ( strcmp( value, "hashblock" ) == 0 ) {
 			_backgroundReplication = BGR_HASHBLOCK;
+		} else if ( strcmp( value, "heat" ) == 0 ) {
+			_backgroundReplication = BGR_HEAT;
 		} else if ( IS_TRUE( value ) ) {
 			_backgroundReplication = BGR_FULL;
 		} else {
 			_backgroundReplication = BGR_DISABLED;
 		}
 	}
+	if ( strcmp( section, "dnbd3" ) == 0 && strcmp( key, "bgrPriority" ) == 0 ) {
+		if ( strcmp( value, "remaining" ) == 0 ) {
+			_bgrPriority = BGR_PRIO_REMAINING;
+		} else if ( strcmp( value, "equal" ) == 0 ) {
+			_bgrPriority = BGR_PRIO_EQUAL;
+		} else {
+			_bgrPriority = BGR_PRIO_USERS;
+		}
+	}
+	if ( strcmp( section, "dnbd3" ) == 0 && strcmp( key, "bgrTimeWindow" ) == 0 ) handleTimeWindow( value );
 	if ( strcmp( section, "logging" ) == 0 && strcmp( key, "fileMask" ) == 0 ) handleMaskString( value, &log_setFileMask );
 	if ( strcmp( section, "logging" ) == 0 && strcmp( key, "consoleMask" ) == 0 ) handleMaskString( value, &log_setConsoleMask );
 	if ( strcmp( section, "logging" ) == 0 && strcmp( key, "consoleTimestamps" ) == 0 ) log_setConsoleTimestamps( IS_TRUE(value) );
@@ -137,7 +190,7 @@ void globals_loadConfig()
 		sanitizeFixedConfig();
 	}
 	if ( _isProxy ) {
-		if ( _backgroundReplication == BGR_FULL && _sparseFiles && _bgrMinClients < 5 ) {
+		if ( BGR_WHOLE_IMAGE( _backgroundReplication ) && _sparseFiles && _bgrMinClients < 5 ) {
 			logadd( LOG_WARNING, "Ignoring 'sparseFiles=true' since backgroundReplication is set to true and bgrMinClients is too low" );
 			_sparseFiles = false;
 		}
@@ -148,6 +201,18 @@ void globals_loadConfig()
 			logadd( LOG_MINOR, "Limiting bgrWindowSize to %d, because of UPLINK_MAX_QUEUE",
 					_bgrWindowSize );
 		}
+		if ( _bgrTargetDelay < 1 ) {
+			_bgrTargetDelay = 1;
+		}
+		if ( _bgrMaxUplinks < 0 ) {
+			_bgrMaxUplinks = 0;
+		}
+		if ( _uplinkConnections < 1 ) {
+			_uplinkConnections = 1;
+		} else if ( _uplinkConnections > UPLINK_MAX_CONNECTIONS ) {
+			_uplinkConnections = UPLINK_MAX_CONNECTIONS;
+			logadd( LOG_MINOR, "Limiting uplinkConnections to %d", _uplinkConnections );
+		}
 		if ( _maxPayload < 256 * 1024 ) {
 			logadd( LOG_WARNING, "maxPayload was increased to 256k" );
 			_maxPayload = 256 * 1024;
@@ -247,6 +312,27 @@ static void handleMaskString( const char *value, void(*func)(logmask_t) )
 	(*func)( mask );
 }
 
+/**
+ * Parse time window in the form HH:MM-HH:MM. An empty value
+ * disables the restriction.
+ */
+static void handleTimeWindow( const char *value )
+{
+	int h1, m1, h2, m2;
+	if ( *value == '\0' ) {
+		_bgrTimeStart = _bgrTimeEnd = 0;
+		return;
+	}
+	if ( sscanf( value, "%d:%d-%d:%d", &h1, &m1, &h2, &m2 ) != 4
+			|| h1 < 0 || h1 > 23 || m1 < 0 || m1 > 59
+			|| h2 < 0 || h2 > 23 || m2 < 0 || m2 > 59 ) {
+		logadd( LOG_WARNING, "Ignoring invalid time window '%s', expected HH:MM-HH:MM", value );
+		return;
+	}
+	_bgrTimeStart = h1 * 60 + m1;
+	_bgrTimeEnd = h2 * 60 + m2;
+}
+
 static bool parse64(const char *in, atomic_int_fast64_t *out, const char *optname)
 {
 	if ( *in == '\0' ) {
@@ -331,6 +417,14 @@ static bool parse32u(const char *in, atomic_uint *out, const char *optname)
 	rem -= r; \
 	buffer += r; \
 } while (0)
+bool globals_parseNumber(const char *in, uint64_t *out, const char *optname)
+{
+	atomic_uint_fast64_t v;
+	if ( !parse64u( in, &v, optname ) ) return false;
+	*out = v;
+	return true;
+}
+
 #define PVAR(var,type,cast) P_ARG(#var "=%" type "\n", (cast) _ ## var)
 #define PINT(var) PVAR(var, "d", int)
 #define PUINT64(var) PVAR(var, PRIu64, uint64_t)
@@ -348,16 +442,36 @@ size_t globals_dumpConfig(char *buffer, size_t size)
 	PBOOL(isProxy);
 	if ( _backgroundReplication == BGR_HASHBLOCK ) {
 		P_ARG("backgroundReplication=hashblock\n");
+	} else if ( _backgroundReplication == BGR_HEAT ) {
+		P_ARG("backgroundReplication=heat\n");
 	} else {
 		PBOOL(backgroundReplication);
 	}
 	PINT(bgrMinClients);
 	PINT(bgrWindowSize);
+	PINT(bgrTargetDelay);
+	if ( _bgrTimeStart != _bgrTimeEnd ) {
+		P_ARG("bgrTimeWindow=%02d:%02d-%02d:%02d\n", _bgrTimeStart / 60, _bgrTimeStart % 60,
+				_bgrTimeEnd / 60, _bgrTimeEnd % 60);
+	}
+	P_ARG("bgrPriority=%s\n", _bgrPriority == BGR_PRIO_REMAINING ? "remaining"
+			: _bgrPriority == BGR_PRIO_EQUAL ? "equal" : "users");
+	PINT(bgrMaxUplinks);
 	PBOOL(lookupMissingForProxy);
 	PBOOL(sparseFiles);
 	PBOOL(ignoreAllocErrors);
 	PBOOL(removeMissingImages);
 	PINT(uplinkTimeout);
+	PINT(uplinkConnections);
+	PBOOL(uplinkSwarm);
+	PBOOL(uplinkHedging);
+	PBOOL(uplinkStandby);
+	P_ARG("siblingName=%s\n", _siblingName == NULL ? "" : _siblingName);
+	PINT(bootProfileTime);
+	P_ARG("multicastGroup=%s\n", _multicastGroup == NULL ? "" : _multicastGroup);
+	P_ARG("multicastUpstream=%s\n", _multicastUpstream == NULL ? "" : _multicastUpstream);
+	PINT(multicastMinClients);
+	P_ARG("handoffSocket=%s\n", _handoffSocket == NULL ? "" : _handoffSocket);
 	PINT(clientTimeout);
 	PBOOL(closeUnusedFd);
 	PBOOL(vmdkLegacyMode);
@@ -371,6 +485,12 @@ size_t globals_dumpConfig(char *buffer, size_t size)
 	PUINT64(maxReplicationSize);
 	PINT(maxPrefetch);
 	PINT(minRequestSize);
+	PUINT64(bgrBandwidth);
+	PINT(admissionClients);
+	PUINT64(admissionBandwidth);
+	PINT(admissionDiskLatency);
+	PINT(admissionQueueDelay);
+	PUINT64(multicastBandwidth);
 	return size - rem;
 }
 
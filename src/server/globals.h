@@ -39,10 +39,18 @@ typedef struct _dnbd3_queue_entry
 #ifdef DEBUG
 	ticks      entered;  // When this request entered the queue (for debugging)
 #endif
+	ticks      sentAt;   // When this request was last sent to the uplink server
 	uint8_t    hopCount; // How many hops this request has already taken across proxies
+	uint8_t    con;      // Connection this request was sent through; 0 = current, n = stripes[n-1]
 	bool       sent;     // Already sent to uplink?
+	bool       hedged;   // Duplicate was sent through hedge connection
+	uint8_t    origin;   // Who queued this request, QUEUE_ORIGIN_*
 } dnbd3_queue_entry_t;
 
+#define QUEUE_ORIGIN_CLIENT 0  // Client request, its read-ahead, or BGR
+#define QUEUE_ORIGIN_PROFILE 1 // Boot profile replay, see sendProfileRequests()
+#define QUEUE_ORIGIN_WARMUP 2  // Warm-up job, see uplink_warmup()
+
 typedef struct _ns
 {
 	struct _ns *next;
@@ -54,10 +62,23 @@ typedef struct
 {
 	int fails;                    // Hard fail: Connection failed
 	int rttIndex;
-	uint32_t rtt[SERVER_RTT_PROBES];
+	uint32_t rtt[SERVER_RTT_PROBES]; // RTT history in µs, shared by all uplinks
+	bool rttInit;                 // At least one RTT sample exists
+	ticks lastRtt;                // Last time rtt was updated, by probe or live traffic of any uplink
+	uint32_t throughput;          // Smoothed throughput of busy uplink connections to this server, bytes/s
 	bool isPrivate, isClientOnly;
+	bool isSibling;               // Proxy in same group; only asked for hash blocks it owns, never used as uplink server
 	bool blocked;                 // If true count down fails until 0 to enable again
 	ticks lastFail;               // Last hard fail
+	struct {
+		uint64_t clients;         // Number of connected clients
+		uint64_t bandwidth;       // Bytes per second sent to clients
+		uint32_t diskLatency;     // Smoothed cache write latency in µs
+		bool busy;                // Currently turning clients away, see admission.c
+		bool valid;               // Got at least one report
+		ticks updated;            // Time of last report
+		ticks retry;              // Don't query before this, so we don't keep asking servers that can't answer
+	} load;                       // As reported by the server itself, see altservers_gossip
 	dnbd3_host_t host;
 	char comment[COMMENT_LENGTH];
 	_Atomic(dnbd3_ns_t *) nameSpaces; // Linked list of name spaces
@@ -66,10 +87,7 @@ typedef struct
 typedef struct
 {
 	int fails;                    // Soft fail: Image not found
-	int rttIndex;
-	uint32_t rtt[SERVER_RTT_PROBES];
 	bool blocked;                 // True if server is to be ignored and fails should be counted down
-	bool initDone;
 } dnbd3_alt_local_t;
 
 typedef struct {
@@ -78,6 +96,58 @@ typedef struct {
 	int index;         // Entry in uplinks list
 } dnbd3_server_connection_t;
 
+/**
+ * Additional connection being established by a worker thread, so the uplink
+ * thread doesn't block on connect() and the handshake.
+ */
+typedef struct {
+	dnbd3_server_connection_t result; // Connection ready to be taken over by uplink thread, if state == UPLINK_CONNECT_OK
+	int state;                    // UPLINK_CONNECT_*. Protected by rttLock
+	ticks retry;                  // Don't try to connect again before this. ONLY USE FROM UPLINK THREAD!
+} dnbd3_pending_connection_t;
+
+#define UPLINK_CONNECT_IDLE 0        // Nothing going on
+#define UPLINK_CONNECT_BUSY 1        // Worker is connecting
+#define UPLINK_CONNECT_OK 2          // Connected and selected image, see result
+#define UPLINK_CONNECT_UNREACHABLE 3 // Could not connect to server
+#define UPLINK_CONNECT_MISMATCH 4    // Handshake failed, or server doesn't have our image
+
+typedef struct {
+	uint64_t outstanding;         // Bytes requested through this connection, not received yet. Protected by queueLock
+	atomic_uint_fast64_t bytesReceived; // Payload bytes received through this connection
+	uint64_t lastBytesReceived;   // Value of bytesReceived when throughput was last updated
+	atomic_uint throughput;       // Bytes per second during last measurement interval
+	atomic_uint rtt;              // Average RTT of the server behind this connection in µs, 0 = unknown
+	uint32_t stalled;             // Seconds this connection had outstanding requests without receiving any data
+	uint32_t liveRtt[UPLINK_LIVE_SAMPLES]; // Latencies of requests answered since last update. ONLY USE FROM UPLINK THREAD!
+	int numLiveRtt;               // Number of valid entries in liveRtt. ONLY USE FROM UPLINK THREAD!
+} dnbd3_connection_stats_t;
+
+typedef struct
+{
+	_Atomic uint64_t from, to;    // Part of an uplink request beyond what the client asked for
+	atomic_uint used;             // Bytes of it that clients requested later
+} dnbd3_overfetch_t;
+
+typedef struct
+{
+	uint32_t chunk;        // Offset in image / SERVER_BOOT_PROFILE_CHUNK
+	uint16_t pos;          // Average relative position in client traces, 0 = first, 65535 = last
+	uint16_t hits;         // Number of client traces this chunk appeared in
+} dnbd3_profile_entry_t;
+
+/**
+ * Aggregated order in which clients read an image after selecting it.
+ * Immutable once set, merging a new trace creates a new profile.
+ */
+typedef struct
+{
+	ref reference;
+	uint32_t traces;       // Number of client traces merged into this profile
+	int count;             // Number of entries
+	dnbd3_profile_entry_t entries[]; // Sorted by pos
+} dnbd3_boot_profile_t;
+
 #define RTT_IDLE 0 // Not in progress
 #define RTT_INPROGRESS 1 // In progess, not finished
 #define RTT_DONTCHANGE 2 // Finished, but no better alternative found
@@ -88,6 +158,13 @@ struct _dnbd3_uplink
 	ref reference;
 	dnbd3_server_connection_t current; // Currently active connection; fd == -1 means disconnected
 	dnbd3_server_connection_t better; // Better connection as found by altserver worker; fd == -1 means none
+	dnbd3_server_connection_t standby; // Handshaken connection to runner-up of last alt check; fd == -1 means none. PROTECTED BY rttLock
+	dnbd3_server_connection_t stripes[UPLINK_MAX_CONNECTIONS - 1]; // Additional connections to current server, or others in swarm mode; fd == -1 means unused
+	dnbd3_server_connection_t hedge; // Connection to next best server for hedged requests; fd == -1 means none
+	dnbd3_server_connection_t siblings[SERVER_MAX_SIBLINGS]; // Connections to sibling proxies; fd == -1 means none
+	dnbd3_connection_stats_t conStats[UPLINK_MAX_CONNECTIONS + 1 + SERVER_MAX_SIBLINGS]; // Per connection stats; [0] = current, [n] = stripes[n-1], then hedge, then siblings
+	dnbd3_pending_connection_t pending[UPLINK_MAX_CONNECTIONS + 1 + SERVER_MAX_SIBLINGS]; // Connections being established in background, same indexes as conStats
+	atomic_bool connectDone;    // A background connect finished, see pending
 	dnbd3_signal_t* signal;     // used to wake up the process
 	pthread_t thread;           // thread holding the connection
 	pthread_mutex_t sendMutex;  // For locking socket while sending
@@ -101,15 +178,44 @@ struct _dnbd3_uplink
 	atomic_bool shutdown;       // signal this thread to stop, must only be set from uplink_shutdown() or cleanup in uplink_mainloop()
 	bool replicatedLastBlock;   // bool telling if the last block has been replicated yet
 	bool cycleDetected;         // connection cycle between proxies detected for current remote server
+	bool bgrThrottled;          // BGR scheduler granted fewer requests than we wanted last time. ONLY USE FROM UPLINK THREAD!
 	int nextReplicationIndex;   // Which index in the cache map we should start looking for incomplete blocks at
 	                            // If BGR == BGR_HASHBLOCK, -1 means "currently no incomplete block"
+	uint16_t announcedRid;      // Newest revision the upstream server announced to us. ONLY USE FROM UPLINK THREAD!
+	uint8_t *heatDone;          // Bitmap of hash blocks already handled in the current BGR_HEAT round. ONLY USE FROM UPLINK THREAD!
 	atomic_uint_fast64_t bytesReceived; // Number of bytes received by the uplink since startup.
 	atomic_uint_fast64_t bytesReceivedLastSave; // Number of bytes received when we last saved the cache map
 	int queueLen;               // length of queue
+	int queueDemand;            // number of demand requests (neither prefetch nor BGR) in queue, protected by queueLock
 	int idleTime;               // How many seconds the uplink was idle (apart from keep-alives)
+	atomic_int bgrWindow;       // Current target of in-flight BGR requests, 1.._bgrWindowSize, adapted by demand latency
+	int bgrWindowAcks;          // BGR replies since last window increase. ONLY USE FROM UPLINK THREAD!
+	atomic_uint demandLatency;  // Smoothed latency of client requests through this uplink in µs, 0 = unknown
+	atomic_uint baseLatency;    // Lowest demand latency seen during last period in µs; 0 = unknown. Only written by uplink thread
+	uint32_t periodMinLatency;  // Lowest demand latency seen in current period. ONLY USE FROM UPLINK THREAD!
+	ticks nextBaseReset;        // When to start a new period for baseLatency
+	ticks lastWindowDecrease;   // Rate limit shrinking of bgrWindow
+	uint32_t latencySamples[UPLINK_HEDGE_SAMPLES]; // Recent client request latencies in µs. ONLY USE FROM UPLINK THREAD!
+	int numLatencySamples;      // Number of samples taken in total. ONLY USE FROM UPLINK THREAD!
+	atomic_uint hedgeThreshold; // Client requests not answered after this many µs get hedged
+	atomic_uint_fast64_t hedgedRequests; // Number of requests sent through hedge connection
+	atomic_uint_fast64_t hedgeDuplicateBytes; // Bytes received for the losing half of hedged requests
+	uint64_t hedgeLosers[UPLINK_HEDGE_LOSERS]; // Handles of hedged requests answered recently, 0 = unused. ONLY USE FROM UPLINK THREAD!
+	int hedgeLoserIndex;        // Next slot in hedgeLosers to use. ONLY USE FROM UPLINK THREAD!
+	atomic_uint_fast64_t cancelledRequests; // Number of requests withdrawn from the upstream server via CMD_CANCEL
+	atomic_uint requestSize;    // Client requests get extended to this size, derived from BDP of current server; 0 = don't
+	dnbd3_overfetch_t overfetch[UPLINK_OVERFETCH_SLOTS]; // Recent request extensions
+	int overfetchIndex;         // Next slot of overfetch to use, protected by queueLock
+	dnbd3_boot_profile_t *profile; // Boot profile being replayed, NULL if none. ONLY USE FROM UPLINK THREAD!
+	int profileIndex;           // Next entry of profile to request. ONLY USE FROM UPLINK THREAD!
+	atomic_bool profileStart;   // Start replaying the image's boot profile
+	atomic_uint_fast64_t overfetchBytes; // Bytes requested beyond what clients asked for
+	atomic_uint_fast64_t overfetchUsed;  // Of those, bytes that clients requested later
+	uint64_t lastOverfetchBytes, lastOverfetchUsed; // Values at last update of overfetchRatio. ONLY USE FROM UPLINK THREAD!
+	uint32_t overfetchRatio;    // Smoothed percentage of overfetch that was used. ONLY USE FROM UPLINK THREAD!
 	dnbd3_queue_entry_t *queue;
 	atomic_uint_fast32_t queueId;
-	dnbd3_alt_local_t altData[SERVER_MAX_ALTS];
+	dnbd3_alt_local_t altData[SERVER_MAX_ALTS]; // Image specific availability of alt servers
 };
 
 typedef struct
@@ -140,14 +246,19 @@ struct _dnbd3_image
 	char *name;            // public name of the image (usually relative path minus revision ID)
 	weakref uplinkref;     // pointer to a server connection
 	weakref ref_cacheMap;  // cache map telling which parts are locally cached, NULL if complete
+	weakref ref_bootProfile; // boot profile of image, NULL if none
 	uint64_t virtualFilesize;   // virtual size of image (real size rounded up to multiple of 4k)
 	uint64_t realFilesize;      // actual file size on disk
 	ticks atime;                // last access time
 	ticks nextCompletenessEstimate; // next time the completeness estimate should be updated
+	ticks nextProfileReplay;    // don't replay boot profile again before this. Protected by lock
 	uint32_t *crc32;       // list of crc32 checksums for each 16MiB block in image
+	atomic_uint_least32_t *heat; // number of client requests per 16MiB block, see heatmap.c
+	atomic_bool heatDirty;       // heat map changed since it was last saved
 	uint32_t masterCrc32;  // CRC-32 of the crc-32 list
 	int readFd;            // used to read the image. Used from multiple threads, so use atomic operations (pread et al)
 	atomic_int completenessEstimate; // Completeness estimate in percent
+	atomic_uint_least8_t peerComplete[SERVER_MAX_ALTS]; // Completeness at each alt server, percent + 1, 0 = unknown, 255 = not there
 	atomic_int users;      // clients currently using this image. XXX Lock on imageListLock when modifying and checking whether the image should be freed. Reading it elsewhere is fine without the lock.
 	int id;                // Unique ID of this image. Only unique in the context of this running instance of DNBD3-Server
 	struct {
@@ -163,19 +274,45 @@ struct _dnbd3_image
 };
 #define PIMG(x) (x)->name, (int)(x)->rid
 
+/**
+ * Sequential read stream of a client, used to determine how far to prefetch.
+ * Only accessed by the client's thread.
+ */
+typedef struct
+{
+	uint64_t next;      // Expected offset of the stream's next request
+	uint64_t ahead;     // End of what was requested as prefetch for this stream
+	uint32_t depth;     // Prefetch depth in bytes, 0 if not confirmed sequential yet
+	uint32_t lastUse;   // Value of client's streamClock when last used, 0 = unused
+} dnbd3_client_stream_t;
+
 struct _dnbd3_client
 {
 #define HOSTNAMELEN (48)
 	atomic_uint_fast64_t bytesSent;   // Byte counter for this client.
 	dnbd3_image_t * _Atomic image;    // Image in use by this client, or NULL during handshake
 	int sock;
-	_Atomic uint8_t relayedCount;     // How many requests are in-flight to the uplink server
+	int relayedCount;                 // How many requests are in-flight to the uplink server, protected by sendMutex
+	pthread_cond_t relayedSignal;     // Signalled with sendMutex held whenever relayedCount decreases
 	bool isServer;                    // true if a server in proxy mode, false if real client
+	atomic_uint_least16_t announceRid; // Newer revision of image to announce to client with its next request, 0 = none
 	dnbd3_host_t host;
 	char hostName[HOSTNAMELEN];       // inet_ntop version of host
 	pthread_mutex_t sendMutex;        // Held while writing to sock if image is incomplete (since uplink uses socket too)
 	pthread_mutex_t lock;
 	pthread_t thread;
+	atomic_bool waiting;              // Client thread is waiting for next request, can be interrupted for handoff
+	bool handoff;                     // Pass connection to new server process instead of closing it
+	uint16_t resumeVersion;           // Protocol version if client was taken over from previous server process, 0 otherwise
+	dnbd3_client_stream_t streams[SERVER_CLIENT_STREAMS];
+	uint32_t streamClock;             // Incremented for every request, for LRU replacement of streams
+	uint32_t prefetchDepth;           // Depth new streams start with; shrinks if prefetched data goes unused
+	atomic_uint_fast64_t prefetchHits;  // Bytes requested by client that were prefetched before
+	atomic_uint_fast64_t prefetchWaste; // Bytes prefetched that the client never requested
+	uint32_t *trace;                  // Chunks read since selecting image, in order, while recording boot profile
+	uint8_t *traceSeen;               // Bitmap of chunks in trace
+	int traceLen;                     // Number of entries in trace
+	ticks traceEnd;                   // Stop recording at this point
 };
 
 // #######################################################
@@ -191,6 +328,37 @@ extern char *_configDir;
  */
 extern char *_basePath;
 
+/**
+ * Address of this server as listed in the alt-servers config of its
+ * siblings. Required for sibling mode, so all members of the group
+ * agree on which one owns which hash block.
+ */
+extern char *_siblingName;
+
+/**
+ * Multicast group to stream popular images to, as <group>:<port>[@<interface address>].
+ * NULL or empty = disabled. See multicast.c
+ */
+extern char *_multicastGroup;
+
+/**
+ * Multicast group to receive blocks from, to fill the cache of
+ * incomplete images (proxy mode). Same format as above.
+ */
+extern char *_multicastUpstream;
+
+/**
+ * Path of unix socket a newly started server process connects to, to take
+ * over listening sockets and clients from this one. NULL or empty = disabled.
+ * See handoff.c
+ */
+extern char *_handoffSocket;
+
+/**
+ * Only stream images to multicast group that are used by at least this many clients.
+ */
+extern atomic_int _multicastMinClients;
+
 /**
  * Whether or not simple *.vmdk files should be treated as revision 1
  */
@@ -245,11 +413,52 @@ extern atomic_bool _closeUnusedFd;
 /**
  * Should we replicate incomplete images in the background?
  * Otherwise, only blocks that were explicitly requested will be cached.
+ * BGR_HEAT replicates the whole image like BGR_FULL, but goes through
+ * incomplete hash blocks in order of their heat (see heatmap.c).
  */
 extern atomic_int _backgroundReplication;
 #define BGR_DISABLED (0)
 #define BGR_FULL (1)
 #define BGR_HASHBLOCK (2)
+#define BGR_HEAT (3)
+// BGR modes that eventually replicate the entire image
+#define BGR_WHOLE_IMAGE(mode) ( (mode) == BGR_FULL || (mode) == BGR_HEAT )
+
+/**
+ * Number of parallel connections an uplink opens to its upstream server.
+ * Requests get spread across them by outstanding bytes.
+ */
+extern atomic_int _uplinkConnections;
+
+/**
+ * If true, the additional connections of an uplink go to other
+ * alt servers providing the image instead of the current one, so
+ * data is fetched from several sources at once.
+ */
+extern atomic_bool _uplinkSwarm;
+
+/**
+ * If true, client requests that take unusually long are requested
+ * from the next best alt server too, and the first reply wins.
+ */
+extern atomic_bool _uplinkHedging;
+
+/**
+ * If true, busy uplinks keep a connection to the second best alt
+ * server around, so they can switch over immediately if the current
+ * server fails.
+ */
+extern atomic_bool _uplinkStandby;
+
+/**
+ * Record which parts of an image clients read during this many seconds
+ * after selecting it, and aggregate this into a boot profile of the image.
+ * When a client selects the image, and the profile wasn't replayed during
+ * the last bootProfileTime seconds, proxies fetch missing data in profile
+ * order, and the page cache is primed for data that is available locally.
+ * 0 disables recording and replay.
+ */
+extern atomic_int _bootProfileTime;
 
 /**
  * Minimum connected clients for background replication to kick in
@@ -257,10 +466,38 @@ extern atomic_int _backgroundReplication;
 extern atomic_int _bgrMinClients;
 
 /**
- * How many in-flight replication requests we should target (per uplink)
+ * Maximum number of in-flight replication requests (per uplink).
+ * The actual window adapts to the latency of client requests, see
+ * _bgrTargetDelay.
  */
 extern atomic_int _bgrWindowSize;
 
+/**
+ * Queuing delay in ms we tolerate for client requests, on top of
+ * the lowest latency observed, before background replication backs off.
+ */
+extern atomic_int _bgrTargetDelay;
+
+/**
+ * Time window for background replication, in minutes since midnight (local time).
+ * If start == end, replication is not restricted.
+ */
+extern atomic_int _bgrTimeStart;
+extern atomic_int _bgrTimeEnd;
+
+/**
+ * How to prioritize uplinks when sharing the global replication bandwidth
+ */
+extern atomic_int _bgrPriority;
+#define BGR_PRIO_EQUAL (0)
+#define BGR_PRIO_USERS (1)
+#define BGR_PRIO_REMAINING (2)
+
+/**
+ * Maximum number of uplinks doing background replication at once; 0 = unlimited
+ */
+extern atomic_int _bgrMaxUplinks;
+
 /**
  * (In proxy mode): If connecting client is a proxy, and the requested image
  * is not known locally, should we ask our known alt servers for it?
@@ -333,24 +570,68 @@ extern atomic_int _autoFreeDiskSpaceDelay;
 
 /**
  * When handling a client request, this sets the maximum amount
- * of bytes we prefetch offset right at the end of the client request.
- * The prefetch size will be MIN( length * 3, _maxPrefetch ), if
- * length <= _maxPrefetch, so effectively, setting this to 0 disables
- * any prefetching.
+ * of bytes we prefetch ahead of a sequential stream of the client.
+ * The actual depth adapts to how much of the prefetched data the client
+ * ends up reading. Setting this to 0 disables any prefetching.
  */
 extern atomic_uint _maxPrefetch;
 
 /**
  * Use with care. Can severely degrade performance.
  * Set either 0 or very high.
+ * Client requests get extended to at least this size. Uplinks
+ * pick a larger size on their own if the bandwidth-delay product
+ * of the server suggests so, and clients read the extra data.
  */
 extern atomic_uint _minRequestSize;
 
+/**
+ * Global bandwidth budget for background replication in bytes per second,
+ * shared among all uplinks. 0 = unlimited.
+ */
+extern atomic_uint_fast64_t _bgrBandwidth;
+
+/**
+ * Admission control: Turn away new clients, pointing them to alt servers,
+ * if there are at least this many clients connected. 0 = no limit.
+ */
+extern atomic_int _admissionClients;
+
+/**
+ * Admission control: Turn away new clients if we're sending more than
+ * this many bytes per second to clients. 0 = no limit.
+ */
+extern atomic_uint_fast64_t _admissionBandwidth;
+
+/**
+ * Admission control: Turn away new clients if writing to the local cache
+ * takes longer than this many ms on average. 0 = no limit.
+ */
+extern atomic_int _admissionDiskLatency;
+
+/**
+ * Admission control: Turn away new clients of an incomplete image if
+ * client requests queue up for more than this many ms at the image's
+ * uplink. 0 = no limit.
+ */
+extern atomic_int _admissionQueueDelay;
+
+/**
+ * Bytes per second to send to the multicast group.
+ */
+extern atomic_uint_fast64_t _multicastBandwidth;
+
 /**
  * Load the server configuration.
  */
 void globals_loadConfig();
 
+/**
+ * Parse a number with optional unit suffix, the same way the config
+ * file is parsed, i.e. "64k" or "2M". optname is used for logging.
+ */
+bool globals_parseNumber(const char *in, uint64_t *out, const char *optname);
+
 /**
  * Dump the effective configuration in use to given buffer.
  */
@@ -0,0 +1,413 @@
+#include "handoff.h"
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include "net.h"
+#include "server.h"
+#include "threadpool.h"
+#include <dnbd3/shared/serialize.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Restart without dropping clients. The running server listens on the unix
+ * socket handoffSocket. A new server process started with --handoff loads
+ * its images, connects to that socket and receives the listening sockets,
+ * so it can accept new connections right away. The old process stops
+ * accepting and passes every client to the new one once it's waiting for
+ * its next request and no replies from the uplink are pending anymore,
+ * along with the image it selected. The new process resumes serving that
+ * client right after the handshake. Finally, the old process saves the cache
+ * maps of all incomplete images, tells the new one it's done and exits. The
+ * new process then merges these maps into the ones it loaded at startup.
+ * File descriptors are passed via SCM_RIGHTS, every message is a datagram
+ * starting with its type, followed by fields in serializer format.
+ */
+
+#define HANDOFF_VERSION 1
+#define MSG_HELLO 1     // new -> old: u16 handoff version
+#define MSG_LISTENERS 2 // old -> new: listening sockets attached
+#define MSG_CLIENT 3    // old -> new: u16 protocol version, u8 is server, string image name, u16 rid; client socket attached
+#define MSG_DONE 4      // old -> new: all clients passed, cache maps saved
+#define MAX_FDS 20
+
+static int listenFd = -1;
+static int peerFd = -1; // Connection to other process while handoff is in progress
+static pthread_mutex_t peerLock;
+static atomic_bool failed = false;
+static atomic_int passedClients = 0;
+static pthread_t resumeThread;
+static bool hasResumeThread = false;
+
+static bool sendMessage(int sock, serialized_buffer_t *buffer, const int *fds, int count);
+static int recvMessage(int sock, serialized_buffer_t *buffer, int *fds, int *count);
+static bool resumeClient(serialized_buffer_t *buffer, int fd);
+static void* resumeMain(void *data);
+
+void handoff_init()
+{
+	mutex_init( &peerLock, LOCK_HANDOFF );
+}
+
+/**
+ * Listen on handoffSocket, if configured, and add it to given poll list.
+ * Binds to a temporary name first and renames it, so it atomically
+ * replaces the socket of a previous server process.
+ */
+bool handoff_listen(poll_list_t *list)
+{
+	if ( _handoffSocket == NULL || *_handoffSocket == '\0' )
+		return true;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if ( snprintf( addr.sun_path, sizeof(addr.sun_path), "%s.%d", _handoffSocket, (int)getpid() )
+			>= (int)sizeof(addr.sun_path) ) {
+		logadd( LOG_ERROR, "handoffSocket path '%s' is too long", _handoffSocket );
+		return false;
+	}
+	const int sock = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+	if ( sock == -1 ) {
+		logadd( LOG_ERROR, "Cannot create handoff socket (errno=%d)", errno );
+		return false;
+	}
+	unlink( addr.sun_path );
+	if ( bind( sock, (struct sockaddr*)&addr, sizeof(addr) ) == -1
+			|| chmod( addr.sun_path, 0600 ) == -1
+			|| listen( sock, 1 ) == -1
+			|| rename( addr.sun_path, _handoffSocket ) == -1 ) {
+		logadd( LOG_ERROR, "Cannot listen on handoff socket %s (errno=%d)", _handoffSocket, errno );
+		unlink( addr.sun_path );
+		close( sock );
+		return false;
+	}
+	if ( !sock_append( list, sock, true, false ) ) {
+		logadd( LOG_ERROR, "Cannot add handoff socket to poll list" );
+		close( sock );
+		return false;
+	}
+	listenFd = sock;
+	return true;
+}
+
+/**
+ * New server process connected to handoffSocket, pass it our listening
+ * sockets and clients. Blocks until all clients have been passed, or
+ * SERVER_HANDOFF_TIMEOUT is reached.
+ * @param fd connection to new process
+ * @param list poll list with our listening sockets
+ * @return true if the new process took over and we should exit now
+ */
+bool handoff_run(int fd, poll_list_t *list)
+{
+	serialized_buffer_t buffer;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int fds[MAX_FDS];
+	int count = 0;
+	if ( getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &cred, &len ) == -1
+			|| ( cred.uid != 0 && cred.uid != geteuid() ) ) {
+		logadd( LOG_WARNING, "Rejecting handoff request from uid %d", len == sizeof(cred) ? (int)cred.uid : -1 );
+		close( fd );
+		return false;
+	}
+	sock_setTimeout( fd, _clientTimeout );
+	if ( recvMessage( fd, &buffer, NULL, &count ) != MSG_HELLO || serializer_get_uint16( &buffer ) != HANDOFF_VERSION ) {
+		logadd( LOG_WARNING, "Invalid handoff request from pid %d", (int)cred.pid );
+		close( fd );
+		return false;
+	}
+	// Pass all listening sockets, except the handoff socket
+	const int total = sock_getFds( list, fds, MAX_FDS );
+	for ( int i = 0; i < total; ++i ) {
+		if ( fds[i] != listenFd ) {
+			fds[count++] = fds[i];
+		}
+	}
+	serializer_reset_write( &buffer );
+	serializer_put_uint8( &buffer, MSG_LISTENERS );
+	if ( !sendMessage( fd, &buffer, fds, count ) ) {
+		logadd( LOG_WARNING, "Could not pass listening sockets to pid %d (errno=%d)", (int)cred.pid, errno );
+		close( fd );
+		return false;
+	}
+	logadd( LOG_INFO, "Handing over to new server process (pid %d)...", (int)cred.pid );
+	mutex_lock( &peerLock );
+	peerFd = fd;
+	failed = false;
+	passedClients = 0;
+	mutex_unlock( &peerLock );
+	// The new process never sends anything from here on, so any event means it went away
+	struct pollfd pfd = { .fd = fd, .events = POLLIN | POLLRDHUP };
+	int remaining = net_handoff( true );
+	for ( int i = 0; i < SERVER_HANDOFF_TIMEOUT && remaining > 0 && !failed && !_shutdown; ++i ) {
+		if ( poll( &pfd, 1, 1000 ) > 0 ) {
+			failed = true;
+		}
+		// Again, in case a client was busy or about to wait for its next request last time
+		remaining = net_handoff( true );
+	}
+	if ( failed ) {
+		net_handoff( false );
+		mutex_lock( &peerLock );
+		peerFd = -1;
+		mutex_unlock( &peerLock );
+		close( fd );
+		logadd( LOG_ERROR, "New server process went away during handoff after %d clients, resuming normal operation",
+				(int)passedClients );
+		return false;
+	}
+	if ( remaining > 0 ) {
+		logadd( LOG_WARNING, "%d clients could not be handed over, disconnecting them", remaining );
+	}
+	// Make sure the new process knows about everything we replicated so far
+	image_killUplinks();
+	image_saveAllCacheMaps();
+	serializer_reset_write( &buffer );
+	serializer_put_uint8( &buffer, MSG_DONE );
+	mutex_lock( &peerLock );
+	sendMessage( fd, &buffer, NULL, 0 );
+	peerFd = -1;
+	mutex_unlock( &peerLock );
+	close( fd );
+	logadd( LOG_INFO, "Handed over %d clients, shutting down", (int)passedClients );
+	return true;
+}
+
+/**
+ * Pass client to new server process, called by client's thread during
+ * handoff. On success, the client's socket is closed here, so it's not
+ * touched during cleanup anymore.
+ */
+bool handoff_passClient(dnbd3_client_t *client, uint16_t clientVersion)
+{
+	serialized_buffer_t buffer;
+	dnbd3_image_t *image = client->image;
+	if ( image == NULL )
+		return false;
+	serializer_reset_write( &buffer );
+	serializer_put_uint8( &buffer, MSG_CLIENT );
+	serializer_put_uint16( &buffer, clientVersion );
+	serializer_put_uint8( &buffer, client->isServer ? 1 : 0 );
+	serializer_put_string( &buffer, image->name );
+	serializer_put_uint16( &buffer, image->rid );
+	mutex_lock( &peerLock );
+	const bool ok = peerFd != -1 && sendMessage( peerFd, &buffer, &client->sock, 1 );
+	if ( !ok && peerFd != -1 ) {
+		failed = true;
+	}
+	mutex_unlock( &peerLock );
+	if ( !ok )
+		return false;
+	mutex_lock( &client->sendMutex );
+	close( client->sock );
+	client->sock = -1;
+	mutex_unlock( &client->sendMutex );
+	passedClients++;
+	return true;
+}
+
+/**
+ * Connect to handoffSocket of running server process and take over its
+ * listening sockets.
+ * @return poll list of listening sockets, NULL on error
+ */
+poll_list_t* handoff_connect()
+{
+	serialized_buffer_t buffer;
+	int fds[MAX_FDS];
+	int count = MAX_FDS;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if ( _handoffSocket == NULL || *_handoffSocket == '\0' ) {
+		logadd( LOG_ERROR, "Cannot take over, handoffSocket not set in %s", CONFIG_FILENAME );
+		return NULL;
+	}
+	if ( snprintf( addr.sun_path, sizeof(addr.sun_path), "%s", _handoffSocket ) >= (int)sizeof(addr.sun_path) ) {
+		logadd( LOG_ERROR, "handoffSocket path '%s' is too long", _handoffSocket );
+		return NULL;
+	}
+	const int sock = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+	if ( sock == -1 || connect( sock, (struct sockaddr*)&addr, sizeof(addr) ) == -1 ) {
+		logadd( LOG_ERROR, "Cannot connect to running server via %s (errno=%d)", _handoffSocket, errno );
+		if ( sock != -1 ) close( sock );
+		return NULL;
+	}
+	sock_setTimeout( sock, _clientTimeout );
+	serializer_reset_write( &buffer );
+	serializer_put_uint8( &buffer, MSG_HELLO );
+	serializer_put_uint16( &buffer, HANDOFF_VERSION );
+	if ( !sendMessage( sock, &buffer, NULL, 0 )
+			|| recvMessage( sock, &buffer, fds, &count ) != MSG_LISTENERS || count == 0 ) {
+		logadd( LOG_ERROR, "Running server did not pass its listening sockets" );
+		for ( int i = 0; i < count; ++i ) {
+			close( fds[i] );
+		}
+		close( sock );
+		return NULL;
+	}
+	poll_list_t *list = sock_newPollList();
+	for ( int i = 0; i < count; ++i ) {
+		sock_append( list, fds[i], true, false );
+	}
+	logadd( LOG_INFO, "Took over %d listening sockets", count );
+	peerFd = sock;
+	return list;
+}
+
+/**
+ * Start thread receiving the clients of the previous server process,
+ * after handoff_connect() succeeded.
+ */
+void handoff_resume()
+{
+	if ( peerFd == -1 )
+		return;
+	if ( thread_create( &resumeThread, NULL, &resumeMain, NULL ) != 0 ) {
+		logadd( LOG_ERROR, "Could not start handoff thread, previous server process will drop its clients" );
+		close( peerFd );
+		peerFd = -1;
+		return;
+	}
+	hasResumeThread = true;
+}
+
+void handoff_shutdown()
+{
+	if ( hasResumeThread ) {
+		thread_join( resumeThread, NULL );
+		hasResumeThread = false;
+	}
+}
+
+static void* resumeMain(void *data UNUSED)
+{
+	serialized_buffer_t buffer;
+	int type = -1, resumed = 0;
+	setThreadName( "handoff" );
+	sock_setTimeout( peerFd, 1000 );
+	while ( !_shutdown ) {
+		int fd = -1, count = 1;
+		type = recvMessage( peerFd, &buffer, &fd, &count );
+		if ( type == 0 )
+			continue; // Timeout
+		if ( type == MSG_CLIENT && count == 1 ) {
+			if ( resumeClient( &buffer, fd ) ) {
+				resumed++;
+			}
+			continue;
+		}
+		if ( count == 1 ) {
+			close( fd );
+		}
+		if ( type == MSG_DONE || type == -1 )
+			break;
+	}
+	if ( type == MSG_DONE ) {
+		logadd( LOG_INFO, "Previous server process handed over %d clients", resumed );
+		image_mergeCacheMapsFromDisk();
+	} else if ( !_shutdown ) {
+		logadd( LOG_WARNING, "Previous server process went away during handoff after %d clients", resumed );
+	}
+	close( peerFd );
+	peerFd = -1;
+	return NULL;
+}
+
+static bool resumeClient(serialized_buffer_t *buffer, int fd)
+{
+	const uint16_t version = serializer_get_uint16( buffer );
+	const bool isServer = serializer_get_uint8( buffer ) != 0;
+	char *name = serializer_get_string( buffer );
+	const uint16_t rid = serializer_get_uint16( buffer );
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	dnbd3_client_t *client = NULL;
+	if ( name != NULL && version != 0 && getpeername( fd, (struct sockaddr*)&addr, &len ) == 0 ) {
+		client = dnbd3_prepareClient( &addr, fd );
+	}
+	if ( client == NULL ) {
+		close( fd );
+		return false;
+	}
+	client->image = image_getOrLoad( name, rid );
+	if ( client->image == NULL ) {
+		logadd( LOG_WARNING, "Cannot resume client of %s:%d, image not available", name, (int)rid );
+		close( fd );
+		free( client );
+		return false;
+	}
+	client->isServer = isServer;
+	client->resumeVersion = version;
+	if ( !threadpool_run( &net_handleNewConnection, (void *)client, "CLIENT" ) ) {
+		logadd( LOG_ERROR, "Could not start thread for resumed client." );
+		image_release( client->image );
+		close( fd );
+		free( client );
+		return false;
+	}
+	return true;
+}
+
+static bool sendMessage(int sock, serialized_buffer_t *buffer, const int *fds, int count)
+{
+	char control[CMSG_SPACE( sizeof(int) * MAX_FDS )];
+	struct iovec iov = { .iov_base = buffer->buffer, .iov_len = serializer_get_written_length( buffer ) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t ret;
+	if ( count > 0 ) {
+		memset( control, 0, sizeof(control) );
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE( sizeof(int) * count );
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msg );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN( sizeof(int) * count );
+		memcpy( CMSG_DATA( cmsg ), fds, sizeof(int) * count );
+	}
+	do {
+		ret = sendmsg( sock, &msg, MSG_NOSIGNAL );
+	} while ( ret == -1 && errno == EINTR );
+	return ret == (ssize_t)iov.iov_len;
+}
+
+/**
+ * Receive message, with up to *count attached fds. Any further fds get closed.
+ * @return message type, 0 on timeout, -1 on error
+ */
+static int recvMessage(int sock, serialized_buffer_t *buffer, int *fds, int *count)
+{
+	char control[CMSG_SPACE( sizeof(int) * MAX_FDS )];
+	struct iovec iov = { .iov_base = buffer->buffer, .iov_len = MAX_PAYLOAD };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	const int max = *count;
+	*count = 0;
+	const ssize_t ret = recvmsg( sock, &msg, 0 );
+	if ( ret == -1 )
+		return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1;
+	for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msg ); cmsg != NULL; cmsg = CMSG_NXTHDR( &msg, cmsg ) ) {
+		if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+			continue;
+		const size_t num = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof(int);
+		for ( size_t i = 0; i < num; ++i ) {
+			int fd;
+			memcpy( &fd, CMSG_DATA( cmsg ) + i * sizeof(int), sizeof(int) );
+			if ( *count < max ) {
+				fds[(*count)++] = fd;
+			} else {
+				close( fd );
+			}
+		}
+	}
+	if ( ret == 0 ) {
+		// EOF; can't have fds attached, but be safe
+		for ( int i = 0; i < *count; ++i ) {
+			close( fds[i] );
+		}
+		*count = 0;
+		return -1;
+	}
+	serializer_reset_read( buffer, (size_t)ret );
+	return serializer_get_uint8( buffer );
+}
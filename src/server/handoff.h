@@ -0,0 +1,21 @@
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include "globals.h"
+#include <dnbd3/shared/sockhelper.h>
+
+void handoff_init();
+
+bool handoff_listen(poll_list_t *list);
+
+bool handoff_run(int fd, poll_list_t *list);
+
+bool handoff_passClient(dnbd3_client_t *client, uint16_t clientVersion);
+
+poll_list_t* handoff_connect();
+
+void handoff_resume();
+
+void handoff_shutdown();
+
+#endif /* HANDOFF_H_ */
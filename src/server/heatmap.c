@@ -0,0 +1,205 @@
+#include "heatmap.h"
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Heat maps. For every hash block (16MiB) of an image, count the client
+ * requests touching it. Requests generated by proxies for prefetching or
+ * background replication are not counted, so the map reflects what
+ * clients actually read, no matter how many proxies are in between.
+ * Once a counter reaches SERVER_HEAT_MAX, all counters of the image are
+ * halved, so old access patterns slowly fade out.
+ * The map is stored next to the image as <image>.heat, and can be
+ * requested by downstream proxies via CMD_GET_HEAT, which merge it into
+ * their own map. With backgroundReplication=heat, the uplink replicates
+ * the hottest incomplete hash blocks first.
+ */
+
+#define HEAT_MAGIC "DNBDHM01"
+
+static pthread_mutex_t saveLock;
+
+static void decay(dnbd3_image_t *image, int count);
+
+void heatmap_init()
+{
+	mutex_init( &saveLock, LOCK_HEAT_MAP );
+}
+
+/**
+ * Allocate heat map of given image and fill it from disk, if a
+ * matching one exists. Only call while the image is not in use yet.
+ */
+void heatmap_load(dnbd3_image_t *image)
+{
+	const int count = IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize );
+	image->heat = calloc( count, sizeof(*image->heat) );
+	if ( image->heat == NULL )
+		return;
+	char *fn;
+	if ( asprintf( &fn, "%s.heat", image->path ) == -1 )
+		return;
+	int fd = open( fn, O_RDONLY );
+	free( fn );
+	if ( fd == -1 )
+		return;
+	char magic[8];
+	uint32_t fileCount;
+	uint32_t *buffer = NULL;
+	const ssize_t size = (ssize_t)( count * sizeof(uint32_t) );
+	if ( read( fd, magic, sizeof(magic) ) != sizeof(magic) || memcmp( magic, HEAT_MAGIC, sizeof(magic) ) != 0
+			|| read( fd, &fileCount, sizeof(fileCount) ) != sizeof(fileCount) || fileCount != (uint32_t)count
+			|| ( buffer = malloc( (size_t)size ) ) == NULL || read( fd, buffer, (size_t)size ) != size ) {
+		logadd( LOG_WARNING, "Ignoring invalid heat map for %s:%d", PIMG(image) );
+	} else {
+		for ( int i = 0; i < count; ++i ) {
+			image->heat[i] = MIN( buffer[i], SERVER_HEAT_MAX - 1 );
+		}
+		logadd( LOG_DEBUG2, "Loaded heat map for %s:%d", PIMG(image) );
+	}
+	free( buffer );
+	close( fd );
+}
+
+/**
+ * Copy heat map of src to dst, for when an image gets cloned
+ * on reload. dst must not be in use yet.
+ */
+void heatmap_copy(dnbd3_image_t *dst, dnbd3_image_t *src)
+{
+	if ( src->heat == NULL )
+		return;
+	const int count = IMGSIZE_TO_HASHBLOCKS( src->virtualFilesize );
+	dst->heat = malloc( count * sizeof(*dst->heat) );
+	if ( dst->heat == NULL )
+		return;
+	for ( int i = 0; i < count; ++i ) {
+		dst->heat[i] = atomic_load_explicit( &src->heat[i], memory_order_relaxed );
+	}
+	dst->heatDirty = src->heatDirty;
+}
+
+/**
+ * Count a client request for given range. Range must be within image.
+ */
+void heatmap_record(dnbd3_image_t *image, uint64_t offset, uint32_t length)
+{
+	if ( image->heat == NULL || length == 0 )
+		return;
+	const int first = (int)( offset / HASH_BLOCK_SIZE );
+	const int last = (int)( ( offset + length - 1 ) / HASH_BLOCK_SIZE );
+	bool overflow = false;
+	for ( int i = first; i <= last; ++i ) {
+		// Only one thread sees the counter hit the limit exactly, that one does the decay
+		if ( atomic_fetch_add_explicit( &image->heat[i], 1, memory_order_relaxed ) + 1 == SERVER_HEAT_MAX ) {
+			overflow = true;
+		}
+	}
+	image->heatDirty = true;
+	if ( unlikely( overflow ) ) {
+		decay( image, IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize ) );
+	}
+}
+
+/**
+ * Merge heat map received from upstream server into local one.
+ * Every counter is raised to the remote value, if that is higher,
+ * so repeatedly merging the same map doesn't inflate anything.
+ */
+void heatmap_merge(dnbd3_image_t *image, const uint32_t *remote, int count)
+{
+	if ( image->heat == NULL || count != IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize ) )
+		return;
+	bool changed = false;
+	for ( int i = 0; i < count; ++i ) {
+		const uint32_t val = MIN( remote[i], SERVER_HEAT_MAX - 1 );
+		uint_least32_t old = atomic_load_explicit( &image->heat[i], memory_order_relaxed );
+		while ( old < val ) {
+			if ( atomic_compare_exchange_weak( &image->heat[i], &old, val ) ) {
+				changed = true;
+				break;
+			}
+		}
+	}
+	if ( changed ) {
+		image->heatDirty = true;
+	}
+}
+
+/**
+ * Get copy of heat map of given image, to be freed by caller.
+ * Returns NULL if image has no heat map.
+ */
+uint32_t* heatmap_get(dnbd3_image_t *image, int *count)
+{
+	if ( image->heat == NULL )
+		return NULL;
+	*count = IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize );
+	uint32_t *copy = malloc( *count * sizeof(uint32_t) );
+	if ( copy == NULL )
+		return NULL;
+	for ( int i = 0; i < *count; ++i ) {
+		copy[i] = atomic_load_explicit( &image->heat[i], memory_order_relaxed );
+	}
+	return copy;
+}
+
+/**
+ * Write heat map to disk, if it changed since the last time.
+ */
+void heatmap_save(dnbd3_image_t *image)
+{
+	if ( !image->heatDirty )
+		return;
+	int count;
+	uint32_t *copy = heatmap_get( image, &count );
+	if ( copy == NULL )
+		return;
+	image->heatDirty = false;
+	char *fn, *tmp;
+	if ( asprintf( &fn, "%s.heat", image->path ) == -1 ) {
+		free( copy );
+		return;
+	}
+	if ( asprintf( &tmp, "%s.heat.tmp", image->path ) == -1 ) {
+		free( copy );
+		free( fn );
+		return;
+	}
+	mutex_lock( &saveLock );
+	int fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd == -1 ) {
+		logadd( LOG_DEBUG1, "Cannot open %s for writing (errno=%d)", tmp, errno );
+	} else {
+		const uint32_t header = (uint32_t)count;
+		const ssize_t size = (ssize_t)( count * sizeof(uint32_t) );
+		const bool ok = write( fd, HEAT_MAGIC, 8 ) == 8
+				&& write( fd, &header, sizeof(header) ) == sizeof(header)
+				&& write( fd, copy, (size_t)size ) == size;
+		close( fd );
+		if ( !ok || rename( tmp, fn ) == -1 ) {
+			logadd( LOG_WARNING, "Could not write heat map %s (errno=%d)", fn, errno );
+			unlink( tmp );
+		}
+	}
+	mutex_unlock( &saveLock );
+	free( copy );
+	free( tmp );
+	free( fn );
+}
+
+/**
+ * Halve all counters of the image's heat map.
+ */
+static void decay(dnbd3_image_t *image, int count)
+{
+	logadd( LOG_DEBUG2, "Decaying heat map of %s:%d", PIMG(image) );
+	for ( int i = 0; i < count; ++i ) {
+		const uint_least32_t val = atomic_load_explicit( &image->heat[i], memory_order_relaxed );
+		atomic_fetch_sub_explicit( &image->heat[i], val / 2, memory_order_relaxed );
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef _HEATMAP_H_
+#define _HEATMAP_H_
+
+#include "globals.h"
+
+void heatmap_init();
+
+void heatmap_load(dnbd3_image_t *image);
+
+void heatmap_copy(dnbd3_image_t *dst, dnbd3_image_t *src);
+
+void heatmap_record(dnbd3_image_t *image, uint64_t offset, uint32_t length);
+
+void heatmap_merge(dnbd3_image_t *image, const uint32_t *remote, int count);
+
+uint32_t* heatmap_get(dnbd3_image_t *image, int *count);
+
+void heatmap_save(dnbd3_image_t *image);
+
+#endif /* HEATMAP_H_ */
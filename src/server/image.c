@@ -5,6 +5,10 @@
 #include "locks.h"
 #include "integrity.h"
 #include "altservers.h"
+#include "bootprofile.h"
+#include "heatmap.h"
+#include "net.h"
+#include "threadpool.h"
 #include <dnbd3/shared/protocol.h>
 #include <dnbd3/shared/timing.h>
 #include <dnbd3/shared/crc32.h>
@@ -29,15 +33,26 @@ static int _num_images = 0;
 static pthread_mutex_t imageListLock;
 static pthread_mutex_t remoteCloneLock;
 static pthread_mutex_t reloadLock;
-#define NAMELEN  500
-#define CACHELEN 20
-typedef struct
+
+/*
+ * Lookups of images on upstream servers, by name and rid. While one thread
+ * asks the upstream servers, others asking for the same image wait for it
+ * to finish. Once done, the entry is kept so we don't ask again for the
+ * same image within SERVER_REMOTE_IMAGE_CHECK_CACHETIME seconds.
+ * Protected by remoteCloneLock.
+ */
+#define LOOKUP_BUCKETS 256
+typedef struct _remote_lookup
 {
-	char name[NAMELEN];
+	struct _remote_lookup *next;
+	ticks deadline;    // Don't ask upstream again before this
+	bool inFlight;     // Some thread is asking upstream servers right now, wait on remoteCloneDone
 	uint16_t rid;
-	ticks deadline;
-} imagecache;
-static imagecache remoteCloneCache[CACHELEN];
+	char name[];
+} remote_lookup_t;
+static remote_lookup_t *remoteLookups[LOOKUP_BUCKETS];
+static int numRemoteLookups = 0;
+static pthread_cond_t remoteCloneDone;
 
 // ##########################################
 
@@ -61,6 +76,8 @@ static void saveCacheMap(dnbd3_image_t *image);
 static void allocCacheMap(dnbd3_image_t *image, bool complete);
 static void saveMetaData(dnbd3_image_t *image, ticks *now, time_t walltime);
 static void loadImageMeta(dnbd3_image_t *image);
+static void* seedFromOlderRevision(void *data);
+static void* replicateRevision(void *data);
 
 static void cmfree(ref *ref)
 {
@@ -76,6 +93,7 @@ void image_serverStartup()
 	srand( (unsigned int)time( NULL ) );
 	mutex_init( &imageListLock, LOCK_IMAGE_LIST );
 	mutex_init( &remoteCloneLock, LOCK_REMOTE_CLONE );
+	pthread_cond_init( &remoteCloneDone, NULL );
 	mutex_init( &reloadLock, LOCK_RELOAD );
 	server_addJob( &closeUnusedFds, NULL, 10, 900 );
 	server_addJob( &saveLoadAllCacheMaps, NULL, 9, 20 );
@@ -410,6 +428,12 @@ dnbd3_image_t* image_get(const char *name, uint16_t revision, bool ensureFdOpen)
 			ref_setref( &img->ref_cacheMap, &cache->reference );
 			ref_put( &cache->reference );
 		}
+		dnbd3_boot_profile_t *profile = ref_get_bootprofile( candidate );
+		if ( profile != NULL ) {
+			ref_setref( &img->ref_bootProfile, &profile->reference );
+			ref_put( &profile->reference );
+		}
+		heatmap_copy( img, candidate );
 		if ( image_addToList( img ) ) {
 			image_release( candidate );
 			candidate = img;
@@ -429,6 +453,27 @@ dnbd3_image_t* image_get(const char *name, uint16_t revision, bool ensureFdOpen)
 	return candidate; // We did all we can, hopefully it's working
 }
 
+/**
+ * Get up to size images that are currently used by clients or uplinks.
+ * Every returned image needs to be passed to image_release() at some point.
+ * Locks on: imageListLock
+ * @return number of images written to the array
+ */
+int image_getInUse(dnbd3_image_t **images, int size)
+{
+	int count = 0;
+	mutex_lock( &imageListLock );
+	for ( int i = 0; i < _num_images && count < size; ++i ) {
+		dnbd3_image_t * const image = _images[i];
+		if ( image == NULL || image->users == 0 )
+			continue;
+		image->users++;
+		images[count++] = image;
+	}
+	mutex_unlock( &imageListLock );
+	return count;
+}
+
 /**
  * Lock the image by increasing its users count
  * Returns the image on success, NULL if it is not found in the image list
@@ -498,6 +543,8 @@ static bool isForbiddenExtension(const char* name)
 	if ( len < 5 ) return false;
 	--ptr;
 	if ( strcmp( ptr, ".meta" ) == 0 ) return true; // Meta data (currently not in use)
+	if ( strcmp( ptr, ".boot" ) == 0 ) return true; // Boot profile
+	if ( strcmp( ptr, ".heat" ) == 0 ) return true; // Heat map
 	return false;
 }
 
@@ -638,12 +685,16 @@ static dnbd3_image_t* image_free(dnbd3_image_t *image)
 			saveCacheMap( image );
 		}
 	}
+	heatmap_save( image );
 	mutex_lock( &image->lock );
 	ref_setref( &image->ref_cacheMap, NULL );
+	ref_setref( &image->ref_bootProfile, NULL );
 	free( image->crc32 );
+	free( image->heat );
 	free( image->path );
 	free( image->name );
 	image->crc32 = NULL;
+	image->heat = NULL;
 	image->path = NULL;
 	image->name = NULL;
 	mutex_unlock( &image->lock );
@@ -908,6 +959,8 @@ static bool image_load(char *base, char *path, bool withUplink)
 	image->completenessEstimate = -1;
 	mutex_init( &image->lock, LOCK_IMAGE );
 	loadImageMeta( image );
+	bootprofile_load( image );
+	heatmap_load( image );
 
 	// Prevent freeing in cleanup
 	cache = NULL;
@@ -940,6 +993,7 @@ static bool image_load(char *base, char *path, bool withUplink)
 		goto load_error;
 	}
 	logadd( LOG_DEBUG1, "Loaded image '%s:%d'\n", PIMG(image) );
+	net_announceRevision( image );
 	function_return = true;
 
 	// Clean exit:
@@ -1152,6 +1206,7 @@ failure_cleanup: ;
 }
 
 static dnbd3_image_t *loadImageProxy(char * const name, const uint16_t revision, const size_t len);
+static remote_lookup_t *getRemoteLookup(const char *name, uint16_t rid, size_t len, bool create, ticks *now);
 static dnbd3_image_t *loadImageServer(char * const name, const uint16_t requestedRid);
 
 /**
@@ -1206,20 +1261,23 @@ static dnbd3_image_t *loadImageProxy(char * const name, const uint16_t revision,
 
 	// Doesn't exist or is rid 0, try remote if not already tried it recently
 	declare_now;
-	char *cmpname = name;
-	int useIndex = -1, fallbackIndex = 0;
-	if ( len >= NAMELEN ) cmpname += 1 + len - NAMELEN;
+	remote_lookup_t *lookup;
+	bool waited = false;
 	mutex_lock( &remoteCloneLock );
-	for (int i = 0; i < CACHELEN; ++i) {
-		if ( remoteCloneCache[i].rid == revision && strcmp( cmpname, remoteCloneCache[i].name ) == 0 ) {
-			useIndex = i;
-			if ( timing_reached( &remoteCloneCache[i].deadline, &now ) ) break;
-			mutex_unlock( &remoteCloneLock ); // Was recently checked...
-			return image;
-		}
-		if ( timing_1le2( &remoteCloneCache[i].deadline, &remoteCloneCache[fallbackIndex].deadline ) ) {
-			fallbackIndex = i;
-		}
+	while ( ( lookup = getRemoteLookup( name, revision, len, false, &now ) ) != NULL && lookup->inFlight ) {
+		// Another thread is asking upstream servers for this very image, wait for it
+		mutex_cond_wait( &remoteCloneDone, &remoteCloneLock );
+		waited = true;
+	}
+	if ( waited ) {
+		mutex_unlock( &remoteCloneLock );
+		// Whatever the other thread came up with is loaded by now, if anything
+		image_release( image );
+		return image_get( name, revision, true );
+	}
+	if ( lookup != NULL && !timing_reached( &lookup->deadline, &now ) ) {
+		mutex_unlock( &remoteCloneLock ); // Was recently checked...
+		return image;
 	}
 	// Re-check to prevent two clients at the same time triggering this,
 	// but only if rid != 0, since we would just get an old rid then
@@ -1232,13 +1290,13 @@ static dnbd3_image_t *loadImageProxy(char * const name, const uint16_t revision,
 	}
 	// Reaching this point means we should contact an authority server
 	serialized_buffer_t serialized;
-	// Mark as recently checked
-	if ( useIndex == -1 ) {
-		useIndex = fallbackIndex;
+	// Mark as in progress, so others wait for us
+	if ( lookup == NULL ) {
+		lookup = getRemoteLookup( name, revision, len, true, &now );
+	}
+	if ( lookup != NULL ) {
+		lookup->inFlight = true;
 	}
-	timing_set( &remoteCloneCache[useIndex].deadline, &now, SERVER_REMOTE_IMAGE_CHECK_CACHETIME );
-	snprintf( remoteCloneCache[useIndex].name, NAMELEN, "%s", cmpname );
-	remoteCloneCache[useIndex].rid = revision;
 	mutex_unlock( &remoteCloneLock );
 
 	// Get some alt servers and try to get the image from there
@@ -1318,7 +1376,7 @@ server_fail: ;
 	// If we still have a pointer to a local image, compare rid
 	if ( image != NULL ) {
 		if ( ( revision == 0 && image->rid >= acceptedRemoteRid ) || ( image->rid == revision ) ) {
-			return image;
+			goto done;
 		}
 		// release the reference
 		image_release( image );
@@ -1330,6 +1388,13 @@ server_fail: ;
 		if ( !uplink_init( image, uplinkSock, &uplinkServer, remoteProtocolVersion ) ) {
 			close( uplinkSock );
 		} else {
+			// Copy unchanged hash blocks from previous revision in the background
+			if ( image->crc32 != NULL ) {
+				dnbd3_image_t *ref = image_lock( image );
+				if ( ref != NULL && !threadpool_run( &seedFromOlderRevision, ref, "SEED" ) ) {
+					image_release( ref );
+				}
+			}
 			// Clumsy busy wait, but this should only take as long as it takes to start a thread, so is it really worth using a signalling mechanism?
 			int i = 0;
 			while ( image->problem.uplink && ++i < 100 )
@@ -1338,9 +1403,204 @@ server_fail: ;
 	} else if ( uplinkSock != -1 ) {
 		close( uplinkSock );
 	}
+done:
+	if ( lookup != NULL ) {
+		// Remember we just checked, and wake up everyone waiting for us
+		mutex_lock( &remoteCloneLock );
+		timing_gets( &lookup->deadline, SERVER_REMOTE_IMAGE_CHECK_CACHETIME );
+		lookup->inFlight = false;
+		pthread_cond_broadcast( &remoteCloneDone );
+		mutex_unlock( &remoteCloneLock );
+	}
 	return image;
 }
 
+/**
+ * Copy all hash blocks of a freshly cloned image that are unchanged
+ * in the newest older revision we have locally, judging by the crc32
+ * lists. Every block is verified against the new crc32 list after
+ * copying, so we never mark anything as cached that is not what the
+ * upstream server has. The uplink might fetch some of these blocks
+ * concurrently, which is harmless as it writes the same data.
+ * Takes ownership of the reference to the image passed in.
+ */
+static void* seedFromOlderRevision(void *data)
+{
+	dnbd3_image_t * const image = data;
+	dnbd3_image_t *old = NULL;
+	dnbd3_cache_map_t *oldCache = NULL;
+	char *buffer = NULL;
+	int fd = -1, seeded = 0;
+	setThreadName( "seed-revision" );
+	mutex_lock( &imageListLock );
+	for ( int i = 0; i < _num_images; ++i ) {
+		dnbd3_image_t * const candidate = _images[i];
+		if ( candidate == NULL || candidate->rid >= image->rid || candidate->crc32 == NULL
+				|| strcmp( candidate->name, image->name ) != 0 )
+			continue;
+		if ( old == NULL || old->rid < candidate->rid ) {
+			old = candidate;
+		}
+	}
+	if ( old != NULL ) {
+		old->users++;
+	}
+	mutex_unlock( &imageListLock );
+	if ( old == NULL || !image_ensureOpen( old ) || old->problem.read )
+		goto cleanup;
+	fd = open( image->path, O_RDWR );
+	if ( fd == -1 ) {
+		logadd( LOG_WARNING, "Cannot open %s for seeding from older revision (errno=%d)", image->path, errno );
+		goto cleanup;
+	}
+	buffer = malloc( HASH_BLOCK_SIZE );
+	oldCache = ref_get_cachemap( old );
+	const int blocks = (int)IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize );
+	for ( int block = 0; block < blocks && !_shutdown; ++block ) {
+		const uint64_t start = (uint64_t)block * HASH_BLOCK_SIZE;
+		const size_t len = (size_t)MIN( HASH_BLOCK_SIZE, image->virtualFilesize - start );
+		if ( start + len > old->virtualFilesize || image->crc32[block] != old->crc32[block] )
+			continue;
+		if ( oldCache != NULL && !image_isHashBlockComplete( oldCache, block, old->realFilesize ) )
+			continue;
+		dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+		if ( cache == NULL )
+			break; // Complete already
+		const bool have = image_isHashBlockComplete( cache, block, image->realFilesize );
+		ref_put( &cache->reference );
+		if ( have )
+			continue;
+		// Older revision might not be a multiple of 4k, treat missing bytes as zero
+		size_t done = 0;
+		while ( done < len ) {
+			const ssize_t ret = pread( old->readFd, buffer + done, len - done, (off_t)( start + done ) );
+			if ( ret <= 0 )
+				break;
+			done += (size_t)ret;
+		}
+		memset( buffer + done, 0, len - done );
+		if ( pwrite( fd, buffer, len, (off_t)start ) != (ssize_t)len ) {
+			logadd( LOG_WARNING, "Write error while seeding %s:%d (errno=%d)", PIMG(image), errno );
+			break;
+		}
+		uint32_t crc;
+		if ( !image_calcBlockCrc32( fd, block, image->realFilesize, &crc ) || crc != image->crc32[block] ) {
+			logadd( LOG_DEBUG1, "Block %d of %s:%d differs from rid %d despite matching crc32", block, PIMG(image), (int)old->rid );
+			continue;
+		}
+		image_updateCachemap( image, start, start + len, true );
+		seeded++;
+	}
+	if ( seeded != 0 ) {
+		logadd( LOG_INFO, "Seeded %d hash blocks of %s:%d from rid %d", seeded, PIMG(image), (int)old->rid );
+	}
+cleanup:
+	if ( oldCache != NULL ) {
+		ref_put( &oldCache->reference );
+	}
+	free( buffer );
+	if ( fd != -1 ) {
+		close( fd );
+	}
+	image_release( old );
+	image_release( image );
+	return NULL;
+}
+
+typedef struct {
+	uint16_t rid;
+	char name[];
+} revision_job_t;
+
+/**
+ * An upstream server announced that there is a newer revision of the
+ * given image. Start replicating it in the background, so it's there
+ * (ideally complete) by the time clients ask for it. Cloning will seed
+ * the new revision from the one we have, see seedFromOlderRevision().
+ */
+void image_replicateRevision(dnbd3_image_t *image, uint16_t rid)
+{
+	if ( !_isProxy || _backgroundReplication == BGR_DISABLED || rid <= image->rid )
+		return;
+	const size_t len = strlen( image->name ) + 1;
+	revision_job_t *job = malloc( sizeof(*job) + len );
+	job->rid = rid;
+	memcpy( job->name, image->name, len );
+	if ( !threadpool_run( &replicateRevision, job, "REVISION" ) ) {
+		free( job );
+	}
+}
+
+static void* replicateRevision(void *data)
+{
+	revision_job_t * const job = data;
+	setThreadName( "new-revision" );
+	dnbd3_image_t *image = image_getOrLoad( job->name, job->rid );
+	if ( image != NULL ) {
+		logadd( LOG_INFO, "Replicating announced revision %s:%d", PIMG(image) );
+		image_release( image );
+	}
+	free( job );
+	return NULL;
+}
+
+/**
+ * Find entry for given image in the list of lookups on upstream servers.
+ * Expired entries in the same bucket are removed on the way. If there is
+ * no entry and create is true, add one, unless there are too many already.
+ * Must be called with remoteCloneLock held.
+ */
+static remote_lookup_t *getRemoteLookup(const char *name, uint16_t rid, size_t len, bool create, ticks *now)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ rid;
+	for ( size_t i = 0; i < len; ++i ) {
+		h = ( h ^ (uint8_t)name[i] ) * 0x100000001b3ull;
+	}
+	remote_lookup_t **it = &remoteLookups[h % LOOKUP_BUCKETS];
+	while ( *it != NULL ) {
+		remote_lookup_t * const entry = *it;
+		if ( entry->rid == rid && strcmp( entry->name, name ) == 0 )
+			return entry;
+		if ( !entry->inFlight && timing_reached( &entry->deadline, now ) ) {
+			*it = entry->next;
+			free( entry );
+			numRemoteLookups--;
+		} else {
+			it = &entry->next;
+		}
+	}
+	if ( !create )
+		return NULL;
+	if ( numRemoteLookups >= SERVER_REMOTE_LOOKUP_MAX ) {
+		// Full, clean up all buckets
+		for ( int i = 0; i < LOOKUP_BUCKETS; ++i ) {
+			for ( remote_lookup_t **e = &remoteLookups[i]; *e != NULL; ) {
+				remote_lookup_t * const entry = *e;
+				if ( !entry->inFlight && timing_reached( &entry->deadline, now ) ) {
+					*e = entry->next;
+					free( entry );
+					numRemoteLookups--;
+				} else {
+					e = &entry->next;
+				}
+			}
+		}
+		if ( numRemoteLookups >= SERVER_REMOTE_LOOKUP_MAX )
+			return NULL;
+	}
+	remote_lookup_t *entry = malloc( sizeof(*entry) + len + 1 );
+	if ( entry == NULL )
+		return NULL;
+	entry->next = NULL;
+	entry->deadline = *now;
+	entry->inFlight = false;
+	entry->rid = rid;
+	memcpy( entry->name, name, len + 1 );
+	*it = entry;
+	numRemoteLookups++;
+	return entry;
+}
+
 /**
  * Called if specific rid is not loaded, or if rid is 0, in which case we check on
  * disk which revision is latest.
@@ -1575,10 +1835,13 @@ json_t* image_getListAsJson()
 {
 	json_t *imagesJson = json_array();
 	json_t *jsonImage;
+	json_t *jsonConnections;
 	int i;
 	char uplinkName[100];
 	uint64_t bytesReceived;
-	int completeness, idleTime;
+	int completeness, idleTime, bgrWindow, demandLatency;
+	uint64_t hedgedRequests, hedgeDuplicateBytes, cancelledRequests, overfetchBytes, overfetchUsed;
+	uint32_t requestSize;
 	declare_now;
 
 	mutex_lock( &imageListLock );
@@ -1593,11 +1856,25 @@ json_t* image_getListAsJson()
 		if ( uplink == NULL ) {
 			bytesReceived = 0;
 			uplinkName[0] = '\0';
+			jsonConnections = NULL;
+			bgrWindow = demandLatency = 0;
+			hedgedRequests = hedgeDuplicateBytes = cancelledRequests = 0;
+			overfetchBytes = overfetchUsed = 0;
+			requestSize = 0;
 		} else {
 			bytesReceived = uplink->bytesReceived;
 			if ( !uplink_getHostString( uplink, uplinkName, sizeof(uplinkName) ) ) {
 				uplinkName[0] = '\0';
 			}
+			jsonConnections = uplink_connectionsToJson( uplink );
+			bgrWindow = uplink->bgrWindow;
+			demandLatency = (int)uplink->demandLatency;
+			hedgedRequests = uplink->hedgedRequests;
+			hedgeDuplicateBytes = uplink->hedgeDuplicateBytes;
+			cancelledRequests = uplink->cancelledRequests;
+			requestSize = uplink->requestSize;
+			overfetchBytes = uplink->overfetchBytes;
+			overfetchUsed = uplink->overfetchUsed;
 			ref_put( &uplink->reference );
 		}
 
@@ -1618,12 +1895,29 @@ json_t* image_getListAsJson()
 				"idle", idleTime,
 				"size", (json_int_t)image->virtualFilesize,
 				"problems", problems );
+		dnbd3_boot_profile_t *profile = ref_get_bootprofile( image );
+		if ( profile != NULL ) {
+			json_object_set_new( jsonImage, "bootProfileChunks", json_integer( profile->count ) );
+			json_object_set_new( jsonImage, "bootProfileTraces", json_integer( profile->traces ) );
+			ref_put( &profile->reference );
+		}
 		if ( bytesReceived != 0 ) {
 			json_object_set_new( jsonImage, "bytesReceived", json_integer( (json_int_t) bytesReceived ) );
 		}
 		if ( uplinkName[0] != '\0' ) {
 			json_object_set_new( jsonImage, "uplinkServer", json_string( uplinkName ) );
 		}
+		if ( jsonConnections != NULL ) {
+			json_object_set_new( jsonImage, "uplinkConnections", jsonConnections );
+			json_object_set_new( jsonImage, "bgrWindow", json_integer( bgrWindow ) );
+			json_object_set_new( jsonImage, "demandLatency", json_integer( demandLatency ) );
+			json_object_set_new( jsonImage, "hedgedRequests", json_integer( (json_int_t)hedgedRequests ) );
+			json_object_set_new( jsonImage, "hedgeDuplicateBytes", json_integer( (json_int_t)hedgeDuplicateBytes ) );
+			json_object_set_new( jsonImage, "cancelledRequests", json_integer( (json_int_t)cancelledRequests ) );
+			json_object_set_new( jsonImage, "requestSize", json_integer( requestSize ) );
+			json_object_set_new( jsonImage, "overfetchBytes", json_integer( (json_int_t)overfetchBytes ) );
+			json_object_set_new( jsonImage, "overfetchUsed", json_integer( (json_int_t)overfetchUsed ) );
+		}
 		json_array_append_new( imagesJson, jsonImage );
 
 	}
@@ -1952,6 +2246,9 @@ static void* saveLoadAllCacheMaps(void* nix UNUSED)
 		if ( full && fromUpstream ) {
 			saveMetaData( image, &now, walltime );
 		}
+		if ( full ) {
+			heatmap_save( image );
+		}
 		image_release( image ); // Always do this instead of users-- to handle freeing
 		mutex_lock( &imageListLock );
 	}
@@ -1959,6 +2256,66 @@ static void* saveLoadAllCacheMaps(void* nix UNUSED)
 	return NULL;
 }
 
+/**
+ * Save the cache maps of all images we replicate from upstream right away,
+ * regardless of whether they changed. Used before handing over to a new
+ * server process, so it can pick up where we left off.
+ */
+void image_saveAllCacheMaps()
+{
+	mutex_lock( &imageListLock );
+	for ( int i = 0; i < _num_images; ++i ) {
+		dnbd3_image_t * const image = _images[i];
+		if ( image == NULL )
+			continue;
+		image->users++;
+		mutex_unlock( &imageListLock );
+		if ( image->ref_cacheMap != NULL && isImageFromUpstream( image ) ) {
+			saveCacheMap( image );
+		}
+		image_release( image );
+		mutex_lock( &imageListLock );
+	}
+	mutex_unlock( &imageListLock );
+}
+
+/**
+ * Merge the cache maps on disk into the ones in memory for all images we
+ * replicate from upstream, i.e. mark every block as cached that is marked
+ * in either one. Used after taking over from a previous server process,
+ * which might have replicated more blocks after we loaded the maps.
+ */
+void image_mergeCacheMapsFromDisk()
+{
+	mutex_lock( &imageListLock );
+	for ( int i = 0; i < _num_images; ++i ) {
+		dnbd3_image_t * const image = _images[i];
+		if ( image == NULL )
+			continue;
+		image->users++;
+		mutex_unlock( &imageListLock );
+		dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+		if ( cache != NULL && isImageFromUpstream( image ) ) {
+			dnbd3_cache_map_t *onDisk = image_loadCacheMap( image->path, image->virtualFilesize );
+			if ( onDisk != NULL ) {
+				const int mapSize = IMGSIZE_TO_MAPBYTES( image->virtualFilesize );
+				for ( int j = 0; j < mapSize; ++j ) {
+					atomic_fetch_or_explicit( &cache->map[j], onDisk->map[j], memory_order_relaxed );
+				}
+				atomic_thread_fence( memory_order_release );
+				onDisk->reference.free( &onDisk->reference );
+			}
+			ref_put( &cache->reference );
+			image_isComplete( image );
+		} else if ( cache != NULL ) {
+			ref_put( &cache->reference );
+		}
+		image_release( image );
+		mutex_lock( &imageListLock );
+	}
+	mutex_unlock( &imageListLock );
+}
+
 /**
  * Saves the cache map of the given image.
  * Return false if this image doesn't have a cache map, or if the image
@@ -25,6 +25,8 @@ bool image_reopenCacheFd(dnbd3_image_t *image, const bool force);
 
 dnbd3_image_t* image_getOrLoad(char *name, uint16_t revision);
 
+void image_replicateRevision(dnbd3_image_t *image, uint16_t rid);
+
 dnbd3_image_t* image_lock(dnbd3_image_t *image);
 
 dnbd3_image_t* image_release(dnbd3_image_t *image);
@@ -45,12 +47,18 @@ struct json_t* image_getListAsJson();
 
 int image_getCompletenessEstimate(dnbd3_image_t * const image);
 
+int image_getInUse(dnbd3_image_t **images, int size);
+
 void image_closeUnusedFd();
 
 bool image_ensureDiskSpaceLocked(uint64_t size, bool force);
 
 bool image_saveCacheMap(dnbd3_image_t *image);
 
+void image_saveAllCacheMaps();
+
+void image_mergeCacheMapsFromDisk();
+
 /**
  * Check if given range is cached. Be careful when using this function because:
  * 1) you need to hold a reference to the cache map
@@ -203,7 +203,8 @@ int debug_mutex_unlock(const char *name, const char *file, int line, pthread_mut
 	return retval;
 }
 
-int debug_mutex_cond_wait(const char *name, const char *file, int line, pthread_cond_t *restrict cond, pthread_mutex_t *restrict lock)
+int debug_mutex_cond_wait(const char *name, const char *file, int line, pthread_cond_t *restrict cond, pthread_mutex_t *restrict lock,
+		const struct timespec *restrict abstime)
 {
 	debug_lock_t *l = NULL;
 	debug_thread_t *t = NULL;
@@ -244,8 +245,8 @@ int debug_mutex_cond_wait(const char *name, const char *file, int line, pthread_
 	l->thread = 0;
 	snprintf( l->where, LOCKLEN, "CWU %s:%d", file, line );
 	pthread_mutex_unlock( &initdestory );
-	int retval = pthread_cond_wait( cond, lock );
-	if ( retval != 0 ) {
+	int retval = abstime == NULL ? pthread_cond_wait( cond, lock ) : pthread_cond_timedwait( cond, lock, abstime );
+	if ( retval != 0 && ( abstime == NULL || retval != ETIMEDOUT ) ) {
 		logadd( LOG_ERROR, "pthread_cond_wait returned %d for lock %p (%s) at %s:%d\n", retval, (void*)lock, name, file, line );
 		exit( 4 );
 	}
@@ -23,6 +23,11 @@
 #define LOCK_UPLINK_RTT 200
 #define LOCK_UPLINK_SEND 210
 #define LOCK_RPC_ACL 220
+#define LOCK_BGR 230
+#define LOCK_BOOT_PROFILE 240
+#define LOCK_HEAT_MAP 250
+#define LOCK_WARMUP 260
+#define LOCK_HANDOFF 270
 #define LOCK_FUSE_INIT 300
 #define LOCK_FUSE_DIR 310
 
@@ -34,13 +39,15 @@
 #define mutex_lock( lock ) debug_mutex_lock( #lock, __FILE__, __LINE__, lock, false)
 #define mutex_trylock( lock ) debug_mutex_lock( #lock, __FILE__, __LINE__, lock, true)
 #define mutex_unlock( lock ) debug_mutex_unlock( #lock, __FILE__, __LINE__, lock)
-#define mutex_cond_wait( cond, lock ) debug_mutex_cond_wait( #lock, __FILE__, __LINE__, cond, lock)
+#define mutex_cond_wait( cond, lock ) debug_mutex_cond_wait( #lock, __FILE__, __LINE__, cond, lock, NULL)
+#define mutex_cond_timedwait( cond, lock, abstime ) debug_mutex_cond_wait( #lock, __FILE__, __LINE__, cond, lock, abstime)
 #define mutex_destroy( lock ) debug_mutex_destroy( #lock, __FILE__, __LINE__, lock)
 
 int debug_mutex_init(const char *name, const char *file, int line, pthread_mutex_t *lock, int priority);
 int debug_mutex_lock(const char *name, const char *file, int line, pthread_mutex_t *lock, bool try);
 int debug_mutex_unlock(const char *name, const char *file, int line, pthread_mutex_t *lock);
-int debug_mutex_cond_wait(const char *name, const char *file, int line, pthread_cond_t *restrict cond, pthread_mutex_t *restrict lock);
+int debug_mutex_cond_wait(const char *name, const char *file, int line, pthread_cond_t *restrict cond, pthread_mutex_t *restrict lock,
+		const struct timespec *restrict abstime);
 int debug_mutex_destroy(const char *name, const char *file, int line, pthread_mutex_t *lock);
 
 void debug_dump_lock_stats();
@@ -53,6 +60,7 @@ void debug_dump_lock_stats();
 #define mutex_trylock( lock ) pthread_mutex_trylock(lock)
 #define mutex_unlock( lock ) pthread_mutex_unlock(lock)
 #define mutex_cond_wait( cond, lock ) pthread_cond_wait(cond, lock)
+#define mutex_cond_timedwait( cond, lock, abstime ) pthread_cond_timedwait(cond, lock, abstime)
 #define mutex_destroy( lock ) pthread_mutex_destroy(lock)
 
 #endif
@@ -0,0 +1,201 @@
+#ifndef _MCASTPROTO_H_
+#define _MCASTPROTO_H_
+
+/*
+ * Multicast carousel. A server streams the most requested parts of a popular
+ * image to a UDP multicast group over and over, so proxies serving clients
+ * that boot at the same time don't all have to fetch the same blocks via TCP.
+ * Every data packet carries one block. After every DNBD3_MCAST_FEC_GROUP data
+ * packets, a parity packet with the XOR of all their payloads follows, so a
+ * receiver can recover one lost packet per group. Anything still missing is
+ * fetched via unicast as usual. There is no authentication, so receivers must
+ * verify the data by other means before using it, like the CRC-32 list of the
+ * image.
+ * Multi-byte fields are in dnbd3 network byte order, see net_order_*.
+ */
+
+#include <dnbd3/types.h>
+#include <dnbd3/shared/crc32.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DNBD3_MCAST_MAGIC     ((uint32_t)0x434d4e44) // "DNMC"
+#define DNBD3_MCAST_VERSION   1
+#define DNBD3_MCAST_ANNOUNCE  1 // Payload: image name, null terminated
+#define DNBD3_MCAST_DATA      2 // Payload: one block of DNBD3_BLOCK_SIZE bytes
+#define DNBD3_MCAST_PARITY    3 // Payload: XOR of all data payloads of the FEC group
+#define DNBD3_MCAST_FEC_GROUP 8 // Max number of data packets per parity packet
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint8_t  version;
+	uint8_t  type;
+	uint16_t rid;
+	uint32_t imageId;     // See dnbd3_mcast_imageId()
+	uint32_t group;       // Sequence number of FEC group, 0 for announcements
+	uint64_t imageSize;
+	uint8_t  index;       // Position of this data packet in its FEC group
+	uint8_t  count;       // Number of data packets in this FEC group
+	uint16_t reserved;
+	uint64_t offsets[DNBD3_MCAST_FEC_GROUP]; // Offsets of all data packets of this FEC group
+} dnbd3_mcast_header_t;
+
+#define DNBD3_MCAST_MAX_PACKET ( sizeof(dnbd3_mcast_header_t) + DNBD3_BLOCK_SIZE )
+
+/**
+ * State of a receiver for one image, to recover a lost packet per FEC group.
+ */
+typedef struct
+{
+	uint32_t group;       // FEC group currently being received
+	uint16_t have;        // Bit n set = data packet n received, bit 15 = parity received
+	bool active;
+	dnbd3_mcast_header_t header;
+	uint8_t xor[DNBD3_BLOCK_SIZE]; // XOR of all payloads of current group received so far
+} dnbd3_mcast_fec_t;
+
+#define DNBD3_MCAST_HAVE_PARITY ((uint16_t)0x8000)
+
+static inline uint32_t dnbd3_mcast_imageId(const char *name)
+{
+	return crc32( 0, (const uint8_t*)name, strlen( name ) );
+}
+
+static inline void dnbd3_mcast_fixup(dnbd3_mcast_header_t *h)
+{
+	h->magic = net_order_32( h->magic );
+	h->rid = net_order_16( h->rid );
+	h->imageId = net_order_32( h->imageId );
+	h->group = net_order_32( h->group );
+	h->imageSize = net_order_64( h->imageSize );
+	for ( int i = 0; i < DNBD3_MCAST_FEC_GROUP; ++i ) {
+		h->offsets[i] = net_order_64( h->offsets[i] );
+	}
+}
+
+/**
+ * Parse "<group>:<port>[@<interface address>]", IPv4 only.
+ * The interface defaults to INADDR_ANY.
+ */
+static inline bool dnbd3_mcast_parse(const char *str, struct sockaddr_in *group, struct in_addr *iface)
+{
+	char buffer[100];
+	if ( str == NULL || strlen( str ) >= sizeof(buffer) )
+		return false;
+	strcpy( buffer, str );
+	iface->s_addr = htonl( INADDR_ANY );
+	char *at = strchr( buffer, '@' );
+	if ( at != NULL ) {
+		*at++ = '\0';
+		if ( inet_pton( AF_INET, at, iface ) != 1 )
+			return false;
+	}
+	char *colon = strrchr( buffer, ':' );
+	if ( colon == NULL )
+		return false;
+	*colon++ = '\0';
+	const int port = atoi( colon );
+	if ( port <= 0 || port > 65535 )
+		return false;
+	memset( group, 0, sizeof(*group) );
+	group->sin_family = AF_INET;
+	group->sin_port = htons( (uint16_t)port );
+	return inet_pton( AF_INET, buffer, &group->sin_addr ) == 1 && IN_MULTICAST( ntohl( group->sin_addr.s_addr ) );
+}
+
+/**
+ * Open socket receiving from given multicast group.
+ * @return socket, -1 on error
+ */
+static inline int dnbd3_mcast_listen(const struct sockaddr_in *group, struct in_addr iface, int timeoutMs)
+{
+	const int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+	if ( sock == -1 )
+		return -1;
+	const int on = 1;
+	struct ip_mreq mreq = { .imr_multiaddr = group->sin_addr, .imr_interface = iface };
+	struct sockaddr_in bindAddr = *group; // Bind to group, so we don't get other traffic to that port
+	struct timeval tv = { .tv_sec = timeoutMs / 1000, .tv_usec = ( timeoutMs % 1000 ) * 1000 };
+	if ( setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) ) == -1
+			|| bind( sock, (struct sockaddr*)&bindAddr, sizeof(bindAddr) ) == -1
+			|| setsockopt( sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq) ) == -1
+			|| setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) ) == -1 ) {
+		close( sock );
+		return -1;
+	}
+	return sock;
+}
+
+/**
+ * Validate received packet and convert header to host byte order.
+ * @return payload length, -1 if the packet is invalid
+ */
+static inline int dnbd3_mcast_check(void *packet, ssize_t len)
+{
+	dnbd3_mcast_header_t *h = (dnbd3_mcast_header_t*)packet;
+	if ( len < (ssize_t)sizeof(*h) )
+		return -1;
+	dnbd3_mcast_fixup( h );
+	if ( h->magic != DNBD3_MCAST_MAGIC || h->version != DNBD3_MCAST_VERSION )
+		return -1;
+	len -= sizeof(*h);
+	if ( h->type == DNBD3_MCAST_ANNOUNCE )
+		return ( len > 0 && ((char*)packet)[sizeof(*h) + len - 1] == '\0' ) ? (int)len : -1;
+	if ( len != DNBD3_BLOCK_SIZE || h->count == 0 || h->count > DNBD3_MCAST_FEC_GROUP
+			|| ( h->type == DNBD3_MCAST_DATA && h->index >= h->count ) )
+		return -1;
+	for ( int i = 0; i < h->count; ++i ) {
+		if ( h->offsets[i] % DNBD3_BLOCK_SIZE != 0 || h->offsets[i] >= h->imageSize )
+			return -1;
+	}
+	return (int)len;
+}
+
+/**
+ * Feed a data or parity packet of our image to the FEC state.
+ * @return index of a data packet of the group that could be recovered, its
+ *         payload is in fec->xor then, and its offset in fec->header.offsets;
+ *         -1 if nothing was recovered
+ */
+static inline int dnbd3_mcast_fec_add(dnbd3_mcast_fec_t *fec, const dnbd3_mcast_header_t *h, const uint8_t *payload)
+{
+	if ( !fec->active || fec->group != h->group || memcmp( fec->header.offsets, h->offsets, sizeof(h->offsets) ) != 0 ) {
+		// New group; any recovery for the previous one is impossible now
+		fec->active = true;
+		fec->group = h->group;
+		fec->have = 0;
+		fec->header = *h;
+		memset( fec->xor, 0, sizeof(fec->xor) );
+	}
+	const uint16_t bit = h->type == DNBD3_MCAST_PARITY ? DNBD3_MCAST_HAVE_PARITY : (uint16_t)( 1 << h->index );
+	if ( fec->have & bit )
+		return -1; // Duplicate
+	fec->have |= bit;
+	for ( size_t i = 0; i < DNBD3_BLOCK_SIZE; ++i ) {
+		fec->xor[i] ^= payload[i];
+	}
+	if ( !( fec->have & DNBD3_MCAST_HAVE_PARITY ) )
+		return -1;
+	int missing = -1;
+	for ( int i = 0; i < fec->header.count; ++i ) {
+		if ( fec->have & ( 1 << i ) )
+			continue;
+		if ( missing != -1 )
+			return -1; // More than one missing, can't recover yet
+		missing = i;
+	}
+	if ( missing != -1 ) {
+		fec->have |= (uint16_t)( 1 << missing );
+	}
+	return missing;
+}
+
+#endif /* _MCASTPROTO_H_ */
@@ -0,0 +1,638 @@
+#include "multicast.h"
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include "heatmap.h"
+#include "reference.h"
+#include "mcastproto.h"
+#include <dnbd3/shared/timing.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <jansson.h>
+
+/*
+ * Multicast carousel, see mcastproto.h for the wire format.
+ * The sender thread picks the image used by the most clients, if there are
+ * at least multicastMinClients of them, and streams the blocks listed in its
+ * boot profile (or its hottest hash blocks, if there is no profile) to the
+ * multicast group over and over, limited to multicastBandwidth. Only blocks
+ * that are cached locally are sent. Every SERVER_MULTICAST_PICK_INTERVAL
+ * seconds, it checks whether another image became more popular.
+ * On a proxy, the receiver thread writes blocks of incomplete images it gets
+ * from multicastUpstream to their cache file, so they don't have to be
+ * fetched by the uplink anymore. Packets are not authenticated, so this is
+ * only done for images that have a CRC-32 list, and received blocks never
+ * go to the cache file directly: they are written to an unlinked staging
+ * file first. Once every block of a hash block is either cached or was
+ * received, the hash block's CRC-32 is checked, and only if it matches,
+ * the received blocks still missing are copied to the cache file and
+ * marked as cached. Otherwise they're discarded and fetched by the uplink
+ * as usual.
+ */
+
+typedef struct
+{
+	uint64_t start, end;
+} range_t;
+
+typedef struct
+{
+	dnbd3_image_t *image;
+	uint32_t imageId;   // dnbd3_mcast_imageId() of image name
+	range_t *ranges;
+	int count;
+	int index;          // Current range...
+	uint64_t pos;       // ...and offset to continue at
+	uint32_t group;     // Sequence number of next FEC group
+} carousel_t;
+
+static struct sockaddr_in sendAddr, recvAddr;
+static struct in_addr sendIface, recvIface;
+static pthread_t sendThreadId, recvThreadId;
+static bool hasSendThread = false, hasRecvThread = false;
+
+// Statistics, see multicast_toJson()
+static atomic_int sendingImage = -1; // ID of image being streamed, -1 = none
+static atomic_uint_fast64_t sentBytes = 0;
+static atomic_uint_fast64_t rounds = 0;
+static atomic_uint_fast64_t receivedBytes = 0;
+static atomic_uint_fast64_t writtenBytes = 0;
+static atomic_uint_fast64_t recoveredBlocks = 0;
+static atomic_uint_fast64_t rejectedBlocks = 0; // Hash blocks that failed the CRC-32 check
+
+static void* sendThread(void *data);
+static void* recvThread(void *data);
+
+void multicast_init()
+{
+	if ( _multicastGroup != NULL && *_multicastGroup != '\0' ) {
+		if ( !dnbd3_mcast_parse( _multicastGroup, &sendAddr, &sendIface ) ) {
+			logadd( LOG_ERROR, "Invalid multicastGroup '%s', expected <group>:<port>[@<interface address>]", _multicastGroup );
+		} else if ( 0 != thread_create( &sendThreadId, NULL, &sendThread, NULL ) ) {
+			logadd( LOG_ERROR, "Could not start multicast sender thread" );
+		} else {
+			hasSendThread = true;
+		}
+	}
+	if ( _multicastUpstream != NULL && *_multicastUpstream != '\0' ) {
+		if ( !_isProxy ) {
+			logadd( LOG_WARNING, "Ignoring multicastUpstream, not running in proxy mode" );
+		} else if ( !dnbd3_mcast_parse( _multicastUpstream, &recvAddr, &recvIface ) ) {
+			logadd( LOG_ERROR, "Invalid multicastUpstream '%s', expected <group>:<port>[@<interface address>]", _multicastUpstream );
+		} else if ( 0 != thread_create( &recvThreadId, NULL, &recvThread, NULL ) ) {
+			logadd( LOG_ERROR, "Could not start multicast receiver thread" );
+		} else {
+			hasRecvThread = true;
+		}
+	}
+}
+
+void multicast_shutdown()
+{
+	if ( hasSendThread ) {
+		thread_join( sendThreadId, NULL );
+		hasSendThread = false;
+	}
+	if ( hasRecvThread ) {
+		thread_join( recvThreadId, NULL );
+		hasRecvThread = false;
+	}
+}
+
+json_t* multicast_toJson()
+{
+	return json_pack( "{sisIsIsIsIsIsI}",
+			"sendingImage", (int)sendingImage,
+			"sentBytes", (json_int_t)sentBytes,
+			"rounds", (json_int_t)rounds,
+			"receivedBytes", (json_int_t)receivedBytes,
+			"writtenBytes", (json_int_t)writtenBytes,
+			"recoveredBlocks", (json_int_t)recoveredBlocks,
+			"rejectedBlocks", (json_int_t)rejectedBlocks );
+}
+
+static void waitSeconds(int seconds)
+{
+	while ( seconds-- > 0 && !_shutdown ) {
+		sleep( 1 );
+	}
+}
+
+/*
+ * Sender
+ */
+
+/**
+ * Get the image with the most users, if it has at least multicastMinClients.
+ * Prefer current image on ties, so we don't switch back and forth.
+ */
+static dnbd3_image_t* pickImage(dnbd3_image_t **images, int current)
+{
+	const int count = image_getInUse( images, SERVER_MAX_IMAGES );
+	dnbd3_image_t *best = NULL;
+	int bestUsers = MAX( 1, _multicastMinClients );
+	for ( int i = 0; i < count; ++i ) {
+		dnbd3_image_t *image = images[i];
+		const int users = image->users - 1; // Minus our own reference
+		if ( !image->problem.read && ( users > bestUsers || ( users == bestUsers && ( best == NULL || image->id == current ) ) ) ) {
+			if ( best != NULL ) {
+				image_release( best );
+			}
+			best = image;
+			bestUsers = users;
+		} else {
+			image_release( image );
+		}
+	}
+	return best;
+}
+
+/**
+ * Fill carousel with the ranges of the image's boot profile, in the order
+ * clients read them, or its hottest hash blocks.
+ */
+static void setupRanges(carousel_t *c)
+{
+	dnbd3_image_t *image = c->image;
+	const uint64_t size = image->virtualFilesize;
+	uint64_t total = 0;
+	c->count = c->index = 0;
+	c->pos = 0;
+	dnbd3_boot_profile_t *profile = ref_get_bootprofile( image );
+	if ( profile != NULL ) {
+		for ( int i = 0; i < profile->count && total < SERVER_MULTICAST_MAX_BYTES; ++i ) {
+			const uint64_t start = (uint64_t)profile->entries[i].chunk * SERVER_BOOT_PROFILE_CHUNK;
+			if ( start >= size )
+				continue;
+			c->ranges[c->count].start = start;
+			c->ranges[c->count].end = MIN( start + SERVER_BOOT_PROFILE_CHUNK, size );
+			total += c->ranges[c->count].end - start;
+			c->count++;
+		}
+		ref_put( &profile->reference );
+		return;
+	}
+	int blocks;
+	uint32_t *heat = heatmap_get( image, &blocks );
+	if ( heat == NULL )
+		return;
+	// Hottest first; there are few hash blocks that fit, so just search repeatedly
+	while ( total < SERVER_MULTICAST_MAX_BYTES && c->count < SERVER_BOOT_PROFILE_MAX ) {
+		int hottest = -1;
+		for ( int i = 0; i < blocks; ++i ) {
+			if ( heat[i] != 0 && ( hottest == -1 || heat[i] > heat[hottest] ) ) {
+				hottest = i;
+			}
+		}
+		if ( hottest == -1 )
+			break;
+		heat[hottest] = 0;
+		const uint64_t start = (uint64_t)hottest * HASH_BLOCK_SIZE;
+		c->ranges[c->count].start = start;
+		c->ranges[c->count].end = MIN( start + HASH_BLOCK_SIZE, size );
+		total += c->ranges[c->count].end - start;
+		c->count++;
+	}
+	free( heat );
+}
+
+static bool sendPacket(int sock, const dnbd3_mcast_header_t *header, const void *payload, size_t len)
+{
+	dnbd3_mcast_header_t h = *header;
+	dnbd3_mcast_fixup( &h );
+	struct iovec iov[2] = {
+		{ .iov_base = &h, .iov_len = sizeof(h) },
+		{ .iov_base = (void*)payload, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_name = &sendAddr, .msg_namelen = sizeof(sendAddr),
+		.msg_iov = iov, .msg_iovlen = 2,
+	};
+	while ( sendmsg( sock, &msg, 0 ) == -1 ) {
+		if ( errno == EINTR && !_shutdown )
+			continue;
+		if ( errno == ENOBUFS || errno == EAGAIN )
+			return true; // Just drop it, it's a carousel anyways
+		logadd( LOG_WARNING, "Sending to multicast group failed (errno=%d)", errno );
+		return false;
+	}
+	sentBytes += sizeof(h) + len;
+	return true;
+}
+
+static bool sendAnnounce(int sock, carousel_t *c)
+{
+	dnbd3_mcast_header_t header = {
+		.magic = DNBD3_MCAST_MAGIC,
+		.version = DNBD3_MCAST_VERSION,
+		.type = DNBD3_MCAST_ANNOUNCE,
+		.rid = c->image->rid,
+		.imageId = c->imageId,
+		.imageSize = c->image->virtualFilesize,
+	};
+	return sendPacket( sock, &header, c->image->name, strlen( c->image->name ) + 1 );
+}
+
+/**
+ * Send next FEC group of carousel, consisting of up to DNBD3_MCAST_FEC_GROUP
+ * locally cached blocks, plus parity.
+ * @return number of bytes sent, -1 on error
+ */
+static int64_t sendFecGroup(int sock, carousel_t *c, uint8_t *blocks)
+{
+	dnbd3_image_t *image = c->image;
+	dnbd3_mcast_header_t header = {
+		.magic = DNBD3_MCAST_MAGIC,
+		.version = DNBD3_MCAST_VERSION,
+		.type = DNBD3_MCAST_DATA,
+		.rid = image->rid,
+		.imageId = c->imageId,
+		.imageSize = image->virtualFilesize,
+	};
+	dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+	while ( header.count < DNBD3_MCAST_FEC_GROUP && c->index < c->count ) {
+		const range_t *range = &c->ranges[c->index];
+		if ( c->pos < range->start ) {
+			c->pos = range->start;
+		}
+		if ( c->pos >= range->end ) {
+			c->index++;
+			continue;
+		}
+		const uint64_t offset = c->pos;
+		c->pos += DNBD3_BLOCK_SIZE;
+		if ( cache != NULL && !image_isRangeCachedUnsafe( cache, offset, offset + DNBD3_BLOCK_SIZE ) )
+			continue;
+		header.offsets[header.count++] = offset;
+	}
+	if ( cache != NULL ) {
+		ref_put( &cache->reference );
+	}
+	if ( header.count == 0 )
+		return 0;
+	uint8_t *parity = blocks + DNBD3_MCAST_FEC_GROUP * DNBD3_BLOCK_SIZE;
+	memset( parity, 0, DNBD3_BLOCK_SIZE );
+	for ( int i = 0; i < header.count; ++i ) {
+		uint8_t *block = blocks + i * DNBD3_BLOCK_SIZE;
+		const ssize_t ret = pread( image->readFd, block, DNBD3_BLOCK_SIZE, (off_t)header.offsets[i] );
+		if ( ret == -1 ) {
+			logadd( LOG_WARNING, "Cannot read from %s:%d for multicast (errno=%d)", PIMG(image), errno );
+			image->problem.read = true;
+			return -1;
+		}
+		if ( ret < (ssize_t)DNBD3_BLOCK_SIZE ) {
+			// Last block, pad with zeros as in virtualFilesize
+			memset( block + ret, 0, DNBD3_BLOCK_SIZE - ret );
+		}
+		for ( size_t j = 0; j < DNBD3_BLOCK_SIZE; ++j ) {
+			parity[j] ^= block[j];
+		}
+	}
+	header.group = c->group++;
+	for ( header.index = 0; header.index < header.count; ++header.index ) {
+		if ( !sendPacket( sock, &header, blocks + header.index * DNBD3_BLOCK_SIZE, DNBD3_BLOCK_SIZE ) )
+			return -1;
+	}
+	header.type = DNBD3_MCAST_PARITY;
+	header.index = 0;
+	if ( !sendPacket( sock, &header, parity, DNBD3_BLOCK_SIZE ) )
+		return -1;
+	return ( header.count + 1 ) * (int64_t)( sizeof(header) + DNBD3_BLOCK_SIZE );
+}
+
+/**
+ * Stream carousel until it's time to check for a more popular image.
+ */
+static bool sendCarousel(int sock, carousel_t *c, uint8_t *blocks)
+{
+	ticks start, nextAnnounce, nextPick;
+	uint64_t sent = 0;
+	bool sentThisRound = c->index != 0 || c->pos != 0;
+	timing_get( &start );
+	nextAnnounce = start;
+	timing_addSeconds( &nextPick, &start, SERVER_MULTICAST_PICK_INTERVAL );
+	while ( !_shutdown ) {
+		declare_now;
+		if ( timing_reached( &nextPick, &now ) )
+			return true;
+		if ( timing_reached( &nextAnnounce, &now ) ) {
+			// Once per second, so new receivers don't have to wait for the next round
+			if ( !sendAnnounce( sock, c ) )
+				return false;
+			timing_addSeconds( &nextAnnounce, &now, 1 );
+		}
+		const int64_t ret = sendFecGroup( sock, c, blocks );
+		if ( ret == -1 )
+			return false;
+		if ( ret > 0 ) {
+			sent += ret;
+			sentThisRound = true;
+		}
+		if ( c->index >= c->count ) {
+			// Round complete, start over
+			c->index = 0;
+			c->pos = 0;
+			rounds++;
+			if ( !sentThisRound ) {
+				sleep( 1 ); // Nothing cached, don't spin
+			}
+			sentThisRound = false;
+		}
+		const uint64_t rate = _multicastBandwidth;
+		if ( rate != 0 && ret > 0 ) {
+			timing_get( &now );
+			const uint64_t due = sent * 1000000 / rate;
+			const uint64_t elapsed = timing_diffUs( &start, &now );
+			if ( due > elapsed ) {
+				usleep( (useconds_t)( due - elapsed ) );
+			}
+		}
+	}
+	return true;
+}
+
+static void* sendThread(void *data UNUSED)
+{
+	setThreadName( "mcast-send" );
+	const int ttl = SERVER_MULTICAST_TTL;
+	const int sock = socket( AF_INET, SOCK_DGRAM, 0 );
+	if ( sock == -1 || setsockopt( sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl) ) == -1
+			|| ( sendIface.s_addr != htonl( INADDR_ANY )
+				&& setsockopt( sock, IPPROTO_IP, IP_MULTICAST_IF, &sendIface, sizeof(sendIface) ) == -1 ) ) {
+		logadd( LOG_ERROR, "Cannot set up socket for multicast group %s (errno=%d)", _multicastGroup, errno );
+		if ( sock != -1 ) {
+			close( sock );
+		}
+		return NULL;
+	}
+	logadd( LOG_INFO, "Streaming popular images to multicast group %s", _multicastGroup );
+	dnbd3_image_t **images = malloc( SERVER_MAX_IMAGES * sizeof(*images) );
+	uint8_t *blocks = malloc( ( DNBD3_MCAST_FEC_GROUP + 1 ) * DNBD3_BLOCK_SIZE );
+	carousel_t c = { .ranges = malloc( SERVER_BOOT_PROFILE_MAX * sizeof(range_t) ) };
+	int current = -1;
+	while ( !_shutdown ) {
+		c.image = pickImage( images, current );
+		if ( c.image == NULL || !image_ensureOpen( c.image ) ) {
+			if ( current != -1 ) {
+				logadd( LOG_INFO, "Stopped streaming to multicast group" );
+			}
+			current = -1;
+			sendingImage = -1;
+			c.image = image_release( c.image );
+			waitSeconds( SERVER_MULTICAST_PICK_INTERVAL );
+			continue;
+		}
+		if ( c.image->id != current ) {
+			// New image, start from the beginning
+			current = c.image->id;
+			c.imageId = dnbd3_mcast_imageId( c.image->name );
+			setupRanges( &c );
+			logadd( LOG_INFO, "Streaming %s:%d to multicast group (%d ranges)", PIMG(c.image), c.count );
+		}
+		sendingImage = current;
+		bool ok = true;
+		if ( c.count == 0 ) {
+			// Neither boot profile nor heat map yet; try again later, maybe set up again
+			current = -1;
+			waitSeconds( SERVER_MULTICAST_PICK_INTERVAL );
+		} else {
+			ok = sendCarousel( sock, &c, blocks );
+		}
+		c.image = image_release( c.image );
+		if ( !ok ) {
+			waitSeconds( SERVER_MULTICAST_PICK_INTERVAL );
+		}
+	}
+	sendingImage = -1;
+	free( c.ranges );
+	free( blocks );
+	free( images );
+	close( sock );
+	return NULL;
+}
+
+/*
+ * Receiver
+ */
+
+#define RECEIVED(received, offset) ( (received)[(offset) / DNBD3_BLOCK_SIZE / 8] & ( 1 << ( (offset) / DNBD3_BLOCK_SIZE % 8 ) ) )
+
+/**
+ * Check whether each block of the given hash block is either cached
+ * already, or was received via multicast.
+ */
+static bool isHashBlockFilled(dnbd3_image_t *image, dnbd3_cache_map_t *cache, const uint8_t *received, int hashBlock)
+{
+	const uint64_t start = (uint64_t)hashBlock * HASH_BLOCK_SIZE;
+	const uint64_t end = MIN( start + HASH_BLOCK_SIZE, image->virtualFilesize );
+	for ( uint64_t offset = start; offset < end; offset += DNBD3_BLOCK_SIZE ) {
+		if ( !RECEIVED( received, offset ) && !image_isRangeCachedUnsafe( cache, offset, offset + DNBD3_BLOCK_SIZE ) )
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Hash block is filled, check its CRC-32, taking the received blocks from
+ * the staging file and the rest from the cache file. If it matches, copy
+ * received blocks that are still missing to the cache file and mark them
+ * as cached. Either way, forget the received blocks of this hash block.
+ */
+static void verifyHashBlock(dnbd3_image_t *image, int fd, int stageFd, uint8_t *received, int hashBlock)
+{
+	const uint64_t start = (uint64_t)hashBlock * HASH_BLOCK_SIZE;
+	const uint64_t end = MIN( start + HASH_BLOCK_SIZE, image->virtualFilesize );
+	// Make buffer 4k aligned in case readFd has O_DIRECT set
+	char rawBuffer[2 * DNBD3_BLOCK_SIZE];
+	uint8_t * const buffer = (uint8_t*)( ( (uintptr_t)rawBuffer + ( DNBD3_BLOCK_SIZE - 1 ) ) & ~(uintptr_t)( DNBD3_BLOCK_SIZE - 1 ) );
+	uint32_t crc = crc32( 0, NULL, 0 );
+	bool ok = image_ensureOpen( image );
+	for ( uint64_t offset = start; ok && offset < end; offset += DNBD3_BLOCK_SIZE ) {
+		const int src = RECEIVED( received, offset ) ? stageFd : image->readFd;
+		if ( pread( src, buffer, DNBD3_BLOCK_SIZE, (off_t)offset ) != DNBD3_BLOCK_SIZE ) {
+			ok = false;
+			break;
+		}
+		// Like image_calcBlockCrc32(), anything past the real file size counts as zero
+		if ( offset + DNBD3_BLOCK_SIZE > image->realFilesize ) {
+			const size_t valid = (size_t)( image->realFilesize - MIN( offset, image->realFilesize ) );
+			memset( buffer + valid, 0, DNBD3_BLOCK_SIZE - valid );
+		}
+		crc = crc32( crc, buffer, DNBD3_BLOCK_SIZE );
+	}
+	if ( ok && net_order_32( crc ) == image->crc32[hashBlock] ) {
+		dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+		for ( uint64_t offset = start; cache != NULL && offset < end; offset += DNBD3_BLOCK_SIZE ) {
+			if ( !RECEIVED( received, offset ) || image_isRangeCachedUnsafe( cache, offset, offset + DNBD3_BLOCK_SIZE ) )
+				continue;
+			const size_t len = (size_t)MIN( DNBD3_BLOCK_SIZE, image->realFilesize - MIN( offset, image->realFilesize ) );
+			if ( len != 0 && ( pread( stageFd, buffer, len, (off_t)offset ) != (ssize_t)len
+					|| pwrite( fd, buffer, len, (off_t)offset ) != (ssize_t)len ) ) {
+				logadd( LOG_DEBUG1, "Cannot write multicast block to %s:%d (errno=%d)", PIMG(image), errno );
+				continue;
+			}
+			image_updateCachemap( image, offset, offset + DNBD3_BLOCK_SIZE, true );
+			writtenBytes += len;
+		}
+		if ( cache != NULL ) {
+			ref_put( &cache->reference );
+		}
+	} else {
+		logadd( LOG_WARNING, "Discarding multicast data of hash block %d of %s:%d, CRC-32 mismatch", hashBlock, PIMG(image) );
+		rejectedBlocks++;
+	}
+	memset( received + start / DNBD3_BLOCK_SIZE / 8, 0, ( end - start + DNBD3_BLOCK_SIZE * 8 - 1 ) / DNBD3_BLOCK_SIZE / 8 );
+	// Free space in staging file; if this fails, it's just wasted disk space until we're done with the image
+	fallocate( stageFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start, (off_t)( end - start ) );
+}
+
+/**
+ * Create file to stage received blocks of given image in until they are
+ * verified. It's unlinked right away, so it's gone once we close it.
+ * @return fd of staging file, -1 on error
+ */
+static int openStagingFile(dnbd3_image_t *image)
+{
+	char *fn;
+	if ( asprintf( &fn, "%s.mcast", image->path ) == -1 )
+		return -1;
+	const int fd = open( fn, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+	if ( fd != -1 ) {
+		unlink( fn );
+	}
+	free( fn );
+	return fd;
+}
+
+/**
+ * Write received block to the staging file, if it's missing in the cache.
+ * Remember it in received; see verifyHashBlock(). As the carousel repeats,
+ * we get to check again if the rest of the hash block was filled by the
+ * uplink meanwhile.
+ */
+static void storeBlock(dnbd3_image_t *image, int fd, int stageFd, uint8_t *received, uint64_t offset, const uint8_t *data)
+{
+	if ( offset >= image->virtualFilesize || offset % DNBD3_BLOCK_SIZE != 0 )
+		return;
+	dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+	if ( cache == NULL )
+		return; // Complete
+	if ( !RECEIVED( received, offset ) ) {
+		if ( image_isRangeCachedUnsafe( cache, offset, offset + DNBD3_BLOCK_SIZE ) )
+			goto out;
+		if ( pwrite( stageFd, data, DNBD3_BLOCK_SIZE, (off_t)offset ) != DNBD3_BLOCK_SIZE ) {
+			logadd( LOG_DEBUG1, "Cannot stage multicast block of %s:%d (errno=%d)", PIMG(image), errno );
+			goto out;
+		}
+		received[offset / DNBD3_BLOCK_SIZE / 8] |= (uint8_t)( 1 << ( offset / DNBD3_BLOCK_SIZE % 8 ) );
+	}
+	const int hashBlock = (int)( offset / HASH_BLOCK_SIZE );
+	if ( isHashBlockFilled( image, cache, received, hashBlock ) ) {
+		verifyHashBlock( image, fd, stageFd, received, hashBlock );
+	}
+out:
+	ref_put( &cache->reference );
+}
+
+static void* recvThread(void *data UNUSED)
+{
+	setThreadName( "mcast-recv" );
+	const int sock = dnbd3_mcast_listen( &recvAddr, recvIface, 1000 );
+	if ( sock == -1 ) {
+		logadd( LOG_ERROR, "Cannot join multicast group %s (errno=%d)", _multicastUpstream, errno );
+		return NULL;
+	}
+	logadd( LOG_INFO, "Receiving from multicast group %s", _multicastUpstream );
+	uint8_t *packet = malloc( DNBD3_MCAST_MAX_PACKET );
+	dnbd3_mcast_fec_t *fec = calloc( 1, sizeof(*fec) );
+	const dnbd3_mcast_header_t *h = (const dnbd3_mcast_header_t*)packet;
+	const uint8_t *payload = packet + sizeof(*h);
+	dnbd3_image_t *image = NULL;
+	uint8_t *received = NULL; // Bitmap of blocks of image staged, but not verified yet
+	uint32_t imageId = 0;
+	int fd = -1, stageFd = -1;
+	ticks lastPacket;
+	timing_get( &lastPacket );
+	while ( !_shutdown ) {
+		const ssize_t ret = recv( sock, packet, DNBD3_MCAST_MAX_PACKET, 0 );
+		declare_now;
+		if ( image != NULL && timing_diff( &lastPacket, &now ) > 3 * SERVER_MULTICAST_PICK_INTERVAL ) {
+			// Sender went quiet or switched to an image we don't have
+			image = image_release( image );
+		}
+		if ( ret == -1 || dnbd3_mcast_check( packet, ret ) == -1 )
+			continue;
+		receivedBytes += ret;
+		if ( h->type == DNBD3_MCAST_ANNOUNCE ) {
+			if ( image != NULL && h->imageId == imageId && h->rid == image->rid ) {
+				lastPacket = now;
+				continue;
+			}
+			image = image_release( image );
+			if ( fd != -1 ) {
+				close( fd );
+				fd = -1;
+			}
+			if ( stageFd != -1 ) {
+				close( stageFd );
+				stageFd = -1;
+			}
+			free( received );
+			received = NULL;
+			fec->active = false;
+			const char *name = (const char*)payload;
+			if ( dnbd3_mcast_imageId( name ) != h->imageId )
+				continue;
+			image = image_get( name, h->rid, false );
+			if ( image == NULL )
+				continue;
+			// Without CRC-32 list, we couldn't verify what we receive
+			if ( image->virtualFilesize != h->imageSize || image->ref_cacheMap == NULL || image->crc32 == NULL
+					|| ( fd = open( image->path, O_WRONLY ) ) == -1 ) {
+				image = image_release( image );
+				continue;
+			}
+			if ( ( stageFd = openStagingFile( image ) ) == -1 ) {
+				logadd( LOG_WARNING, "Cannot create multicast staging file for %s:%d (errno=%d)", PIMG(image), errno );
+				close( fd );
+				fd = -1;
+				image = image_release( image );
+				continue;
+			}
+			received = calloc( 1, (size_t)IMGSIZE_TO_MAPBYTES( image->virtualFilesize ) );
+			imageId = h->imageId;
+			lastPacket = now;
+			logadd( LOG_DEBUG1, "Filling cache of %s:%d from multicast group", PIMG(image) );
+			continue;
+		}
+		if ( image == NULL || h->imageId != imageId || h->rid != image->rid )
+			continue;
+		lastPacket = now;
+		if ( h->type == DNBD3_MCAST_DATA ) {
+			storeBlock( image, fd, stageFd, received, h->offsets[h->index], payload );
+		}
+		const int recovered = dnbd3_mcast_fec_add( fec, h, payload );
+		if ( recovered != -1 ) {
+			recoveredBlocks++;
+			storeBlock( image, fd, stageFd, received, fec->header.offsets[recovered], fec->xor );
+		}
+		if ( image->ref_cacheMap == NULL ) {
+			// Complete now
+			image = image_release( image );
+		}
+	}
+	image_release( image );
+	if ( fd != -1 ) {
+		close( fd );
+	}
+	if ( stageFd != -1 ) {
+		close( stageFd );
+	}
+	free( received );
+	free( fec );
+	free( packet );
+	close( sock );
+	return NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef _MULTICAST_H_
+#define _MULTICAST_H_
+
+#include "globals.h"
+
+struct json_t;
+
+void multicast_init();
+
+void multicast_shutdown();
+
+struct json_t* multicast_toJson();
+
+#endif /* MULTICAST_H_ */
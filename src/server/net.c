@@ -25,6 +25,10 @@
 #include "rpc.h"
 #include "altservers.h"
 #include "reference.h"
+#include "bootprofile.h"
+#include "heatmap.h"
+#include "admission.h"
+#include "handoff.h"
 
 #include <dnbd3/shared/sockhelper.h>
 #include <dnbd3/shared/timing.h>
@@ -53,22 +57,50 @@ static pthread_mutex_t _clients_lock;
 static char nullbytes[500];
 
 static atomic_uint_fast64_t totalBytesSent = 0;
+static atomic_uint_fast64_t totalPrefetchHits = 0;
+static atomic_uint_fast64_t totalPrefetchWaste = 0;
+static atomic_bool handoffActive = false;
 
 // Adding and removing clients -- list management
 static bool addToList(dnbd3_client_t *client);
 static void removeFromList(dnbd3_client_t *client);
 static dnbd3_client_t* freeClientStruct(dnbd3_client_t *client);
+static bool waitForRelayed(dnbd3_client_t *client, int seconds);
 static void uplinkCallback(void *data, uint64_t handle, uint64_t start, uint32_t length, const char *buffer);
+static bool acquireRelaySlot(dnbd3_client_t *client);
+static void releaseRelaySlots(dnbd3_client_t *client, int count);
+static uint64_t trackStream(dnbd3_client_t *client, uint64_t start, uint32_t length, bool cached, uint64_t *aheadFrom);
+static void retireStream(dnbd3_client_t *client, dnbd3_client_stream_t *stream);
+static void sendLatestRid(dnbd3_client_t *client);
+static bool redirectClient(dnbd3_client_t *client, const char *reason);
+static void sendLoad(int sock, uint32_t size);
 
-static inline bool recv_request_header(int sock, dnbd3_request_t *request)
+/**
+ * Receive next request header of client. If a handoff to a new server
+ * process is in progress and nothing has been read yet, return false and
+ * set client->handoff instead.
+ */
+static inline bool recv_request_header(dnbd3_client_t *client, dnbd3_request_t *request)
 {
 	ssize_t ret, fails = 0;
 #ifdef DNBD3_SERVER_AFL
-	sock = 0;
+	const int sock = 0;
+#else
+	const int sock = client->sock;
 #endif
 	// Read request header from socket
-	while ( ( ret = recv( sock, request, sizeof(*request), MSG_WAITALL ) ) != sizeof(*request) ) {
-		if ( errno == EINTR && ++fails < 10 ) continue;
+	for ( ;; ) {
+		client->waiting = true;
+		if ( unlikely( handoffActive ) && !_shutdown ) {
+			client->waiting = false;
+			client->handoff = true;
+			return false;
+		}
+		ret = recv( sock, request, sizeof(*request), MSG_WAITALL );
+		client->waiting = false;
+		if ( ret == sizeof(*request) )
+			break;
+		if ( ret == -1 && errno == EINTR && ( handoffActive || ++fails < 10 ) ) continue;
 		if ( ret >= 0 || ++fails > SOCKET_TIMEOUT_CLIENT_RETRIES ) return false;
 		if ( errno == EAGAIN ) continue;
 		logadd( LOG_DEBUG2, "Error receiving request: Could not read message header (%d/%d, e=%d)\n", (int)ret, (int)sizeof(*request), errno );
@@ -81,7 +113,7 @@ static inline bool recv_request_header(int sock, dnbd3_request_t *request)
 		return false;
 	}
 	// Payload sanity check
-	if ( request->cmd != CMD_GET_BLOCK && request->size > MAX_PAYLOAD ) {
+	if ( request->cmd != CMD_GET_BLOCK && request->cmd != CMD_CANCEL && request->size > MAX_PAYLOAD ) {
 		logadd( LOG_WARNING, "Client tries to send a packet of type %d with %d bytes payload. Dropping client.", (int)request->cmd, (int)request->size );
 		return false;
 	}
@@ -159,7 +191,7 @@ void* net_handleNewConnection(void *clientPtr)
 
 	// Await data from client. Since this is a fresh connection, we expect data right away
 	sock_setTimeout( client->sock, _clientTimeout );
-	do {
+	if ( client->resumeVersion == 0 ) {
 #ifdef DNBD3_SERVER_AFL
 		const int ret = (int)recv( 0, &request, sizeof(request), MSG_WAITALL );
 #else
@@ -184,14 +216,31 @@ void* net_handleNewConnection(void *clientPtr)
 		}
 		// Magic OK, untangle byte order if required
 		fixup_request( request );
+		if ( request.cmd == CMD_GET_LOAD ) {
+			// Another server asking how busy we are, no handshake required,
+			// but only answer servers we know, so nobody else can probe our image list
+			if ( altservers_isKnownHost( &client->host ) ) {
+				sendLoad( client->sock, request.size );
+			} else {
+				char buffer[HOSTNAMELEN];
+				host_to_string( &client->host, buffer, HOSTNAMELEN );
+				logadd( LOG_DEBUG1, "Ignoring load query from %s, not an alt server", buffer );
+			}
+			goto fail_preadd;
+		}
 		if ( request.cmd != CMD_SELECT_IMAGE ) {
 			logadd( LOG_WARNING, "Client sent != CMD_SELECT_IMAGE in handshake (got cmd=%d, size=%d), dropping client.", (int)request.cmd, (int)request.size );
 			goto fail_preadd;
 		}
-	} while (0);
+	}
 	// Fully init client struct
 	mutex_init( &client->lock, LOCK_CLIENT );
 	mutex_init( &client->sendMutex, LOCK_CLIENT_SEND );
+	pthread_condattr_t condAttr;
+	pthread_condattr_init( &condAttr );
+	pthread_condattr_setclock( &condAttr, CLOCK_MONOTONIC );
+	pthread_cond_init( &client->relayedSignal, &condAttr );
+	pthread_condattr_destroy( &condAttr );
 
 	mutex_lock( &client->lock );
 	host_to_string( &client->host, client->hostName, HOSTNAMELEN );
@@ -199,6 +248,7 @@ void* net_handleNewConnection(void *clientPtr)
 	mutex_unlock( &client->lock );
 	client->bytesSent = 0;
 	client->relayedCount = 0;
+	client->prefetchDepth = SERVER_PREFETCH_MIN_DEPTH;
 
 	if ( !addToList( client ) ) {
 		freeClientStruct( client );
@@ -217,7 +267,7 @@ void* net_handleNewConnection(void *clientPtr)
 	bool hasName = false;
 
 	serialized_buffer_t payload;
-	uint16_t rid, client_version;
+	uint16_t rid, client_version = 0;
 
 	dnbd3_server_entry_t server_list[NUMBER_SERVERS];
 
@@ -226,8 +276,16 @@ void* net_handleNewConnection(void *clientPtr)
 	memset( &payload, 0, sizeof(payload) );
 	reply.magic = dnbd3_packet_magic;
 
-	// Receive first packet's payload
-	if ( recv_request_payload( client->sock, request.size, &payload ) ) {
+	if ( client->resumeVersion != 0 ) {
+		// Taken over from previous server process, handshake was done there
+		image = client->image;
+		client_version = client->resumeVersion;
+		mutex_lock( &image->lock );
+		image_file = image->readFd;
+		mutex_unlock( &image->lock );
+		bOk = image_file != -1;
+	} else if ( recv_request_payload( client->sock, request.size, &payload ) ) {
+		// Received first packet's payload
 		char *image_name;
 		client_version = serializer_get_uint16( &payload );
 		image_name = serializer_get_string( &payload );
@@ -244,7 +302,7 @@ void* net_handleNewConnection(void *clientPtr)
 			if ( !client->isServer || !_isProxy ) {
 				// Is a normal client, or we're not proxy
 				image = image_getOrLoad( image_name, rid );
-			} else if ( _backgroundReplication != BGR_FULL && ( flags & FLAGS8_BG_REP ) ) {
+			} else if ( !BGR_WHOLE_IMAGE( _backgroundReplication ) && ( flags & FLAGS8_BG_REP ) ) {
 				// We're a proxy, client is another proxy, we don't do BGR, but connecting proxy does...
 				// Reject, as this would basically force this proxy to do BGR too.
 				image = image_get( image_name, rid, true );
@@ -268,22 +326,9 @@ void* net_handleNewConnection(void *clientPtr)
 				logadd( LOG_DEBUG1, "Client %s requested non-working image '%s' (rid:%d), rejected\n",
 						client->hostName, image_name, (int)rid );
 			} else {
-				// Image is fine so far, but occasionally drop a client if the uplink for the image is clogged or unavailable
-				bOk = true;
-				if ( image->ref_cacheMap != NULL ) {
-					if ( image->problem.queue || image->problem.write ) {
-						bOk = ( rand() % 4 ) == 1;
-					}
-					if ( bOk ) {
-						if ( image->problem.write ) { // Wait 100ms if local caching is not working so this
-							usleep( 100000 ); // server gets a penalty and is less likely to be selected
-						}
-						if ( image->problem.uplink ) {
-							// Penaltize depending on completeness, if no uplink is available
-							usleep( ( 100 - image->completenessEstimate ) * 100 );
-						}
-					}
-				}
+				// Image is fine so far, but turn client away if we're too busy and it has alternatives
+				const char *reason = admission_check( client, image );
+				bOk = reason == NULL || !redirectClient( client, reason );
 				if ( bOk ) {
 					mutex_lock( &image->lock );
 					image_file = image->readFd;
@@ -302,6 +347,15 @@ void* net_handleNewConnection(void *clientPtr)
 					reply.size = serializer_get_written_length( &payload );
 					if ( !send_reply( client->sock, &reply, &payload ) ) {
 						bOk = false;
+					} else if ( client_version >= 3 ) {
+						// Tell client right away if we already have a newer revision
+						dnbd3_image_t *latest = image_get( image->name, 0, false );
+						if ( latest != NULL ) {
+							if ( latest->rid > image->rid ) {
+								client->announceRid = (uint16_t)latest->rid;
+							}
+							image_release( latest );
+						}
 					}
 				}
 			}
@@ -315,9 +369,15 @@ void* net_handleNewConnection(void *clientPtr)
 		} else if ( !client->isServer && _clientPenalty != 0 ) {
 			usleep( _clientPenalty );
 		}
+		if ( client->resumeVersion == 0 ) {
+			bootprofile_clientStart( client );
+		}
 		// client handling mainloop
-		while ( recv_request_header( client->sock, &request ) ) {
+		while ( recv_request_header( client, &request ) ) {
 			if ( _shutdown ) break;
+			if ( unlikely( client->announceRid != 0 ) && client_version >= 3 ) {
+				sendLatestRid( client );
+			}
 			if ( likely ( request.cmd == CMD_GET_BLOCK ) ) {
 
 				const uint64_t offset = request.offset_small; // Copy to full uint64 to prevent repeated masking
@@ -339,6 +399,11 @@ void* net_handleNewConnection(void *clientPtr)
 					continue;
 				}
 
+				bootprofile_record( client, offset, request.size );
+				if ( !( request.hops & HOP_FLAGS ) ) {
+					heatmap_record( image, offset, request.size );
+				}
+
 				if ( cache == NULL ) {
 					cache = ref_get_cachemap( image );
 				}
@@ -347,26 +412,27 @@ void* net_handleNewConnection(void *clientPtr)
 					// This is a proxyed image, check if we need to relay the request...
 					const uint64_t start = offset & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1);
 					const uint64_t end = (offset + request.size + DNBD3_BLOCK_SIZE - 1) & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1);
-					if ( !image_isRangeCachedUnsafe( cache, start, end ) ) {
-						if ( unlikely( client->relayedCount > 250 ) ) {
-							logadd( LOG_DEBUG1, "Client is overloading uplink; throttling" );
-							for ( int i = 0; i < 100 && client->relayedCount > 200; ++i ) {
-								usleep( 10000 );
-							}
-							if ( client->relayedCount > 250 ) {
-								logadd( LOG_WARNING, "Could not lower client's uplink backlog; dropping client" );
-								goto exit_client_cleanup;
-							}
+					const bool cached = image_isRangeCachedUnsafe( cache, start, end );
+					uint64_t aheadFrom;
+					const uint64_t aheadTo = trackStream( client, offset, request.size, cached, &aheadFrom );
+					if ( !cached ) {
+						if ( !acquireRelaySlot( client ) ) {
+							logadd( LOG_WARNING, "Uplink didn't make progress on client's backlog; dropping client" );
+							goto exit_client_cleanup;
 						}
-						client->relayedCount++;
-						if ( !uplink_requestClient( client, &uplinkCallback, request.handle, offset, request.size, request.hops ) ) {
-							client->relayedCount--;
+						if ( !uplink_requestClient( client, &uplinkCallback, request.handle, offset, request.size, request.hops, aheadTo ) ) {
+							releaseRelaySlots( client, 1 );
 							logadd( LOG_DEBUG1, "Could not relay uncached request from %s to upstream proxy for image %s:%d",
 									client->hostName, image->name, image->rid );
 							goto exit_client_cleanup;
 						}
 						continue; // Reply arrives on uplink some time later, handle next request now
 					}
+					if ( aheadTo != 0 && !image_isRangeCachedUnsafe( cache, aheadFrom & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1), aheadTo ) ) {
+						// Served from cache, but stream is approaching missing data
+						uplink_prefetch( client, request.hops, aheadFrom, aheadTo );
+					}
+					uplink_recordCachedRead( image, start, end );
 				}
 
 				reply.cmd = CMD_GET_BLOCK;
@@ -409,6 +475,8 @@ void* net_handleNewConnection(void *clientPtr)
 							const int err = errno;
 #elif defined(__linux__)
 						const ssize_t sent = sendfile( client->sock, image_file, &foffset, realBytes - done );
+						if ( sent == -1 && errno == EINTR )
+							continue; // Nothing sent yet, signal might have been meant for handoff
 						if ( sent <= 0 ) {
 							const int err = errno;
 #elif defined(__FreeBSD__)
@@ -504,17 +572,49 @@ set_name: ;
 				mutex_unlock( &client->sendMutex );
 				break;
 
+			case CMD_CANCEL: {
+				// Cached requests have been answered already, only relayed ones can still be withdrawn.
+				// size is the length of the range to cancel, or 0 to cancel by handle
+				dnbd3_uplink_t *uplink = ref_get_uplink( &image->uplinkref );
+				if ( uplink != NULL ) {
+					releaseRelaySlots( client, uplink_cancel( uplink, client, &uplinkCallback,
+							request.handle, request.offset_small, request.size ) );
+					ref_put( &uplink->reference );
+				}
+				break;
+			}
+
+			case CMD_GET_HEAT: {
+				int count = 0;
+				uint32_t *heat = heatmap_get( image, &count );
+				reply.cmd = CMD_GET_HEAT;
+				reply.size = (uint32_t)( count * sizeof(uint32_t) );
+				mutex_lock( &client->sendMutex );
+				send_reply( client->sock, &reply, heat );
+				mutex_unlock( &client->sendMutex );
+				free( heat );
+				break;
+			}
+
 			default:
 				logadd( LOG_ERROR, "Unknown command from client %s: %d", client->hostName, (int)request.cmd );
 				break;
 
 			} // end switch
 		} // end loop
+		if ( client->handoff && waitForRelayed( client, SERVER_HANDOFF_RELAY_WAIT ) ) {
+			// Idle with no replies from uplink pending, let new server process continue
+			handoff_passClient( client, client_version );
+		}
 	} // end bOk
 exit_client_cleanup: ;
 	// First remove from list, then add to counter to prevent race condition
 	removeFromList( client );
 	totalBytesSent += client->bytesSent;
+	bootprofile_clientEnd( client );
+	for ( int i = 0; i < SERVER_CLIENT_STREAMS; ++i ) {
+		retireStream( client, &client->streams[i] );
+	}
 	// Access time, but only if client didn't just probe
 	if ( image != NULL && client->bytesSent > DNBD3_BLOCK_SIZE * 10 ) {
 		mutex_lock( &image->lock );
@@ -542,7 +642,7 @@ struct json_t* net_getListAsJson()
 	json_t *jsonClients = json_array();
 	json_t *clientStats;
 	int imgId, isServer;
-	uint64_t bytesSent;
+	uint64_t bytesSent, prefetchHits, prefetchWaste;
 	char host[HOSTNAMELEN];
 	host[HOSTNAMELEN-1] = '\0';
 
@@ -560,12 +660,16 @@ struct json_t* net_getListAsJson()
 		imgId = client->image->id;
 		isServer = (int)client->isServer;
 		bytesSent = client->bytesSent;
+		prefetchHits = client->prefetchHits;
+		prefetchWaste = client->prefetchWaste;
 		mutex_unlock( &client->lock );
-		clientStats = json_pack( "{sssisisI}",
+		clientStats = json_pack( "{sssisisIsIsI}",
 				"address", host,
 				"imageId", imgId,
 				"isServer", isServer,
-				"bytesSent", (json_int_t)bytesSent );
+				"bytesSent", (json_int_t)bytesSent,
+				"prefetchHits", (json_int_t)prefetchHits,
+				"prefetchWaste", (json_int_t)prefetchWaste );
 		json_array_append_new( jsonClients, clientStats );
 		mutex_lock( &_clients_lock );
 	}
@@ -610,6 +714,42 @@ void net_getStats(int *clientCount, int *serverCount, uint64_t *bytesSent)
 	}
 }
 
+void net_getPrefetchStats(uint64_t *hits, uint64_t *waste)
+{
+	*hits = totalPrefetchHits;
+	*waste = totalPrefetchWaste;
+}
+
+/**
+ * A new revision of an image was loaded. Flag every client using an
+ * older revision of it, so it gets told about the new rid along with
+ * its next request. Proxies will start replicating the new revision
+ * right away, the kernel module marks the device as outdated.
+ * We don't write to the clients' sockets here, as replies to cached
+ * blocks are sent without holding sendMutex.
+ * Locks on: _clients_lock
+ */
+void net_announceRevision(dnbd3_image_t *image)
+{
+	int count = 0;
+	mutex_lock( &_clients_lock );
+	for ( int i = 0; i < _num_clients; ++i ) {
+		dnbd3_client_t * const client = _clients[i];
+		if ( client == NULL )
+			continue;
+		// Client holds a reference to its image while it's in the list
+		const dnbd3_image_t * const current = client->image;
+		if ( current == NULL || current->rid >= image->rid || strcmp( current->name, image->name ) != 0 )
+			continue;
+		client->announceRid = (uint16_t)image->rid;
+		count++;
+	}
+	mutex_unlock( &_clients_lock );
+	if ( count != 0 ) {
+		logadd( LOG_DEBUG1, "Announcing %s:%d to %d client(s)", image->name, (int)image->rid, count );
+	}
+}
+
 void net_disconnectAll()
 {
 	int i;
@@ -623,6 +763,29 @@ void net_disconnectAll()
 	mutex_unlock( &_clients_lock );
 }
 
+/**
+ * Start or stop handing over clients to a new server process. While active,
+ * clients waiting for their next request get interrupted, and pass their
+ * connection to handoff_passClient().
+ * @return number of clients still connected
+ */
+int net_handoff(bool active)
+{
+	int count = 0;
+	handoffActive = active;
+	mutex_lock( &_clients_lock );
+	for ( int i = 0; i < _num_clients; ++i ) {
+		if ( _clients[i] == NULL )
+			continue;
+		count++;
+		if ( active && _clients[i]->waiting ) {
+			pthread_kill( _clients[i]->thread, SIGINT );
+		}
+	}
+	mutex_unlock( &_clients_lock );
+	return count;
+}
+
 void net_waitForAllDisconnected()
 {
 	int retries = 10, count, i;
@@ -673,6 +836,26 @@ static void removeFromList(dnbd3_client_t *client)
 	mutex_unlock( &_clients_lock );
 }
 
+/**
+ * Wait until no more replies from uplink are pending for client.
+ * @return true if none are pending anymore, false on timeout
+ */
+static bool waitForRelayed(dnbd3_client_t *client, int seconds)
+{
+	struct timespec deadline;
+	clock_gettime( CLOCK_MONOTONIC, &deadline );
+	deadline.tv_sec += seconds;
+	mutex_lock( &client->sendMutex );
+	if ( client->relayedCount != 0 ) {
+		logadd( LOG_DEBUG1, "Waiting for client with relayedCount == %d..", client->relayedCount );
+		while ( client->relayedCount != 0
+				&& mutex_cond_timedwait( &client->relayedSignal, &client->sendMutex, &deadline ) != ETIMEDOUT ) { }
+	}
+	const bool done = client->relayedCount == 0;
+	mutex_unlock( &client->sendMutex );
+	return done;
+}
+
 /**
  * Free the client struct recursively.
  * !! Make sure to call this function after removing the client from _dnbd3_clients !!
@@ -685,20 +868,12 @@ static dnbd3_client_t* freeClientStruct(dnbd3_client_t *client)
 	if ( client->image != NULL ) {
 		dnbd3_uplink_t *uplink = ref_get_uplink( &client->image->uplinkref );
 		if ( uplink != NULL ) {
-			if ( client->relayedCount != 0 ) {
-				uplink_removeEntry( uplink, client, &uplinkCallback );
-			}
+			uplink_removeEntry( uplink, client, &uplinkCallback );
 			ref_put( &uplink->reference );
 		}
-		if ( client->relayedCount != 0 ) {
-			logadd( LOG_DEBUG1, "Client has relayedCount == %"PRIu8" on disconnect..", client->relayedCount );
-			int i;
-			for ( i = 0; i < 1000 && client->relayedCount != 0; ++i ) {
-				usleep( 10000 );
-			}
-			if ( client->relayedCount != 0 ) {
-				logadd( LOG_WARNING, "Client relayedCount still %"PRIu8" after sleeping!", client->relayedCount );
-			}
+		// Callbacks might still be running, wait for them to finish
+		if ( !waitForRelayed( client, 10 ) ) {
+			logadd( LOG_WARNING, "Client relayedCount still %d after waiting!", client->relayedCount );
 		}
 	}
 	mutex_lock( &client->sendMutex );
@@ -711,6 +886,7 @@ static dnbd3_client_t* freeClientStruct(dnbd3_client_t *client)
 	client->image = image_release( client->image );
 	mutex_destroy( &client->lock );
 	mutex_destroy( &client->sendMutex );
+	pthread_cond_destroy( &client->relayedSignal );
 	free( client );
 	return NULL ;
 }
@@ -756,6 +932,247 @@ static void uplinkCallback(void *data, uint64_t handle, uint64_t start UNUSED, u
 		shutdown( client->sock, SHUT_RDWR );
 	}
 	client->relayedCount--;
+	pthread_cond_signal( &client->relayedSignal );
+	mutex_unlock( &client->sendMutex );
+}
+
+/**
+ * Take one of the client's SERVER_MAX_RELAYED slots for requests waiting
+ * for the uplink. If there is none, stop reading further requests until
+ * a reply from the uplink frees one. Since the client's requests then pile
+ * up in the socket, TCP flow control slows the client down, instead of us
+ * having to drop it. Gives up after the client timeout, when the uplink
+ * obviously doesn't make any progress.
+ * Only called from the client's thread.
+ */
+static bool acquireRelaySlot(dnbd3_client_t *client)
+{
+	mutex_lock( &client->sendMutex );
+	if ( unlikely( client->relayedCount >= SERVER_MAX_RELAYED ) ) {
+		logadd( LOG_DEBUG2, "Client %s is overloading uplink; throttling", client->hostName );
+		const unsigned int ms = _clientTimeout;
+		struct timespec deadline;
+		clock_gettime( CLOCK_MONOTONIC, &deadline );
+		deadline.tv_sec += ms / 1000;
+		deadline.tv_nsec += (long)( ms % 1000 ) * 1000000;
+		if ( deadline.tv_nsec >= 1000000000 ) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while ( client->relayedCount >= SERVER_MAX_RELAYED && !_shutdown
+				&& mutex_cond_timedwait( &client->relayedSignal, &client->sendMutex, &deadline ) != ETIMEDOUT ) { }
+	}
+	const bool ok = client->relayedCount < SERVER_MAX_RELAYED;
+	if ( ok ) {
+		client->relayedCount++;
+	}
+	mutex_unlock( &client->sendMutex );
+	return ok;
+}
+
+/**
+ * Give back slots of requests that will never be answered through
+ * uplinkCallback.
+ */
+static void releaseRelaySlots(dnbd3_client_t *client, int count)
+{
+	if ( count == 0 )
+		return;
+	mutex_lock( &client->sendMutex );
+	client->relayedCount -= count;
+	pthread_cond_signal( &client->relayedSignal );
+	mutex_unlock( &client->sendMutex );
+}
+
+
+/**
+ * Find the sequential stream the given request belongs to, or replace the least
+ * recently used one if none. The stream's prefetch depth doubles whenever the
+ * client requests prefetched data that didn't arrive in time.
+ * Only called from the client's thread.
+ * @param cached whether the requested range is in the local cache already
+ * @param aheadFrom set to where the returned prefetch range starts
+ * @return end of range to prefetch, 0 if nothing should be prefetched
+ */
+static uint64_t trackStream(dnbd3_client_t *client, uint64_t start, uint32_t length, bool cached, uint64_t *aheadFrom)
+{
+	const uint64_t end = start + length;
+	dnbd3_client_stream_t *stream = NULL, *oldest = &client->streams[0];
+	if ( ++client->streamClock == 0 ) {
+		client->streamClock = 1;
+	}
+	for ( int i = 0; i < SERVER_CLIENT_STREAMS; ++i ) {
+		dnbd3_client_stream_t * const s = &client->streams[i];
+		if ( s->lastUse != 0 && start + SERVER_STREAM_SLACK >= s->next && start <= s->next + SERVER_STREAM_SLACK ) {
+			stream = s;
+			break;
+		}
+		if ( s->lastUse < oldest->lastUse ) {
+			oldest = s;
+		}
+	}
+	if ( stream == NULL ) {
+		// New stream; don't prefetch anything until we see it is actually sequential
+		retireStream( client, oldest );
+		oldest->next = oldest->ahead = end;
+		oldest->depth = 0;
+		oldest->lastUse = client->streamClock;
+		return 0;
+	}
+	stream->lastUse = client->streamClock;
+	const uint64_t hitFrom = MAX( start, stream->next );
+	const uint64_t hitTo = MIN( end, stream->ahead );
+	if ( hitTo > hitFrom ) {
+		client->prefetchHits += hitTo - hitFrom;
+		totalPrefetchHits += hitTo - hitFrom;
+		if ( !cached ) {
+			// Client caught up with prefetch, go deeper
+			stream->depth *= 2;
+		}
+	}
+	if ( end > stream->next ) {
+		stream->next = end;
+	}
+	if ( stream->depth == 0 ) {
+		// Second request of stream, confirms it's sequential
+		stream->depth = client->prefetchDepth;
+	}
+	stream->depth = MIN( stream->depth, (uint32_t)_maxPrefetch );
+	if ( stream->depth == 0 || stream->ahead >= stream->next + stream->depth / 2 )
+		return 0; // Enough in flight already
+	*aheadFrom = MAX( stream->ahead, stream->next );
+	const uint64_t aheadTo = MIN( stream->next + stream->depth, client->image->virtualFilesize );
+	if ( aheadTo <= *aheadFrom )
+		return 0;
+	stream->ahead = aheadTo;
+	return aheadTo;
+}
+
+/**
+ * Stream is not used anymore. Account for data that was prefetched but never
+ * requested, and adjust the depth the client's new streams start with.
+ * Only called from the client's thread.
+ */
+static void retireStream(dnbd3_client_t *client, dnbd3_client_stream_t *stream)
+{
+	if ( stream->lastUse == 0 )
+		return;
+	if ( stream->ahead > stream->next ) {
+		client->prefetchWaste += stream->ahead - stream->next;
+		totalPrefetchWaste += stream->ahead - stream->next;
+		client->prefetchDepth = MAX( client->prefetchDepth / 2, SERVER_PREFETCH_MIN_DEPTH );
+	} else if ( stream->depth > client->prefetchDepth ) {
+		client->prefetchDepth = stream->depth;
+	}
+	stream->lastUse = 0;
+}
+
+/**
+ * Send pending revision announcement to client. This is an unsolicited
+ * reply with handle 0, carrying the new rid in network byte order.
+ * Locks on: client.sendMutex
+ */
+static void sendLatestRid(dnbd3_client_t *client)
+{
+	dnbd3_reply_t reply = {
+		.magic = dnbd3_packet_magic,
+		.cmd = CMD_LATEST_RID,
+		.size = sizeof(uint16_t),
+		.handle = 0,
+	};
+	uint16_t rid = (uint16_t)atomic_exchange( &client->announceRid, 0 );
+	if ( rid == 0 )
+		return;
+	rid = net_order_16( rid );
+	mutex_lock( &client->sendMutex );
+	send_reply( client->sock, &reply, &rid );
 	mutex_unlock( &client->sendMutex );
 }
 
+/**
+ * Turn client away during handshake because we're too busy, pointing it
+ * to alt servers instead: It gets a CMD_GET_SERVERS reply instead of the
+ * reply to CMD_SELECT_IMAGE. Clients not aware of this just see a failed
+ * handshake and move on to the next server, as they did before.
+ * @return false if there are no alt servers to point the client to, in
+ *         which case it should be served anyways
+ */
+static bool redirectClient(dnbd3_client_t *client, const char *reason)
+{
+	dnbd3_server_entry_t servers[NUMBER_SERVERS];
+	const int num = altservers_getListForClient( client, servers, NUMBER_SERVERS );
+	if ( num <= 0 )
+		return false;
+	dnbd3_reply_t reply = {
+		.magic = dnbd3_packet_magic,
+		.cmd = CMD_GET_SERVERS,
+		.size = (uint32_t)( num * sizeof(dnbd3_server_entry_t) ),
+		.handle = 0,
+	};
+	send_reply( client->sock, &reply, servers );
+	logadd( LOG_DEBUG1, "Redirecting client %s for %s:%d: %s", client->hostName, PIMG(client->image), reason );
+	return true;
+}
+
+/**
+ * Answer a load query from another server, see altservers_gossip.
+ * Only call for hosts in our alt server list.
+ * Request payload: protocol version, number of images, then name and rid of each.
+ * Reply payload: protocol version, clients, bytes per second, cache write latency
+ * in µs, busy flag, number of images, then the completeness of each image in
+ * percent, 255 if we don't have it.
+ */
+static void sendLoad(int sock, uint32_t size)
+{
+	serialized_buffer_t payload;
+	uint8_t complete[SERVER_LOAD_MAX_IMAGES];
+	uint16_t count = 0;
+	uint64_t clients, bandwidth;
+	uint32_t diskLatency;
+	bool busy;
+	if ( size > MAX_PAYLOAD ) // recv_request_header() isn't used for the first request
+		return;
+	if ( size != 0 ) {
+		if ( !recv_request_payload( sock, size, &payload ) )
+			return;
+		serializer_get_uint16( &payload ); // Protocol version of asking server
+		count = serializer_get_uint16( &payload );
+		if ( count > SERVER_LOAD_MAX_IMAGES ) {
+			count = SERVER_LOAD_MAX_IMAGES;
+		}
+		for ( uint16_t i = 0; i < count; ++i ) {
+			char *name = serializer_get_string( &payload );
+			const uint16_t rid = serializer_get_uint16( &payload );
+			dnbd3_image_t *image = NULL;
+			if ( name != NULL && rid != 0 ) {
+				image = image_get( name, rid, false );
+			}
+			if ( image == NULL ) {
+				complete[i] = 255;
+			} else {
+				mutex_lock( &image->lock );
+				complete[i] = (uint8_t)image_getCompletenessEstimate( image );
+				mutex_unlock( &image->lock );
+				image_release( image );
+			}
+		}
+	}
+	admission_getLoad( &clients, &bandwidth, &diskLatency, &busy );
+	serializer_reset_write( &payload );
+	serializer_put_uint16( &payload, PROTOCOL_VERSION );
+	serializer_put_uint64( &payload, clients );
+	serializer_put_uint64( &payload, bandwidth );
+	serializer_put_uint64( &payload, diskLatency );
+	serializer_put_uint8( &payload, busy ? 1 : 0 );
+	serializer_put_uint16( &payload, count );
+	for ( uint16_t i = 0; i < count; ++i ) {
+		serializer_put_uint8( &payload, complete[i] );
+	}
+	dnbd3_reply_t reply = {
+		.magic = dnbd3_packet_magic,
+		.cmd = CMD_GET_LOAD,
+		.size = serializer_get_written_length( &payload ),
+		.handle = 0,
+	};
+	send_reply( sock, &reply, &payload );
+}
@@ -33,8 +33,14 @@ struct json_t* net_getListAsJson();
 
 void net_getStats(int *clientCount, int *serverCount, uint64_t *bytesSent);
 
+void net_getPrefetchStats(uint64_t *hits, uint64_t *waste);
+
+void net_announceRevision(dnbd3_image_t *image);
+
 void net_disconnectAll();
 
+int net_handoff(bool active);
+
 void net_waitForAllDisconnected();
 
 #endif /* NET_H_ */
@@ -61,4 +61,9 @@ static inline void ref_put( ref *ref )
 	ref == NULL ? NULL : container_of(ref, dnbd3_cache_map_t, reference); \
 })
 
+#define ref_get_bootprofile(image) __extension__({ \
+	ref* ref = ref_get( &(image)->ref_bootProfile ); \
+	ref == NULL ? NULL : container_of(ref, dnbd3_boot_profile_t, reference); \
+})
+
 #endif
@@ -5,6 +5,10 @@
 #include "locks.h"
 #include "image.h"
 #include "altservers.h"
+#include "bgr.h"
+#include "warmup.h"
+#include "admission.h"
+#include "multicast.h"
 #include <dnbd3/shared/sockhelper.h>
 #include <dnbd3/version.h>
 #include <dnbd3/build.h>
@@ -30,6 +34,7 @@
 #define ACL_CONFIG              8
 #define ACL_LOG                16
 #define ACL_ALTSERVERS         32
+#define ACL_WARMUP             64
 
 #define HTTP_CLOSE 4
 #define HTTP_KEEPALIVE 9
@@ -47,6 +52,7 @@ DEFSTR(STR_CONNECTION, "connection")
 DEFSTR(STR_CLOSE, "close")
 DEFSTR(STR_QUERY, "/query")
 DEFSTR(STR_CACHEMAP, "/cachemap")
+DEFSTR(STR_WARMUP, "/warmup")
 DEFSTR(STR_Q, "q")
 DEFSTR(STR_ID, "id")
 
@@ -87,6 +93,7 @@ static struct {
 
 static bool handleStatus(int sock, int permissions, struct field *fields, size_t fields_num, int keepAlive);
 static bool handleCacheMap(int sock, int permissions, struct field *fields, size_t fields_num, int keepAlive);
+static bool handleWarmup(int sock, int permissions, struct field *fields, size_t fields_num, int keepAlive);
 static bool sendReply(int sock, const char *status, const char *ctype, const char *payload, ssize_t plen, int keepAlive);
 static void parsePath(struct string *path, struct string *file, struct field *getv, size_t *getc);
 static bool hasHeaderValue(struct phr_header *headers, size_t numHeaders, struct string *name, struct string *value);
@@ -212,11 +219,11 @@ void rpc_sendStatsJson(int sock, dnbd3_host_t* host, const void* data, const int
 			struct field getv[10];
 			size_t getc = 10;
 			parsePath( &path, &file, getv, &getc );
-			if ( method.s && method.s[0] == 'P' ) {
+			if ( method.s && method.s[0] == 'P' && equals( &file, &STR_WARMUP ) ) {
 				// POST only methods
-			}
-			// Don't care if GET or POST
-			if ( equals( &file, &STR_QUERY ) ) {
+				ok = handleWarmup( sock, permissions, getv, getc, keepAlive );
+			} else if ( equals( &file, &STR_QUERY ) ) {
+				// Don't care if GET or POST
 				ok = handleStatus( sock, permissions, getv, getc, keepAlive );
 			} else if ( equals( &file, &STR_CACHEMAP ) ) {
 				ok = handleCacheMap( sock, permissions, getv, getc, keepAlive );
@@ -261,7 +268,7 @@ static bool handleStatus(int sock, int permissions, struct field *fields, size_t
 {
 	bool ok;
 	bool stats = false, images = false, clients = false, space = false;
-	bool logfile = false, config = false, altservers = false, version = false;
+	bool logfile = false, config = false, altservers = false, version = false, bgr = false, warmup = false;
 #define SETVAR(var) if ( !var && STRCMP(fields[i].value, #var) ) var = true
 	for (size_t i = 0; i < fields_num; ++i) {
 		if ( !equals( &fields[i].name, &STR_Q ) ) continue;
@@ -273,9 +280,11 @@ static bool handleStatus(int sock, int permissions, struct field *fields, size_t
 		else SETVAR(config);
 		else SETVAR(altservers);
 		else SETVAR(version);
+		else SETVAR(bgr);
+		else SETVAR(warmup);
 	}
 #undef SETVAR
-	if ( ( stats || space || version ) && !(permissions & ACL_STATS) ) {
+	if ( ( stats || space || version || bgr || warmup ) && !(permissions & ACL_STATS) ) {
 		return sendReply( sock, "403 Forbidden", "text/plain", "No permission to access statistics", -1, keepAlive );
 	}
 	if ( images && !(permissions & ACL_IMAGE_LIST) ) {
@@ -297,16 +306,21 @@ static bool handleStatus(int sock, int permissions, struct field *fields, size_t
 	json_t *statisticsJson;
 	if ( stats ) {
 		int clientCount, serverCount;
-		uint64_t bytesSent;
+		uint64_t bytesSent, prefetchHits, prefetchWaste;
 		const uint64_t bytesReceived = uplink_getTotalBytesReceived();
 		net_getStats( &clientCount, &serverCount, &bytesSent );
-		statisticsJson = json_pack( "{sIsIsisisIsI}",
+		net_getPrefetchStats( &prefetchHits, &prefetchWaste );
+		statisticsJson = json_pack( "{sIsIsisisIsIsIsI}",
 				"bytesReceived", (json_int_t) bytesReceived,
 				"bytesSent", (json_int_t) bytesSent,
 				"clientCount", clientCount,
 				"serverCount", serverCount,
 				"uptime", (json_int_t) dnbd3_serverUptime(),
-				"runId", randomRunId );
+				"runId", randomRunId,
+				"prefetchHits", (json_int_t) prefetchHits,
+				"prefetchWaste", (json_int_t) prefetchWaste );
+		json_object_set_new( statisticsJson, "admission", admission_toJson() );
+		json_object_set_new( statisticsJson, "multicast", multicast_toJson() );
 	} else {
 		statisticsJson = json_pack( "{sI}",
 				"runId", randomRunId );
@@ -347,6 +361,12 @@ static bool handleStatus(int sock, int permissions, struct field *fields, size_t
 	if ( altservers ) {
 		json_object_set_new( statisticsJson, "altservers", altservers_toJson() );
 	}
+	if ( bgr ) {
+		json_object_set_new( statisticsJson, "bgr", bgr_toJson() );
+	}
+	if ( warmup ) {
+		json_object_set_new( statisticsJson, "warmup", warmup_toJson() );
+	}
 
 	char *jsonString = json_dumps( statisticsJson, 0 );
 	json_decref( statisticsJson );
@@ -395,6 +415,37 @@ static bool handleCacheMap(int sock, int permissions, struct field *fields, size
 	return ok;
 }
 
+/**
+ * Add warm-up job. Parameters are the same as in the warmup config file,
+ * plus "image" for the image name. See warmup_add().
+ */
+static bool handleWarmup(int sock, int permissions, struct field *fields, size_t fields_num, int keepAlive)
+{
+	if ( !(permissions & ACL_WARMUP) ) {
+		return sendReply( sock, "403 Forbidden", "text/plain", "No permission to add warm-up jobs", -1, keepAlive );
+	}
+	static const char * const keys[] = { "image", "rid", "what", "blocks", "by", "rate" };
+	char values[6][200];
+	const char *args[6] = { NULL };
+	for ( size_t i = 0; i < fields_num; ++i ) {
+		for ( int k = 0; k < 6; ++k ) {
+			if ( fields[i].name.l != strlen( keys[k] ) || strncmp( fields[i].name.s, keys[k], fields[i].name.l ) != 0 )
+				continue;
+			const size_t len = MIN( fields[i].value.l, sizeof(values[k]) - 1 );
+			memcpy( values[k], fields[i].value.s, len );
+			values[k][len] = '\0';
+			args[k] = values[k];
+		}
+	}
+	const char *error = NULL;
+	const int id = warmup_add( args[0], args[1], args[2], args[3], args[4], args[5], &error );
+	if ( id == -1 )
+		return sendReply( sock, "400 Bad Request", "text/plain", error, -1, keepAlive );
+	char buffer[50];
+	const int len = snprintf( buffer, sizeof(buffer), "{\"id\":%d}", id );
+	return sendReply( sock, "200 OK", "application/json", buffer, len, keepAlive );
+}
+
 static bool sendReply(int sock, const char *status, const char *ctype, const char *payload, ssize_t plen, int keepAlive)
 {
 	if ( plen == -1 ) plen = strlen( payload );
@@ -484,6 +535,7 @@ static void addacl(int argc, char **argv, void *data UNUSED)
 		SETBIT(STATS);
 		SETBIT(CLIENT_LIST);
 		SETBIT(IMAGE_LIST);
+		SETBIT(WARMUP);
 		else logadd( LOG_WARNING, "Invalid ACL flag '%s' for %s", argv[i], argv[0] );
 	}
 	if ( mask == 0 ) {
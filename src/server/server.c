@@ -26,6 +26,13 @@
 #include "uplink.h"
 #include "net.h"
 #include "altservers.h"
+#include "bgr.h"
+#include "bootprofile.h"
+#include "heatmap.h"
+#include "warmup.h"
+#include "admission.h"
+#include "multicast.h"
+#include "handoff.h"
 #include "integrity.h"
 #include "threadpool.h"
 #include "rpc.h"
@@ -48,6 +55,7 @@
 #define LONGOPT_REVISION   1003
 #define LONGOPT_SIZE       1004
 #define LONGOPT_ERRORMSG   1005
+#define LONGOPT_HANDOFF    1006
 
 typedef struct _job job_t;
 
@@ -87,8 +95,6 @@ void printSignal();
 
 static poll_list_t* setupNetwork(char *bindAddress);
 
-static dnbd3_client_t* dnbd3_prepareClient(struct sockaddr_storage *client, int fd);
-
 static void dnbd3_handleSignal(int signum);
 
 static void dnbd3_handleSignal2(int signum, siginfo_t *info, void *data);
@@ -118,6 +124,7 @@ void dnbd3_printHelp(char *argv_0)
 	printf( "-b or --bind        Local Address to bind to\n" );
 	printf( "-h or --help        Show this help text and quit\n" );
 	printf( "-v or --version     Show version and quit\n" );
+	printf( "--handoff           Take over listening sockets and clients from running server, see handoffSocket\n" );
 	printf( "\nManagement functions:\n" );
 	printf( "--crc [image-file]  Generate crc block list for given image\n" );
 	printf( "--create [image-name] --revision [rid] --size [filesize]\n"
@@ -154,6 +161,9 @@ _Noreturn static void dnbd3_cleanup()
 		thread_join( timerThread, NULL );
 	}
 
+	// Stop receiving clients from previous server process
+	handoff_shutdown();
+
 	if ( listeners != NULL ) {
 		sock_destroyPollList( listeners );
 	}
@@ -171,11 +181,17 @@ _Noreturn static void dnbd3_cleanup()
 	// Terminate integrity checker
 	integrity_shutdown();
 
+	// Stop multicast sender and receiver
+	multicast_shutdown();
+
 	// Wait for clients to disconnect
 	net_waitForAllDisconnected();
 
 	threadpool_waitEmpty();
 
+	// Merge boot traces of clients that just disconnected
+	bootprofile_shutdown();
+
 	// Clean up images
 	retries = 5;
 	while ( !image_tryFreeAll() && --retries > 0 ) {
@@ -200,6 +216,7 @@ int main(int argc, char *argv[])
 	char *bindAddress = NULL;
 	char *errorMsg = NULL;
 	char *mountDir = NULL;
+	bool takeOver = false;
 	int64_t paramSize = -1;
 	int paramRevision = -1;
 	static const char *optString = "b:c:m:d:hnv?";
@@ -217,6 +234,7 @@ int main(int argc, char *argv[])
 			{ "revision", required_argument, NULL, LONGOPT_REVISION },
 			{ "size", required_argument, NULL, LONGOPT_SIZE },
 			{ "errormsg", required_argument, NULL, LONGOPT_ERRORMSG },
+			{ "handoff", no_argument, NULL, LONGOPT_HANDOFF },
 			{ 0, 0, 0, 0 }
 	};
 
@@ -287,6 +305,9 @@ int main(int argc, char *argv[])
 		case LONGOPT_ERRORMSG:
 			errorMsg = strdup( optarg );
 			break;
+		case LONGOPT_HANDOFF:
+			takeOver = true;
+			break;
 		}
 		opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
 	}
@@ -308,6 +329,12 @@ int main(int argc, char *argv[])
 	image_serverStartup();
 	net_init();
 	uplink_globalsInit();
+	bgr_init();
+	bootprofile_init();
+	heatmap_init();
+	warmup_init();
+	admission_init();
+	multicast_init();
 	rpc_init();
 	if ( !image_loadAll( NULL ) || _shutdown ) {
 		fprintf( stderr, "Error loading images\n" );
@@ -366,6 +393,13 @@ int main(int argc, char *argv[])
 	integrity_init();
 	net_init();
 	uplink_globalsInit();
+	bgr_init();
+	bootprofile_init();
+	heatmap_init();
+	warmup_init();
+	admission_init();
+	multicast_init();
+	handoff_init();
 	rpc_init();
 	if ( mountDir != NULL && !dfuse_init( "-oallow_other", mountDir ) ) {
 		logadd( LOG_ERROR, "Cannot mount fuse directory to %s", mountDir );
@@ -410,7 +444,15 @@ int main(int argc, char *argv[])
 	usleep( 100000 );
 
 	// setup network
-	listeners = setupNetwork( bindAddress );
+	if ( takeOver ) {
+		listeners = handoff_connect();
+		if ( listeners == NULL ) {
+			exit( EXIT_FAILURE );
+		}
+	} else {
+		listeners = setupNetwork( bindAddress );
+	}
+	handoff_listen( listeners );
 
 	// Initialize thread pool
 	if ( !threadpool_init( 8 ) ) {
@@ -419,6 +461,10 @@ int main(int argc, char *argv[])
 		exit( EXIT_FAILURE );
 	}
 
+	if ( takeOver ) {
+		handoff_resume();
+	}
+
 	logadd( LOG_INFO, "Server is ready." );
 
 	if ( thread_create( &timerThread, NULL, &timerMainloop, NULL ) == 0 ) {
@@ -456,6 +502,13 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
+		if ( client.ss_family == AF_UNIX ) {
+			// New server process wants to take over
+			if ( handoff_run( fd, listeners ) )
+				break;
+			continue;
+		}
+
 		dnbd3_client_t *dnbd3_client = dnbd3_prepareClient( &client, fd );
 		if ( dnbd3_client == NULL ) {
 			close( fd );
@@ -511,7 +564,7 @@ static poll_list_t* setupNetwork(char *bindAddress)
  * connection is accepted. As this might be an HTTP request we don't initialize the
  * locks, that would happen later once we know.
  */
-static dnbd3_client_t* dnbd3_prepareClient(struct sockaddr_storage *client, int fd)
+dnbd3_client_t* dnbd3_prepareClient(struct sockaddr_storage *client, int fd)
 {
 	dnbd3_client_t *dnbd3_client = calloc( 1, sizeof(dnbd3_client_t) );
 	if ( dnbd3_client == NULL ) { // This will never happen thanks to memory overcommit
@@ -26,6 +26,8 @@
 
 uint32_t dnbd3_serverUptime();
 void server_addJob(void *(*startRoutine)(void *), void *arg, int delaySecs, int intervalSecs);
+struct sockaddr_storage;
+dnbd3_client_t* dnbd3_prepareClient(struct sockaddr_storage *client, int fd);
 
 #if !defined(_FILE_OFFSET_BITS) || _FILE_OFFSET_BITS != 64
 #error Please set _FILE_OFFSET_BITS to 64 in your makefile/configuration
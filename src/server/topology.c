@@ -0,0 +1,251 @@
+#include "topology.h"
+#include "helper.h"
+#include "ini.h"
+#include "fileutil.h"
+
+#include <stdlib.h>
+
+/*
+ * Network topology. The optional file <configDir>/topology maps networks
+ * to zones (sites, racks, ...) and assigns costs to traffic between zones.
+ * It is compiled into a list of networks sorted by prefix length, so the
+ * zone of an address is found by a binary search per distinct prefix
+ * length, longest first. altservers.c uses this to build per-zone tables
+ * of alt servers sorted by cost, for ordering the server list sent to
+ * clients and picking uplink servers.
+ * The file is only read once at startup, everything is read-only after
+ * that, so no locking is required.
+ */
+
+typedef struct
+{
+	uint8_t addr[16]; // Network address, host bits cleared
+	uint8_t type;     // HOST_IP4 or HOST_IP6
+	uint8_t bits;     // Prefix length
+	int16_t zone;
+} topo_net_t;
+
+typedef struct
+{
+	uint8_t type, bits;
+	int start, end;   // Range of nets with this prefix length
+} topo_group_t;
+
+static char *zoneNames[SERVER_TOPOLOGY_MAX_ZONES];
+static int numZones = 0;
+static uint16_t costs[SERVER_TOPOLOGY_MAX_ZONES][SERVER_TOPOLOGY_MAX_ZONES];
+static bool explicitCost[SERVER_TOPOLOGY_MAX_ZONES][SERVER_TOPOLOGY_MAX_ZONES]; // Only used while loading
+static topo_net_t nets[SERVER_TOPOLOGY_MAX_NETS];
+static int numNets = 0;
+static topo_group_t groups[33 + 129];
+static int numGroups = 0;
+static int localZone = -1;
+
+static inline int addrLen(uint8_t type)
+{
+	return type == HOST_IP4 ? 4 : 16;
+}
+
+static void maskAddr(uint8_t *dst, const uint8_t *src, uint8_t type, uint8_t bits)
+{
+	memset( dst, 0, 16 );
+	const int len = addrLen( type );
+	for ( int i = 0; i < len && bits > 0; ++i ) {
+		if ( bits >= 8 ) {
+			dst[i] = src[i];
+			bits -= 8;
+		} else {
+			dst[i] = (uint8_t)( src[i] & ( 0xff << ( 8 - bits ) ) );
+			bits = 0;
+		}
+	}
+}
+
+static int getOrAddZone(const char *name)
+{
+	for ( int i = 0; i < numZones; ++i ) {
+		if ( strcmp( zoneNames[i], name ) == 0 )
+			return i;
+	}
+	if ( numZones >= SERVER_TOPOLOGY_MAX_ZONES ) {
+		logadd( LOG_WARNING, "Too many zones in topology file, ignoring '%s'", name );
+		return -1;
+	}
+	zoneNames[numZones] = strdup( name );
+	return numZones++;
+}
+
+static void addNet(int zone, const char *value)
+{
+	dnbd3_host_t host;
+	if ( numNets >= SERVER_TOPOLOGY_MAX_NETS ) {
+		logadd( LOG_WARNING, "Too many networks in topology file, ignoring %s", value );
+		return;
+	}
+	char *tmp = strdup( value );
+	char *slash = strchr( tmp, '/' );
+	if ( slash != NULL ) {
+		*slash++ = '\0';
+	}
+	if ( !parse_address( tmp, &host ) ) {
+		logadd( LOG_WARNING, "Invalid network '%s' in topology file ignored", value );
+		free( tmp );
+		return;
+	}
+	const int max = addrLen( host.type ) * 8;
+	int bits = max;
+	if ( slash != NULL ) {
+		char *end;
+		bits = (int)strtol( slash, &end, 10 );
+		if ( end == slash || *end != '\0' || bits < 0 || bits > max ) {
+			logadd( LOG_WARNING, "Invalid prefix length in '%s' in topology file ignored", value );
+			free( tmp );
+			return;
+		}
+	}
+	free( tmp );
+	topo_net_t *net = &nets[numNets++];
+	net->type = host.type;
+	net->bits = (uint8_t)bits;
+	net->zone = (int16_t)zone;
+	maskAddr( net->addr, host.addr, host.type, net->bits );
+}
+
+static int topologyHandler(void *data UNUSED, const char *section, const char *key, const char *value)
+{
+	if ( section[0] == '\0' ) {
+		if ( strcmp( key, "zone" ) == 0 ) {
+			localZone = getOrAddZone( value );
+		} else {
+			logadd( LOG_WARNING, "Unknown key in topology file: '%s'", key );
+		}
+		return 1;
+	}
+	const int zone = getOrAddZone( section );
+	if ( zone == -1 )
+		return 1;
+	if ( strcmp( key, "net" ) == 0 ) {
+		addNet( zone, value );
+	} else if ( strncmp( key, "cost.", 5 ) == 0 ) {
+		const int other = getOrAddZone( key + 5 );
+		char *end;
+		const long cost = strtol( value, &end, 10 );
+		if ( other == -1 || other == zone )
+			return 1;
+		if ( end == value || cost < 0 || cost > SERVER_TOPOLOGY_MAX_COST ) {
+			logadd( LOG_WARNING, "Invalid cost '%s' from %s to %s in topology file", value, section, key + 5 );
+			return 1;
+		}
+		costs[zone][other] = (uint16_t)cost;
+		explicitCost[zone][other] = true;
+		// Same in the other direction, unless configured explicitly
+		if ( !explicitCost[other][zone] ) {
+			costs[other][zone] = (uint16_t)cost;
+		}
+	} else {
+		logadd( LOG_WARNING, "Unknown key in topology section %s: '%s'", section, key );
+	}
+	return 1;
+}
+
+/**
+ * Sort by address type, then longest prefix first, then address.
+ */
+static int netCompare(const void *a, const void *b)
+{
+	const topo_net_t *x = a, *y = b;
+	if ( x->type != y->type )
+		return (int)x->type - (int)y->type;
+	if ( x->bits != y->bits )
+		return (int)y->bits - (int)x->bits;
+	return memcmp( x->addr, y->addr, 16 );
+}
+
+/**
+ * Load topology file, if it exists. Only call once at startup.
+ * @return true if a topology was loaded
+ */
+bool topology_load()
+{
+	char *name;
+	if ( asprintf( &name, "%s/%s", _configDir, "topology" ) == -1 )
+		return false;
+	if ( !file_isReadable( name ) ) {
+		free( name );
+		return false;
+	}
+	for ( int i = 0; i < SERVER_TOPOLOGY_MAX_ZONES; ++i ) {
+		for ( int j = 0; j < SERVER_TOPOLOGY_MAX_ZONES; ++j ) {
+			costs[i][j] = i == j ? 0 : SERVER_TOPOLOGY_MAX_COST + 1;
+		}
+	}
+	ini_parse( name, &topologyHandler, NULL );
+	free( name );
+	qsort( nets, numNets, sizeof(nets[0]), &netCompare );
+	for ( int i = 0; i < numNets; ++i ) {
+		if ( numGroups == 0 || groups[numGroups - 1].type != nets[i].type || groups[numGroups - 1].bits != nets[i].bits ) {
+			groups[numGroups].type = nets[i].type;
+			groups[numGroups].bits = nets[i].bits;
+			groups[numGroups].start = i;
+			numGroups++;
+		}
+		groups[numGroups - 1].end = i + 1;
+	}
+	logadd( LOG_INFO, "Loaded topology with %d zones and %d networks, local zone: %s",
+			numZones, numNets, localZone == -1 ? "(unknown)" : zoneNames[localZone] );
+	return numZones != 0;
+}
+
+/**
+ * Get zone of given address, by longest prefix match.
+ * @return zone, -1 if the address is not in any configured network
+ */
+int topology_getZone(const dnbd3_host_t *host)
+{
+	topo_net_t key;
+	const int len = addrLen( host->type );
+	for ( int g = 0; g < numGroups; ++g ) {
+		if ( groups[g].type != host->type )
+			continue;
+		maskAddr( key.addr, host->addr, host->type, groups[g].bits );
+		int lo = groups[g].start, hi = groups[g].end;
+		while ( lo < hi ) {
+			const int mid = ( lo + hi ) / 2;
+			const int cmp = memcmp( nets[mid].addr, key.addr, len );
+			if ( cmp == 0 )
+				return nets[mid].zone;
+			if ( cmp < 0 ) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * Get cost of traffic between two zones. Unknown zones, and zones
+ * without a configured cost are more expensive than any configured cost.
+ */
+int topology_getCost(int from, int to)
+{
+	if ( from < 0 || to < 0 )
+		return SERVER_TOPOLOGY_MAX_COST + 1;
+	return costs[from][to];
+}
+
+/**
+ * Zone of this server, as configured in topology file, -1 if unknown.
+ */
+int topology_localZone()
+{
+	return localZone;
+}
+
+const char* topology_zoneName(int zone)
+{
+	if ( zone < 0 || zone >= numZones )
+		return NULL;
+	return zoneNames[zone];
+}
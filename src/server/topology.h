@@ -0,0 +1,16 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include "globals.h"
+
+bool topology_load();
+
+int topology_getZone(const dnbd3_host_t *host);
+
+int topology_getCost(int from, int to);
+
+int topology_localZone();
+
+const char* topology_zoneName(int zone);
+
+#endif /* TOPOLOGY_H_ */
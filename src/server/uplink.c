@@ -3,6 +3,7 @@
 #include "locks.h"
 #include "image.h"
 #include "altservers.h"
+#include "bgr.h"
 #include "net.h"
 #include <dnbd3/shared/sockhelper.h>
 #include <dnbd3/shared/protocol.h>
@@ -10,6 +11,8 @@
 #include <dnbd3/shared/crc32.h>
 #include "threadpool.h"
 #include "reference.h"
+#include "heatmap.h"
+#include "admission.h"
 
 #include <assert.h>
 #include <inttypes.h>
@@ -17,9 +20,23 @@
 #include <poll.h>
 #include <unistd.h>
 #include <stdatomic.h>
+#include <jansson.h>
 
-static const uint8_t HOP_FLAG_BGR = 0x80;
-static const uint8_t HOP_FLAG_PREFETCH = 0x40;
+// Connection number of the hedge connection, see getConnection()
+#define HEDGE_CON UPLINK_MAX_CONNECTIONS
+// Connection number of given sibling connection
+#define SIBLING_CON(i) ( HEDGE_CON + 1 + (i) )
+// Total number of connections an uplink can have
+#define NUM_CONNECTIONS SIBLING_CON(SERVER_MAX_SIBLINGS)
+
+/*
+ * Priority classes of requests, derived from the hop flags, so they
+ * are the same on every proxy of a chain. Lower is more important.
+ */
+#define PRIO_DEMAND (0)
+#define PRIO_PREFETCH (1)
+#define PRIO_BGR (2)
+#define PRIO_COUNT (3)
 #define FILE_BYTES_PER_MAP_BYTE ( DNBD3_BLOCK_SIZE * 8 )
 #define MAP_BYTES_PER_HASH_BLOCK (int)( HASH_BLOCK_SIZE / FILE_BYTES_PER_MAP_BYTE )
 #define MAP_INDEX_HASH_START_MASK ( ~(int)( MAP_BYTES_PER_HASH_BLOCK - 1 ) )
@@ -28,6 +45,7 @@ static atomic_uint_fast64_t totalBytesReceived = 0;
 
 typedef struct {
 	uint64_t start, end, handle;
+	int con;
 } req_t;
 
 static void cancelAllRequests(dnbd3_uplink_t *uplink);
@@ -35,19 +53,76 @@ static void freeUplinkStruct(ref *ref);
 static void* uplink_mainloop(void *data);
 static void sendQueuedRequests(dnbd3_uplink_t *uplink, bool newOnly);
 static int findNextIncompleteHashBlock(dnbd3_uplink_t *uplink, const int lastBlockIndex);
-static void handleReceive(dnbd3_uplink_t *uplink);
+static int findHottestIncompleteHashBlock(dnbd3_uplink_t *uplink, const int doneMapIndex);
+static void handleReceive(dnbd3_uplink_t *uplink, int con);
 static bool sendKeepalive(dnbd3_uplink_t *uplink);
+static void checkStandby(dnbd3_uplink_t *uplink);
 static void requestCrc32List(dnbd3_uplink_t *uplink);
+static bool requestHeatMap(dnbd3_uplink_t *uplink);
 static bool sendReplicationRequest(dnbd3_uplink_t *uplink);
 static bool reopenCacheFd(dnbd3_uplink_t *uplink, const bool force);
 static bool connectionShouldShutdown(dnbd3_uplink_t *uplink);
 static void connectionFailed(dnbd3_uplink_t *uplink, bool findNew);
+static void stripeFailed(dnbd3_uplink_t *uplink, int con);
+static void openStripes(dnbd3_uplink_t *uplink);
+static void openSiblings(dnbd3_uplink_t *uplink);
+static void closeStripes(dnbd3_uplink_t *uplink);
+static void connectAsync(dnbd3_uplink_t *uplink, int con, int server);
+static int takeConnection(dnbd3_uplink_t *uplink, int con, dnbd3_server_connection_t *conn);
+static void updateConnectionStats(dnbd3_uplink_t *uplink, uint32_t secondsPassed);
 static int numWantedReplicationRequests(dnbd3_uplink_t *uplink);
+static void updateBgrWindow(dnbd3_uplink_t *uplink, const dnbd3_queue_entry_t *entry);
+static void updateHedgeThreshold(dnbd3_uplink_t *uplink, const dnbd3_queue_entry_t *entry);
+static void recordLiveRtt(dnbd3_uplink_t *uplink, int con, const dnbd3_queue_entry_t *entry);
+static void recordOverfetch(dnbd3_uplink_t *uplink, uint64_t from, uint64_t to);
+static void sendProfileRequests(dnbd3_uplink_t *uplink);
+static void markOverfetchUsed(dnbd3_uplink_t *uplink, uint64_t start, uint64_t end);
+static void updateRequestSize(dnbd3_uplink_t *uplink);
+static void openHedge(dnbd3_uplink_t *uplink);
+static bool isHedgeLoser(dnbd3_uplink_t *uplink, uint64_t handle);
+static void closeHedge(dnbd3_uplink_t *uplink);
+static int sendHedgedRequests(dnbd3_uplink_t *uplink);
 static void markRequestUnsent(dnbd3_uplink_t *uplink, uint64_t handle);
-static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length, uint8_t hops);
+static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length, uint8_t hops, uint64_t prefetchTo);
+static dnbd3_queue_entry_t* addPrefetch(dnbd3_uplink_t *uplink, dnbd3_queue_entry_t *after, uint64_t start, uint64_t to, uint8_t hops, uint8_t origin, req_t *preReq);
+static int countQueued(dnbd3_uplink_t *uplink, uint8_t origin);
+static bool requestBlock(dnbd3_uplink_t *uplink, req_t *req, uint8_t hops);
+static int removeClients(dnbd3_uplink_t *uplink, void *data, uplink_callback callback, const req_t *which);
+static void sendCancel(dnbd3_uplink_t *uplink, int con, uint64_t handle);
+static bool sendRequestBatch(dnbd3_uplink_t *uplink, int con, dnbd3_request_t *reqs, int count);
+static void releaseConnection(dnbd3_uplink_t *uplink, dnbd3_queue_entry_t *entry);
 
 #define assert_uplink_thread() assert( pthread_equal( uplink->thread, pthread_self() ) )
 
+/**
+ * Get connection by number. 0 is the main connection, HEDGE_CON is the
+ * hedge connection, anything in between is an additional connection (stripe),
+ * anything above is a connection to a sibling proxy.
+ */
+static inline dnbd3_server_connection_t* getConnection(dnbd3_uplink_t *uplink, int con)
+{
+	if ( con > HEDGE_CON )
+		return &uplink->siblings[con - SIBLING_CON(0)];
+	if ( con == HEDGE_CON )
+		return &uplink->hedge;
+	return con == 0 ? &uplink->current : &uplink->stripes[con - 1];
+}
+
+static int cmpUint32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static inline int requestPrio(uint8_t hops)
+{
+	if ( hops & HOP_FLAG_BGR )
+		return PRIO_BGR;
+	if ( hops & HOP_FLAG_PREFETCH )
+		return PRIO_PREFETCH;
+	return PRIO_DEMAND;
+}
+
 // ############ uplink connection handling
 
 void uplink_globalsInit()
@@ -94,9 +169,23 @@ bool uplink_init(dnbd3_image_t *image, int sock, dnbd3_host_t *host, int version
 	uplink->bytesReceived = 0;
 	uplink->bytesReceivedLastSave = 0;
 	uplink->idleTime = SERVER_UPLINK_IDLE_TIMEOUT - 90;
+	uplink->bgrWindow = 1;
+	uplink->hedgeThreshold = UPLINK_HEDGE_DEFAULT_DELAY * 1000;
+	uplink->overfetchRatio = 50;
 	uplink->queue = NULL;
 	uplink->queueLen = 0;
 	uplink->cacheFd = -1;
+	for ( int i = 0; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+		uplink->stripes[i].fd = -1;
+	}
+	uplink->hedge.fd = -1;
+	uplink->standby.fd = -1;
+	for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+		uplink->siblings[i].fd = -1;
+	}
+	for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+		uplink->pending[i].result.fd = -1;
+	}
 	uplink->signal = signal_new();
 	if ( uplink->signal == NULL ) {
 		logadd( LOG_WARNING, "Error creating signal. Uplink unavailable." );
@@ -191,6 +280,10 @@ static void cancelAllRequests(dnbd3_uplink_t *uplink)
 	}
 	uplink->queue = NULL;
 	uplink->queueLen = 0;
+	uplink->queueDemand = 0;
+	for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+		uplink->conStats[i].outstanding = 0;
+	}
 	uplink->image->problem.queue = false;
 }
 
@@ -210,11 +303,39 @@ static void freeUplinkStruct(ref *ref)
 		close( uplink->better.fd );
 		uplink->better.fd = -1;
 	}
+	for ( int i = 0; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+		if ( uplink->stripes[i].fd != -1 ) {
+			close( uplink->stripes[i].fd );
+			uplink->stripes[i].fd = -1;
+		}
+	}
+	if ( uplink->hedge.fd != -1 ) {
+		close( uplink->hedge.fd );
+		uplink->hedge.fd = -1;
+	}
+	if ( uplink->standby.fd != -1 ) {
+		close( uplink->standby.fd );
+		uplink->standby.fd = -1;
+	}
+	for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+		if ( uplink->siblings[i].fd != -1 ) {
+			close( uplink->siblings[i].fd );
+			uplink->siblings[i].fd = -1;
+		}
+	}
+	for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+		if ( uplink->pending[i].result.fd != -1 ) {
+			close( uplink->pending[i].result.fd );
+			uplink->pending[i].result.fd = -1;
+		}
+	}
 	mutex_destroy( &uplink->queueLock );
 	mutex_destroy( &uplink->rttLock );
 	mutex_destroy( &uplink->sendMutex );
 	free( uplink->recvBuffer );
 	uplink->recvBuffer = NULL;
+	free( uplink->heatDone );
+	uplink->heatDone = NULL;
 	if ( uplink->cacheFd != -1 ) {
 		close( uplink->cacheFd );
 	}
@@ -230,27 +351,105 @@ static void freeUplinkStruct(ref *ref)
  */
 void uplink_removeEntry(dnbd3_uplink_t *uplink, void *data, uplink_callback callback)
 {
+	removeClients( uplink, data, callback, NULL );
+}
+
+/**
+ * Client cancelled a request it relayed through this uplink, either by
+ * handle (length == 0) or all of its requests overlapping the given range.
+ * The callback is not called for cancelled requests.
+ * @return number of requests removed
+ */
+int uplink_cancel(dnbd3_uplink_t *uplink, void *data, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length)
+{
+	const req_t which = { .start = start, .end = start + length, .handle = handle };
+	return removeClients( uplink, data, callback, &which );
+}
+
+/**
+ * Remove the given client from all matching queue entries. If which is NULL,
+ * all of the client's requests are removed and the callback is called for
+ * each one to signal failure. Otherwise, only requests matching which are
+ * removed, see uplink_cancel().
+ * Entries that lose their last client are withdrawn from the upstream
+ * server, unless we replicate the whole image anyways.
+ * Locks on: uplink.queueLock, uplink.sendMutex
+ */
+static int removeClients(dnbd3_uplink_t *uplink, void *data, uplink_callback callback, const req_t *which)
+{
+	req_t cancels[UPLINK_CANCEL_BATCH];
+	int numCancels = 0, removed = 0;
+	const bool keep = BGR_WHOLE_IMAGE( _backgroundReplication ); // Data would be replicated later anyways
 	mutex_lock( &uplink->queueLock );
-	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
-		for ( dnbd3_queue_client_t **cit = &it->clients; *cit != NULL; ) {
-			if ( (**cit).data == data && (**cit).callback == callback ) {
-				(*(**cit).callback)( (**cit).data, (**cit).handle, 0, 0, NULL );
-				dnbd3_queue_client_t *entry = *cit;
-				*cit = (**cit).next;
-				free( entry );
+	for ( dnbd3_queue_entry_t **it = &uplink->queue; *it != NULL; ) {
+		dnbd3_queue_entry_t * const entry = *it;
+		const bool hadClients = entry->clients != NULL;
+		for ( dnbd3_queue_client_t **cit = &entry->clients; *cit != NULL; ) {
+			dnbd3_queue_client_t * const c = *cit;
+			if ( c->data == data && c->callback == callback && ( which == NULL
+					|| ( which->start == which->end && c->handle == which->handle )
+					|| ( which->start < which->end && c->from < which->end && c->to > which->start ) ) ) {
+				if ( which == NULL ) {
+					(*c->callback)( c->data, c->handle, 0, 0, NULL );
+				}
+				*cit = c->next;
+				free( c );
+				removed++;
 			} else {
-				cit = &(**cit).next;
+				cit = &c->next;
+			}
+		}
+		if ( !hadClients || entry->clients != NULL || keep || numCancels + 2 > UPLINK_CANCEL_BATCH ) {
+			it = &entry->next;
+			continue;
+		}
+		// Nobody is interested in this anymore
+		*it = entry->next;
+		uplink->queueLen--;
+		if ( requestPrio( entry->hopCount ) == PRIO_DEMAND ) {
+			uplink->queueDemand--;
+		}
+		if ( entry->sent ) {
+			releaseConnection( uplink, entry );
+			cancels[numCancels++] = (req_t){ .handle = entry->handle, .con = entry->con };
+			if ( entry->hedged ) {
+				cancels[numCancels++] = (req_t){ .handle = entry->handle, .con = HEDGE_CON };
 			}
 		}
+		free( entry );
 	}
 	mutex_unlock( &uplink->queueLock );
+	for ( int i = 0; i < numCancels; ++i ) {
+		sendCancel( uplink, cancels[i].con, cancels[i].handle );
+	}
+	return removed;
+}
+
+/**
+ * Tell the server on given connection that we don't need the reply
+ * to the request with given handle anymore. Servers older than protocol
+ * version 5 don't know CMD_CANCEL, nothing is sent to them.
+ * Locks on: uplink.sendMutex
+ */
+static void sendCancel(dnbd3_uplink_t *uplink, int con, uint64_t handle)
+{
+	if ( getConnection( uplink, con )->version < 5 )
+		return;
+	dnbd3_request_t request = { .magic = dnbd3_packet_magic, .cmd = CMD_CANCEL, .handle = handle };
+	fixup_request( request );
+	if ( sendRequestBatch( uplink, con, &request, 1 ) ) {
+		uplink->cancelledRequests++;
+	}
 }
 
 /**
  * Called from a client (proxy) connection to request a missing part of the image.
  * The caller has made sure that the range is actually missing.
+ * If prefetchTo is not 0, data following the request up to that offset is
+ * fetched too, as determined by the client's stream detection.
  */
-bool uplink_requestClient(dnbd3_client_t *client, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length, uint8_t hops)
+bool uplink_requestClient(dnbd3_client_t *client, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length,
+		uint8_t hops, uint64_t prefetchTo)
 {
 	assert( client != NULL && callback != NULL );
 	if ( ( hops & 0x3f ) > 60 ) { // This is just silly
@@ -275,7 +474,7 @@ bool uplink_requestClient(dnbd3_client_t *client, uplink_callback callback, uint
 		logadd( LOG_WARNING, "Proxy cycle detected (same host)." );
 		ret = false;
 	} else {
-		ret = uplink_requestInternal( uplink, (void*)client, callback, handle, start, length, hops );
+		ret = uplink_requestInternal( uplink, (void*)client, callback, handle, start, length, hops, prefetchTo );
 	}
 	ref_put( &uplink->reference );
 	return ret;
@@ -296,11 +495,56 @@ bool uplink_request(dnbd3_image_t *image, void *data, uplink_callback callback,
 			return false;
 		}
 	}
-	bool ret = uplink_requestInternal( uplink, data, callback, handle, start, length, 0 );
+	// No stream detection here, use fixed prefetch size
+	uint64_t prefetchTo = 0;
+	if ( length <= _maxPrefetch ) {
+		prefetchTo = start + length + MIN( length * 3, _maxPrefetch );
+	}
+	bool ret = uplink_requestInternal( uplink, data, callback, handle, start, length, 0, prefetchTo );
 	ref_put( &uplink->reference );
 	return ret;
 }
 
+/**
+ * Called from a client connection to read ahead on a sequential stream while
+ * it is being served from the local cache, so the stream doesn't stall once
+ * it reaches missing data. Ranges already queued on the uplink are skipped.
+ * Locks on: uplink.queueLock, uplink.sendMutex
+ */
+void uplink_prefetch(dnbd3_client_t *client, uint8_t hops, uint64_t start, uint64_t to)
+{
+	if ( ( hops & HOP_FLAGS ) || ( hops & 0x3f ) > 60 )
+		return; // No cascading of prefetches
+	dnbd3_uplink_t *uplink = ref_get_uplink( &client->image->uplinkref );
+	if ( uplink == NULL )
+		return;
+	req_t preReq;
+	dnbd3_queue_entry_t *pre = NULL;
+	hops++;
+	mutex_lock( &uplink->queueLock );
+	if ( !uplink->shutdown ) {
+		pre = addPrefetch( uplink, NULL, start & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1), to, hops, QUEUE_ORIGIN_CLIENT, &preReq );
+	}
+	mutex_unlock( &uplink->queueLock );
+	if ( pre != NULL ) {
+		mutex_lock( &uplink->sendMutex );
+		const bool ok = requestBlock( uplink, &preReq, hops | HOP_FLAG_PREFETCH );
+		if ( !ok && preReq.con == 0 ) {
+			uplink->image->problem.uplink = true;
+		} else if ( !ok && getConnection( uplink, preReq.con )->fd != -1 ) {
+			shutdown( getConnection( uplink, preReq.con )->fd, SHUT_RDWR );
+		}
+		mutex_unlock( &uplink->sendMutex );
+		if ( !ok ) {
+			markRequestUnsent( uplink, preReq.handle );
+			if ( signal_call( uplink->signal ) == SIGNAL_ERROR ) {
+				logadd( LOG_WARNING, "Cannot wake up uplink thread; errno=%d", (int)errno );
+			}
+		}
+	}
+	ref_put( &uplink->reference );
+}
+
 static void extendRequest(uint64_t start, uint64_t *end, const dnbd3_image_t *image, uint32_t wanted)
 {
 	uint32_t length = (uint32_t)( *end - start );
@@ -323,25 +567,297 @@ static void extendRequest(uint64_t start, uint64_t *end, const dnbd3_image_t *im
 
 static bool requestBlock(dnbd3_uplink_t *uplink, req_t *req, uint8_t hops)
 {
-	if ( uplink->current.fd == -1 )
+	const dnbd3_server_connection_t *con = getConnection( uplink, req->con );
+	if ( con->fd == -1 )
 		return false;
-	return dnbd3_get_block( uplink->current.fd, req->start,
+	return dnbd3_get_block( con->fd, req->start,
 			(uint32_t)( req->end - req->start ), req->handle,
-			COND_HOPCOUNT( uplink->current.version, hops ) );
+			COND_HOPCOUNT( con->version, hops ) );
+}
+
+/**
+ * Pick the connection that is expected to deliver a request of given
+ * size first. This is estimated from the connection's RTT, its measured
+ * throughput and the amount of bytes already outstanding on it.
+ * Connections that have no throughput measurement yet are assumed to
+ * be average, so they get a fair chance of being measured.
+ * Stripes are only used if they're connected, the main connection
+ * is always considered.
+ * HOLD QUEUE LOCK WHILE CALLING
+ */
+static int pickConnection(dnbd3_uplink_t *uplink, uint64_t size)
+{
+	uint64_t tput[UPLINK_MAX_CONNECTIONS];
+	uint64_t sum = 0;
+	int known = 0;
+	for ( int i = 0; i < UPLINK_MAX_CONNECTIONS; ++i ) {
+		tput[i] = ( i == 0 || uplink->stripes[i - 1].fd != -1 ) ? uplink->conStats[i].throughput : 0;
+		if ( tput[i] != 0 ) {
+			sum += tput[i];
+			known++;
+		}
+	}
+	const uint64_t avgTput = known == 0 ? 0 : sum / known;
+	const uint64_t mainRtt = uplink->conStats[0].rtt;
+	int best = 0;
+	uint64_t bestCost = UINT64_MAX;
+	for ( int i = 0; i < UPLINK_MAX_CONNECTIONS; ++i ) {
+		if ( i != 0 && uplink->stripes[i - 1].fd == -1 )
+			continue;
+		const dnbd3_connection_stats_t *stats = &uplink->conStats[i];
+		uint64_t cost;
+		if ( avgTput == 0 ) {
+			// Nothing measured yet, only consider outstanding bytes
+			cost = stats->outstanding;
+		} else {
+			const uint64_t t = tput[i] == 0 ? avgTput : tput[i];
+			const uint64_t rtt = stats->rtt == 0 ? mainRtt : stats->rtt;
+			cost = rtt + ( stats->outstanding + size ) * 1000000 / t; // µs
+		}
+		if ( cost < bestCost ) {
+			best = i;
+			bestCost = cost;
+		}
+	}
+	return best;
+}
+
+/**
+ * In sibling mode, get the connection to the sibling owning the hash block
+ * the given request starts in. Requests that came from another proxy are
+ * never passed on to a sibling, to keep the chain short and cycle free.
+ * @return connection number, -1 if we own the block or have no connection
+ *         to its owner, so it should go upstream
+ */
+static int siblingConnection(dnbd3_uplink_t *uplink, const dnbd3_queue_entry_t *entry)
+{
+	if ( ( entry->hopCount & ~HOP_FLAGS ) > 1 )
+		return -1;
+	const int owner = altservers_getOwner( uplink->image->name, uplink->image->rid, entry->from / HASH_BLOCK_SIZE );
+	if ( owner == -1 )
+		return -1;
+	for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+		if ( uplink->siblings[i].fd != -1 && uplink->siblings[i].index == owner )
+			return SIBLING_CON(i);
+	}
+	return -1;
+}
+
+/**
+ * Assign given queue entry to a connection and account for its size.
+ * HOLD QUEUE LOCK WHILE CALLING
+ */
+static int assignConnection(dnbd3_uplink_t *uplink, dnbd3_queue_entry_t *entry)
+{
+	int con = siblingConnection( uplink, entry );
+	if ( con == -1 ) {
+		con = pickConnection( uplink, entry->to - entry->from );
+	}
+	entry->con = (uint8_t)con;
+	uplink->conStats[con].outstanding += entry->to - entry->from;
+	return con;
+}
+
+/**
+ * Remove given queue entry's size from its connection's outstanding bytes.
+ * HOLD QUEUE LOCK WHILE CALLING
+ */
+static void releaseConnection(dnbd3_uplink_t *uplink, dnbd3_queue_entry_t *entry)
+{
+	const uint64_t size = entry->to - entry->from;
+	dnbd3_connection_stats_t *stats = &uplink->conStats[entry->con];
+	stats->outstanding = stats->outstanding > size ? stats->outstanding - size : 0;
+}
+
+/**
+ * Called from a client connection when serving a range from the local cache,
+ * to find out whether data we requested beyond earlier client requests
+ * turned out to be useful.
+ */
+void uplink_recordCachedRead(dnbd3_image_t *image, uint64_t start, uint64_t end)
+{
+	dnbd3_uplink_t *uplink = ref_get_uplink( &image->uplinkref );
+	if ( uplink == NULL )
+		return;
+	if ( uplink->overfetchBytes != 0 ) {
+		markOverfetchUsed( uplink, start, end );
+	}
+	ref_put( &uplink->reference );
+}
+
+/**
+ * Make the uplink of given image fetch missing parts of the image in
+ * the order given by the image's boot profile. Starts the uplink if
+ * it isn't running yet.
+ */
+void uplink_startProfile(dnbd3_image_t *image)
+{
+	dnbd3_uplink_t *uplink = ref_get_uplink( &image->uplinkref );
+	if ( uplink == NULL ) {
+		uplink_init( image, -1, NULL, -1 );
+		uplink = ref_get_uplink( &image->uplinkref );
+		if ( uplink == NULL )
+			return;
+	}
+	uplink->profileStart = true;
+	signal_call( uplink->signal );
+	ref_put( &uplink->reference );
+}
+
+/**
+ * Count queue entries that were queued by given origin, QUEUE_ORIGIN_*.
+ * HOLD QUEUE LOCK WHILE CALLING
+ */
+static int countQueued(dnbd3_uplink_t *uplink, uint8_t origin)
+{
+	int count = 0;
+	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
+		if ( it->origin == origin ) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/**
+ * Queue requests for missing parts of [start, end) of given image on
+ * behalf of a warm-up job. Stops once *budget bytes have been queued,
+ * which are deducted from it, or if there are UPLINK_WARMUP_WINDOW
+ * warm-up requests in flight already. Starts the uplink if it isn't
+ * running yet. The requests are sent by the uplink thread.
+ * Locks on: uplink.queueLock
+ * @return offset up to which everything is either cached or queued,
+ *         so the caller can continue from there next time
+ */
+uint64_t uplink_warmup(dnbd3_image_t *image, uint64_t start, uint64_t end, uint64_t *budget)
+{
+	dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+	if ( cache == NULL )
+		return end; // Complete
+	dnbd3_uplink_t *uplink = ref_get_uplink( &image->uplinkref );
+	if ( uplink == NULL ) {
+		uplink_init( image, -1, NULL, -1 );
+		uplink = ref_get_uplink( &image->uplinkref );
+		if ( uplink == NULL ) {
+			ref_put( &cache->reference );
+			return start;
+		}
+	}
+	end = MIN( end, image->virtualFilesize );
+	uint64_t pos = start & ~(uint64_t)(DNBD3_BLOCK_SIZE - 1);
+	int added = 0;
+	mutex_lock( &uplink->queueLock );
+	int inFlight = countQueued( uplink, QUEUE_ORIGIN_WARMUP );
+	while ( pos < end && *budget != 0 && inFlight < UPLINK_WARMUP_WINDOW
+			&& uplink->queueLen < UPLINK_MAX_QUEUE && !uplink->shutdown ) {
+		// Skip what we have, in steps of one byte of the cache map
+		if ( atomic_load_explicit( &cache->map[pos >> 15], memory_order_relaxed ) == 0xff ) {
+			pos = ( pos + FILE_BYTES_PER_MAP_BYTE ) & ~(uint64_t)( FILE_BYTES_PER_MAP_BYTE - 1 );
+			continue;
+		}
+		// Request everything up to the next complete part
+		const uint64_t limit = MIN( end, pos + MIN( *budget, (uint64_t)_maxPayload ) );
+		uint64_t to = ( pos + FILE_BYTES_PER_MAP_BYTE ) & ~(uint64_t)( FILE_BYTES_PER_MAP_BYTE - 1 );
+		while ( to < limit && atomic_load_explicit( &cache->map[to >> 15], memory_order_relaxed ) != 0xff ) {
+			to += FILE_BYTES_PER_MAP_BYTE;
+		}
+		to = MIN( to, limit );
+		// Let sendQueuedRequests take care of it
+		dnbd3_queue_entry_t *entry = addPrefetch( uplink, NULL, pos, to, 1, QUEUE_ORIGIN_WARMUP, NULL );
+		pos = to;
+		if ( entry == NULL )
+			continue; // Already queued
+		const uint64_t size = entry->to - entry->from;
+		*budget = *budget > size ? *budget - size : 0;
+		pos = MAX( pos, entry->to );
+		inFlight++;
+		added++;
+	}
+	mutex_unlock( &uplink->queueLock );
+	ref_put( &cache->reference );
+	if ( added != 0 && signal_call( uplink->signal ) == SIGNAL_ERROR ) {
+		logadd( LOG_WARNING, "Cannot wake up uplink thread; errno=%d", (int)errno );
+	}
+	ref_put( &uplink->reference );
+	return MIN( pos, end );
+}
+
+/**
+ * Queue a prefetch request for the range [start, to), skipping anything at
+ * start that is already queued, so repeated read-ahead on the same stream
+ * doesn't fetch data twice. New entry goes after the given one, or to the
+ * head of the queue if after is NULL.
+ * If preReq is NULL, the entry is only queued, to be sent by the uplink
+ * thread. Otherwise it's assigned a connection, and preReq is filled so
+ * the caller can send it right away.
+ * HOLD QUEUE LOCK WHILE CALLING
+ * @return the new entry, NULL if there was nothing to prefetch
+ */
+static dnbd3_queue_entry_t* addPrefetch(dnbd3_uplink_t *uplink, dnbd3_queue_entry_t *after,
+		uint64_t start, uint64_t to, uint8_t hops, uint8_t origin, req_t *preReq)
+{
+	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; ) {
+		if ( it->from <= start && it->to > start ) {
+			start = it->to;
+			it = uplink->queue;
+		} else {
+			it = it->next;
+		}
+	}
+	if ( start >= to || uplink->queueLen >= UPLINK_MAX_QUEUE )
+		return NULL;
+	uint64_t end = start;
+	extendRequest( start, &end, uplink->image, (uint32_t)MIN( to - start, (uint64_t)_maxPayload ) );
+	if ( start >= end )
+		return NULL;
+	//logadd( LOG_DEBUG2, "Prefetching @ %"PRIx64" - %"PRIx64, preReq->start, preReq->end );
+	uplink->queueLen++;
+	dnbd3_queue_entry_t *pre = malloc( sizeof(*pre) );
+	if ( after == NULL ) {
+		pre->next = uplink->queue;
+		uplink->queue = pre;
+	} else {
+		pre->next = after->next;
+		after->next = pre;
+	}
+	pre->handle = ++uplink->queueId;
+	pre->from = start;
+	pre->to = end;
+	pre->hopCount = hops | HOP_FLAG_PREFETCH;
+	pre->hedged = false;
+	pre->clients = NULL;
+	pre->origin = origin;
+	if ( preReq == NULL ) {
+		pre->sent = false;
+		pre->con = 0;
+	} else {
+		pre->sent = true; // Optimistic; would be set to false on failure
+		preReq->handle = pre->handle;
+		preReq->start = start;
+		preReq->end = end;
+		preReq->con = assignConnection( uplink, pre );
+	}
+#ifdef DEBUG
+	timing_get( &pre->entered );
+#endif
+	timing_get( &pre->sentAt );
+	return pre;
 }
 
 /**
  * Request a chunk of data through an uplink server. Either uplink or client has to be non-NULL.
  * If callback is NULL, this is assumed to be a background replication request.
+ * If prefetchTo is not 0, everything from the end of the request up to this
+ * offset will be requested too.
  * Locks on: uplink.queueLock, uplink.sendMutex
  */
 static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_callback callback,
-		uint64_t handle, uint64_t start, uint32_t length, uint8_t hops)
+		uint64_t handle, uint64_t start, uint32_t length, uint8_t hops, uint64_t prefetchTo)
 {
 	assert( uplink != NULL );
 	assert( data == NULL || callback != NULL );
 	if ( ( hops & HOP_FLAG_BGR ) // This is a background replication request
-			&& _backgroundReplication != BGR_FULL ) { // Deny if we're not doing BGR
+			&& !BGR_WHOLE_IMAGE( _backgroundReplication ) ) { // Deny if we're not doing BGR
 		// TODO: Allow BGR_HASHBLOCK too, but only if hash block isn't completely empty
 		logadd( LOG_DEBUG2, "Dopping client because of BGR policy" );
 		return false;
@@ -365,7 +881,8 @@ static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_ca
 
 	req_t req, preReq;
 	dnbd3_queue_entry_t *request = NULL, *last = NULL, *pre = NULL;
-	bool isNew;
+	bool doSend = false;
+	uint8_t sendHops = hops;
 	const uint64_t end = start + length;
 	req.start = start & ~(DNBD3_BLOCK_SIZE - 1);
 	req.end = end;
@@ -380,9 +897,10 @@ static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_ca
 	 * clients form the receive buffer, but just issue a normal sendfile() call after writing
 	 * the received data to the local cache.
 	 */
-	if ( callback != NULL && _minRequestSize != 0 ) {
+	const uint32_t wanted = MAX( (uint32_t)_minRequestSize, (uint32_t)uplink->requestSize );
+	if ( callback != NULL && wanted != 0 ) {
 		// Not background replication request, extend request size
-		extendRequest( req.start, &req.end, uplink->image, _minRequestSize );
+		extendRequest( req.start, &req.end, uplink->image, wanted );
 	}
 	req.end = (req.end + DNBD3_BLOCK_SIZE - 1) & ~(DNBD3_BLOCK_SIZE - 1);
 	// Critical section - work with the queue
@@ -427,24 +945,41 @@ static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_ca
 #ifdef DEBUG
 		timing_get( &request->entered );
 #endif
+		timing_get( &request->sentAt );
+		request->hedged = false;
+		request->con = 0;
+		request->origin = QUEUE_ORIGIN_CLIENT;
 		request->hopCount = hops;
-		request->sent = true; // Optimistic; would be set to false on failure
+		if ( requestPrio( hops ) == PRIO_DEMAND ) {
+			uplink->queueDemand++;
+		}
+		if ( requestPrio( hops ) == PRIO_BGR && uplink->queueDemand > 0 ) {
+			// Don't put BGR on the wire while demand requests are waiting, uplink thread will send later
+			request->sent = false;
+		} else {
+			request->sent = true; // Optimistic; would be set to false on failure
+			req.con = assignConnection( uplink, request );
+			doSend = true;
+		}
 		if ( callback == NULL ) {
 			// BGR
 			request->clients = NULL;
 		} else {
 			c = &request->clients;
+			const uint64_t clientEnd = ( end + DNBD3_BLOCK_SIZE - 1 ) & ~(uint64_t)( DNBD3_BLOCK_SIZE - 1 );
+			if ( req.end > clientEnd ) {
+				recordOverfetch( uplink, clientEnd, req.end );
+			}
 		}
-		isNew = true;
 	} else if ( callback == NULL ) {
 		// Replication request that maches existing request. Do nothing
-		isNew = false;
 	} else {
 		// Existing request. Check if potential cycle
 		if ( hops > request->hopCount && request->from == start && request->to == end ) {
 			logadd( LOG_DEBUG1, "Request cycle detected on uplink for %s:%d", PIMG(uplink->image) );
 			goto fail_lock;
 		}
+		markOverfetchUsed( uplink, start, end );
 		// Count number if clients, get tail of list
 		int count = 0;
 		c = &request->clients;
@@ -455,37 +990,33 @@ static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_ca
 				goto fail_lock;
 			}
 		}
-		isNew = false;
+		if ( requestPrio( hops ) < requestPrio( request->hopCount ) ) {
+			// More important client attached, upgrade request so resends carry the new priority
+			if ( requestPrio( hops ) == PRIO_DEMAND ) {
+				uplink->queueDemand++;
+			}
+			request->hopCount = (uint8_t)( ( request->hopCount & ~HOP_FLAGS ) | ( hops & HOP_FLAGS ) );
+			if ( !request->sent ) {
+				// Was held back, send right away
+				request->sent = true;
+				timing_get( &request->sentAt );
+				req.start = request->from;
+				req.end = request->to;
+				req.con = assignConnection( uplink, request );
+				sendHops = request->hopCount;
+				doSend = true;
+			}
+		}
 	}
 	// Prefetch immediately, without unlocking the list - the old approach of
 	// async prefetching in another thread was sometimes so slow that we'd process
 	// another request from the same client before the prefetch job would execute.
-	if ( callback != NULL && ( isNew || request->clients == NULL || request->clients->data == data )
-			&& !( hops & (HOP_FLAG_BGR | HOP_FLAG_PREFETCH) ) // No cascading of prefetches
-			&& end == request->to && length <= _maxPrefetch ) {
-		// Only if this is a client request, and the !! end boundary matches exactly !!
-		// (See above for reason why)
-		// - We neither check the local cache, nor other pending requests. Worth it?
-		// Complexity vs. probability
-		preReq.start = end;
-		preReq.end = end;
-		extendRequest( preReq.start, &preReq.end, uplink->image, MIN( length * 3, _maxPrefetch ) );
-		if ( preReq.start < preReq.end ) {
-			//logadd( LOG_DEBUG2, "Prefetching @ %"PRIx64" - %"PRIx64, preReq.start, preReq.end );
-			uplink->queueLen++;
-			pre = malloc( sizeof(*pre) );
-			pre->next = request->next;
-			request->next = pre;
-			pre->handle = preReq.handle = ++uplink->queueId;
-			pre->from = preReq.start;
-			pre->to = preReq.end;
-			pre->hopCount = hops | HOP_FLAG_PREFETCH;
-			pre->sent = true; // Optimistic; would be set to false on failure
-			pre->clients = NULL;
-#ifdef DEBUG
-			timing_get( &pre->entered );
-#endif
-		}
+	if ( callback != NULL && prefetchTo != 0
+			&& !( hops & (HOP_FLAG_BGR | HOP_FLAG_PREFETCH) ) ) { // No cascading of prefetches
+		// Start right at the end of the entry, so the stream's next request will
+		// match either this one or the prefetch job (see above for reason why).
+		// - We don't check the local cache. Worth it? Complexity vs. probability
+		pre = addPrefetch( uplink, request, request->to, prefetchTo, hops, QUEUE_ORIGIN_CLIENT, &preReq );
 	}
 	// // // //
 	// Copy data - need this after unlocking
@@ -502,22 +1033,29 @@ static bool uplink_requestInternal(dnbd3_uplink_t *uplink, void *data, uplink_ca
 	}
 	mutex_unlock( &uplink->queueLock );
 	// End queue critical section
-	if ( pre == NULL && !isNew )
+	if ( pre == NULL && !doSend )
 		return true; // Nothing to do
 
 	// Fire away the request(s)
 	mutex_lock( &uplink->sendMutex );
 	bool ret1 = true;
 	bool ret2 = true;
-	if ( isNew ) {
-		ret1 = requestBlock( uplink, &req, hops );
+	if ( doSend ) {
+		ret1 = requestBlock( uplink, &req, sendHops );
 	}
 	if ( pre != NULL ) {
 		ret2 = requestBlock( uplink, &preReq, hops | HOP_FLAG_PREFETCH );
 	}
-	if ( !ret1 || !ret2 ) { // Set with send locked
+	if ( ( !ret1 && req.con == 0 ) || ( !ret2 && preReq.con == 0 ) ) { // Set with send locked
 		uplink->image->problem.uplink = true;
 	}
+	// Failed stripes get torn down by the uplink thread, which will see the hangup
+	if ( !ret1 && req.con != 0 && getConnection( uplink, req.con )->fd != -1 ) {
+		shutdown( getConnection( uplink, req.con )->fd, SHUT_RDWR );
+	}
+	if ( !ret2 && preReq.con != 0 && getConnection( uplink, preReq.con )->fd != -1 ) {
+		shutdown( getConnection( uplink, preReq.con )->fd, SHUT_RDWR );
+	}
 	mutex_unlock( &uplink->sendMutex );
 	// markRequestUnsend locks the queue, would violate locking order with send mutex
 	if ( !ret1 ) {
@@ -546,10 +1084,14 @@ static void* uplink_mainloop(void *data)
 {
 #define EV_SIGNAL (0)
 #define EV_SOCKET (1)
-#define EV_COUNT  (2)
+#define EV_STRIPE (2)
+#define EV_HEDGE  (EV_STRIPE + UPLINK_MAX_CONNECTIONS - 1)
+#define EV_SIBLING (EV_HEDGE + 1)
+#define EV_COUNT  (EV_SIBLING + SERVER_MAX_SIBLINGS)
 	struct pollfd events[EV_COUNT];
 	dnbd3_uplink_t * const uplink = (dnbd3_uplink_t*)data;
 	int numSocks, waitTime;
+	int hedgeWait = -1;
 	int altCheckInterval = SERVER_RTT_INTERVAL_INIT;
 	int rttTestResult;
 	uint32_t discoverFailCount = 0;
@@ -572,6 +1114,16 @@ static void* uplink_mainloop(void *data)
 	events[EV_SIGNAL].events = POLLIN;
 	events[EV_SIGNAL].fd = signal_getWaitFd( uplink->signal );
 	events[EV_SOCKET].fd = -1;
+	for ( int i = 0; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+		events[EV_STRIPE + i].fd = -1;
+		events[EV_STRIPE + i].events = POLLIN | POLLRDHUP;
+	}
+	events[EV_HEDGE].fd = -1;
+	events[EV_HEDGE].events = POLLIN | POLLRDHUP;
+	for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+		events[EV_SIBLING + i].fd = -1;
+		events[EV_SIBLING + i].events = POLLIN | POLLRDHUP;
+	}
 	if ( uplink->rttTestResult != RTT_DOCHANGE ) {
 		altservers_findUplink( uplink ); // In case we didn't kickstart
 	}
@@ -585,8 +1137,21 @@ static void* uplink_mainloop(void *data)
 			waitTime = (int)timing_diffMs( &now, &nextAltCheck );
 			if ( waitTime < 100 ) waitTime = 100;
 			else if ( waitTime > 10000 ) waitTime = 10000;
+			if ( uplink->bgrThrottled && waitTime > 250 ) {
+				waitTime = 250; // Ask BGR scheduler again soon
+			}
+			if ( hedgeWait != -1 && waitTime > hedgeWait ) {
+				waitTime = hedgeWait; // Client request will be due for hedging
+			}
 		}
 		events[EV_SOCKET].fd = uplink->current.fd;
+		for ( int i = 0; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+			events[EV_STRIPE + i].fd = uplink->stripes[i].fd;
+		}
+		events[EV_HEDGE].fd = uplink->hedge.fd;
+		for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+			events[EV_SIBLING + i].fd = uplink->siblings[i].fd;
+		}
 		numSocks = poll( events, EV_COUNT, waitTime );
 		if ( _shutdown || uplink->shutdown ) goto cleanup;
 		if ( numSocks == -1 ) { // Error?
@@ -603,6 +1168,8 @@ static void* uplink_mainloop(void *data)
 			// The rttTest worker thread has finished our request.
 			// And says it's better to switch to another server
 			const int fd = uplink->current.fd;
+			closeStripes( uplink );
+			closeHedge( uplink ); // Might point to the server we're switching to
 			mutex_lock( &uplink->sendMutex );
 			uplink->current = uplink->better;
 			mutex_unlock( &uplink->sendMutex );
@@ -622,9 +1189,15 @@ static void* uplink_mainloop(void *data)
 			if ( uplink->image->crc32 == NULL ) {
 				requestCrc32List( uplink );
 			}
+			// Seed heat map from upstream if we replicate by heat; CMD_GET_HEAT was added in protocol version 4
+			if ( _backgroundReplication == BGR_HEAT && uplink->current.version >= 4 ) {
+				requestHeatMap( uplink );
+			}
 			// Re-send all pending requests
 			sendQueuedRequests( uplink, false );
 			sendReplicationRequest( uplink );
+			openStripes( uplink );
+			openHedge( uplink );
 			events[EV_SOCKET].events = POLLIN | POLLRDHUP;
 			if ( uplink->image->problem.uplink ) {
 				// Some of the requests above must have failed again already :-(
@@ -659,15 +1232,74 @@ static void* uplink_mainloop(void *data)
 			logadd( LOG_DEBUG1, "Uplink gone away, panic! (revents=%d)\n", (int)events[EV_SOCKET].revents );
 			setThreadName( "panic-uplink" );
 		} else if ( (events[EV_SOCKET].revents & POLLIN) ) {
-			handleReceive( uplink );
+			handleReceive( uplink, 0 );
 			if ( _shutdown || uplink->shutdown ) goto cleanup;
 		}
+		// Additional connections; fd might have been closed above if the main connection failed
+		for ( int i = 0; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+			const struct pollfd *ev = &events[EV_STRIPE + i];
+			if ( ev->fd == -1 || ev->fd != uplink->stripes[i].fd )
+				continue;
+			if ( (ev->revents & (POLLERR | POLLHUP | POLLRDHUP | POLLNVAL)) ) {
+				logadd( LOG_DEBUG1, "Additional uplink connection #%d gone away (revents=%d)", i + 1, (int)ev->revents );
+				stripeFailed( uplink, i + 1 );
+			} else if ( (ev->revents & POLLIN) ) {
+				handleReceive( uplink, i + 1 );
+				if ( _shutdown || uplink->shutdown ) goto cleanup;
+			}
+		}
+		// Hedge connection
+		if ( events[EV_HEDGE].fd != -1 && events[EV_HEDGE].fd == uplink->hedge.fd ) {
+			if ( (events[EV_HEDGE].revents & (POLLERR | POLLHUP | POLLRDHUP | POLLNVAL)) ) {
+				logadd( LOG_DEBUG1, "Hedge uplink connection gone away (revents=%d)", (int)events[EV_HEDGE].revents );
+				closeHedge( uplink );
+			} else if ( (events[EV_HEDGE].revents & POLLIN) ) {
+				handleReceive( uplink, HEDGE_CON );
+				if ( _shutdown || uplink->shutdown ) goto cleanup;
+			}
+		}
+		// Sibling connections
+		for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+			const struct pollfd *ev = &events[EV_SIBLING + i];
+			if ( ev->fd == -1 || ev->fd != uplink->siblings[i].fd )
+				continue;
+			if ( (ev->revents & (POLLERR | POLLHUP | POLLRDHUP | POLLNVAL)) ) {
+				logadd( LOG_DEBUG1, "Sibling connection #%d gone away (revents=%d)", i, (int)ev->revents );
+				stripeFailed( uplink, SIBLING_CON(i) );
+			} else if ( (ev->revents & POLLIN) ) {
+				handleReceive( uplink, SIBLING_CON(i) );
+				if ( _shutdown || uplink->shutdown ) goto cleanup;
+			}
+		}
+		if ( uplink->connectDone ) {
+			// Background connect finished, take over the new connection
+			uplink->connectDone = false;
+			if ( uplink->current.fd != -1 ) {
+				openStripes( uplink );
+				openSiblings( uplink );
+			}
+			openHedge( uplink );
+		}
+		hedgeWait = sendHedgedRequests( uplink );
+		if ( uplink->profileStart ) {
+			uplink->profileStart = false;
+			if ( uplink->profile != NULL ) {
+				ref_put( &uplink->profile->reference );
+			}
+			uplink->profile = ref_get_bootprofile( uplink->image );
+			uplink->profileIndex = 0;
+		}
+		if ( uplink->profile != NULL && uplink->current.fd != -1 ) {
+			sendProfileRequests( uplink );
+		}
 		declare_now;
 		uint32_t timepassed = timing_diff( &lastKeepalive, &now );
 		if ( timepassed >= SERVER_UPLINK_KEEPALIVE_INTERVAL
 				|| ( timepassed >= 2 && uplink->idleTime < _bgrWindowSize ) ) {
 			lastKeepalive = now;
 			uplink->idleTime += timepassed;
+			updateConnectionStats( uplink, timepassed );
+			updateRequestSize( uplink );
 			// Keep-alive
 			if ( uplink->current.fd != -1 && uplink->queueLen < _bgrWindowSize ) {
 				// Send keep-alive if nothing is happening, and try to trigger background rep.
@@ -676,11 +1308,23 @@ static void* uplink_mainloop(void *data)
 					logadd( LOG_DEBUG1, "Error sending keep-alive/BGR, panic!\n" );
 				}
 			}
+			checkStandby( uplink );
+			// (Re)establish additional connections, or close surplus ones if config changed
+			if ( uplink->current.fd != -1 ) {
+				openStripes( uplink );
+				openSiblings( uplink );
+			}
+			openHedge( uplink );
 			// Don't keep uplink established if we're idle for too much
 			if ( connectionShouldShutdown( uplink ) ) {
 				logadd( LOG_DEBUG1, "Closing idle uplink for image %s:%d", PIMG(uplink->image) );
 				goto cleanup;
 			}
+		} else if ( uplink->bgrThrottled && uplink->current.fd != -1 ) {
+			// Replication was held back by the scheduler last time, see if we may continue
+			if ( !sendReplicationRequest( uplink ) ) {
+				connectionFailed( uplink, true );
+			}
 		}
 		// See if we should trigger an RTT measurement
 		rttTestResult = uplink->rttTestResult;
@@ -696,7 +1340,7 @@ static void* uplink_mainloop(void *data)
 				} else {
 					// Not complete - do measurement
 					altservers_findUplinkAsync( uplink ); // This will set RTT_INPROGRESS (synchronous)
-					if ( _backgroundReplication == BGR_FULL && uplink->nextReplicationIndex == -1 ) {
+					if ( BGR_WHOLE_IMAGE( _backgroundReplication ) && uplink->nextReplicationIndex == -1 ) {
 						uplink->nextReplicationIndex = 0;
 					}
 				}
@@ -738,6 +1382,10 @@ static void* uplink_mainloop(void *data)
 #endif
 	}
 cleanup: ;
+	if ( uplink->profile != NULL ) {
+		ref_put( &uplink->profile->reference );
+		uplink->profile = NULL;
+	}
 	dnbd3_image_t *image = uplink->image;
 	dnbd3_cache_map_t *cache = ref_get_cachemap( image );
 	if ( cache != NULL ) {
@@ -765,8 +1413,36 @@ cleanup: ;
 	return NULL ;
 }
 
+/**
+ * Send a batch of prepared request headers through given connection.
+ * If sending fails on the main connection, the uplink is flagged as
+ * having a problem. Failing additional connections are shut down, so
+ * the uplink thread will notice and re-queue their requests.
+ * HOLD NO LOCKS WHEN CALLING, or at most the queue lock
+ */
+static bool sendRequestBatch(dnbd3_uplink_t *uplink, int con, dnbd3_request_t *reqs, int count)
+{
+	bool ok = false;
+	const ssize_t len = (ssize_t)DNBD3_REQUEST_SIZE * count;
+	mutex_lock( &uplink->sendMutex );
+	const int fd = getConnection( uplink, con )->fd;
+	if ( fd != -1 ) {
+		ok = ( sock_sendAll( fd, reqs, len, 3 ) == len );
+		if ( !ok && con != 0 ) {
+			shutdown( fd, SHUT_RDWR );
+		}
+	}
+	if ( con == 0 && fd != -1 ) {
+		uplink->image->problem.uplink = !ok;
+	}
+	mutex_unlock( &uplink->sendMutex );
+	return ok;
+}
+
 /**
  * Only called from uplink thread.
+ * Requests are sent in order of their priority class, and BGR requests
+ * are held back entirely as long as there are demand requests waiting.
  */
 static void sendQueuedRequests(dnbd3_uplink_t *uplink, bool newOnly)
 {
@@ -776,47 +1452,53 @@ static void sendQueuedRequests(dnbd3_uplink_t *uplink, bool newOnly)
 	// unlocking the queue again. Otherwise we need flushes during iteration, which
 	// is no ideal, but in that case the uplink is probably overwhelmed anyways.
 	// Try 125 as that's exactly 300bytes, usually 2*MTU.
+	// Requests are distributed among all established connections to the server.
 #define MAX_RESEND_BATCH 125
-	dnbd3_request_t reqs[MAX_RESEND_BATCH];
-	int count = 0;
+	dnbd3_request_t reqs[NUM_CONNECTIONS][MAX_RESEND_BATCH];
+	int count[NUM_CONNECTIONS] = { 0 };
+	declare_now;
 	mutex_lock( &uplink->queueLock );
-	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
-		if ( newOnly && it->sent )
-			continue;
-		it->sent = true;
-		dnbd3_request_t *hdr = &reqs[count++];
-		hdr->magic = dnbd3_packet_magic;
-		hdr->cmd = CMD_GET_BLOCK;
-		hdr->size = (uint32_t)( it->to - it->from );
-		hdr->offset = it->from; // Offset first, then hops! (union)
-		hdr->hops = COND_HOPCOUNT( uplink->current.version, it->hopCount );
-		hdr->handle = it->handle;
-		fixup_request( *hdr );
-		if ( count == MAX_RESEND_BATCH ) {
-			bool ok = false;
-			logadd( LOG_DEBUG2, "BLOCKING resend of %d", count );
-			count = 0;
-			mutex_lock( &uplink->sendMutex );
-			if ( uplink->current.fd != -1 ) {
-				ok = ( sock_sendAll( uplink->current.fd, reqs, DNBD3_REQUEST_SIZE * MAX_RESEND_BATCH, 3 )
-						== DNBD3_REQUEST_SIZE * MAX_RESEND_BATCH );
+	if ( !newOnly ) {
+		// Everything will be (re)assigned below
+		for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+			uplink->conStats[i].outstanding = 0;
+		}
+	}
+	for ( int prio = 0; prio < PRIO_COUNT; ++prio ) {
+		for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
+			if ( requestPrio( it->hopCount ) != prio )
+				continue;
+			if ( newOnly && it->sent )
+				continue;
+			if ( prio == PRIO_BGR && uplink->queueDemand > 0 ) {
+				it->sent = false; // Outstanding counters were reset above if it was sent before
+				continue;
 			}
-			mutex_unlock( &uplink->sendMutex );
-			if ( !ok ) {
-				uplink->image->problem.uplink = true;
-				break;
+			it->sent = true;
+			it->sentAt = now;
+			const int con = assignConnection( uplink, it );
+			dnbd3_request_t *hdr = &reqs[con][count[con]++];
+			hdr->magic = dnbd3_packet_magic;
+			hdr->cmd = CMD_GET_BLOCK;
+			hdr->size = (uint32_t)( it->to - it->from );
+			hdr->offset = it->from; // Offset first, then hops! (union)
+			hdr->hops = COND_HOPCOUNT( getConnection( uplink, con )->version, it->hopCount );
+			hdr->handle = it->handle;
+			fixup_request( *hdr );
+			if ( count[con] == MAX_RESEND_BATCH ) {
+				logadd( LOG_DEBUG2, "BLOCKING resend of %d", count[con] );
+				count[con] = 0;
+				if ( !sendRequestBatch( uplink, con, reqs[con], MAX_RESEND_BATCH ) && con == 0 )
+					goto send_failed;
 			}
 		}
 	}
+send_failed: ;
 	mutex_unlock( &uplink->queueLock );
-	if ( count != 0 ) {
-		mutex_lock( &uplink->sendMutex );
-		if ( uplink->current.fd != -1 ) {
-			uplink->image->problem.uplink =
-				( sock_sendAll( uplink->current.fd, reqs, DNBD3_REQUEST_SIZE * count, 3 )
-					!= DNBD3_REQUEST_SIZE * count );
+	for ( int con = 0; con < NUM_CONNECTIONS; ++con ) {
+		if ( count[con] != 0 ) {
+			sendRequestBatch( uplink, con, reqs[con], count[con] );
 		}
-		mutex_unlock( &uplink->sendMutex );
 	}
 #undef MAX_RESEND_BATCH
 }
@@ -838,6 +1520,7 @@ static void sendQueuedRequests(dnbd3_uplink_t *uplink, bool newOnly)
 static bool sendReplicationRequest(dnbd3_uplink_t *uplink)
 {
 	assert_uplink_thread();
+	uplink->bgrThrottled = false;
 	if ( uplink->current.fd == -1 )
 		return false; // Should never be called in this state, consider send error
 	if ( _backgroundReplication == BGR_DISABLED || uplink->cacheFd == -1 )
@@ -847,23 +1530,33 @@ static bool sendReplicationRequest(dnbd3_uplink_t *uplink)
 	dnbd3_image_t * const image = uplink->image;
 	if ( image->users < _bgrMinClients )
 		return true; // Not enough active users
-	const int numNewRequests = numWantedReplicationRequests( uplink );
+	int numNewRequests = numWantedReplicationRequests( uplink );
 	if ( numNewRequests <= 0 )
 		return true; // Already sufficient amount of requests on the wire
+	// Ask global scheduler how many we may actually send
+	const uint32_t requestSize = BGR_WHOLE_IMAGE( _backgroundReplication )
+			? MAX( FILE_BYTES_PER_MAP_BYTE, _minRequestSize ) : FILE_BYTES_PER_MAP_BYTE;
+	const int wanted = numNewRequests;
+	numNewRequests = bgr_requestSlots( uplink, wanted, requestSize );
+	uplink->bgrThrottled = numNewRequests < wanted;
+	if ( numNewRequests <= 0 )
+		return true; // Bandwidth budget exhausted, or not our turn
 	dnbd3_cache_map_t *cache = ref_get_cachemap( image );
 	if ( cache == NULL ) {
 		// No cache map (=image complete)
+		bgr_returnSlots( uplink, numNewRequests, requestSize );
 		return true;
 	}
 	const int mapBytes = IMGSIZE_TO_MAPBYTES( image->virtualFilesize );
 	const int lastBlockIndex = mapBytes - 1;
-	for ( int bc = 0; bc < numNewRequests; ++bc ) {
+	int bc;
+	for ( bc = 0; bc < numNewRequests; ++bc ) {
 		int endByte;
 		if ( UPLINK_MAX_QUEUE - uplink->queueLen < 10 )
 			break; // Don't overload queue
 		if ( _backgroundReplication == BGR_FULL ) { // Full mode: consider all blocks
 			endByte = uplink->nextReplicationIndex + mapBytes;
-		} else { // Hashblock based: Only look for match in current hash block
+		} else { // Hashblock or heat based: Only look for match in current hash block
 			endByte = ( uplink->nextReplicationIndex + MAP_BYTES_PER_HASH_BLOCK ) & MAP_INDEX_HASH_START_MASK;
 			if ( endByte > mapBytes ) {
 				endByte = mapBytes;
@@ -883,6 +1576,9 @@ static bool sendReplicationRequest(dnbd3_uplink_t *uplink)
 		if ( replicationIndex == -1 && _backgroundReplication == BGR_HASHBLOCK ) {
 			// Nothing left in current block, find next one
 			replicationIndex = findNextIncompleteHashBlock( uplink, endByte );
+		} else if ( replicationIndex == -1 && _backgroundReplication == BGR_HEAT ) {
+			// Nothing left in current block, continue with hottest one
+			replicationIndex = findHottestIncompleteHashBlock( uplink, uplink->nextReplicationIndex );
 		}
 		if ( replicationIndex == -1 ) {
 			// Replication might be complete, uplink_mainloop should take care....
@@ -893,18 +1589,21 @@ static bool sendReplicationRequest(dnbd3_uplink_t *uplink)
 		const uint64_t offset = (uint64_t)replicationIndex * FILE_BYTES_PER_MAP_BYTE;
 		uint32_t size = (uint32_t)MIN( image->virtualFilesize - offset, FILE_BYTES_PER_MAP_BYTE );
 		// Extend the default 32k request size if _minRequestSize is > 32k
+		// In heat mode, stay within the hash block, it might be the last hot one
 		for ( size_t extra = 1; extra < ( _minRequestSize / FILE_BYTES_PER_MAP_BYTE )
 				&& offset + size < image->virtualFilesize
-				&& _backgroundReplication == BGR_FULL; ++extra ) {
+				&& ( _backgroundReplication == BGR_FULL || ( _backgroundReplication == BGR_HEAT
+						&& ( replicationIndex + 1 ) % MAP_BYTES_PER_HASH_BLOCK != 0 ) ); ++extra ) {
 			if ( atomic_load_explicit( &cache->map[replicationIndex+1], memory_order_relaxed ) == 0xff )
 				break; // Hit complete 32k block, stop here
 			replicationIndex++;
 			size += (uint32_t)MIN( image->virtualFilesize - offset - size, FILE_BYTES_PER_MAP_BYTE );
 		}
-		if ( !uplink_requestInternal( uplink, NULL, NULL, handle, offset, size, 0 ) ) {
+		if ( !uplink_requestInternal( uplink, NULL, NULL, handle, offset, size, 0, 0 ) ) {
 			logadd( LOG_DEBUG1, "Error sending background replication request to uplink server (%s:%d)",
 					PIMG(uplink->image) );
 			ref_put( &cache->reference );
+			bgr_returnSlots( uplink, numNewRequests - bc, requestSize );
 			return false;
 		}
 		if ( replicationIndex == lastBlockIndex ) {
@@ -915,23 +1614,90 @@ static bool sendReplicationRequest(dnbd3_uplink_t *uplink)
 				&& uplink->nextReplicationIndex % MAP_BYTES_PER_HASH_BLOCK == 0 ) {
 			// Just crossed a hash block boundary, look for new candidate starting at this very index
 			uplink->nextReplicationIndex = findNextIncompleteHashBlock( uplink, uplink->nextReplicationIndex );
-			if ( uplink->nextReplicationIndex == -1 )
+			if ( uplink->nextReplicationIndex == -1 ) {
+				bc++;
+				break;
+			}
+		} else if ( _backgroundReplication == BGR_HEAT
+				&& uplink->nextReplicationIndex % MAP_BYTES_PER_HASH_BLOCK == 0 ) {
+			// Requested everything missing in this hash block, pick next one by heat
+			uplink->nextReplicationIndex = findHottestIncompleteHashBlock( uplink, replicationIndex );
+			if ( uplink->nextReplicationIndex == -1 ) {
+				bc++;
 				break;
+			}
 		}
 	}
 	ref_put( &cache->reference );
+	bgr_returnSlots( uplink, numNewRequests - bc, requestSize );
 	return true;
 }
 
 /**
- * find next index into cache map that corresponds to the beginning
- * of a hash block which is neither completely empty nor completely
- * replicated yet. Returns -1 if no match.
+ * Mark the hash block containing the given cache map index as handled
+ * for the current round, then find the hottest hash block that is
+ * incomplete and wasn't handled in this round yet. On equal heat, the
+ * first one wins, so without any heat this is a linear walk.
+ * Returns the index into the cache map of the first incomplete part of
+ * that hash block, or -1 if no match, which also starts a new round.
  */
-static int findNextIncompleteHashBlock(dnbd3_uplink_t *uplink, const int startMapIndex)
+static int findHottestIncompleteHashBlock(dnbd3_uplink_t *uplink, const int doneMapIndex)
 {
-	int retval = -1;
-	dnbd3_cache_map_t *cache = ref_get_cachemap( uplink->image );
+	assert_uplink_thread();
+	dnbd3_image_t * const image = uplink->image;
+	const int blocks = IMGSIZE_TO_HASHBLOCKS( image->virtualFilesize );
+	if ( uplink->heatDone == NULL ) {
+		uplink->heatDone = calloc( ( blocks + 7 ) / 8, 1 );
+		if ( uplink->heatDone == NULL )
+			return -1;
+	}
+	if ( doneMapIndex >= 0 ) {
+		const int block = doneMapIndex / MAP_BYTES_PER_HASH_BLOCK;
+		uplink->heatDone[block / 8] |= (uint8_t)( 1 << ( block % 8 ) );
+	}
+	dnbd3_cache_map_t *cache = ref_get_cachemap( image );
+	if ( cache == NULL )
+		return -1;
+	int best = -1;
+	uint32_t bestHeat = 0;
+	atomic_thread_fence( memory_order_acquire );
+	for ( int i = 0; i < blocks; ++i ) {
+		if ( uplink->heatDone[i / 8] & ( 1 << ( i % 8 ) ) )
+			continue;
+		const uint32_t heat = image->heat == NULL ? 0 : atomic_load_explicit( &image->heat[i], memory_order_relaxed );
+		if ( best != -1 && heat <= bestHeat )
+			continue;
+		if ( image_isHashBlockComplete( cache, (uint64_t)i, image->realFilesize ) ) {
+			uplink->heatDone[i / 8] |= (uint8_t)( 1 << ( i % 8 ) ); // Don't check again this round
+			continue;
+		}
+		best = i;
+		bestHeat = heat;
+	}
+	int retval = -1;
+	if ( best != -1 ) {
+		const int mapBytes = IMGSIZE_TO_MAPBYTES( image->virtualFilesize );
+		const int end = MIN( mapBytes, ( best + 1 ) * MAP_BYTES_PER_HASH_BLOCK );
+		for ( retval = best * MAP_BYTES_PER_HASH_BLOCK; retval < end - 1; ++retval ) {
+			if ( atomic_load_explicit( &cache->map[retval], memory_order_relaxed ) != 0xff )
+				break;
+		}
+	} else {
+		memset( uplink->heatDone, 0, ( blocks + 7 ) / 8 );
+	}
+	ref_put( &cache->reference );
+	return retval;
+}
+
+/**
+ * find next index into cache map that corresponds to the beginning
+ * of a hash block which is neither completely empty nor completely
+ * replicated yet. Returns -1 if no match.
+ */
+static int findNextIncompleteHashBlock(dnbd3_uplink_t *uplink, const int startMapIndex)
+{
+	int retval = -1;
+	dnbd3_cache_map_t *cache = ref_get_cachemap( uplink->image );
 	if ( cache != NULL ) {
 		const int mapBytes = IMGSIZE_TO_MAPBYTES( uplink->image->virtualFilesize );
 		const int start = ( startMapIndex & MAP_INDEX_HASH_START_MASK );
@@ -975,16 +1741,19 @@ static int findNextIncompleteHashBlock(dnbd3_uplink_t *uplink, const int startMa
 /**
  * Receive data from uplink server and process/dispatch
  * Locks on: uplink.lock, images[].lock
- * Only called from uplink thread, so current.fd is assumed to be valid.
+ * Only called from uplink thread, so the fd of the given connection is assumed to be valid.
+ * @param con connection to read from, 0 = current, n = stripes[n-1]
  */
-static void handleReceive(dnbd3_uplink_t *uplink)
+static void handleReceive(dnbd3_uplink_t *uplink, int con)
 {
 	dnbd3_reply_t inReply;
 	int ret;
 	assert_uplink_thread();
 	assert( uplink->queueLen >= 0 );
+	const int fd = getConnection( uplink, con )->fd;
+	bool sendDeferred = false;
 	for (;;) {
-		ret = dnbd3_read_reply( uplink->current.fd, &inReply, false );
+		ret = dnbd3_read_reply( fd, &inReply, false );
 		if ( unlikely( ret == REPLY_INTR ) && likely( !_shutdown && !uplink->shutdown ) ) continue;
 		if ( ret == REPLY_AGAIN ) break;
 		if ( unlikely( ret == REPLY_CLOSED ) ) {
@@ -1012,17 +1781,36 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 				exit( 1 );
 			}
 		}
-		if ( unlikely( (uint32_t)sock_recv( uplink->current.fd, uplink->recvBuffer, inReply.size ) != inReply.size ) ) {
+		if ( unlikely( (uint32_t)sock_recv( fd, uplink->recvBuffer, inReply.size ) != inReply.size ) ) {
 			logadd( LOG_INFO, "Lost connection to uplink server of %s:%d (payload)", PIMG(uplink->image) );
 			goto error_cleanup;
 		}
 		// Payload read completely
+		if ( unlikely( inReply.cmd == CMD_GET_HEAT ) ) {
+			heatmap_merge( uplink->image, (const uint32_t*)uplink->recvBuffer, (int)( inReply.size / sizeof(uint32_t) ) );
+			continue;
+		}
+		if ( unlikely( inReply.cmd == CMD_LATEST_RID ) ) {
+			// Upstream server got a new revision of this image, replicate it early
+			if ( inReply.size >= sizeof(uint16_t) ) {
+				uint16_t rid;
+				memcpy( &rid, uplink->recvBuffer, sizeof(rid) );
+				rid = net_order_16( rid );
+				if ( rid > uplink->image->rid && rid != uplink->announcedRid ) {
+					uplink->announcedRid = rid;
+					logadd( LOG_INFO, "Uplink server announced new revision %d of %s:%d", (int)rid, PIMG(uplink->image) );
+					image_replicateRevision( uplink->image, rid );
+				}
+			}
+			continue;
+		}
 		// Bail out if we're not interested
 		if ( unlikely( inReply.cmd != CMD_GET_BLOCK ) )
 			continue;
 		// Is a legit block reply
 		totalBytesReceived += inReply.size;
 		uplink->bytesReceived += inReply.size;
+		uplink->conStats[con].bytesReceived += inReply.size;
 		// Get entry from queue
 		dnbd3_queue_entry_t *entry;
 		mutex_lock( &uplink->queueLock );
@@ -1032,8 +1820,14 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 		}
 		if ( entry == NULL ) {
 			mutex_unlock( &uplink->queueLock ); // Do not dereference pointer after unlock!
-			logadd( LOG_DEBUG1, "Received block reply on uplink, but handle %"PRIu64" is unknown (%s:%d)",
-					inReply.handle, PIMG(uplink->image) );
+			if ( isHedgeLoser( uplink, inReply.handle ) ) {
+				uplink->hedgeDuplicateBytes += inReply.size;
+				logadd( LOG_DEBUG2, "Dropping duplicate reply for handle %"PRIu64" (%s:%d)",
+						inReply.handle, PIMG(uplink->image) );
+			} else {
+				logadd( LOG_DEBUG1, "Received block reply on uplink, but handle %"PRIu64" is unknown (%s:%d)",
+						inReply.handle, PIMG(uplink->image) );
+			}
 			continue;
 		}
 		const uint64_t start = entry->from;
@@ -1053,6 +1847,8 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 			int err = 0;
 			bool tryAgain = true; // Allow one retry in case we run out of space or the write fd became invalid
 			uint32_t done = 0;
+			ticks writeStart;
+			timing_get( &writeStart );
 			ret = 0;
 			while ( done < inReply.size ) {
 				ret = (int)pwrite( uplink->cacheFd, uplink->recvBuffer + done, inReply.size - done, start + done );
@@ -1084,6 +1880,8 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 				done += (uint32_t)ret;
 			}
 			if ( likely( done > 0 ) ) {
+				declare_now;
+				admission_recordDiskLatency( timing_diffUs( &writeStart, &now ) );
 				image_updateCachemap( uplink->image, start, start + done, true );
 			}
 			if ( unlikely( ret == -1 && ( err == EBADF || err == EINVAL || err == EIO ) ) ) {
@@ -1092,6 +1890,7 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 			}
 		}
 		bool found = false;
+		int hedgeLoser = -1;
 		dnbd3_queue_entry_t **it;
 		mutex_lock( &uplink->queueLock );
 		for ( it = &uplink->queue; *it != NULL; it = &(**it).next ) {
@@ -1100,6 +1899,14 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 				*it = (**it).next;
 				found = true;
 				uplink->queueLen--;
+				releaseConnection( uplink, entry );
+				if ( entry->hedged ) {
+					// Other half of hedged request is still on its way, if the reply didn't start yet
+					hedgeLoser = con == HEDGE_CON ? entry->con : HEDGE_CON;
+				}
+				if ( requestPrio( entry->hopCount ) == PRIO_DEMAND && --uplink->queueDemand == 0 ) {
+					sendDeferred = true; // Last demand request done, BGR might have been held back
+				}
 				break;
 			}
 		}
@@ -1112,6 +1919,14 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 					PIMG(uplink->image) );
 			continue;
 		}
+		if ( hedgeLoser != -1 ) {
+			uplink->hedgeLosers[uplink->hedgeLoserIndex] = inReply.handle;
+			uplink->hedgeLoserIndex = ( uplink->hedgeLoserIndex + 1 ) % UPLINK_HEDGE_LOSERS;
+			sendCancel( uplink, hedgeLoser, inReply.handle );
+		}
+		updateBgrWindow( uplink, entry );
+		updateHedgeThreshold( uplink, entry );
+		recordLiveRtt( uplink, con, entry );
 		dnbd3_queue_client_t *next;
 		for ( dnbd3_queue_client_t *c = entry->clients; c != NULL; c = next ) {
 			assert( c->from >= start && c->to <= end );
@@ -1135,15 +1950,24 @@ static void handleReceive(dnbd3_uplink_t *uplink)
 		}
 		free( entry );
 	} // main receive loop
+	if ( sendDeferred && uplink->current.fd != -1 ) {
+		sendQueuedRequests( uplink, true );
+	}
 	// Trigger background replication if applicable
 	if ( !sendReplicationRequest( uplink ) ) {
-		goto error_cleanup;
+		connectionFailed( uplink, true );
 	}
 	// Normal end
 	return;
 	// Error handling from failed receive or message parsing
 error_cleanup: ;
-	connectionFailed( uplink, true );
+	if ( con == 0 ) {
+		connectionFailed( uplink, true );
+	} else if ( con == HEDGE_CON ) {
+		closeHedge( uplink );
+	} else {
+		stripeFailed( uplink, con ); // Also handles siblings
+	}
 }
 
 /**
@@ -1156,24 +1980,436 @@ static void connectionFailed(dnbd3_uplink_t *uplink, bool findNew)
 		return;
 	setThreadName( "panic-uplink" );
 	altservers_serverFailed( uplink->current.index );
+	closeStripes( uplink );
 	mutex_lock( &uplink->sendMutex );
 	uplink->image->problem.uplink = true;
 	close( uplink->current.fd );
 	uplink->current.fd = -1;
 	mutex_unlock( &uplink->sendMutex );
-	if ( _backgroundReplication == BGR_FULL && uplink->nextReplicationIndex == -1 ) {
+	if ( BGR_WHOLE_IMAGE( _backgroundReplication ) && uplink->nextReplicationIndex == -1 ) {
 		uplink->nextReplicationIndex = 0;
 	}
 	if ( !findNew )
 		return;
 	mutex_lock( &uplink->rttLock );
 	bool bail = uplink->rttTestResult == RTT_INPROGRESS || uplink->better.fd != -1;
+	if ( !bail && uplink->standby.fd != -1 ) {
+		// Fail over to standby connection right away, main loop will switch on next iteration
+		uplink->better = uplink->standby;
+		uplink->standby.fd = -1;
+		uplink->rttTestResult = RTT_DOCHANGE;
+		bail = true;
+		logadd( LOG_DEBUG1, "Failing over to standby uplink connection for %s:%d", PIMG(uplink->image) );
+	}
 	mutex_unlock( &uplink->rttLock );
 	if ( bail )
 		return;
 	altservers_findUplinkAsync( uplink );
 }
 
+/**
+ * Close given additional or sibling connection and re-queue all requests
+ * that were sent through it, so they will go through one of the
+ * remaining connections.
+ * Only call from uplink thread
+ */
+static void stripeFailed(dnbd3_uplink_t *uplink, int con)
+{
+	assert_uplink_thread();
+	assert( con > 0 && con < NUM_CONNECTIONS && con != HEDGE_CON );
+	dnbd3_server_connection_t *stripe = getConnection( uplink, con );
+	if ( stripe->fd == -1 )
+		return;
+	mutex_lock( &uplink->sendMutex );
+	close( stripe->fd );
+	stripe->fd = -1;
+	mutex_unlock( &uplink->sendMutex );
+	bool resend = false;
+	mutex_lock( &uplink->queueLock );
+	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
+		if ( it->sent && it->con == con ) {
+			it->sent = false;
+			resend = true;
+		}
+	}
+	uplink->conStats[con].outstanding = 0;
+	mutex_unlock( &uplink->queueLock );
+	if ( resend && uplink->current.fd != -1 ) {
+		sendQueuedRequests( uplink, true );
+	}
+}
+
+/**
+ * Close all additional connections. Pending requests are not
+ * touched, as this is only called when the main connection is
+ * going away too, which will trigger a resend of everything.
+ * Only call from uplink thread
+ */
+static void closeStripes(dnbd3_uplink_t *uplink)
+{
+	assert_uplink_thread();
+	mutex_lock( &uplink->sendMutex );
+	for ( int i = 0; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+		if ( uplink->stripes[i].fd != -1 ) {
+			close( uplink->stripes[i].fd );
+			uplink->stripes[i].fd = -1;
+		}
+	}
+	mutex_unlock( &uplink->sendMutex );
+}
+
+/**
+ * Open another connection to the given server and select our image.
+ * Blocks, so never call from uplink thread, see connectAsync().
+ * @param failure set to UPLINK_CONNECT_UNREACHABLE or UPLINK_CONNECT_MISMATCH on error
+ * @return fd of new connection, -1 on error
+ */
+static int connectToServer(dnbd3_uplink_t *uplink, int server, int *version, int *failure)
+{
+	dnbd3_image_t * const image = uplink->image;
+	int sock = sock_connect( altservers_indexToHost( server ), 500, _uplinkTimeout );
+	*failure = UPLINK_CONNECT_UNREACHABLE;
+	if ( sock == -1 )
+		return -1;
+	*failure = UPLINK_CONNECT_MISMATCH;
+	uint16_t protocolVersion = 0;
+	uint16_t rid;
+	uint64_t imageSize;
+	char *name;
+	serialized_buffer_t serialized;
+	if ( !dnbd3_select_image( sock, image->name, image->rid, SI_SERVER_FLAGS )
+			|| !dnbd3_select_image_reply( &serialized, sock, &protocolVersion, &name, &rid, &imageSize )
+			|| protocolVersion < MIN_SUPPORTED_SERVER
+			|| name == NULL || strcmp( name, image->name ) != 0
+			|| rid != image->rid || imageSize != image->virtualFilesize ) {
+		close( sock );
+		return -1;
+	}
+	*version = protocolVersion;
+	return sock;
+}
+
+typedef struct {
+	dnbd3_uplink_t *uplink;
+	int con;
+	int server;
+} connect_job_t;
+
+static void* connectWorker(void *data)
+{
+	connect_job_t * const job = (connect_job_t*)data;
+	dnbd3_uplink_t * const uplink = job->uplink;
+	dnbd3_pending_connection_t * const pending = &uplink->pending[job->con];
+	int version = 0, failure;
+	setThreadName( "uplink-connect" );
+	const int sock = connectToServer( uplink, job->server, &version, &failure );
+	mutex_lock( &uplink->rttLock );
+	pending->result.fd = sock;
+	pending->result.index = job->server;
+	pending->result.version = version;
+	pending->state = sock == -1 ? failure : UPLINK_CONNECT_OK;
+	mutex_unlock( &uplink->rttLock );
+	uplink->connectDone = true;
+	signal_call( uplink->signal );
+	ref_put( &uplink->reference ); // Acquired in connectAsync
+	free( job );
+	return NULL;
+}
+
+/**
+ * Connect given connection to given server in the background, so the
+ * uplink thread doesn't stall on connect() or the handshake. Once done, the
+ * uplink thread is woken up and picks the result up via takeConnection().
+ * Does nothing if an attempt for this connection is already in progress.
+ * Only call from uplink thread
+ */
+static void connectAsync(dnbd3_uplink_t *uplink, int con, int server)
+{
+	assert_uplink_thread();
+	dnbd3_pending_connection_t * const pending = &uplink->pending[con];
+	mutex_lock( &uplink->rttLock );
+	if ( pending->state != UPLINK_CONNECT_IDLE ) {
+		mutex_unlock( &uplink->rttLock );
+		return;
+	}
+	pending->state = UPLINK_CONNECT_BUSY;
+	mutex_unlock( &uplink->rttLock );
+	// Worker holds a reference, so the uplink struct stays valid until it's done
+	dnbd3_uplink_t *current = ref_get_uplink( &uplink->image->uplinkref );
+	connect_job_t *job = NULL;
+	if ( current == uplink ) {
+		job = malloc( sizeof(*job) );
+		job->uplink = uplink;
+		job->con = con;
+		job->server = server;
+		if ( threadpool_run( &connectWorker, job, "UPLINK_CONNECT" ) )
+			return;
+		free( job );
+	}
+	if ( current != NULL ) {
+		ref_put( &current->reference );
+	}
+	mutex_lock( &uplink->rttLock );
+	pending->state = UPLINK_CONNECT_IDLE;
+	mutex_unlock( &uplink->rttLock );
+}
+
+/**
+ * Check for result of connectAsync() for given connection. If the attempt
+ * finished, successful or not, the result is copied to conn and the state
+ * is reset, so the caller now owns the connection.
+ * Only call from uplink thread
+ * @return UPLINK_CONNECT_*
+ */
+static int takeConnection(dnbd3_uplink_t *uplink, int con, dnbd3_server_connection_t *conn)
+{
+	assert_uplink_thread();
+	dnbd3_pending_connection_t * const pending = &uplink->pending[con];
+	mutex_lock( &uplink->rttLock );
+	const int state = pending->state;
+	if ( state != UPLINK_CONNECT_IDLE && state != UPLINK_CONNECT_BUSY ) {
+		*conn = pending->result;
+		pending->result.fd = -1;
+		pending->state = UPLINK_CONNECT_IDLE;
+	}
+	mutex_unlock( &uplink->rttLock );
+	return state;
+}
+
+/**
+ * Pick the server the given additional connection should go to.
+ * Normally this is the current server. In swarm mode, pick the best
+ * server by RTT that isn't used by any other connection yet. If there
+ * are more connections than servers, spread them evenly.
+ * Only call from uplink thread
+ */
+static int pickStripeServer(dnbd3_uplink_t *uplink, int stripe)
+{
+	if ( !_uplinkSwarm )
+		return uplink->current.index;
+	int servers[SERVER_MAX_ALTS];
+	const int num = altservers_getSwarmList( uplink, servers, SERVER_MAX_ALTS );
+	if ( num == 0 )
+		return uplink->current.index;
+	for ( int i = 0; i < num; ++i ) {
+		bool used = false;
+		for ( int j = 0; j < UPLINK_MAX_CONNECTIONS - 1 && !used; ++j ) {
+			used = uplink->stripes[j].fd != -1 && uplink->stripes[j].index == servers[i];
+		}
+		if ( !used )
+			return servers[i];
+	}
+	return servers[stripe % num];
+}
+
+/**
+ * Make sure we have as many additional connections as configured via
+ * uplinkConnections. They go to the current server, or to other alt servers
+ * in swarm mode. New connections are established in the background, at
+ * most one at a time; a connection that failed is only tried again after
+ * UPLINK_CONNECT_RETRY seconds.
+ * Surplus connections (config was reloaded) are closed gracefully
+ * by re-queueing their requests.
+ * Only call from uplink thread
+ */
+static void openStripes(dnbd3_uplink_t *uplink)
+{
+	assert_uplink_thread();
+	if ( uplink->current.fd == -1 )
+		return;
+	const int wanted = _uplinkConnections - 1;
+	dnbd3_server_connection_t conn;
+	bool connecting = false;
+	declare_now;
+	for ( int i = wanted; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+		if ( uplink->stripes[i].fd != -1 ) {
+			stripeFailed( uplink, i + 1 );
+		}
+		if ( takeConnection( uplink, i + 1, &conn ) == UPLINK_CONNECT_OK ) {
+			close( conn.fd );
+		}
+	}
+	for ( int i = 0; i < wanted; ++i ) {
+		const int state = takeConnection( uplink, i + 1, &conn );
+		if ( state == UPLINK_CONNECT_BUSY ) {
+			connecting = true;
+			continue;
+		}
+		if ( state == UPLINK_CONNECT_UNREACHABLE || state == UPLINK_CONNECT_MISMATCH ) {
+			logadd( LOG_DEBUG1, "Could not open additional uplink connection #%d for %s:%d", i + 1, PIMG(uplink->image) );
+			if ( conn.index != uplink->current.index ) {
+				if ( state == UPLINK_CONNECT_UNREACHABLE ) {
+					altservers_serverFailed( conn.index );
+				} else {
+					altservers_imageFailed( uplink, conn.index );
+				}
+			}
+			timing_set( &uplink->pending[i + 1].retry, &now, UPLINK_CONNECT_RETRY );
+			continue;
+		}
+		if ( state == UPLINK_CONNECT_OK ) {
+			if ( uplink->stripes[i].fd != -1 || ( !_uplinkSwarm && conn.index != uplink->current.index ) ) {
+				close( conn.fd ); // Switched servers meanwhile
+				continue;
+			}
+			mutex_lock( &uplink->queueLock );
+			uplink->conStats[i + 1].outstanding = 0;
+			uplink->conStats[i + 1].stalled = 0;
+			uplink->conStats[i + 1].throughput = 0;
+			uplink->conStats[i + 1].rtt = altservers_getRtt( conn.index );
+			mutex_unlock( &uplink->queueLock );
+			mutex_lock( &uplink->sendMutex );
+			uplink->stripes[i] = conn;
+			mutex_unlock( &uplink->sendMutex );
+			logadd( LOG_DEBUG2, "Opened additional uplink connection #%d for %s:%d", i + 1, PIMG(uplink->image) );
+			continue;
+		}
+		if ( uplink->stripes[i].fd != -1 || connecting || !timing_reached( &uplink->pending[i + 1].retry, &now ) )
+			continue;
+		connectAsync( uplink, i + 1, pickStripeServer( uplink, i ) );
+		connecting = true;
+	}
+}
+
+/**
+ * In sibling mode, make sure we're connected to all siblings, so requests
+ * for hash blocks they own can be sent there. Like openStripes(), new
+ * connections are established in the background, one at a time. A sibling
+ * that cannot be reached is left alone for a while; its hash blocks go
+ * upstream meanwhile.
+ * Only call from uplink thread
+ */
+static void openSiblings(dnbd3_uplink_t *uplink)
+{
+	assert_uplink_thread();
+	int servers[SERVER_MAX_SIBLINGS];
+	const int num = altservers_getSiblings( servers, SERVER_MAX_SIBLINGS );
+	// Close connections that don't match the (possibly reloaded) list of siblings
+	for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+		if ( uplink->siblings[i].fd != -1 && ( i >= num || uplink->siblings[i].index != servers[i] ) ) {
+			stripeFailed( uplink, SIBLING_CON(i) );
+		}
+	}
+	dnbd3_server_connection_t conn;
+	bool connecting = false;
+	declare_now;
+	for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+		const int state = takeConnection( uplink, SIBLING_CON(i), &conn );
+		if ( state == UPLINK_CONNECT_BUSY ) {
+			connecting = true;
+			continue;
+		}
+		if ( state == UPLINK_CONNECT_UNREACHABLE || state == UPLINK_CONNECT_MISMATCH ) {
+			logadd( LOG_DEBUG1, "Could not connect to sibling #%d for %s:%d", i, PIMG(uplink->image) );
+			timing_set( &uplink->pending[SIBLING_CON(i)].retry, &now, UPLINK_SIBLING_RETRY );
+			continue;
+		}
+		if ( state == UPLINK_CONNECT_OK ) {
+			if ( i >= num || uplink->siblings[i].fd != -1 || conn.index != servers[i] ) {
+				close( conn.fd ); // List of siblings changed meanwhile
+				continue;
+			}
+			mutex_lock( &uplink->queueLock );
+			uplink->conStats[SIBLING_CON(i)].outstanding = 0;
+			uplink->conStats[SIBLING_CON(i)].throughput = 0;
+			mutex_unlock( &uplink->queueLock );
+			mutex_lock( &uplink->sendMutex );
+			uplink->siblings[i] = conn;
+			mutex_unlock( &uplink->sendMutex );
+			logadd( LOG_DEBUG2, "Connected to sibling #%d for %s:%d", i, PIMG(uplink->image) );
+		}
+	}
+	for ( int i = 0; i < num && !connecting; ++i ) {
+		if ( uplink->siblings[i].fd != -1 || !timing_reached( &uplink->pending[SIBLING_CON(i)].retry, &now ) )
+			continue;
+		connectAsync( uplink, SIBLING_CON(i), servers[i] );
+		connecting = true;
+	}
+}
+
+/**
+ * Update throughput and RTT of each connection, given the time since
+ * last update. Additional connections that have requests pending, but
+ * are either stalled or way slower than the fastest connection for too
+ * long get closed, so their work is reassigned to the others.
+ * Only call from uplink thread
+ */
+static void updateConnectionStats(dnbd3_uplink_t *uplink, uint32_t secondsPassed)
+{
+	if ( secondsPassed == 0 )
+		return;
+	uint64_t outstanding[NUM_CONNECTIONS];
+	uint32_t rtt[NUM_CONNECTIONS];
+	unsigned int maxTput = 0;
+	for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+		const dnbd3_server_connection_t *con = getConnection( uplink, i );
+		dnbd3_connection_stats_t *stats = &uplink->conStats[i];
+		if ( con->fd != -1 && stats->numLiveRtt >= UPLINK_LIVE_MIN_SAMPLES ) {
+			// Use 10th percentile, which is close to what an isolated probe request would see,
+			// as most requests are queued behind others on a busy connection
+			qsort( stats->liveRtt, stats->numLiveRtt, sizeof(stats->liveRtt[0]), &cmpUint32 );
+			altservers_recordLiveRtt( con->index, stats->liveRtt[stats->numLiveRtt / 10] );
+		}
+		stats->numLiveRtt = 0;
+		rtt[i] = con->fd == -1 ? 0 : altservers_getRtt( con->index );
+	}
+	mutex_lock( &uplink->queueLock );
+	for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+		dnbd3_connection_stats_t *stats = &uplink->conStats[i];
+		const uint64_t bytes = stats->bytesReceived;
+		stats->throughput = (unsigned int)MIN( ( bytes - stats->lastBytesReceived ) / secondsPassed, UINT32_MAX );
+		stats->lastBytesReceived = bytes;
+		if ( rtt[i] != 0 ) {
+			stats->rtt = rtt[i];
+		}
+		outstanding[i] = stats->outstanding;
+		if ( outstanding[i] != 0 && stats->throughput != 0 ) {
+			// Only busy connections tell us something about the server's capacity
+			altservers_recordThroughput( getConnection( uplink, i )->index, stats->throughput );
+		}
+		if ( i < HEDGE_CON && stats->throughput > maxTput ) {
+			maxTput = stats->throughput;
+		}
+	}
+	mutex_unlock( &uplink->queueLock );
+	for ( int i = 1; i < UPLINK_MAX_CONNECTIONS; ++i ) {
+		dnbd3_connection_stats_t *stats = &uplink->conStats[i];
+		if ( uplink->stripes[i - 1].fd == -1 || outstanding[i] == 0 ) {
+			stats->stalled = 0;
+			continue;
+		}
+		if ( stats->throughput != 0 && (uint64_t)stats->throughput * UPLINK_STRIPE_SLOW_FACTOR >= maxTput ) {
+			stats->stalled = 0;
+			continue;
+		}
+		stats->stalled += secondsPassed;
+		if ( stats->stalled < UPLINK_STRIPE_STALL_TIME )
+			continue;
+		const int server = uplink->stripes[i - 1].index;
+		logadd( LOG_DEBUG1, "Additional uplink connection #%d for %s:%d is %s, reassigning its requests",
+				i, PIMG(uplink->image), stats->throughput == 0 ? "stalled" : "too slow" );
+		if ( server != uplink->current.index ) {
+			altservers_imageFailed( uplink, server );
+		}
+		stripeFailed( uplink, i );
+	}
+}
+
+/**
+ * Ask current upstream server for its heat map of our image. The reply
+ * is handled asynchronously in handleReceive().
+ * Called from uplink thread, current.fd must be valid.
+ */
+static bool requestHeatMap(dnbd3_uplink_t *uplink)
+{
+	static const dnbd3_request_t request = { .magic = dnbd3_packet_magic, .cmd = net_order_16( CMD_GET_HEAT ) };
+	assert_uplink_thread();
+	mutex_lock( &uplink->sendMutex );
+	const bool sendOk = send( uplink->current.fd, &request, sizeof(request), MSG_NOSIGNAL ) == sizeof(request);
+	mutex_unlock( &uplink->sendMutex );
+	return sendOk;
+}
+
 /**
  * Send keep alive request to server.
  * Called from uplink thread, current.fd must be valid.
@@ -1184,10 +2420,51 @@ static bool sendKeepalive(dnbd3_uplink_t *uplink)
 	assert_uplink_thread();
 	mutex_lock( &uplink->sendMutex );
 	bool sendOk = send( uplink->current.fd, &request, sizeof(request), MSG_NOSIGNAL ) == sizeof(request);
+	for ( int i = 0; i < UPLINK_MAX_CONNECTIONS - 1; ++i ) {
+		const int fd = uplink->stripes[i].fd;
+		if ( fd != -1 && send( fd, &request, sizeof(request), MSG_NOSIGNAL ) != sizeof(request) ) {
+			shutdown( fd, SHUT_RDWR ); // Will be cleaned up by uplink thread
+		}
+	}
+	if ( uplink->hedge.fd != -1 && send( uplink->hedge.fd, &request, sizeof(request), MSG_NOSIGNAL ) != sizeof(request) ) {
+		shutdown( uplink->hedge.fd, SHUT_RDWR );
+	}
+	for ( int i = 0; i < SERVER_MAX_SIBLINGS; ++i ) {
+		const int fd = uplink->siblings[i].fd;
+		if ( fd != -1 && send( fd, &request, sizeof(request), MSG_NOSIGNAL ) != sizeof(request) ) {
+			shutdown( fd, SHUT_RDWR );
+		}
+	}
 	mutex_unlock( &uplink->sendMutex );
 	return sendOk;
 }
 
+/**
+ * Keep standby connection alive, or close it if it's not needed anymore,
+ * i.e. the uplink wasn't serving clients for a while, or we switched to
+ * the standby's server in the meantime.
+ * Only call from uplink thread
+ */
+static void checkStandby(dnbd3_uplink_t *uplink)
+{
+	static const dnbd3_request_t request = { .magic = dnbd3_packet_magic, .cmd = net_order_16( CMD_KEEPALIVE ) };
+	assert_uplink_thread();
+	int fd = -1;
+	mutex_lock( &uplink->rttLock );
+	if ( uplink->standby.fd != -1 ) {
+		if ( !_uplinkStandby || uplink->idleTime >= UPLINK_STANDBY_IDLE_TIME
+				|| uplink->standby.index == uplink->current.index
+				|| send( uplink->standby.fd, &request, sizeof(request), MSG_NOSIGNAL ) != sizeof(request) ) {
+			fd = uplink->standby.fd;
+			uplink->standby.fd = -1;
+		}
+	}
+	mutex_unlock( &uplink->rttLock );
+	if ( fd != -1 ) {
+		close( fd );
+	}
+}
+
 /**
  * Request crclist from uplink.
  * Called from uplink thread, current.fd must be valid.
@@ -1264,7 +2541,41 @@ static bool reopenCacheFd(dnbd3_uplink_t *uplink, const bool force)
 static bool connectionShouldShutdown(dnbd3_uplink_t *uplink)
 {
 	return ( uplink->idleTime > SERVER_UPLINK_IDLE_TIMEOUT
-			&& ( _backgroundReplication != BGR_FULL || _bgrMinClients > uplink->image->users ) );
+			&& ( !BGR_WHOLE_IMAGE( _backgroundReplication ) || _bgrMinClients > uplink->image->users ) );
+}
+
+/**
+ * Get list of all established connections of given uplink,
+ * along with some statistics.
+ */
+json_t* uplink_connectionsToJson(dnbd3_uplink_t *uplink)
+{
+	json_t *list = json_array();
+	int fds[NUM_CONNECTIONS], index[NUM_CONNECTIONS];
+	uint64_t outstanding[NUM_CONNECTIONS];
+	char host[100];
+	mutex_lock( &uplink->queueLock );
+	mutex_lock( &uplink->sendMutex );
+	for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+		const dnbd3_server_connection_t *con = getConnection( uplink, i );
+		fds[i] = con->fd;
+		index[i] = con->index;
+		outstanding[i] = uplink->conStats[i].outstanding;
+	}
+	mutex_unlock( &uplink->sendMutex );
+	mutex_unlock( &uplink->queueLock );
+	for ( int i = 0; i < NUM_CONNECTIONS; ++i ) {
+		if ( fds[i] == -1 || !altservers_toString( index[i], host, sizeof(host) ) )
+			continue;
+		json_array_append_new( list, json_pack( "{ss,sI,si,sI,sb,sb}",
+				"host", host,
+				"bytesReceived", (json_int_t)uplink->conStats[i].bytesReceived,
+				"throughput", (int)uplink->conStats[i].throughput,
+				"outstanding", (json_int_t)outstanding[i],
+				"hedge", i == HEDGE_CON,
+				"sibling", i > HEDGE_CON ) );
+	}
+	return list;
 }
 
 bool uplink_getHostString(dnbd3_uplink_t *uplink, char *buffer, size_t len)
@@ -1278,28 +2589,88 @@ bool uplink_getHostString(dnbd3_uplink_t *uplink, char *buffer, size_t len)
 	return altservers_toString( current, buffer, len );
 }
 
+/**
+ * Adapt the BGR window to the latency of client requests, in the style of
+ * a delay based congestion controller: Comparing the latency of a client
+ * request to the lowest latency seen recently yields the queuing delay,
+ * which is mostly caused by BGR requests on the wire in front of it. If it
+ * exceeds bgrTargetDelay, halve the window. Otherwise, every window's worth
+ * of BGR replies grows the window by one, up to bgrWindowSize.
+ * Only call from uplink thread, for entries that were just removed from
+ * the queue.
+ */
+static void updateBgrWindow(dnbd3_uplink_t *uplink, const dnbd3_queue_entry_t *entry)
+{
+#define BASE_LATENCY_PERIOD 60 // Seconds after which the base latency is re-evaluated
+	assert_uplink_thread();
+	const int maxWindow = _bgrWindowSize;
+	int window = MIN( uplink->bgrWindow, maxWindow );
+	if ( entry->clients == NULL ) {
+		if ( entry->hopCount & HOP_FLAG_BGR ) {
+			// Additive increase
+			if ( ++uplink->bgrWindowAcks >= window ) {
+				uplink->bgrWindowAcks = 0;
+				if ( window < maxWindow ) {
+					window++;
+				}
+			}
+		}
+		uplink->bgrWindow = window;
+		return;
+	}
+	declare_now;
+	uint64_t us = timing_diffUs( &entry->sentAt, &now );
+	// Remove time needed for the actual transfer, so larger requests don't look congested
+	const uint64_t tput = uplink->conStats[entry->con].throughput;
+	if ( tput != 0 ) {
+		const uint64_t transfer = ( entry->to - entry->from ) * 1000000 / tput;
+		us = us > transfer ? us - transfer : 0;
+	}
+	const uint32_t latency = (uint32_t)MAX( 1, MIN( us, UINT32_MAX ) );
+	const uint32_t smoothed = uplink->demandLatency;
+	uplink->demandLatency = smoothed == 0 ? latency : (uint32_t)( ( (uint64_t)smoothed * 7 + latency ) / 8 );
+	// Track minimum over a sliding period, so route changes eventually get picked up
+	if ( uplink->periodMinLatency == 0 || latency < uplink->periodMinLatency ) {
+		uplink->periodMinLatency = latency;
+	}
+	if ( uplink->baseLatency == 0 || latency < uplink->baseLatency ) {
+		uplink->baseLatency = latency;
+	}
+	if ( timing_reached( &uplink->nextBaseReset, &now ) ) {
+		uplink->baseLatency = uplink->periodMinLatency;
+		uplink->periodMinLatency = 0;
+		timing_set( &uplink->nextBaseReset, &now, BASE_LATENCY_PERIOD );
+	}
+	const uint64_t target = (uint64_t)_bgrTargetDelay * 1000;
+	if ( latency > uplink->baseLatency + target
+			&& timing_diffMs( &uplink->lastWindowDecrease, &now ) >= 200 ) {
+		// Multiplicative decrease, at most every 200ms so we don't collapse on a burst of replies
+		window = MAX( 1, window / 2 );
+		uplink->bgrWindowAcks = 0;
+		uplink->lastWindowDecrease = now;
+		logadd( LOG_DEBUG2, "Client request latency %"PRIu32"µs (base %"PRIu32"µs), shrinking BGR window to %d for %s:%d",
+				latency, (uint32_t)uplink->baseLatency, window, PIMG(uplink->image) );
+	}
+	uplink->bgrWindow = window;
+#undef BASE_LATENCY_PERIOD
+}
+
 /**
  * Get number of replication requests that should be sent right now to
- * meet the configured bgrWindowSize. Returns 0 if any client requests
- * are pending.
- * This applies a sort of "slow start" in case the uplink was recently
- * dealing with actual client requests, in that the uplink's idle time
- * (in seconds) is an upper bound for the number returned, so we don't
- * saturate the uplink with loads of requests right away, in case that
- * client triggers more requests to the uplink server.
+ * meet the current BGR window. Only BGR requests count against the window,
+ * not prefetches, profile replay or warm-up. Client requests in flight
+ * don't stop BGR; they are what the window adapts to: it starts at 1 and
+ * shrinks as soon as they get delayed, see updateBgrWindow().
  */
 static int numWantedReplicationRequests(dnbd3_uplink_t *uplink)
 {
-	int ret = MIN( _bgrWindowSize, uplink->idleTime + 1 );
+	int ret = MIN( _bgrWindowSize, uplink->bgrWindow );
 	if ( uplink->queueLen == 0 )
 		return ret;
 	mutex_lock( &uplink->queueLock );
 	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
-		if ( it->clients == NULL ) {
+		if ( requestPrio( it->hopCount ) == PRIO_BGR ) {
 			ret--;
-		} else {
-			ret = 0; // Do not allow BGR if client requests are being handled
-			break;
 		}
 	}
 	mutex_unlock( &uplink->queueLock );
@@ -1311,6 +2682,9 @@ static void markRequestUnsent(dnbd3_uplink_t *uplink, uint64_t handle)
 	mutex_lock( &uplink->queueLock );
 	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
 		if ( it->handle == handle ) {
+			if ( it->sent ) {
+				releaseConnection( uplink, it );
+			}
 			it->sent = false;
 			break;
 		}
@@ -1318,3 +2692,320 @@ static void markRequestUnsent(dnbd3_uplink_t *uplink, uint64_t handle)
 	mutex_unlock( &uplink->queueLock );
 }
 
+
+/**
+ * Record latency of a client request that was just answered. Every
+ * 16 samples, the hedging threshold is set to the 95th percentile of
+ * the last UPLINK_HEDGE_SAMPLES latencies, so only requests in the
+ * tail get hedged.
+ * Only call from uplink thread.
+ */
+static void updateHedgeThreshold(dnbd3_uplink_t *uplink, const dnbd3_queue_entry_t *entry)
+{
+	assert_uplink_thread();
+	if ( entry->clients == NULL )
+		return;
+	declare_now;
+	const uint64_t us = timing_diffUs( &entry->sentAt, &now );
+	uplink->latencySamples[uplink->numLatencySamples % UPLINK_HEDGE_SAMPLES] = (uint32_t)MIN( us, UINT32_MAX );
+	uplink->numLatencySamples++;
+	if ( uplink->numLatencySamples < UPLINK_HEDGE_SAMPLES / 2 || uplink->numLatencySamples % 16 != 0 )
+		return;
+	if ( uplink->numLatencySamples >= 0x40000000 ) {
+		uplink->numLatencySamples = UPLINK_HEDGE_SAMPLES; // Prevent overflow, keep ring position aligned
+	}
+	uint32_t sorted[UPLINK_HEDGE_SAMPLES];
+	const int num = MIN( uplink->numLatencySamples, UPLINK_HEDGE_SAMPLES );
+	memcpy( sorted, uplink->latencySamples, num * sizeof(*sorted) );
+	qsort( sorted, num, sizeof(*sorted), &cmpUint32 );
+	uplink->hedgeThreshold = MAX( sorted[num * 95 / 100], UPLINK_HEDGE_MIN_DELAY * 1000 );
+}
+
+/**
+ * Make sure there is a hedge connection to the next best alt server
+ * if hedging is enabled, or close it if it isn't. The connection is
+ * established in the background; after a failure, we wait
+ * UPLINK_CONNECT_RETRY seconds before trying again.
+ * Only call from uplink thread
+ */
+static void openHedge(dnbd3_uplink_t *uplink)
+{
+	assert_uplink_thread();
+	dnbd3_server_connection_t conn;
+	const int state = takeConnection( uplink, HEDGE_CON, &conn );
+	if ( !_uplinkHedging || uplink->current.fd == -1 ) {
+		if ( state == UPLINK_CONNECT_OK ) {
+			close( conn.fd );
+		}
+		closeHedge( uplink );
+		return;
+	}
+	declare_now;
+	if ( state == UPLINK_CONNECT_UNREACHABLE || state == UPLINK_CONNECT_MISMATCH ) {
+		logadd( LOG_DEBUG1, "Could not open hedge uplink connection for %s:%d", PIMG(uplink->image) );
+		if ( state == UPLINK_CONNECT_UNREACHABLE ) {
+			altservers_serverFailed( conn.index );
+		} else {
+			altservers_imageFailed( uplink, conn.index );
+		}
+		timing_set( &uplink->pending[HEDGE_CON].retry, &now, UPLINK_CONNECT_RETRY );
+		return;
+	}
+	if ( state == UPLINK_CONNECT_OK ) {
+		if ( uplink->hedge.fd != -1 || conn.index == uplink->current.index ) {
+			close( conn.fd ); // Switched to that server meanwhile
+			return;
+		}
+		mutex_lock( &uplink->queueLock );
+		uplink->conStats[HEDGE_CON].throughput = 0;
+		uplink->conStats[HEDGE_CON].rtt = altservers_getRtt( conn.index );
+		mutex_unlock( &uplink->queueLock );
+		mutex_lock( &uplink->sendMutex );
+		uplink->hedge = conn;
+		mutex_unlock( &uplink->sendMutex );
+		logadd( LOG_DEBUG2, "Opened hedge uplink connection for %s:%d", PIMG(uplink->image) );
+		return;
+	}
+	if ( state == UPLINK_CONNECT_BUSY || uplink->hedge.fd != -1
+			|| !timing_reached( &uplink->pending[HEDGE_CON].retry, &now ) )
+		return;
+	int server;
+	if ( altservers_getSwarmList( uplink, &server, 1 ) == 0 )
+		return; // No other server available
+	connectAsync( uplink, HEDGE_CON, server );
+}
+
+/**
+ * Check whether given handle belongs to a hedged request that was answered
+ * recently, so a reply for it is the losing half. Forgets the handle, so
+ * each duplicate is only counted once.
+ * Only call from uplink thread
+ */
+static bool isHedgeLoser(dnbd3_uplink_t *uplink, uint64_t handle)
+{
+	assert_uplink_thread();
+	for ( int i = 0; i < UPLINK_HEDGE_LOSERS; ++i ) {
+		if ( uplink->hedgeLosers[i] == handle ) {
+			uplink->hedgeLosers[i] = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Close hedge connection. Duplicates sent through it are lost, but
+ * the original requests are still pending, so nothing needs to be
+ * re-queued; the requests just become eligible for hedging again.
+ * Only call from uplink thread
+ */
+static void closeHedge(dnbd3_uplink_t *uplink)
+{
+	assert_uplink_thread();
+	if ( uplink->hedge.fd == -1 )
+		return;
+	mutex_lock( &uplink->sendMutex );
+	close( uplink->hedge.fd );
+	uplink->hedge.fd = -1;
+	mutex_unlock( &uplink->sendMutex );
+	mutex_lock( &uplink->queueLock );
+	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL; it = it->next ) {
+		it->hedged = false;
+	}
+	mutex_unlock( &uplink->queueLock );
+}
+
+/**
+ * Send a duplicate of every client request through the hedge connection
+ * that has been waiting for a reply longer than the current hedging
+ * threshold. Whichever reply arrives first is used, the other one will
+ * be dropped as its handle is unknown by then.
+ * Only call from uplink thread.
+ * @return ms until the next request is due for hedging, -1 if none
+ */
+static int sendHedgedRequests(dnbd3_uplink_t *uplink)
+{
+#define MAX_HEDGE_BATCH 32
+	assert_uplink_thread();
+	if ( uplink->hedge.fd == -1 || uplink->queueLen == 0 )
+		return -1;
+	dnbd3_request_t reqs[MAX_HEDGE_BATCH];
+	int count = 0;
+	int64_t nextDue = -1;
+	const uint64_t threshold = uplink->hedgeThreshold;
+	declare_now;
+	mutex_lock( &uplink->queueLock );
+	for ( dnbd3_queue_entry_t *it = uplink->queue; it != NULL && count < MAX_HEDGE_BATCH; it = it->next ) {
+		if ( !it->sent || it->hedged || requestPrio( it->hopCount ) != PRIO_DEMAND )
+			continue;
+		if ( getConnection( uplink, it->con )->index == uplink->hedge.index )
+			continue; // Would ask the same server again
+		const uint64_t age = timing_diffUs( &it->sentAt, &now );
+		if ( age < threshold ) {
+			const int64_t due = (int64_t)( threshold - age );
+			if ( nextDue == -1 || due < nextDue ) {
+				nextDue = due;
+			}
+			continue;
+		}
+		it->hedged = true;
+		dnbd3_request_t *hdr = &reqs[count++];
+		hdr->magic = dnbd3_packet_magic;
+		hdr->cmd = CMD_GET_BLOCK;
+		hdr->size = (uint32_t)( it->to - it->from );
+		hdr->offset = it->from; // Offset first, then hops! (union)
+		hdr->hops = COND_HOPCOUNT( uplink->hedge.version, it->hopCount );
+		hdr->handle = it->handle;
+		fixup_request( *hdr );
+	}
+	mutex_unlock( &uplink->queueLock );
+	if ( count != 0 ) {
+		if ( sendRequestBatch( uplink, HEDGE_CON, reqs, count ) ) {
+			uplink->hedgedRequests += count;
+			logadd( LOG_DEBUG2, "Hedged %d requests for %s:%d", count, PIMG(uplink->image) );
+		}
+		if ( count == MAX_HEDGE_BATCH )
+			return 0; // There might be more
+	}
+	return nextDue == -1 ? -1 : (int)( ( nextDue + 999 ) / 1000 );
+#undef MAX_HEDGE_BATCH
+}
+
+/**
+ * Record latency of a request that was just answered, for passive
+ * estimation of the server's RTT. The latency is normalized to the
+ * size of an alt check probe, DNBD3_BLOCK_SIZE, using the connection's
+ * current throughput. Samples are handed over to the alt server
+ * logic periodically, see updateConnectionStats().
+ * Only call from uplink thread.
+ */
+static void recordLiveRtt(dnbd3_uplink_t *uplink, int con, const dnbd3_queue_entry_t *entry)
+{
+	assert_uplink_thread();
+	if ( con != entry->con )
+		return; // Reply to hedged request; sentAt refers to other connection
+	dnbd3_connection_stats_t *stats = &uplink->conStats[con];
+	if ( stats->numLiveRtt >= UPLINK_LIVE_SAMPLES )
+		return;
+	declare_now;
+	uint64_t us = timing_diffUs( &entry->sentAt, &now );
+	const uint64_t size = entry->to - entry->from;
+	if ( size > DNBD3_BLOCK_SIZE && stats->throughput != 0 ) {
+		const uint64_t transfer = ( size - DNBD3_BLOCK_SIZE ) * 1000000 / stats->throughput;
+		us = us > transfer ? us - transfer : 0;
+	}
+	stats->liveRtt[stats->numLiveRtt++] = (uint32_t)MAX( 1, MIN( us, UINT32_MAX ) );
+}
+
+/**
+ * Remember that the range [from, to) was requested without any client
+ * asking for it, because the request got extended.
+ * HOLD QUEUE LOCK WHILE CALLING
+ */
+static void recordOverfetch(dnbd3_uplink_t *uplink, uint64_t from, uint64_t to)
+{
+	dnbd3_overfetch_t *slot = &uplink->overfetch[uplink->overfetchIndex];
+	uplink->overfetchIndex = ( uplink->overfetchIndex + 1 ) % UPLINK_OVERFETCH_SLOTS;
+	slot->used = 0;
+	slot->from = from;
+	slot->to = to;
+	uplink->overfetchBytes += to - from;
+}
+
+/**
+ * A client requested the range [start, end), account for any part of
+ * it that we fetched before due to request extension.
+ * Lock free, so might be off a bit if a slot is reused concurrently,
+ * which is fine for statistics.
+ */
+static void markOverfetchUsed(dnbd3_uplink_t *uplink, uint64_t start, uint64_t end)
+{
+	for ( int i = 0; i < UPLINK_OVERFETCH_SLOTS; ++i ) {
+		dnbd3_overfetch_t *slot = &uplink->overfetch[i];
+		const uint64_t from = slot->from, to = slot->to;
+		if ( from >= to || to <= start || from >= end )
+			continue;
+		const uint32_t size = (uint32_t)( to - from );
+		const uint32_t n = (uint32_t)( MIN( end, to ) - MAX( start, from ) );
+		const uint32_t old = atomic_fetch_add( &slot->used, n );
+		// Don't count bytes twice if they are read repeatedly
+		uplink->overfetchUsed += MIN( old + n, size ) - MIN( old, size );
+	}
+}
+
+/**
+ * Determine how large client requests should be made. Extending a request
+ * costs the time to transfer the extra data, but saves a full round trip
+ * every time a client reads that data later on. So it pays off up to the
+ * bandwidth-delay product of the link, scaled by the fraction of extra
+ * data that clients actually ended up reading so far.
+ * Only call from uplink thread
+ */
+static void updateRequestSize(dnbd3_uplink_t *uplink)
+{
+	const uint64_t bytes = uplink->overfetchBytes, used = uplink->overfetchUsed;
+	if ( bytes - uplink->lastOverfetchBytes >= UPLINK_REQUEST_SIZE_MAX ) {
+		// Enough new data to tell something
+		const uint64_t ratio = MIN( 100, ( used - uplink->lastOverfetchUsed ) * 100 / ( bytes - uplink->lastOverfetchBytes ) );
+		uplink->overfetchRatio = (uint32_t)( ( uplink->overfetchRatio * 3 + ratio ) / 4 );
+		uplink->lastOverfetchBytes = bytes;
+		uplink->lastOverfetchUsed = used;
+	}
+	const uint64_t rtt = uplink->current.fd == -1 ? 0 : uplink->conStats[0].rtt;
+	const uint64_t tput = uplink->current.fd == -1 ? 0 : altservers_getThroughput( uplink->current.index );
+	if ( rtt == 0 || tput == 0 ) {
+		uplink->requestSize = 0;
+		return;
+	}
+	// Keep a minimum ratio, so we get to see if it's worth extending again
+	uint64_t size = rtt * tput / 1000000 * MAX( uplink->overfetchRatio, 10 ) / 100;
+	size = MIN( size, MIN( UPLINK_REQUEST_SIZE_MAX, (uint64_t)_maxPayload ) );
+	if ( size < DNBD3_BLOCK_SIZE * 2 ) {
+		size = 0; // Not worth it
+	}
+	uplink->requestSize = (uint32_t)( size & ~(uint64_t)( DNBD3_BLOCK_SIZE - 1 ) );
+}
+
+/**
+ * Queue requests for the next missing chunks of the boot profile being
+ * replayed, keeping at most UPLINK_PROFILE_WINDOW of these requests in
+ * flight, so client requests aren't stuck behind a long queue.
+ * Only call from uplink thread
+ */
+static void sendProfileRequests(dnbd3_uplink_t *uplink)
+{
+	assert_uplink_thread();
+	dnbd3_boot_profile_t * const profile = uplink->profile;
+	dnbd3_cache_map_t *cache = ref_get_cachemap( uplink->image );
+	if ( cache == NULL ) {
+		uplink->profileIndex = profile->count; // Image complete
+	}
+	int added = 0;
+	mutex_lock( &uplink->queueLock );
+	int inFlight = countQueued( uplink, QUEUE_ORIGIN_PROFILE );
+	while ( inFlight < UPLINK_PROFILE_WINDOW && uplink->profileIndex < profile->count ) {
+		const uint64_t start = (uint64_t)profile->entries[uplink->profileIndex++].chunk * SERVER_BOOT_PROFILE_CHUNK;
+		if ( start >= uplink->image->virtualFilesize )
+			continue;
+		const uint64_t end = MIN( start + SERVER_BOOT_PROFILE_CHUNK, uplink->image->virtualFilesize );
+		if ( image_isRangeCachedUnsafe( cache, start, end ) )
+			continue;
+		// Let sendQueuedRequests take care of it
+		if ( addPrefetch( uplink, NULL, start, end, 1, QUEUE_ORIGIN_PROFILE, NULL ) == NULL )
+			continue;
+		inFlight++;
+		added++;
+	}
+	mutex_unlock( &uplink->queueLock );
+	if ( cache != NULL ) {
+		ref_put( &cache->reference );
+	}
+	if ( added != 0 ) {
+		sendQueuedRequests( uplink, true );
+	}
+	if ( uplink->profileIndex >= profile->count ) {
+		logadd( LOG_DEBUG1, "Done replaying boot profile of %s:%d", PIMG(uplink->image) );
+		ref_put( &profile->reference );
+		uplink->profile = NULL;
+	}
+}
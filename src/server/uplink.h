@@ -4,6 +4,13 @@
 #include "globals.h"
 #include <dnbd3/types.h>
 
+struct json_t;
+
+// Upper bits of hop count in requests between proxies, marking them as not directly caused by a client
+static const uint8_t HOP_FLAG_BGR = 0x80;
+static const uint8_t HOP_FLAG_PREFETCH = 0x40;
+#define HOP_FLAGS ( HOP_FLAG_BGR | HOP_FLAG_PREFETCH )
+
 void uplink_globalsInit();
 
 uint64_t uplink_getTotalBytesReceived();
@@ -12,12 +19,25 @@ bool uplink_init(dnbd3_image_t *image, int sock, dnbd3_host_t *host, int version
 
 void uplink_removeEntry(dnbd3_uplink_t *uplink, void *data, uplink_callback callback);
 
-bool uplink_requestClient(dnbd3_client_t *client, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length, uint8_t hops);
+int uplink_cancel(dnbd3_uplink_t *uplink, void *data, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length);
+
+bool uplink_requestClient(dnbd3_client_t *client, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length,
+		uint8_t hops, uint64_t prefetchTo);
 
 bool uplink_request(dnbd3_image_t *image, void *data, uplink_callback callback, uint64_t handle, uint64_t start, uint32_t length);
 
+void uplink_prefetch(dnbd3_client_t *client, uint8_t hops, uint64_t start, uint64_t to);
+
+void uplink_recordCachedRead(dnbd3_image_t *image, uint64_t start, uint64_t end);
+
+void uplink_startProfile(dnbd3_image_t *image);
+
+uint64_t uplink_warmup(dnbd3_image_t *image, uint64_t start, uint64_t end, uint64_t *budget);
+
 bool uplink_shutdown(dnbd3_image_t *image);
 
 bool uplink_getHostString(dnbd3_uplink_t *uplink, char *buffer, size_t len);
 
+struct json_t* uplink_connectionsToJson(dnbd3_uplink_t *uplink);
+
 #endif /* UPLINK_H_ */
@@ -0,0 +1,465 @@
+#include "warmup.h"
+#include "helper.h"
+#include "locks.h"
+#include "image.h"
+#include "uplink.h"
+#include "server.h"
+#include "fileutil.h"
+#include "reference.h"
+#include <dnbd3/shared/timing.h>
+
+#include <time.h>
+#include <jansson.h>
+
+/*
+ * Warm-up jobs. Make sure an entire image, a range of its hash blocks,
+ * or everything covered by its boot profile is replicated, ideally by
+ * a given deadline, without waiting for clients to show up. Jobs are
+ * read from the file "warmup" in the config directory at startup, and
+ * can be added at runtime via the RPC interface (POST /warmup).
+ * A timer drives all jobs once per second, earliest deadline first:
+ * It makes sure the image is there, cloning it if required, and queues
+ * missing parts on the image's uplink, limited by the job's bandwidth
+ * cap. These are prefetch requests, so they never delay client requests.
+ * While active, a job holds a reference to its image, so it counts as
+ * a user for bgrMinClients. Progress is listed in the status JSON.
+ */
+
+#define WARMUP_IMAGE 0
+#define WARMUP_BLOCKS 1
+#define WARMUP_PROFILE 2
+
+#define STATE_WAITING 0  // Image not available yet
+#define STATE_RUNNING 1
+#define STATE_DONE 2
+#define STATE_FAILED 3
+
+#define PROGRESS_INTERVAL 10 // Seconds between checks of how much of a job is done
+
+static const char *typeNames[] = { "image", "blocks", "profile" };
+static const char *stateNames[] = { "waiting", "running", "done", "failed" };
+#define NUM_TYPES (int)( sizeof(typeNames) / sizeof(typeNames[0]) )
+
+typedef struct
+{
+	uint64_t start, end;
+} range_t;
+
+typedef struct _warmup_job
+{
+	struct _warmup_job *next;
+	int id;
+	int type;             // WARMUP_*
+	char *name;
+	uint16_t rid;         // 0 = latest
+	int firstBlock;       // Hash block range, WARMUP_BLOCKS only
+	int lastBlock;
+	time_t deadline;      // 0 = none
+	uint64_t rate;        // Bytes per second, 0 = unlimited
+	// Changed by timer only, with warmupLock held; read by warmup_toJson()
+	dnbd3_image_t *image; // Reference held while running
+	int state;            // STATE_*
+	int progress;         // Percentage of ranges cached
+	time_t finished;      // When job was done or failed
+	// Only used by timer
+	range_t *ranges;
+	int rangeCount;
+	int rangeIndex;       // Current range...
+	uint64_t pos;         // ...and offset to continue at
+	int64_t tokens;       // Bandwidth budget in bytes
+	ticks lastRefill;
+	ticks nextTry;        // When to look for image again, or start the next pass
+	ticks nextProgress;
+	bool warnedLate;
+} warmup_job_t;
+
+static pthread_mutex_t warmupLock;
+static warmup_job_t *jobList = NULL; // Sorted by deadline
+static int jobCount = 0;
+static int lastId = 0;
+
+static void* warmupTimer(void *data);
+static void loadConfig();
+
+void warmup_init()
+{
+	mutex_init( &warmupLock, LOCK_WARMUP );
+	loadConfig();
+	server_addJob( &warmupTimer, NULL, 10, 1 );
+}
+
+/**
+ * Parse deadline, either a unix timestamp, or HH:MM, meaning the next
+ * time it is HH:MM local time.
+ */
+static bool parseDeadline(const char *in, time_t *out)
+{
+	int hour, minute;
+	char *end;
+	if ( sscanf( in, "%d:%d", &hour, &minute ) == 2 ) {
+		if ( hour < 0 || hour > 23 || minute < 0 || minute > 59 )
+			return false;
+		time_t now = time( NULL );
+		struct tm tm;
+		if ( localtime_r( &now, &tm ) == NULL )
+			return false;
+		tm.tm_hour = hour;
+		tm.tm_min = minute;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		*out = mktime( &tm );
+		if ( *out <= now ) {
+			tm.tm_mday++;
+			*out = mktime( &tm );
+		}
+		return *out != (time_t)-1;
+	}
+	const long long ts = strtoll( in, &end, 10 );
+	if ( end == in || *end != '\0' || ts <= 0 )
+		return false;
+	*out = (time_t)ts;
+	return true;
+}
+
+/**
+ * Add a warm-up job. All arguments are strings as passed in the config
+ * file or via RPC; only name is mandatory.
+ * what: "image" (default), "blocks", or "profile"
+ * blocks: "first-last" hash block, for what=blocks
+ * deadline: see parseDeadline()
+ * rate: Bandwidth cap in bytes per second, with optional unit ("10M")
+ * @return id of new job, -1 on error, in which case error is set
+ */
+int warmup_add(const char *name, const char *rid, const char *what, const char *blocks,
+		const char *deadline, const char *rate, const char **error)
+{
+	warmup_job_t job = { .type = WARMUP_IMAGE, .firstBlock = 0, .lastBlock = -1 };
+	if ( name == NULL || *name == '\0' || name[0] == '/' ) {
+		*error = "Invalid image name";
+		return -1;
+	}
+	if ( rid != NULL ) {
+		char *end;
+		const long val = strtol( rid, &end, 10 );
+		if ( end == rid || *end != '\0' || val < 0 || val > 65535 ) {
+			*error = "Invalid revision";
+			return -1;
+		}
+		job.rid = (uint16_t)val;
+	}
+	if ( what != NULL ) {
+		for ( job.type = 0; job.type < NUM_TYPES; ++job.type ) {
+			if ( strcmp( what, typeNames[job.type] ) == 0 )
+				break;
+		}
+		if ( job.type == NUM_TYPES ) {
+			*error = "Invalid type, must be image, blocks or profile";
+			return -1;
+		}
+	}
+	if ( job.type == WARMUP_BLOCKS ) {
+		if ( blocks == NULL || sscanf( blocks, "%d-%d", &job.firstBlock, &job.lastBlock ) != 2
+				|| job.firstBlock < 0 || job.lastBlock < job.firstBlock ) {
+			*error = "Invalid or missing block range, must be first-last";
+			return -1;
+		}
+	}
+	if ( deadline != NULL && !parseDeadline( deadline, &job.deadline ) ) {
+		*error = "Invalid deadline, must be HH:MM or unix timestamp";
+		return -1;
+	}
+	if ( rate != NULL && !globals_parseNumber( rate, &job.rate, "warmup rate" ) ) {
+		*error = "Invalid rate";
+		return -1;
+	}
+	warmup_job_t *new = malloc( sizeof(*new) );
+	*new = job;
+	new->name = strdup( name );
+	new->state = STATE_WAITING;
+	timing_get( &new->nextTry );
+	new->nextProgress = new->nextTry;
+	mutex_lock( &warmupLock );
+	if ( jobCount >= SERVER_WARMUP_MAX_JOBS ) {
+		mutex_unlock( &warmupLock );
+		free( new->name );
+		free( new );
+		*error = "Too many warm-up jobs";
+		return -1;
+	}
+	new->id = ++lastId;
+	// Keep sorted by deadline, jobs without deadline last
+	warmup_job_t **it;
+	for ( it = &jobList; *it != NULL; it = &(*it)->next ) {
+		if ( new->deadline != 0 && ( (*it)->deadline == 0 || (*it)->deadline > new->deadline ) )
+			break;
+	}
+	new->next = *it;
+	*it = new;
+	jobCount++;
+	mutex_unlock( &warmupLock );
+	logadd( LOG_INFO, "Added warm-up job #%d: %s of %s:%d", new->id, typeNames[new->type], name, (int)new->rid );
+	return new->id;
+}
+
+json_t* warmup_toJson()
+{
+	json_t *list = json_array();
+	mutex_lock( &warmupLock );
+	for ( warmup_job_t *job = jobList; job != NULL; job = job->next ) {
+		json_t *item = json_pack( "{sisssssisIsIsssi}",
+				"id", job->id,
+				"name", job->name,
+				"type", typeNames[job->type],
+				"rid", job->image == NULL ? (int)job->rid : (int)job->image->rid,
+				"deadline", (json_int_t)job->deadline,
+				"rate", (json_int_t)job->rate,
+				"state", stateNames[job->state],
+				"progress", job->progress );
+		if ( job->type == WARMUP_BLOCKS ) {
+			json_object_set_new( item, "blocks", json_pack( "[ii]", job->firstBlock, job->lastBlock ) );
+		}
+		if ( job->deadline != 0 ) {
+			const time_t done = job->state == STATE_DONE ? job->finished : time( NULL );
+			json_object_set_new( item, "late", done > job->deadline ? json_true() : json_false() );
+		}
+		json_array_append_new( list, item );
+	}
+	mutex_unlock( &warmupLock );
+	return list;
+}
+
+static void setState(warmup_job_t *job, int state, dnbd3_image_t *image)
+{
+	mutex_lock( &warmupLock );
+	job->state = state;
+	job->image = image;
+	if ( state == STATE_DONE || state == STATE_FAILED ) {
+		job->finished = time( NULL );
+	}
+	mutex_unlock( &warmupLock );
+}
+
+/**
+ * Turn what the job should replicate into a list of byte ranges.
+ */
+static bool setupRanges(warmup_job_t *job, dnbd3_image_t *image)
+{
+	const uint64_t size = image->virtualFilesize;
+	if ( job->type == WARMUP_PROFILE ) {
+		dnbd3_boot_profile_t *profile = ref_get_bootprofile( image );
+		if ( profile == NULL ) {
+			logadd( LOG_WARNING, "Warm-up job #%d: %s:%d has no boot profile", job->id, PIMG(image) );
+			return false;
+		}
+		job->ranges = malloc( profile->count * sizeof(*job->ranges) );
+		job->rangeCount = 0;
+		for ( int i = 0; i < profile->count; ++i ) {
+			const uint64_t start = (uint64_t)profile->entries[i].chunk * SERVER_BOOT_PROFILE_CHUNK;
+			if ( start >= size )
+				continue;
+			job->ranges[job->rangeCount].start = start;
+			job->ranges[job->rangeCount].end = MIN( start + SERVER_BOOT_PROFILE_CHUNK, size );
+			job->rangeCount++;
+		}
+		ref_put( &profile->reference );
+		return true;
+	}
+	job->ranges = malloc( sizeof(*job->ranges) );
+	job->rangeCount = 1;
+	if ( job->type == WARMUP_BLOCKS ) {
+		job->ranges[0].start = (uint64_t)job->firstBlock * HASH_BLOCK_SIZE;
+		job->ranges[0].end = MIN( (uint64_t)( job->lastBlock + 1 ) * HASH_BLOCK_SIZE, size );
+		if ( job->ranges[0].start >= size ) {
+			logadd( LOG_WARNING, "Warm-up job #%d: Block range beyond end of %s:%d", job->id, PIMG(image) );
+			return false;
+		}
+	} else {
+		job->ranges[0].start = 0;
+		job->ranges[0].end = size;
+	}
+	return true;
+}
+
+/**
+ * Get percentage of the job's ranges that is cached already.
+ */
+static int getProgress(warmup_job_t *job)
+{
+	dnbd3_cache_map_t *cache = ref_get_cachemap( job->image );
+	if ( cache == NULL )
+		return 100;
+	uint64_t total = 0, missing = 0;
+	atomic_thread_fence( memory_order_acquire );
+	for ( int i = 0; i < job->rangeCount; ++i ) {
+		const uint64_t first = job->ranges[i].start / DNBD3_BLOCK_SIZE;
+		const uint64_t last = ( job->ranges[i].end + DNBD3_BLOCK_SIZE - 1 ) / DNBD3_BLOCK_SIZE;
+		for ( uint64_t block = first; block < last; ++block ) {
+			const uint8_t byte = atomic_load_explicit( &cache->map[block / 8], memory_order_relaxed );
+			if ( byte == 0xff && block % 8 == 0 && block + 8 <= last ) {
+				block += 7;
+				total += 8;
+				continue;
+			}
+			total++;
+			if ( !( byte & ( 1 << ( block % 8 ) ) ) ) {
+				missing++;
+			}
+		}
+	}
+	ref_put( &cache->reference );
+	if ( missing == 0 )
+		return 100;
+	return (int)MIN( 99, ( total - missing ) * 100 / total );
+}
+
+static void runJob(warmup_job_t *job, ticks *now)
+{
+	if ( job->image == NULL ) {
+		if ( !timing_reached( &job->nextTry, now ) )
+			return;
+		timing_set( &job->nextTry, now, SERVER_WARMUP_RETRY );
+		dnbd3_image_t *image = image_getOrLoad( job->name, job->rid );
+		if ( image == NULL ) {
+			logadd( LOG_DEBUG1, "Warm-up job #%d: Image %s:%d not available", job->id, job->name, (int)job->rid );
+			return;
+		}
+		if ( !setupRanges( job, image ) ) {
+			image_release( image );
+			setState( job, STATE_FAILED, NULL );
+			return;
+		}
+		logadd( LOG_INFO, "Starting warm-up job #%d for %s:%d", job->id, PIMG(image) );
+		job->rangeIndex = 0;
+		job->pos = 0;
+		job->tokens = (int64_t)job->rate;
+		job->lastRefill = *now;
+		setState( job, STATE_RUNNING, image );
+	}
+	uint64_t budget = UINT64_MAX;
+	if ( job->rate != 0 ) {
+		// Refill token bucket, but never accumulate more than one second worth of data
+		const uint64_t ms = timing_diffMs( &job->lastRefill, now );
+		job->lastRefill = *now;
+		job->tokens = MIN( job->tokens + (int64_t)( job->rate * ms / 1000 ), (int64_t)job->rate );
+		budget = job->tokens > 0 ? (uint64_t)job->tokens : 0;
+	}
+	const uint64_t before = budget;
+	if ( job->rangeIndex >= job->rangeCount && timing_reached( &job->nextTry, now ) ) {
+		// Start another pass, in case requests got lost
+		job->rangeIndex = 0;
+		job->pos = 0;
+	}
+	while ( budget != 0 && job->rangeIndex < job->rangeCount ) {
+		const range_t *range = &job->ranges[job->rangeIndex];
+		job->pos = uplink_warmup( job->image, MAX( job->pos, range->start ), range->end, &budget );
+		if ( job->pos < range->end )
+			break; // Enough in flight
+		job->rangeIndex++;
+		if ( job->rangeIndex >= job->rangeCount ) {
+			timing_set( &job->nextTry, now, PROGRESS_INTERVAL );
+		}
+	}
+	if ( job->rate != 0 ) {
+		job->tokens -= (int64_t)( before - budget );
+	}
+	if ( !timing_reached( &job->nextProgress, now ) )
+		return;
+	timing_set( &job->nextProgress, now, PROGRESS_INTERVAL );
+	const int progress = getProgress( job );
+	dnbd3_image_t *image = job->image;
+	mutex_lock( &warmupLock );
+	job->progress = progress;
+	mutex_unlock( &warmupLock );
+	if ( progress == 100 ) {
+		logadd( LOG_INFO, "Warm-up job #%d for %s:%d done", job->id, PIMG(image) );
+		setState( job, STATE_DONE, NULL );
+		image_release( image );
+	} else if ( job->deadline != 0 && !job->warnedLate && time( NULL ) > job->deadline ) {
+		job->warnedLate = true;
+		logadd( LOG_WARNING, "Warm-up job #%d for %s:%d missed its deadline (%d%% done)", job->id, PIMG(image), progress );
+	}
+}
+
+static void* warmupTimer(void *data UNUSED)
+{
+	static atomic_bool running = false;
+	if ( atomic_exchange( &running, true ) )
+		return NULL; // Previous run still busy, probably cloning an image
+	warmup_job_t *jobs[SERVER_WARMUP_MAX_JOBS];
+	warmup_job_t *expired = NULL;
+	int count = 0;
+	const time_t walltime = time( NULL );
+	mutex_lock( &warmupLock );
+	for ( warmup_job_t **it = &jobList; *it != NULL; ) {
+		warmup_job_t * const job = *it;
+		if ( ( job->state == STATE_DONE || job->state == STATE_FAILED )
+				&& walltime - job->finished > SERVER_WARMUP_KEEP ) {
+			*it = job->next;
+			job->next = expired;
+			expired = job;
+			jobCount--;
+			continue;
+		}
+		if ( job->state == STATE_WAITING || job->state == STATE_RUNNING ) {
+			jobs[count++] = job;
+		}
+		it = &job->next;
+	}
+	mutex_unlock( &warmupLock );
+	while ( expired != NULL ) {
+		warmup_job_t *next = expired->next;
+		free( expired->ranges );
+		free( expired->name );
+		free( expired );
+		expired = next;
+	}
+	if ( count != 0 ) {
+		setThreadName( "warmup" );
+	}
+	declare_now;
+	for ( int i = 0; i < count && !_shutdown; ++i ) {
+		runJob( jobs[i], &now );
+	}
+	running = false;
+	return NULL;
+}
+
+static void addFromConfig(int argc, char **argv, void *data UNUSED)
+{
+	if ( argv[0][0] == '#' )
+		return;
+	const char *rid = NULL, *what = NULL, *blocks = NULL, *deadline = NULL, *rate = NULL, *error;
+	for ( int i = 1; i < argc; ++i ) {
+		char *value = strchr( argv[i], '=' );
+		if ( value == NULL ) {
+			logadd( LOG_WARNING, "Ignoring invalid option '%s' in warm-up job for %s", argv[i], argv[0] );
+			continue;
+		}
+		*value++ = '\0';
+		if ( strcmp( argv[i], "rid" ) == 0 ) {
+			rid = value;
+		} else if ( strcmp( argv[i], "what" ) == 0 ) {
+			what = value;
+		} else if ( strcmp( argv[i], "blocks" ) == 0 ) {
+			blocks = value;
+		} else if ( strcmp( argv[i], "by" ) == 0 ) {
+			deadline = value;
+		} else if ( strcmp( argv[i], "rate" ) == 0 ) {
+			rate = value;
+		} else {
+			logadd( LOG_WARNING, "Ignoring unknown option '%s' in warm-up job for %s", argv[i], argv[0] );
+		}
+	}
+	if ( warmup_add( argv[0], rid, what, blocks, deadline, rate, &error ) == -1 ) {
+		logadd( LOG_WARNING, "Ignoring warm-up job for %s: %s", argv[0], error );
+	}
+}
+
+static void loadConfig()
+{
+	char *fn;
+	if ( asprintf( &fn, "%s/%s", _configDir, "warmup" ) == -1 )
+		return;
+	file_loadLineBased( fn, 1, 10, &addFromConfig, NULL );
+	free( fn );
+}
@@ -0,0 +1,15 @@
+#ifndef _WARMUP_H_
+#define _WARMUP_H_
+
+#include "globals.h"
+
+struct json_t;
+
+void warmup_init();
+
+int warmup_add(const char *name, const char *rid, const char *what, const char *blocks,
+		const char *deadline, const char *rate, const char **error);
+
+struct json_t* warmup_toJson();
+
+#endif /* WARMUP_H_ */
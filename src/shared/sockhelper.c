@@ -393,12 +393,34 @@ void sock_set_block(int sock)
 bool sock_append(poll_list_t *list, const int sock, bool wantRead, bool wantWrite)
 {
 	if ( sock == -1 || list->count >= MAXLISTEN ) return false;
-	list->entry[list->count++].fd = sock;
-	list->entry[list->count++].events = (short)( ( wantRead ? POLLIN : 0 ) | ( wantWrite ? POLLOUT : 0 ) | POLLRDHUP );
+	list->entry[list->count].fd = sock;
+	list->entry[list->count].events = (short)( ( wantRead ? POLLIN : 0 ) | ( wantWrite ? POLLOUT : 0 ) | POLLRDHUP );
 	list->count++;
 	return true;
 }
 
+int sock_getFds(poll_list_t *list, int *fds, const int max)
+{
+	int count = 0;
+	for ( int i = 0; i < list->count && count < max; ++i ) {
+		if ( list->entry[i].fd >= 0 ) {
+			fds[count++] = list->entry[i].fd;
+		}
+	}
+	return count;
+}
+
+bool sock_remove(poll_list_t *list, const int sock)
+{
+	for ( int i = 0; i < list->count; ++i ) {
+		if ( list->entry[i].fd != sock ) continue;
+		list->count--;
+		if ( i != list->count ) list->entry[i] = list->entry[list->count];
+		return true;
+	}
+	return false;
+}
+
 ssize_t sock_sendAll(const int sock, const void *buffer, const size_t len, int maxtries)
 {
 	size_t done = 0;